@@ -20,28 +20,296 @@
 ** Thanks to sqldiff utility program of SQLite project.
 ** How it works and limitations see at https://www.sqlite.org/sqldiff.html
 **
-** To compile, simply link against SQLite.
+** To compile, simply link against SQLite and zlib.
 **
 ** See the showHelp() routine below for a brief description of how to
 ** run the utility.
 */
 
+#define _GNU_SOURCE             /* fopencookie() and F_SETPIPE_SZ */
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sqlite3.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned char u8;
+typedef sqlite3_uint64 u64;
+
+/*
+** Content hash of a table of the backup, as of the last replication
+*/
+typedef struct TableHash TableHash;
+struct TableHash
+{
+  char *zTab;                   /* Name of the table                       */
+  u64 h;                        /* Hash computed by tableHash(), or 0      */
+};
+
+/*
+** A prepared statement cached by db_cprepare()
+*/
+#define STMT_NHASH 128          /* Number of hash buckets of a StmtCache */
+#define STMT_MAX   512          /* Max number of statements cached       */
+#define STMT_PHASH(p) (((size_t) (p) >> 4) % STMT_NHASH) /* Bucket of p */
+#define PLAN_UNKNOWN 0          /* Query plan not checked yet            */
+#define PLAN_INDEXED 1          /* No nested full scan in the plan       */
+#define PLAN_NESTED  2          /* The plan has a nested full scan       */
+typedef struct StmtCache StmtCache;
+struct StmtCache
+{
+  char *zSql;                   /* SQL text of the statement               */
+  unsigned int h;               /* Hash of zSql                            */
+  sqlite3_stmt *pStmt;          /* The prepared statement                  */
+  int bInUse;                   /* True between db_cprepare() and release  */
+  int ePlan;                    /* PLAN_xxx, see diffPlanNested()          */
+  StmtCache *pNext;             /* Next entry in the same hash bucket      */
+  StmtCache *pNextStmt;         /* Next entry in the same aStmtByPtr[]     */
+};
+
+/*
+** The result of columnNames() for one table, cached
+*/
+typedef struct ColCache ColCache;
+struct ColCache
+{
+  char *zDb;                    /* "main" or "aux"                         */
+  char *zTab;                   /* Name of the table                       */
+  char **az;                    /* Column names, or NULL                   */
+  int nPk;                      /* Number of primary key columns           */
+  int bRowid;                   /* True if the PK is an implicit rowid     */
+  ColCache *pNext;              /* Next cached table                       */
+};
+
+/*
+** A diff kernel: what the diff and the dump of a table output, built
+** once for its columns.  See diffKernel().
+*/
+typedef void (*LitEmitter) (FILE *, sqlite3_value *);
+typedef struct DiffKernel DiffKernel;
+struct DiffKernel
+{
+  char *zTab;                   /* Name of the table                       */
+  char *zId;                    /* zTab, quoted for SQL                    */
+  char **az;                    /* Columns of aux.zTab, or NULL            */
+  int nPk;                      /* Number of primary key columns of az[]   */
+  int nCol;                     /* Number of entries in az[]               */
+  char **azEq;                  /* "column=" for every entry of az[]       */
+  LitEmitter *axEmit;           /* Literal encoder of every entry of az[]  */
+  char *zDump;                  /* Query of dump_table()                   */
+  char *zInsert;                /* "INSERT INTO zId(az) VALUES("           */
+  char *aRec;                   /* Its --binary 'T' record, once written   */
+  size_t nRec;                  /* Size of aRec                            */
+  int bMain;                    /* True once azMain and nPkMain are set    */
+  char **azMain;                /* Columns of main.zTab, or NULL           */
+  int nPkMain;                  /* Number of primary key columns of azMain */
+  char *azDiff[2];              /* Comparison queries, without/with CDC    */
+  int bCached;                  /* True if kept in the Replica             */
+  DiffKernel *pNext;            /* Next cached table                       */
+};
+
+/*
+** A histogram of durations, in microseconds, or of sizes, in bytes.
+** Bucket i counts the values up to base * 4^i, see histAdd(), and the
+** last bucket the larger ones.
+*/
+#define HIST_NBUCKET 12         /* Buckets of a Hist, +Inf excluded        */
+typedef struct Hist Hist;
+struct Hist
+{
+  sqlite3_int64 aCount[HIST_NBUCKET + 1];       /* Values, by bucket       */
+  sqlite3_int64 nCount;         /* Number of values                        */
+  sqlite3_int64 iSum;           /* Sum of the values                       */
+};
+
+/*
+** Kinds of the rows output by a diff
+*/
+#define ROW_INSERT 0
+#define ROW_UPDATE 1
+#define ROW_DELETE 2
+#define ROW_NKIND  3
+
+/*
+** Outcomes of the replication of a database, see statsCount()
+*/
+#define STAT_APPLIED   0        /* A patch was applied                     */
+#define STAT_FAILED    1        /* A patch failed to apply                 */
+#define STAT_EMPTY     2        /* The diff found no change                */
+#define STAT_UNCHANGED 3        /* The source did not change, no diff      */
+#define STAT_BUSY      4        /* The source was locked, retried later    */
+#define STAT_RESYNC    5        /* The backup was copied from the source   */
+#define STAT_NRESULT   6
+
+/*
+** Metrics of the diffs of one table of a database
+*/
+typedef struct TableStats TableStats;
+struct TableStats
+{
+  char *zTab;                   /* Name of the table                       */
+  Hist diff;                    /* Durations of its diffs                  */
+  sqlite3_int64 anRow[ROW_NKIND];       /* Rows output, by ROW_* kind      */
+  TableStats *pNext;            /* Next table in the same hash bucket      */
+};
+
+/*
+** Metrics of one database.  See "Metrics" below.
+*/
+#define STATS_NHASH 64          /* Number of hash buckets of apTable     */
+typedef struct ReplicaStats ReplicaStats;
+struct ReplicaStats
+{
+  sqlite3_int64 nEvent;         /* Events received (inotify thread)        */
+  sqlite3_int64 nCoalesced;     /* Events merged into a replication        */
+  sqlite3_int64 anResult[STAT_NRESULT]; /* Replications, by STAT_* outcome */
+  sqlite3_int64 anRow[ROW_NKIND];       /* Rows output, by ROW_* kind      */
+  Hist diff;                    /* Durations of the diffs                  */
+  Hist apply;                   /* Durations of the patches                */
+  Hist lag;                     /* From the first event to the patch       */
+  Hist bytes;                   /* Sizes of the patches                    */
+  TableStats *apTable[STATS_NHASH];     /* Metrics of the tables           */
+};
+
+/*
+** Replication state kept for every database of the watched directories.
+** A Replica object is created the first time an event is seen for the
+** database and lives until the program exits.
+*/
+#define REPLICA_NHASH 1024      /* Number of hash buckets of g.aRepHash  */
+typedef struct Replica Replica;
+struct Replica
+{
+  char *zName;                  /* Database file name, relative to PATH    */
+  char *zSrc;                   /* Path of the source database             */
+  char *zBackup;                /* Path of its backup                      */
+  char *zPatch;                 /* Path of its patch journal, less suffix  */
+  char *zIndex;                 /* Path of the journal index               */
+  char *zSegment;               /* Path of the current journal segment     */
+  int bJournal;                 /* True once journalOpen() was called      */
+  sqlite3_uint64 iSeq;          /* Number of the last journaled patch      */
+  sqlite3_uint64 iSegment;      /* Number of the first patch of zSegment   */
+  sqlite3_int64 nSegment;       /* Size of zSegment                        */
+  sqlite3_uint64 iApplied;      /* Number of the last patch applied        */
+  int bWalValid;                /* True if the WAL fields below are valid  */
+  u32 aWalSalt[2];              /* Salt values of the WAL last scanned     */
+  u32 aWalCksum[2];             /* Running checksum at frame nWalFrame     */
+  u32 nWalFrame;                /* WAL frames already replicated           */
+  int iSchema;                  /* Source schema_version at that point     */
+  int bCounterValid;            /* True if iCounter is valid               */
+  u32 iCounter;                 /* Change counter of the source header     */
+  TableHash *aHash;             /* Hashes of the tables of the backup      */
+  int nHash;                    /* Number of entries in aHash[]            */
+  int bQueued;                  /* True if waiting in the job queue        */
+  int bBusy;                    /* True while a worker replicates it       */
+  int bPending;                 /* Changed again while bBusy               */
+  int bDirty;                   /* Changed, but not scheduled yet          */
+  sqlite3_int64 iFirstEvent;    /* Time of the first event while bDirty    */
+  sqlite3_int64 iLastEvent;     /* Time of the last event while bDirty     */
+  Replica *pNextDirty;          /* Next database in the g.pDirty list      */
+  Replica *pNextJob;            /* Next database in the job queue          */
+  sqlite3 *db;                  /* Diff connection: backup plus source     */
+  struct Patcher *pPatcher;     /* Patch connection to the backup          */
+  dev_t aDev[2];                /* Devices of the source and backup files  */
+  ino_t aIno[2];                /* Inodes of the source and backup files   */
+  int aSchema[2];               /* schema_version of backup and source     */
+  StmtCache *aStmt[STMT_NHASH]; /* Statements prepared on db               */
+  StmtCache *aStmtByPtr[STMT_NHASH];    /* aStmt[] hashed by pStmt   */
+  int nStmt;                    /* Number of entries in aStmt[]            */
+  ColCache *pColCache;          /* Cached columnNames() results            */
+  DiffKernel *pKernel;          /* Cached diffKernel() results             */
+  sqlite3 **apReader;           /* Extra diff connections, --table-jobs    */
+  int nReader;                  /* Number of entries in apReader[]         */
+  sqlite3_uint64 iShipped;      /* iApplied, as the links see it (g.mutex) */
+  sqlite3_uint64 *aAcked;       /* Last patch acked by every link (g.mutex)*/
+  sqlite3_int64 iEventTime;     /* First event not taken by a worker, or 0 */
+  sqlite3_int64 iJobEvent;      /* First event of the current replication  */
+  ReplicaStats stats;           /* Metrics, see "Metrics" (g.mutex)        */
+  Replica *pNext;               /* Next known database                     */
+  Replica *pHashNext;           /* Next database in the same hash bucket   */
+};
+
+/*
+** A directory watched by inotify: one of the PATH arguments or, with
+** --recursive, one of their subdirectories.  The backups and patch
+** journals of the databases of directory PATH/DIR are kept in
+** PATH/backup/DIR and PATH/patches/DIR.
+*/
+#define WATCH_NHASH 1024        /* Number of hash buckets of g.aWatch    */
+typedef struct Watch Watch;
+struct Watch
+{
+  int wd;                       /* inotify watch descriptor                */
+  char *zDir;                   /* Path of the directory                   */
+  const char *zRoot;            /* PATH argument the directory is under    */
+  char *zRel;                   /* zDir relative to zRoot, "" for zRoot    */
+  Watch *pNext;                 /* Next watch in the same hash bucket      */
+};
+
+/*
+** A buffer of frames sent over or received from a TCP connection.  See
+** "Remote replicas" below.
+*/
+typedef struct LinkBuf LinkBuf;
+struct LinkBuf
+{
+  void *a;                      /* The bytes                               */
+  size_t n;                     /* Bytes used                              */
+  size_t nAlloc;                /* Bytes allocated                         */
+  size_t iRead;                 /* Bytes already decoded, if received      */
+};
+
+/*
+** A remote replica, --replica HOST:PORT.  Everything but zHost and zPort
+** is only used by the thread of the link.
+*/
+typedef struct LinkDb LinkDb;
+typedef struct Link Link;
+struct Link
+{
+  char *zHost;                  /* Host of the receiver                    */
+  char *zPort;                  /* Its port                                */
+  int iLink;                    /* Index in g.aLink[] and Replica.aAcked[] */
+  int efd;                      /* eventfd signaled when patches applied   */
+  int fd;                       /* The connection, or -1                   */
+  pthread_t tid;                /* The thread of the link                  */
+  LinkBuf in;                   /* Frames received                         */
+  LinkBuf out;                  /* Frames to send                          */
+  int nFlight;                  /* Patches not acknowledged yet            */
+  LinkDb *pDb;                  /* What the link knows of every database   */
+  void *pRaw;                   /* Buffer patches are read in              */
+  size_t nRaw;                  /* Bytes allocated for pRaw                */
+  void *pZip;                   /* Buffer patches are compressed in        */
+  size_t nZip;                  /* Bytes allocated for pZip                */
+};
+
 /*
 ** All global variables are gathered into the "g" singleton.
 */
@@ -50,14 +318,117 @@ struct GlobalVars
   const char *zArgv0;           /* Name of program                            */
   int bSchemaPK;                /* Use the schema-defined PK, not the true PK */
   unsigned fDebug;              /* Debug flags                                */
-  sqlite3 *db;                  /* The database connection                    */
   uint32_t FSEvent;             /* inotify event: IN_CLOSE_WRITE by default   */
   unsigned int verbose;         /* Verbose output                             */
   int useTransaction;           /* Show SQL output inside a transaction       */
   int nExt;
   char **azExt;                 /* Load an SQLite extension library           */
   int rbuTable;                 /* Output SQL to create/populate RBU table(s) */
-} g;
+  int bCdc;                     /* Diff only the rows changed in the WAL      */
+  int bTableHash;               /* Skip tables whose content hash is the same */
+  int nBatch;                   /* Commit patches every nBatch statements     */
+  int bBinary;                  /* Write and apply binary patches             */
+  Replica *pReplica;            /* List of all known databases                */
+  Replica *aRepHash[REPLICA_NHASH];     /* g.pReplica, by zSrc             */
+  Replica *pDirty;              /* Databases with bDirty set                  */
+  int nWorker;                  /* Number of worker threads                   */
+  pthread_t *aWorker;           /* The worker threads                         */
+  pthread_mutex_t mutex;        /* Protects the job queue                     */
+  pthread_cond_t cond;          /* Signaled when a job is queued              */
+  Replica *pJob;                /* First database waiting for a worker        */
+  Replica *pLastJob;            /* Last database waiting for a worker         */
+  int nBusy;                    /* Databases being replicated by a worker     */
+  int doneFd;                   /* eventfd signaled when a job is done        */
+  int bStop;                    /* Workers exit once the queue is empty       */
+  int iInterval;                /* Quiet time before a replication, in ms     */
+  int iMaxDelay;                /* Max delay of a replication, in ms          */
+  int iBusyTimeout;             /* Max wait for a database lock, in ms        */
+  int nRoot;
+  char **azRoot;                /* The PATH arguments                         */
+  int bRecursive;               /* Also watch the subdirectories of PATH      */
+  int inotifyFd;                /* The inotify file descriptor                */
+  int epollFd;                  /* The event loop, see eventLoop()            */
+  int timerFd;                  /* timerfd of the next deadline of the loop   */
+  int signalFd;                 /* signalfd of SIGINT and SIGTERM             */
+  Watch *aWatch[WATCH_NHASH];   /* Watched directories, by watch descriptor   */
+  int nEventBuf;                /* Size of the inotify read buffer, in bytes  */
+  char *aEventBuf;              /* The inotify read buffer                    */
+  sqlite3_int64 nEvent;         /* Number of inotify events read              */
+  sqlite3_int64 nEventRead;     /* Number of read()s that returned events     */
+  sqlite3_int64 nEventStale;    /* Events of directories no longer watched    */
+  ssize_t nEventMax;            /* Largest read(), in bytes                   */
+  int nOverflow;                /* Number of inotify queue overflows          */
+  int nDeltaThread;             /* Threads computing large RBU blob deltas    */
+  int nDeltaStep;               /* Sampling step of RBU delta sources         */
+  int nTableJob;                /* Tables of a database diffed at once        */
+  sqlite3_int64 nSegmentSize;   /* Journal segments are rotated at this size  */
+  int nKeepSegment;             /* Journal segments kept, 0 for all           */
+  int bDirect;                  /* Apply the diff while it runs               */
+  int bNoJournal;               /* Do not write the journal, with --direct    */
+  sqlite3_int64 nSplitKey;      /* Diff tables in ranges of this many keys    */
+  int nLink;
+  Link *aLink;                  /* Remote replicas the patches are shipped to */
+  int nSendWindow;              /* Patches in flight on a link at most        */
+  int bLinkStop;                /* Links exit once idle (g.mutex)             */
+  const char *zListen;          /* Receive patches on this address            */
+  int nResync;                  /* Copy the source when the diff dumps more   */
+  int bMergeJoin;               /* Diff all tables by merge join              */
+  int bRowHash;                 /* Keep the row hashes of the backups         */
+  sqlite3_int64 nStatPatch;     /* Patches diffed, see statsAdd() (g.mutex)   */
+  sqlite3_int64 nStatRow;       /* Rows changed by them                       */
+  sqlite3_int64 nStatByte;      /* Bytes of these patches                     */
+  sqlite3_int64 nStatStmt;      /* Statements applied by sqlPatch()           */
+  sqlite3_int64 usStatDiff;     /* Time spent in sqlDiff(), in microseconds   */
+  sqlite3_int64 usStatPatch;    /* Time spent applying the patches            */
+  int bWal;                     /* Replicate on the writes to the -wal files  */
+  int bCheckpoint;              /* Checkpoint the sources once diffed         */
+  int bBackupWal;               /* Put the backups in WAL mode                */
+  sqlite3_int64 nMemory;        /* Memory budget in bytes, 0 for none         */
+  const char *zStats;           /* Write the metrics to this file             */
+  int iStatsInterval;           /* Every this many ms                         */
+  sqlite3_int64 iStatsDue;      /* Time of the next write, in ms              */
+} g = {
+  /* Initialized statically: the first watches lock the mutex before
+   ** the worker threads are started */
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+** A range of the first primary key column of a table.  See diffSplit().
+*/
+typedef struct DiffRange DiffRange;
+struct DiffRange
+{
+  int bLo;                      /* False if the range has no lower bound      */
+  int bHi;                      /* False if the range has no upper bound      */
+  sqlite3_int64 iLo;            /* Keys are >= iLo, if bLo                    */
+  sqlite3_int64 iHi;            /* Keys are < iHi, if bHi                     */
+};
+
+/*
+** Variables private to every worker thread.  The diff of a database runs
+** on the connection of the worker that replicates it.
+*/
+static __thread struct WorkerVars
+{
+  sqlite3 *db;                  /* The database connection                    */
+  Replica *pRep;                /* The database being diffed, if any          */
+  void *pLit;                   /* Buffer printQuoted() encodes values in     */
+  size_t nLit;                  /* Bytes allocated for pLit                   */
+  void *pDelta;                 /* Buffer rbuDeltaCreate() writes deltas in   */
+  size_t nDelta;                /* Bytes allocated for pDelta                 */
+  void *pDeltaHash;             /* Hash tables of rbuDeltaCreate()            */
+  size_t nDeltaHash;            /* Bytes allocated for pDeltaHash             */
+  char *aOutBuf;                /* stdio buffer of the patch journal          */
+  const DiffRange *pRange;      /* Range diff_one_table() restricts itself to */
+  Replica *pRowHash;            /* Database whose sidecars are used, if any   */
+  sqlite3_int64 anDiffRow[ROW_NKIND];   /* Rows output by the current diff */
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  sqlite3_snapshot *pSnapshot;  /* Source snapshot of the extra readers     */
+#endif
+  long nDiffByte;               /* Bytes of the last patch of sqlDiff()       */
+} w;
 
 #define VERBOSE(fmt, args...) if (g.verbose) printf(fmt, ##args)
 
@@ -240,9 +611,9 @@ db_vprepare (const char *zFormat, va_list ap)
   zSql = sqlite3_vmprintf (zFormat, ap);
   if (zSql == 0)
     runtimeError ("out of memory");
-  rc = sqlite3_prepare_v2 (g.db, zSql, -1, &pStmt, 0);
+  rc = sqlite3_prepare_v2 (w.db, zSql, -1, &pStmt, 0);
   if (rc)
-    runtimeError ("SQL statement error: %s\n\"%s\"", sqlite3_errmsg (g.db),
+    runtimeError ("SQL statement error: %s\n\"%s\"", sqlite3_errmsg (w.db),
                   zSql);
 
   sqlite3_free (zSql);
@@ -260,6 +631,105 @@ db_prepare (const char *zFormat, ...)
   return pStmt;
 }
 
+/*
+** Statement cache.
+**
+** When a Replica is being diffed, the statements prepared with
+** db_cprepare() and released with db_crelease() stay prepared on its
+** connection, for the next diff that runs the same SQL.  Without a
+** Replica, they are prepared and finalized every time.
+*/
+static unsigned int
+strHash (const char *z)
+{
+  unsigned int h = 0;
+  while (*z)
+    h = (h ^ (unsigned char) *z++) * 16777619u;
+  return h;
+}
+
+static sqlite3_stmt *
+db_cprepare (const char *zFormat, ...)
+{
+  va_list ap;
+  char *zSql;
+  unsigned int h;
+  StmtCache *pEntry;
+  sqlite3_stmt *pStmt;
+
+  va_start (ap, zFormat);
+  if (w.pRep == 0 || w.pRep->nStmt >= STMT_MAX)
+    {
+      pStmt = db_vprepare (zFormat, ap);
+      va_end (ap);
+      return pStmt;
+    }
+  zSql = sqlite3_vmprintf (zFormat, ap);
+  va_end (ap);
+  if (zSql == 0)
+    runtimeError ("out of memory");
+
+  h = strHash (zSql);
+  for (pEntry = w.pRep->aStmt[h % STMT_NHASH]; pEntry; pEntry = pEntry->pNext)
+    if (pEntry->h == h && !pEntry->bInUse && strcmp (pEntry->zSql, zSql) == 0)
+      {
+        sqlite3_free (zSql);
+        pEntry->bInUse = 1;
+        return pEntry->pStmt;
+      }
+
+  pEntry = sqlite3_malloc (sizeof (*pEntry));
+  if (pEntry == 0)
+    runtimeError ("out of memory");
+  pEntry->pStmt = db_prepare ("%s", zSql);
+  pEntry->zSql = zSql;
+  pEntry->h = h;
+  pEntry->bInUse = 1;
+  pEntry->ePlan = PLAN_UNKNOWN;
+  pEntry->pNext = w.pRep->aStmt[h % STMT_NHASH];
+  w.pRep->aStmt[h % STMT_NHASH] = pEntry;
+  pEntry->pNextStmt = w.pRep->aStmtByPtr[STMT_PHASH (pEntry->pStmt)];
+  w.pRep->aStmtByPtr[STMT_PHASH (pEntry->pStmt)] = pEntry;
+  w.pRep->nStmt++;
+  return pEntry->pStmt;
+}
+
+/*
+** Return the cache entry of a statement obtained from db_cprepare(), or
+** NULL if it is not cached.  The entries are also hashed by statement,
+** as sqlite3_sql() drops what follows the first statement of the text
+** they were prepared from.
+*/
+static StmtCache *
+db_centry (sqlite3_stmt * pStmt)
+{
+  StmtCache *pEntry;
+  if (w.pRep == 0 || pStmt == 0)
+    return 0;
+  for (pEntry = w.pRep->aStmtByPtr[STMT_PHASH (pStmt)]; pEntry;
+       pEntry = pEntry->pNextStmt)
+    if (pEntry->pStmt == pStmt)
+      return pEntry;
+  return 0;
+}
+
+/*
+** Release a statement obtained from db_cprepare()
+*/
+static void
+db_crelease (sqlite3_stmt * pStmt)
+{
+  StmtCache *pEntry = db_centry (pStmt);
+  if (pEntry)
+    {
+      sqlite3_reset (pStmt);
+      sqlite3_clear_bindings (pStmt);
+      pEntry->bInUse = 0;
+      return;
+    }
+  sqlite3_finalize (pStmt);
+}
+
 /*
 ** Free a list of strings
 */
@@ -317,10 +787,10 @@ namelistFree (char **az)
 **    az = 0     // The rowid is not accessible
 */
 static char **
-columnNames (const char *zDb,   /* Database ("main" or "aux") to query  */
-             const char *zTab,  /* Name of table to return details of   */
-             int *pnPKey,       /* OUT: Number of PK columns            */
-             int *pbRowid       /* OUT: True if PK is an implicit rowid */
+columnNamesRead (const char *zDb,   /* Database ("main" or "aux") to query  */
+                 const char *zTab,  /* Name of table to return details of   */
+                 int *pnPKey,       /* OUT: Number of PK columns            */
+                 int *pbRowid       /* OUT: True if PK is an implicit rowid */
   )
 {
   char **az = 0;                /* List of column names to be returned         */
@@ -460,6 +930,260 @@ columnNames (const char *zDb,   /* Database ("main" or "aux") to query  */
   return az;
 }
 
+/*
+** Return a copy of the list of strings az, or NULL if az is NULL
+*/
+static char **
+namelistDup (char **az)
+{
+  char **azCopy;
+  int i, n;
+  if (az == 0)
+    return 0;
+  for (n = 0; az[n]; n++);
+  azCopy = sqlite3_malloc ((n + 1) * sizeof (azCopy[0]));
+  if (azCopy == 0)
+    runtimeError ("out of memory");
+  for (i = 0; i < n; i++)
+    if ((azCopy[i] = sqlite3_mprintf ("%s", az[i])) == 0)
+      runtimeError ("out of memory");
+  azCopy[n] = 0;
+  return azCopy;
+}
+
+/*
+** Same as columnNamesRead(), but the result is cached in the Replica
+** being diffed, until the schema of its databases changes.
+*/
+static char **
+columnNames (const char *zDb, const char *zTab, int *pnPKey, int *pbRowid)
+{
+  ColCache *pEntry;
+  int bRowid = 0;
+
+  if (w.pRep == 0)
+    return columnNamesRead (zDb, zTab, pnPKey, pbRowid);
+  for (pEntry = w.pRep->pColCache; pEntry; pEntry = pEntry->pNext)
+    if (strcmp (pEntry->zDb, zDb) == 0 && strcmp (pEntry->zTab, zTab) == 0)
+      break;
+  if (pEntry == 0)
+    {
+      pEntry = sqlite3_malloc (sizeof (*pEntry));
+      if (pEntry == 0)
+        runtimeError ("out of memory");
+      pEntry->nPk = 0;
+      pEntry->az = columnNamesRead (zDb, zTab, &pEntry->nPk, &bRowid);
+      pEntry->bRowid = pEntry->az ? bRowid : 0;
+      pEntry->zDb = sqlite3_mprintf ("%s", zDb);
+      pEntry->zTab = sqlite3_mprintf ("%s", zTab);
+      if (pEntry->zDb == 0 || pEntry->zTab == 0)
+        runtimeError ("out of memory");
+      pEntry->pNext = w.pRep->pColCache;
+      w.pRep->pColCache = pEntry;
+    }
+  *pnPKey = pEntry->nPk;
+  if (pbRowid)
+    *pbRowid = pEntry->bRowid;
+  return namelistDup (pEntry->az);
+}
+
+/*
+** Literal encoder.
+**
+** printQuoted() does not go through stdio formatting: every value is
+** encoded into w.pLit, a buffer reused by the thread, and written with
+** a single fwrite().  Blobs are hex-encoded from a table, and text is
+** copied in runs between quotes.  Values of more than LIT_CHUNK bytes
+** are encoded and written LIT_CHUNK bytes at a time, so that w.pLit
+** does not grow to twice the largest of them.  The patch journal itself
+** has a stdio buffer of OUT_BUFSIZE bytes.
+*/
+#define OUT_BUFSIZE (256 * 1024)
+#define LIT_CHUNK (64 * 1024)
+
+static const char hexDigits[] = "0123456789abcdef";
+
+/*
+** Return the scratch buffer *pp of *pnAlloc bytes, grown to at least n
+** bytes if needed.  Scratch buffers belong to the worker thread and are
+** reused from one call to the next, instead of being allocated for
+** every value.
+*/
+static void *
+scratchReserve (void **pp, size_t *pnAlloc, size_t n)
+{
+  if (n > *pnAlloc)
+    {
+      size_t nNew = *pnAlloc ? *pnAlloc : 4096;
+      void *pNew;
+      while (nNew < n)
+        nNew *= 2;
+      pNew = sqlite3_realloc64 (*pp, nNew);
+      if (pNew == 0)
+        runtimeError ("out of memory");
+      *pp = pNew;
+      *pnAlloc = nNew;
+    }
+  return *pp;
+}
+
+/*
+** Return a buffer of at least n bytes in w.pLit
+*/
+static char *
+litReserve (size_t n)
+{
+  return scratchReserve (&w.pLit, &w.nLit, n);
+}
+
+/*
+** Memory budget.
+**
+** With --memory MB, the memory of the process is kept within about MB
+** megabytes.  Half of it is the soft heap limit of SQLite, which makes
+** it reuse the pages of its caches rather than allocate more.  Every
+** connection caches MEMORY_CACHE_SHARE of it per database at most, does
+** not mmap the databases, and keeps its temporary tables in files.  The
+** --rbu rows waiting for the deltas of their blobs hold a quarter of it
+** at most, and blobs of more than MEMORY_DELTA_SHARE of it are written
+** whole, as computing their delta takes as much again.  The scratch
+** buffers of a worker are released once it replicated a database if they
+** grew past MEMORY_SCRATCH_KEEP bytes.
+**
+** Values are still read whole by the diff queries, and a patch statement
+** is held whole while it is applied, so the budget cannot be smaller than
+** a few times the largest of them.
+*/
+#define MEMORY_CACHE_SHARE 16   /* Cache of a database: 1/16 of budget  */
+#define MEMORY_DELTA_SHARE 8    /* Largest --rbu delta: 1/8 of budget   */
+#define MEMORY_SCRATCH_KEEP (1024 * 1024)       /* Scratch kept at most */
+
+/*
+** Apply the memory budget to database zDb of connection db
+*/
+static void
+memoryConfigure (sqlite3 * db, const char *zDb)
+{
+  char *zSql;
+  if (g.nMemory == 0)
+    return;
+  zSql = sqlite3_mprintf ("PRAGMA %s.cache_size=-%lld;"
+                          " PRAGMA %s.mmap_size=0; PRAGMA temp_store=FILE",
+                          zDb, g.nMemory / MEMORY_CACHE_SHARE / 1024, zDb);
+  if (zSql == 0)
+    runtimeError ("out of memory");
+  sqlite3_exec (db, zSql, 0, 0, 0);
+  sqlite3_free (zSql);
+}
+
+/*
+** Release the scratch buffers of the thread that grew too large
+*/
+static void
+scratchTrim (void)
+{
+  if (g.nMemory == 0)
+    return;
+  if (w.nLit > MEMORY_SCRATCH_KEEP)
+    {
+      sqlite3_free (w.pLit);
+      w.pLit = 0;
+      w.nLit = 0;
+    }
+  if (w.nDelta > MEMORY_SCRATCH_KEEP)
+    {
+      sqlite3_free (w.pDelta);
+      w.pDelta = 0;
+      w.nDelta = 0;
+    }
+  if (w.nDeltaHash > MEMORY_SCRATCH_KEEP)
+    {
+      sqlite3_free (w.pDeltaHash);
+      w.pDeltaHash = 0;
+      w.nDeltaHash = 0;
+    }
+}
+
+/*
+** Write the n bytes of a as the SQL blob literal x'...' to out
+*/
+static void
+printBlob (FILE * out, const unsigned char *a, size_t n)
+{
+  char *z = litReserve (2 * (n < LIT_CHUNK ? n : LIT_CHUNK) + 3);
+  char *zOut = z;
+  size_t i;
+
+  *zOut++ = 'x';
+  *zOut++ = '\'';
+  for (i = 0; i < n; i++)
+    {
+      if (i % LIT_CHUNK == 0 && i > 0)
+        {
+          fwrite (z, 1, zOut - z, out);
+          zOut = z;
+        }
+      zOut[0] = hexDigits[a[i] >> 4];
+      zOut[1] = hexDigits[a[i] & 0x0f];
+      zOut += 2;
+    }
+  *zOut++ = '\'';
+  fwrite (z, 1, zOut - z, out);
+}
+
+/*
+** Write the n bytes of text zArg as an SQL text literal to out
+*/
+static void
+printText (FILE * out, const unsigned char *zArg, size_t n)
+{
+  char *z, *zOut;
+  const unsigned char *zEnd = zArg + n;
+
+  /* At worst every character of a chunk is a quote */
+  z = litReserve (2 * (n < LIT_CHUNK ? n : LIT_CHUNK) + 2);
+  zOut = z;
+  *zOut++ = '\'';
+  while (zArg < zEnd)
+    {
+      size_t nMax = zEnd - zArg < LIT_CHUNK ? zEnd - zArg : LIT_CHUNK;
+      const unsigned char *zQuote = memchr (zArg, '\'', nMax);
+      size_t nRun = (zQuote ? zQuote + 1 : zArg + nMax) - zArg;
+      if (zOut - z + 2 * nRun + 2 > 2 * LIT_CHUNK + 2)
+        {
+          fwrite (z, 1, zOut - z, out);
+          zOut = z;
+        }
+      memcpy (zOut, zArg, nRun);
+      zOut += nRun;
+      if (zQuote)
+        *zOut++ = '\'';
+      zArg += nRun;
+    }
+  *zOut++ = '\'';
+  fwrite (z, 1, zOut - z, out);
+}
+
+/*
+** Print the integer v, without going through stdio formatting
+*/
+static void
+printInt64 (FILE * out, sqlite3_int64 v)
+{
+  char zBuf[24];
+  char *z = zBuf + sizeof (zBuf);
+  sqlite3_uint64 u = v < 0 ? -(sqlite3_uint64) v : (sqlite3_uint64) v;
+  do
+    {
+      *--z = (char) ('0' + u % 10);
+      u /= 10;
+    }
+  while (u != 0);
+  if (v < 0)
+    *--z = '-';
+  fwrite (z, 1, zBuf + sizeof (zBuf) - z, out);
+}
+
 /*
 ** Print the sqlite3_value X as an SQL literal.
 */
@@ -474,12 +1198,12 @@ printQuoted (FILE * out, sqlite3_value * X)
         char zBuf[50];
         r1 = sqlite3_value_double (X);
         sqlite3_snprintf (sizeof (zBuf), zBuf, "%!.15g", r1);
-        fprintf (out, "%s", zBuf);
+        fputs (zBuf, out);
         break;
       }
     case SQLITE_INTEGER:
       {
-        fprintf (out, "%lld", sqlite3_value_int64 (X));
+        printInt64 (out, sqlite3_value_int64 (X));
         break;
       }
     case SQLITE_BLOB:
@@ -487,1263 +1211,8864 @@ printQuoted (FILE * out, sqlite3_value * X)
         const unsigned char *zBlob = sqlite3_value_blob (X);
         int nBlob = sqlite3_value_bytes (X);
         if (zBlob)
-          {
-            int i;
-            fprintf (out, "x'");
-            for (i = 0; i < nBlob; i++)
-              fprintf (out, "%02x", zBlob[i]);
-
-            fprintf (out, "'");
-          }
+          printBlob (out, zBlob, nBlob);
         else
-          fprintf (out, "NULL");
+          fputs ("NULL", out);
 
         break;
       }
     case SQLITE_TEXT:
       {
         const unsigned char *zArg = sqlite3_value_text (X);
-        int i, j;
 
         if (zArg == 0)
-          fprintf (out, "NULL");
+          fputs ("NULL", out);
         else
-          {
-            fprintf (out, "'");
-            for (i = j = 0; zArg[i]; i++)
-              if (zArg[i] == '\'')
-                {
-                  fprintf (out, "%.*s'", i - j + 1, &zArg[j]);
-                  j = i + 1;
-                }
-            fprintf (out, "%s'", &zArg[j]);
-          }
+          printText (out, zArg, strlen ((const char *) zArg));
         break;
       }
     case SQLITE_NULL:
       {
-        fprintf (out, "NULL");
+        fputs ("NULL", out);
         break;
       }
     }
 }
 
 /*
-** Output SQL that will recreate the aux.zTab table.
+** printQuoted() for a column of INTEGER affinity: integers are printed
+** without looking further at the value
 */
 static void
-dump_table (const char *zTab, FILE * out)
+printInteger (FILE * out, sqlite3_value * X)
 {
-  char *zId = safeId (zTab);    /* Name of the table                  */
-  char **az = 0;                /* List of columns                    */
-  int nPk;                      /* Number of true primary key columns */
-  int nCol;                     /* Number of data columns             */
-  int i;                        /* Loop counter                       */
-  sqlite3_stmt *pStmt;          /* SQL statement                      */
-  const char *zSep;             /* Separator string                   */
-  Str ins;                      /* Beginning of the INSERT statement  */
+  if (sqlite3_value_type (X) == SQLITE_INTEGER)
+    printInt64 (out, sqlite3_value_int64 (X));
+  else
+    printQuoted (out, X);
+}
 
-  pStmt =
-    db_prepare ("SELECT sql FROM aux.sqlite_master WHERE name=%Q", zTab);
-  if (SQLITE_ROW == sqlite3_step (pStmt))
-    fprintf (out, "%s;\n", sqlite3_column_text (pStmt, 0));
+/*
+** printQuoted() for a column of TEXT affinity
+*/
+static void
+printTextValue (FILE * out, sqlite3_value * X)
+{
+  const unsigned char *z;
+  if (sqlite3_value_type (X) == SQLITE_TEXT
+      && (z = sqlite3_value_text (X)) != 0)
+    printText (out, z, strlen ((const char *) z));
+  else
+    printQuoted (out, X);
+}
 
-  sqlite3_finalize (pStmt);
+/*
+** Return the literal encoder of a column of declared type zType, from
+** its affinity as SQLite determines it
+*/
+static LitEmitter
+litEmitter (const char *zType)
+{
+  static const char *azText[] = { "CHAR", "CLOB", "TEXT" };
+  const char *z;
+  size_t i;
+
+  for (z = zType ? zType : ""; *z; z++)
+    if (sqlite3_strnicmp (z, "INT", 3) == 0)
+      return printInteger;
+  for (i = 0; i < sizeof (azText) / sizeof (azText[0]); i++)
+    for (z = zType ? zType : ""; *z; z++)
+      if (sqlite3_strnicmp (z, azText[i], 4) == 0)
+        return printTextValue;
+  return printQuoted;
+}
 
-  az = columnNames ("aux", zTab, &nPk, 0);
-  strInit (&ins);
-  if (az == 0)
-    {
-      pStmt = db_prepare ("SELECT * FROM aux.%s", zId);
-      strPrintf (&ins, "INSERT INTO %s VALUES", zId);
-    }
-  else
-    {
-      Str sql;
-      strInit (&sql);
-      zSep = "SELECT";
-      for (i = 0; az[i]; i++)
-        {
-          strPrintf (&sql, "%s %s", zSep, az[i]);
+/*
+** Binary patches.
+**
+** With --binary, patches are written as a sequence of records with
+** typed column values instead of SQL text.  Every record starts with
+** a one-byte type:
+**
+**    'S'  varint nByte, followed by nByte bytes of SQL text.  Used for
+**         schema changes.
+**
+**    'T'  varint nCol, varint nPk, then the name of the table and the
+**         names of its nCol columns, primary key columns first.  Each
+**         name is a varint length followed by the name, quoted for SQL.
+**         The records up to the next 'T' record apply to this table.
+**         If the column names are empty, rows are inserted without a
+**         column list.
+**
+**    'I'  Insert a row: nCol values.
+**
+**    'D'  Delete a row: the nPk values of its primary key.
+**
+**    'U'  Update a row: the nPk values of its primary key, followed by
+**         nCol-nPk values, where unchanged columns are undefined.
+**
+** Values are encoded the way the SQLite changeset format does it: a
+** one-byte type, which is 0 for an undefined value, or SQLITE_INTEGER,
+** SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB or SQLITE_NULL.  Integers and
+** real numbers follow as 8 bytes, big-endian.  Text and blobs follow
+** as a varint length and their content.  Varints use the SQLite
+** database file format.
+*/
+#define PATCH_UNDEFINED 0
+
+/*
+** Write v to out as a varint
+*/
+static void
+putVarint (FILE * out, sqlite3_uint64 v)
+{
+  u8 a[10];
+  int i, n = 0;
+  if (v & ((sqlite3_uint64) 0xff000000 << 32))
+    {
+      a[8] = (u8) v;
+      v >>= 8;
+      for (i = 7; i >= 0; i--)
+        {
+          a[i] = (u8) ((v & 0x7f) | 0x80);
+          v >>= 7;
+        }
+      fwrite (a, 1, 9, out);
+      return;
+    }
+  do
+    {
+      a[n++] = (u8) ((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+  while (v != 0);
+  a[0] &= 0x7f;
+  for (i = n - 1; i >= 0; i--)
+    putc (a[i], out);
+}
+
+/*
+** Write the sqlite3_value X to out as a binary patch value
+*/
+static void
+patchValue (FILE * out, sqlite3_value * X)
+{
+  int eType = sqlite3_value_type (X);
+  putc (eType, out);
+  switch (eType)
+    {
+    case SQLITE_INTEGER:
+    case SQLITE_FLOAT:
+      {
+        sqlite3_uint64 v;
+        int i;
+        if (eType == SQLITE_INTEGER)
+          v = (sqlite3_uint64) sqlite3_value_int64 (X);
+        else
+          {
+            double r = sqlite3_value_double (X);
+            memcpy (&v, &r, sizeof (v));
+          }
+        for (i = 56; i >= 0; i -= 8)
+          putc ((int) (v >> i) & 0xff, out);
+        break;
+      }
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      {
+        const void *p = eType == SQLITE_TEXT
+          ? (const void *) sqlite3_value_text (X) : sqlite3_value_blob (X);
+        int n = sqlite3_value_bytes (X);
+        putVarint (out, (sqlite3_uint64) n);
+        if (n > 0)
+          fwrite (p, 1, n, out);
+        break;
+      }
+    }
+}
+
+/*
+** Write a 'T' record for table zId with the nCol columns of az[].  If
+** az is NULL, the column names are left empty.
+*/
+static void
+patchTable (FILE * out, const char *zId, char **az, int nCol, int nPk)
+{
+  int i;
+  putc ('T', out);
+  putVarint (out, (sqlite3_uint64) nCol);
+  putVarint (out, (sqlite3_uint64) nPk);
+  putVarint (out, (sqlite3_uint64) strlen (zId));
+  fputs (zId, out);
+  for (i = 0; i < nCol; i++)
+    {
+      const char *z = az ? az[i] : "";
+      putVarint (out, (sqlite3_uint64) strlen (z));
+      fputs (z, out);
+    }
+}
+
+/*
+** Output an SQL statement.  With --binary, it is written as an 'S'
+** record.
+*/
+static void
+patchSql (FILE * out, const char *zFormat, ...)
+{
+  va_list ap;
+  va_start (ap, zFormat);
+  if (g.bBinary)
+    {
+      char *z = sqlite3_vmprintf (zFormat, ap);
+      if (z == 0)
+        runtimeError ("out of memory");
+      putc ('S', out);
+      putVarint (out, (sqlite3_uint64) strlen (z));
+      fputs (z, out);
+      sqlite3_free (z);
+    }
+  else
+    vfprintf (out, zFormat, ap);
+  va_end (ap);
+}
+
+/*
+** Diff kernels.
+**
+** What diff_one_table() and dump_table() output for a table depends on
+** its columns only, so it is built once for them: the column lists of
+** both databases, the comparison queries, the query of dump_table() and
+** the beginning of its INSERT statements, the "column=" of the UPDATE
+** and DELETE statements, the --binary 'T' record, and a literal encoder
+** for every column, chosen from its declared type, which goes straight
+** to the encoding of the values of that type.  The kernels of a Replica
+** are kept until the schema of one of its databases changes, as its
+** statements and column lists are, see replicaCheckSchema().  The extra
+** connections of --table-jobs, which have no Replica, build them for
+** every table they diff.
+*/
+
+/*
+** Free the kernel k
+*/
+static void
+kernelFree (DiffKernel * k)
+{
+  sqlite3_free (k->zTab);
+  sqlite3_free (k->zId);
+  namelistFree (k->az);
+  namelistFree (k->azEq);
+  sqlite3_free (k->axEmit);
+  sqlite3_free (k->zDump);
+  sqlite3_free (k->zInsert);
+  free (k->aRec);
+  namelistFree (k->azMain);
+  sqlite3_free (k->azDiff[0]);
+  sqlite3_free (k->azDiff[1]);
+  sqlite3_free (k);
+}
+
+/*
+** Release a kernel obtained from diffKernel()
+*/
+static void
+kernelRelease (DiffKernel * k)
+{
+  if (!k->bCached)
+    kernelFree (k);
+}
+
+/*
+** Return the kernel of table zTab of the databases of w.db, building it
+** if it is not cached.  Release it with kernelRelease().
+*/
+static DiffKernel *
+diffKernel (const char *zTab)
+{
+  DiffKernel *k;
+  sqlite3_stmt *pStmt;
+  const char *zSep;
+  Str sql, ins;
+  int i;
+
+  if (w.pRep)
+    for (k = w.pRep->pKernel; k; k = k->pNext)
+      if (strcmp (k->zTab, zTab) == 0)
+        return k;
+
+  k = sqlite3_malloc (sizeof (*k));
+  if (k == 0)
+    runtimeError ("out of memory");
+  memset (k, 0, sizeof (*k));
+  k->zTab = sqlite3_mprintf ("%s", zTab);
+  k->zId = safeId (zTab);
+  if (k->zTab == 0 || k->zId == 0)
+    runtimeError ("out of memory");
+  k->az = columnNames ("aux", zTab, &k->nPk, 0);
+
+  strInit (&sql);
+  strInit (&ins);
+  if (k->az == 0)
+    {
+      strPrintf (&sql, "SELECT * FROM aux.%s", k->zId);
+      strPrintf (&ins, "INSERT INTO %s VALUES(", k->zId);
+    }
+  else
+    {
+      zSep = "SELECT";
+      for (i = 0; k->az[i]; i++)
+        {
+          strPrintf (&sql, "%s %s", zSep, k->az[i]);
           zSep = ",";
         }
-      strPrintf (&sql, " FROM aux.%s", zId);
+      strPrintf (&sql, " FROM aux.%s", k->zId);
       zSep = " ORDER BY";
-      for (i = 1; i <= nPk; i++)
+      for (i = 1; i <= k->nPk; i++)
         {
           strPrintf (&sql, "%s %d", zSep, i);
           zSep = ",";
         }
-      pStmt = db_prepare ("%s", sql.z);
-      strFree (&sql);
-      strPrintf (&ins, "INSERT INTO %s", zId);
+      strPrintf (&ins, "INSERT INTO %s", k->zId);
       zSep = "(";
-      for (i = 0; az[i]; i++)
+      for (i = 0; k->az[i]; i++)
         {
-          strPrintf (&ins, "%s%s", zSep, az[i]);
+          strPrintf (&ins, "%s%s", zSep, k->az[i]);
           zSep = ",";
         }
-      strPrintf (&ins, ") VALUES");
-      namelistFree (az);
+      strPrintf (&ins, ") VALUES(");
+      k->nCol = i;
+
+      k->azEq = sqlite3_malloc ((k->nCol + 1) * sizeof (k->azEq[0]));
+      k->axEmit = sqlite3_malloc (k->nCol * sizeof (k->axEmit[0]) + 1);
+      if (k->azEq == 0 || k->axEmit == 0)
+        runtimeError ("out of memory");
+      for (i = 0; i < k->nCol; i++)
+        {
+          k->azEq[i] = sqlite3_mprintf ("%s=", k->az[i]);
+          if (k->azEq[i] == 0)
+            runtimeError ("out of memory");
+          k->axEmit[i] = printInteger;  /* The rowid, if not declared */
+        }
+      k->azEq[k->nCol] = 0;
+
+      /* The declared types of the columns */
+      pStmt = db_prepare ("PRAGMA aux.table_info=%Q", zTab);
+      while (SQLITE_ROW == sqlite3_step (pStmt))
+        {
+          char *zCol = safeId ((const char *) sqlite3_column_text (pStmt, 1));
+          for (i = 0; i < k->nCol; i++)
+            if (strcmp (k->az[i], zCol) == 0)
+              k->axEmit[i] =
+                litEmitter ((const char *) sqlite3_column_text (pStmt, 2));
+          sqlite3_free (zCol);
+        }
+      sqlite3_finalize (pStmt);
+    }
+  k->zDump = sql.z;
+  k->zInsert = ins.z;
+
+  if (w.pRep)
+    {
+      k->bCached = 1;
+      k->pNext = w.pRep->pKernel;
+      w.pRep->pKernel = k;
+    }
+  return k;
+}
+
+/*
+** Set the columns of main.zTab of k, if not done yet
+*/
+static void
+kernelMain (DiffKernel * k)
+{
+  if (k->bMain)
+    return;
+  k->azMain = columnNames ("main", k->zTab, &k->nPkMain, 0);
+  k->bMain = 1;
+}
+
+/*
+** Write the 'T' record of k for nCol columns, nPk of them in the
+** primary key.  The record is kept in k once written.
+*/
+static void
+kernelTable (FILE * out, DiffKernel * k, int nCol, int nPk)
+{
+  if (k->aRec == 0)
+    {
+      FILE *rec = open_memstream (&k->aRec, &k->nRec);
+      if (rec == 0)
+        runtimeError ("out of memory");
+      patchTable (rec, k->zId, k->az, nCol, nPk);
+      fclose (rec);
     }
+  fwrite (k->aRec, 1, k->nRec, out);
+}
+
+/*
+** Output SQL that will recreate the aux.zTab table.
+*/
+static void
+dump_table (const char *zTab, FILE * out)
+{
+  DiffKernel *k;                /* Columns and output of the table    */
+  int nCol;                     /* Number of data columns             */
+  int i;                        /* Loop counter                       */
+  sqlite3_stmt *pStmt;          /* SQL statement                      */
+
+  pStmt =
+    db_prepare ("SELECT sql FROM aux.sqlite_master WHERE name=%Q", zTab);
+  if (SQLITE_ROW == sqlite3_step (pStmt))
+    patchSql (out, "%s;\n", sqlite3_column_text (pStmt, 0));
+
+  sqlite3_finalize (pStmt);
+
+  k = diffKernel (zTab);
+  pStmt = db_prepare ("%s", k->zDump);
   nCol = sqlite3_column_count (pStmt);
+  if (g.bBinary)
+    kernelTable (out, k, nCol, k->az ? k->nPk : 0);
   while (SQLITE_ROW == sqlite3_step (pStmt))
     {
-      fprintf (out, "%s", ins.z);
-      zSep = "(";
+      w.anDiffRow[ROW_INSERT]++;
+      if (g.bBinary)
+        {
+          putc ('I', out);
+          for (i = 0; i < nCol; i++)
+            patchValue (out, sqlite3_column_value (pStmt, i));
+          continue;
+        }
+      fputs (k->zInsert, out);
       for (i = 0; i < nCol; i++)
         {
-          fprintf (out, "%s", zSep);
-          printQuoted (out, sqlite3_column_value (pStmt, i));
-          zSep = ",";
+          if (i > 0)
+            putc (',', out);
+          if (k->axEmit)
+            k->axEmit[i] (out, sqlite3_column_value (pStmt, i));
+          else
+            printQuoted (out, sqlite3_column_value (pStmt, i));
         }
-      fprintf (out, ");\n");
+      fputs (");\n", out);
     }
   sqlite3_finalize (pStmt);
-  strFree (&ins);
+  kernelRelease (k);
 
   pStmt = db_prepare ("SELECT sql FROM aux.sqlite_master"
                       " WHERE type='index' AND tbl_name=%Q AND sql IS NOT NULL",
                       zTab);
   while (SQLITE_ROW == sqlite3_step (pStmt))
-    fprintf (out, "%s;\n", sqlite3_column_text (pStmt, 0));
+    patchSql (out, "%s;\n", sqlite3_column_text (pStmt, 0));
 
   sqlite3_finalize (pStmt);
 }
 
 
 /*
-** Compute all differences for a single table.
+** Return the WHERE clause term, followed by AND, that restricts column
+** zCol of table zAlias to the range pR.  NULL keys sort first and belong
+** to the first range.
 */
-static void
-diff_one_table (const char *zTab, FILE * out)
+static char *
+diffRangeWhere (const DiffRange * pR, const char *zAlias, const char *zCol)
 {
-  char *zId = safeId (zTab);    /* Name of table (translated for us in SQL)   */
-  char **az = 0;                /* Columns in main                            */
-  char **az2 = 0;               /* Columns in aux                             */
-  int nPk;                      /* Primary key columns in main                */
-  int nPk2;                     /* Primary key columns in aux                 */
-  int n = 0;                    /* Number of columns in main                  */
-  int n2;                       /* Number of columns in aux                   */
-  int nQ;                       /* Number of output columns in the diff query */
-  int i;                        /* Loop counter                               */
-  const char *zSep;             /* Separator string                           */
-  Str sql;                      /* Comparison query                           */
-  sqlite3_stmt *pStmt;          /* Query statement to do the diff             */
+  char *z;
+  if (!pR->bLo)
+    z = sqlite3_mprintf (" (%s.%s<%lld OR %s.%s IS NULL) AND",
+                         zAlias, zCol, pR->iHi, zAlias, zCol);
+  else if (!pR->bHi)
+    z = sqlite3_mprintf (" %s.%s>=%lld AND", zAlias, zCol, pR->iLo);
+  else
+    z = sqlite3_mprintf (" %s.%s>=%lld AND %s.%s<%lld AND",
+                         zAlias, zCol, pR->iLo, zAlias, zCol, pR->iHi);
+  if (z == 0)
+    runtimeError ("out of memory");
+  return z;
+}
 
-  strInit (&sql);
-  if (g.fDebug == DEBUG_COLUMN_NAMES)
-    { /* Simply run columnNames() on all tables of the origin
-       ** database and show the results.  This is used for testing
-       ** and debugging of the columnNames() function.
-       */
-      az = columnNames ("aux", zTab, &nPk, 0);
-      if (az == 0)
-        printf ("Rowid not accessible for %s\n", zId);
-      else
-        {
-          printf ("%s:", zId);
-          for (i = 0; az[i]; i++)
-            {
-              printf (" %s", az[i]);
-              if (i + 1 == nPk)
-                printf (" *");
-            }
-          printf ("\n");
-        }
-      goto end_diff_one_table;
-    }
+/*
+** Merge join.
+**
+** The comparison queries of diff_one_table() and getRbudiffQuery() look
+** up every row of one database in the other by primary key.  SQLite does
+** that with the primary key index of the other table, unless it cannot
+** use it: then the lookup is a full scan of the other table, once per
+** row, and the diff is quadratic.  That happens for instance when the
+** primary key of a table has a different collation in the source and in
+** its backup, or with old versions of SQLite that do not use indexes for
+** the IS operator.
+**
+** diffPlanNested() finds such plans with EXPLAIN QUERY PLAN.  The table
+** is then diffed by a MergeJoin instead: the rows of "main" and of "aux"
+** are read by two queries, both in primary key order, and walked in
+** lockstep.  Each step of the walk tells whether the current row of
+** main has the same key as the current row of aux (MERGE_UPDATE), is
+** missing from aux (MERGE_DELETE), or the row of aux is missing from
+** main (MERGE_INSERT).  The keys and the values are compared in C, with
+** the collations of the columns of main, as the queries would.
+**
+** With --merge-join, every table is diffed this way.  When main and aux
+** agree on the collations, both queries read their table in the order
+** of its primary key index: the rows are streamed from the two b-trees,
+** and none is held by the join.
+**
+** The rows of aux are sorted with the collations of main, so that the
+** rows of aux with keys equal in main are next to each other.  A row of
+** main then matches all of them, as it would in the queries.
+*/
+#define MERGE_EOF    0          /* No more rows                          */
+#define MERGE_UPDATE 1          /* The rows of main and aux have one key */
+#define MERGE_DELETE 2          /* The row of main is missing from aux   */
+#define MERGE_INSERT 3          /* The row of aux is missing from main   */
 
+#define MERGE_BINARY 0          /* The BINARY collation                  */
+#define MERGE_NOCASE 1          /* The NOCASE collation                  */
+#define MERGE_RTRIM  2          /* The RTRIM collation                   */
 
-  if (sqlite3_table_column_metadata (g.db, "aux", zTab, 0, 0, 0, 0, 0, 0))
-    {
-      if (!sqlite3_table_column_metadata
-          (g.db, "main", zTab, 0, 0, 0, 0, 0, 0))
-        { /* Table missing from second database. */
-          fprintf (out, "DROP TABLE %s;\n", zId);
-        }
-      goto end_diff_one_table;
-    }
+typedef struct RowHash RowHash;
 
-  if (sqlite3_table_column_metadata (g.db, "main", zTab, 0, 0, 0, 0, 0, 0))
-    { /* Table missing from source */
-      dump_table (zTab, out);
-      goto end_diff_one_table;
-    }
+/*
+** A merge join of a table of main with the same table of aux
+*/
+typedef struct MergeJoin MergeJoin;
+struct MergeJoin
+{
+  sqlite3_stmt *pA;             /* The rows of main, in primary key order  */
+  sqlite3_stmt *pB;             /* The rows of aux, in primary key order   */
+  sqlite3_stmt *pConst;         /* The values NULL, 0, 1, 2 and 3          */
+  int bA;                       /* True if pA is on a row                  */
+  int bB;                       /* True if pB is on a row                  */
+  int bMatched;                 /* The row of pA matched a row of pB       */
+  int eLast;                    /* MERGE_xxx of the previous mergeStep()   */
+  int nPk;                      /* Number of primary key columns           */
+  int nCol;                     /* Number of columns of pA                 */
+  int *aColl;                   /* MERGE_xxx collation of each pA column   */
+  RowHash *pHash;               /* Sidecar of the table, or NULL           */
+  int bSame;                    /* MERGE_UPDATE rows with the same hash    */
+};
 
-  az = columnNames ("main", zTab, &nPk, 0);
-  az2 = columnNames ("aux", zTab, &nPk2, 0);
-  if (az && az2)
+/*
+** Return in *peColl the MERGE_xxx collation of column zCol of zDb.zTab,
+** and in *pzType a copy of its declared type.  Return non-zero if the
+** column is missing or its collation is not a built-in one.
+*/
+static int
+mergeColumnInfo (const char *zDb, const char *zTab, const char *zCol,
+                 int *peColl, char **pzType)
+{
+  const char *zType = 0;
+  const char *zColl = 0;
+  char *zName;
+  int rc;
+  int i, j;
+
+  /* The names from columnNames() are quoted by safeId() */
+  zName = sqlite3_mprintf ("%s", zCol);
+  if (zName == 0)
+    runtimeError ("out of memory");
+  if (zName[0] == '"')
     {
-      for (n = 0; az[n] && az2[n]; n++)
-        if (sqlite3_stricmp (az[n], az2[n]) != 0)
-          break;
-    }
-  if (az == 0 || az2 == 0 || nPk != nPk2 || az[n])
-    { /* Schema mismatch */
-      fprintf (out, "DROP TABLE %s; -- due to schema mismatch\n", zId);
-      dump_table (zTab, out);
-      goto end_diff_one_table;
+      for (i = 1, j = 0; zName[i]; i++)
+        {
+          if (zName[i] == '"' && zName[++i] != '"')
+            break;
+          zName[j++] = zName[i];
+        }
+      zName[j] = 0;
     }
+  rc = sqlite3_table_column_metadata (w.db, zDb, zTab, zName, &zType,
+                                      &zColl, 0, 0, 0);
+  sqlite3_free (zName);
+  if (rc != SQLITE_OK)
+    return 1;
+  if (zColl == 0 || sqlite3_stricmp (zColl, "BINARY") == 0)
+    *peColl = MERGE_BINARY;
+  else if (sqlite3_stricmp (zColl, "NOCASE") == 0)
+    *peColl = MERGE_NOCASE;
+  else if (sqlite3_stricmp (zColl, "RTRIM") == 0)
+    *peColl = MERGE_RTRIM;
+  else
+    return 1;
+  *pzType = sqlite3_mprintf ("%s", zType ? zType : "");
+  if (*pzType == 0)
+    runtimeError ("out of memory");
+  return 0;
+}
 
-  /* Build the comparison query */
-  for (n2 = n; az2[n2]; n2++)
-    fprintf (out, "ALTER TABLE %s ADD COLUMN %s;\n", zId, safeId (az2[n2]));
-  nQ = nPk2 + 1 + 2 * (n2 - nPk2);
-  if (n2 > nPk2)
+/*
+** Compare two values the way SQLite sorts them, with collation eColl
+** for text
+*/
+static int
+mergeCompare (sqlite3_value * pA, sqlite3_value * pB, int eColl)
+{
+  static const int aClass[] = { 0, 1, 1, 2, 3, 0 };
+  int eA = sqlite3_value_type (pA);
+  int eB = sqlite3_value_type (pB);
+  const unsigned char *zA, *zB;
+  int nA, nB, c;
+
+  if (aClass[eA] != aClass[eB])
+    return aClass[eA] < aClass[eB] ? -1 : 1;
+  switch (aClass[eA])
     {
-      zSep = "SELECT ";
-      for (i = 0; i < nPk; i++)
+    case 0:                    /* NULL */
+      return 0;
+
+    case 1:                    /* INTEGER or REAL */
+      if (eA == SQLITE_INTEGER && eB == SQLITE_INTEGER)
         {
-          strPrintf (&sql, "%sB.%s", zSep, az[i]);
-          zSep = ", ";
+          sqlite3_int64 iA = sqlite3_value_int64 (pA);
+          sqlite3_int64 iB = sqlite3_value_int64 (pB);
+          return iA < iB ? -1 : iA > iB;
         }
-      strPrintf (&sql, ", 1%s -- changed row\n", nPk == n ? "" : ",");
-      while (az[i])
+      if (eA == SQLITE_FLOAT && eB == SQLITE_FLOAT)
         {
-          strPrintf (&sql, "       A.%s IS NOT B.%s, B.%s%s\n",
-                     az[i], az2[i], az2[i], az2[i + 1] == 0 ? "" : ",");
-          i++;
+          double rA = sqlite3_value_double (pA);
+          double rB = sqlite3_value_double (pB);
+          return rA < rB ? -1 : rA > rB;
         }
-      while (az2[i])
-        {
-          strPrintf (&sql, "       B.%s IS NOT NULL, B.%s%s\n",
-                     az2[i], az2[i], az2[i + 1] == 0 ? "" : ",");
-          i++;
-        }
-      strPrintf (&sql, "  FROM main.%s A, aux.%s B\n", zId, zId);
-      zSep = " WHERE";
-      for (i = 0; i < nPk; i++)
-        {
-          strPrintf (&sql, "%s A.%s=B.%s", zSep, az[i], az[i]);
-          zSep = " AND";
-        }
-      zSep = "\n   AND (";
-      while (az[i])
-        {
-          strPrintf (&sql, "%sA.%s IS NOT B.%s%s\n",
-                     zSep, az[i], az2[i], az2[i + 1] == 0 ? ")" : "");
-          zSep = "        OR ";
-          i++;
+      if (eA == SQLITE_FLOAT)
+        return -mergeCompare (pB, pA, eColl);
+      else
+        { /* An integer and a real, without the rounding of a cast */
+          sqlite3_int64 i = sqlite3_value_int64 (pA);
+          double r = sqlite3_value_double (pB);
+          sqlite3_int64 y;
+          if (r < -9223372036854775808.0)
+            return 1;
+          if (r >= 9223372036854775808.0)
+            return -1;
+          y = (sqlite3_int64) r;
+          if (i != y)
+            return i < y ? -1 : 1;
+          return (double) i < r ? -1 : (double) i > r;
         }
-      while (az2[i])
+
+    case 2:                    /* TEXT */
+      zA = sqlite3_value_text (pA);
+      nA = sqlite3_value_bytes (pA);
+      zB = sqlite3_value_text (pB);
+      nB = sqlite3_value_bytes (pB);
+      if (zA == 0 || zB == 0)
+        runtimeError ("out of memory");
+      if (eColl == MERGE_RTRIM)
         {
-          strPrintf (&sql, "%sB.%s IS NOT NULL%s\n",
-                     zSep, az2[i], az2[i + 1] == 0 ? ")" : "");
-          zSep = "        OR ";
-          i++;
+          while (nA > 0 && zA[nA - 1] == ' ')
+            nA--;
+          while (nB > 0 && zB[nB - 1] == ' ')
+            nB--;
         }
-      strPrintf (&sql, " UNION ALL\n");
-    }
-  zSep = "SELECT ";
-  for (i = 0; i < nPk; i++)
-    {
-      strPrintf (&sql, "%sA.%s", zSep, az[i]);
-      zSep = ", ";
-    }
-  strPrintf (&sql, ", 2%s -- deleted row\n", nPk == n ? "" : ",");
-  while (az2[i])
-    {
-      strPrintf (&sql, "       NULL, NULL%s\n", i == n2 - 1 ? "" : ",");
-      i++;
-    }
-  strPrintf (&sql, "  FROM main.%s A\n", zId);
-  strPrintf (&sql, " WHERE NOT EXISTS(SELECT 1 FROM aux.%s B\n", zId);
-  zSep = "                   WHERE";
-  for (i = 0; i < nPk; i++)
-    {
-      strPrintf (&sql, "%s A.%s=B.%s", zSep, az[i], az[i]);
-      zSep = " AND";
-    }
-  strPrintf (&sql, ")\n");
-  zSep = " UNION ALL\nSELECT ";
-  for (i = 0; i < nPk; i++)
-    {
-      strPrintf (&sql, "%sB.%s", zSep, az[i]);
-      zSep = ", ";
-    }
-  strPrintf (&sql, ", 3%s -- inserted row\n", nPk == n ? "" : ",");
-  while (az2[i])
-    {
-      strPrintf (&sql, "       1, B.%s%s\n", az2[i],
-                 az2[i + 1] == 0 ? "" : ",");
-      i++;
-    }
-  strPrintf (&sql, "  FROM aux.%s B\n", zId);
-  strPrintf (&sql, " WHERE NOT EXISTS(SELECT 1 FROM main.%s A\n", zId);
-  zSep = "                   WHERE";
-  for (i = 0; i < nPk; i++)
-    {
-      strPrintf (&sql, "%s A.%s=B.%s", zSep, az[i], az[i]);
-      zSep = " AND";
-    }
-  strPrintf (&sql, ")\n ORDER BY");
-  zSep = " ";
-  for (i = 1; i <= nPk; i++)
-    {
-      strPrintf (&sql, "%s%d", zSep, i);
-      zSep = ", ";
+      if (eColl == MERGE_NOCASE)
+        c = sqlite3_strnicmp ((const char *) zA, (const char *) zB,
+                              nA < nB ? nA : nB);
+      else
+        c = memcmp (zA, zB, nA < nB ? nA : nB);
+      return c ? c : nA - nB;
+
+    default:                   /* BLOB */
+      zA = sqlite3_value_blob (pA);
+      nA = sqlite3_value_bytes (pA);
+      zB = sqlite3_value_blob (pB);
+      nB = sqlite3_value_bytes (pB);
+      c = nA && nB ? memcmp (zA, zB, nA < nB ? nA : nB) : 0;
+      return c ? c : nA - nB;
     }
-  strPrintf (&sql, ";\n");
+}
 
-  if (g.fDebug & DEBUG_DIFF_SQL)
+/*
+** Compare the keys of the current rows of p.  Keys with a NULL never
+** match, as with the = operator: the row of main goes first.
+*/
+static int
+mergeCompareKeys (MergeJoin * p)
+{
+  int i, c;
+  for (i = 0; i < p->nPk; i++)
     {
-      printf ("SQL for %s:\n%s\n", zId, sql.z);
-      goto end_diff_one_table;
+      sqlite3_value *pA = sqlite3_column_value (p->pA, i);
+      sqlite3_value *pB = sqlite3_column_value (p->pB, i);
+      if ((c = mergeCompare (pA, pB, p->aColl[i])) != 0)
+        return c;
+      if (sqlite3_value_type (pA) == SQLITE_NULL)
+        return -1;
     }
+  return 0;
+}
 
-  /* Drop indexes that are missing in the destination */
-  pStmt = db_prepare ("SELECT name FROM main.sqlite_master"
-                      " WHERE type='index' AND tbl_name=%Q"
-                      "   AND sql IS NOT NULL"
-                      "   AND sql NOT IN (SELECT sql FROM aux.sqlite_master"
-                      "                    WHERE type='index' AND tbl_name=%Q"
-                      "                      AND sql IS NOT NULL)",
-                      zTab, zTab);
-  while (SQLITE_ROW == sqlite3_step (pStmt))
+/*
+** Return true if column i of the current rows of p differ, in the sense
+** of the IS NOT operator
+*/
+static int
+mergeChanged (MergeJoin * p, int i)
+{
+  return mergeCompare (sqlite3_column_value (p->pA, i),
+                       sqlite3_column_value (p->pB, i), p->aColl[i]) != 0;
+}
+
+/*
+** Return the value of pConst for NULL, or for iValue from 0 to 3
+*/
+static sqlite3_value *
+mergeConst (MergeJoin * p, int iValue)
+{
+  return sqlite3_column_value (p->pConst, iValue < 0 ? 0 : iValue + 1);
+}
+
+/*
+** Release the statements of p
+*/
+static void
+mergeClose (MergeJoin * p)
+{
+  db_crelease (p->pA);
+  db_crelease (p->pB);
+  db_crelease (p->pConst);
+  sqlite3_free (p->aColl);
+  memset (p, 0, sizeof (*p));
+}
+
+/*
+** Open a merge join of the table zTab, with the nCol first columns az
+** of main and all the columns az2 of aux, of which the nPk first are
+** the primary key.  zJoin, zRangeA and zRangeB restrict the rows as in
+** diff_one_table().
+**
+** Return non-zero, and leave p closed, if the columns of main and aux
+** disagree on their declared types or use a collation other than the
+** built-in ones: the comparisons of SQLite would then depend on them.
+*/
+static int
+mergeOpen (MergeJoin * p, const char *zTab, char **az, char **az2,
+           int nPk, int nCol, const char *zJoin, const char *zRangeA,
+           const char *zRangeB)
+{
+  char *zId = safeId (zTab);
+  Str sql;
+  int i, rc = 0;
+
+  memset (p, 0, sizeof (*p));
+  p->nPk = nPk;
+  p->nCol = nCol;
+  p->eLast = -1;
+  p->aColl = sqlite3_malloc (nCol * sizeof (p->aColl[0]));
+  if (p->aColl == 0)
+    runtimeError ("out of memory");
+  for (i = 0; rc == 0 && i < nCol; i++)
     {
-      char *z = safeId ((const char *) sqlite3_column_text (pStmt, 0));
-      fprintf (out, "DROP INDEX %s;\n", z);
-      sqlite3_free (z);
+      char *zType = 0, *zType2 = 0;
+      int eColl2;
+      rc = mergeColumnInfo ("main", zTab, az[i], &p->aColl[i], &zType)
+        || mergeColumnInfo ("aux", zTab, az2[i], &eColl2, &zType2)
+        || sqlite3_stricmp (zType, zType2) != 0;
+      sqlite3_free (zType);
+      sqlite3_free (zType2);
     }
-  sqlite3_finalize (pStmt);
-
-  /* Run the query and output differences */
-  pStmt = db_prepare (sql.z);
-  while (SQLITE_ROW == sqlite3_step (pStmt))
+  if (rc)
     {
-      int iType = sqlite3_column_int (pStmt, nPk);
-      if (iType == 1 || iType == 2)
-        {
-          if (iType == 1)
-            { /* Change the content of a row */
-              fprintf (out, "UPDATE %s", zId);
-              zSep = " SET";
-              for (i = nPk + 1; i < nQ; i += 2)
-                {
-                  if (sqlite3_column_int (pStmt, i) == 0)
-                    continue;
-                  fprintf (out, "%s %s=", zSep, az2[(i + nPk - 1) / 2]);
-                  zSep = ",";
-                  printQuoted (out, sqlite3_column_value (pStmt, i + 1));
-                }
-            }
-          else /* Delete a row */
-            fprintf (out, "DELETE FROM %s", zId);
-
-          zSep = " WHERE";
-          for (i = 0; i < nPk; i++)
-            {
-              fprintf (out, "%s %s=", zSep, az2[i]);
-              printQuoted (out, sqlite3_column_value (pStmt, i));
-              zSep = " AND";
-            }
-          fprintf (out, ";\n");
-        }
-      else
-        { /* Insert a row */
-          fprintf (out, "INSERT INTO %s(%s", zId, az2[0]);
-          for (i = 1; az2[i]; i++)
-            fprintf (out, ",%s", az2[i]);
-          fprintf (out, ") VALUES");
-          zSep = "(";
-          for (i = 0; i < nPk2; i++)
-            {
-              fprintf (out, "%s", zSep);
-              zSep = ",";
-              printQuoted (out, sqlite3_column_value (pStmt, i));
-            }
-          for (i = nPk2 + 2; i < nQ; i += 2)
-            {
-              fprintf (out, ",");
-              printQuoted (out, sqlite3_column_value (pStmt, i));
-            }
-          fprintf (out, ");\n");
-        }
+      sqlite3_free (p->aColl);
+      p->aColl = 0;
+      sqlite3_free (zId);
+      return rc;
     }
-  sqlite3_finalize (pStmt);
-  /* Create indexes that are missing in the source */
-  pStmt = db_prepare ("SELECT sql FROM aux.sqlite_master"
-                      " WHERE type='index' AND tbl_name=%Q"
-                      "   AND sql IS NOT NULL"
-                      "   AND sql NOT IN (SELECT sql FROM main.sqlite_master"
-                      "                    WHERE type='index' AND tbl_name=%Q"
-                      "                      AND sql IS NOT NULL)",
-                      zTab, zTab);
-  while (SQLITE_ROW == sqlite3_step (pStmt))
-    fprintf (out, "%s;\n", sqlite3_column_text (pStmt, 0));
 
-  sqlite3_finalize (pStmt);
+  strInit (&sql);
+  strPrintf (&sql, "SELECT ");
+  for (i = 0; i < nCol; i++)
+    strPrintf (&sql, "%sA.%s", i ? ", " : "", az[i]);
+  strPrintf (&sql, " FROM %smain.%s A WHERE%s 1 ORDER BY ", zJoin, zId,
+             zRangeA);
+  for (i = 0; i < nPk; i++)
+    strPrintf (&sql, "%sA.%s COLLATE %s", i ? ", " : "", az[i],
+               p->aColl[i] == MERGE_NOCASE ? "NOCASE" :
+               p->aColl[i] == MERGE_RTRIM ? "RTRIM" : "BINARY");
+  p->pA = db_cprepare ("%s", sql.z);
 
-end_diff_one_table:
   strFree (&sql);
+  strPrintf (&sql, "SELECT ");
+  for (i = 0; az2[i]; i++)
+    strPrintf (&sql, "%sB.%s", i ? ", " : "", az2[i]);
+  strPrintf (&sql, " FROM %saux.%s B WHERE%s 1 ORDER BY ", zJoin, zId,
+             zRangeB);
+  for (i = 0; i < nPk; i++)
+    strPrintf (&sql, "%sB.%s COLLATE %s", i ? ", " : "", az2[i],
+               p->aColl[i] == MERGE_NOCASE ? "NOCASE" :
+               p->aColl[i] == MERGE_RTRIM ? "RTRIM" : "BINARY");
+  p->pB = db_cprepare ("%s", sql.z);
+  strFree (&sql);
+
+  p->pConst = db_cprepare ("SELECT NULL, 0, 1, 2, 3");
+  if (sqlite3_step (p->pConst) != SQLITE_ROW)
+    runtimeError ("%s", sqlite3_errmsg (w.db));
   sqlite3_free (zId);
-  namelistFree (az);
-  namelistFree (az2);
-  return;
+  return 0;
 }
 
 /*
-** Check that table zTab exists and has the same schema in both the "main"
-** and "aux" databases currently opened by the global db handle. If they
-** do not, output an error message on stderr and exit(1). Otherwise, if
-** the schemas do match, return control to the caller.
+** Row hashes.
+**
+** With --row-hash, the merge join of a table keyed by its rowid keeps a
+** sidecar file in the PATH/backup/NAME.rowhash directory: the rowid and
+** a 64-bit hash of every row, in rowid order.  The hashes are those of
+** the rows of the source as of the last diff, which the backup holds
+** once the patch of that diff is applied.  The next diff then walks the
+** sidecar instead of the table of the backup.  A row of the source
+** whose hash is the same is skipped, and the row of the backup is only
+** read by rowid when the hashes differ, or for a DELETE.  The sidecar
+** of the table is written again during the walk.
+**
+** The sidecar is valid when the backup is at the patch it was written
+** for: its header holds the number of the last patch applied to the
+** backup when it was written, iBase, and whether the diff found rows of
+** the table to change.  If it did, only the next patch brings the backup
+** to the hashes.  Otherwise the backup is there already, and stays there
+** as long as no patch changes the table.  A table diffed in any other
+** way, a range or a dump for instance, loses its sidecar.
 */
-static void
-checkSchemasMatch (const char *zTab)
+#define ROWHASH_MAGIC   "RQROWH01"      /* aMagic of a sidecar header       */
+#define ROWHASH_CHANGED 0x01            /* Rows of the table were changed   */
+
+/*
+** Header of a sidecar file, followed by nRow RowHashRec
+*/
+typedef struct RowHashHdr RowHashHdr;
+struct RowHashHdr
 {
-  sqlite3_stmt *pStmt =
-    db_prepare
-    ("SELECT A.sql=B.sql FROM main.sqlite_master A, aux.sqlite_master B"
-     " WHERE A.name=%Q AND B.name=%Q", zTab, zTab);
-  if (SQLITE_ROW == sqlite3_step (pStmt))
-    {
-      if (sqlite3_column_int (pStmt, 0) == 0)
-        runtimeError ("schema changes for table %s", safeId (zTab));
-    }
-  else
-    runtimeError ("table %s missing from one or both databases",
-                  safeId (zTab));
+  char aMagic[8];               /* ROWHASH_MAGIC                           */
+  u64 iBase;                    /* Last patch applied to the backup        */
+  u64 flags;                    /* ROWHASH_xxx flags                       */
+  u64 iLayout;                  /* Hash of the name and columns of table   */
+  u64 nRow;                     /* Number of records                       */
+};
 
-  sqlite3_finalize (pStmt);
-}
+/*
+** One row of a sidecar file
+*/
+typedef struct RowHashRec RowHashRec;
+struct RowHashRec
+{
+  sqlite3_int64 iKey;           /* Rowid of the row                        */
+  u64 h;                        /* Hash of the other columns of the row    */
+};
 
-/**************************************************************************
-** The following code is copied from fossil. It is used to generate the
-** fossil delta blobs sometimes used in RBU update records.
+/*
+** The sidecar of a table during its merge join
 */
+struct RowHash
+{
+  char *zPath;                  /* Path of the sidecar file                */
+  char *zTmp;                   /* Path the new sidecar is written to      */
+  FILE *in;                     /* Sidecar read instead of main, or NULL   */
+  FILE *out;                    /* New sidecar, from the rows of aux       */
+  RowHashRec cur;               /* Current record of in                    */
+  RowHashHdr hdr;               /* Header of out                           */
+  u64 hB;                       /* Hash of the current row of aux          */
+  u64 nSame;                    /* Rows skipped as their hashes match      */
+};
 
-typedef unsigned short u16;
-typedef unsigned int u32;
-typedef unsigned char u8;
+static u64 hashMix (u64 h);
+static u64 hashBytes (u64 h, const u8 * a, int n);
+static u64 hashValue (sqlite3_value * pVal);
 
 /*
-** The width of a hash window in bytes.  The algorithm only works if this
-** is a power of 2.
+** Return the hash of the columns iFirst to nCol-1 of the row of pStmt
 */
-#define NHASH 16
+static u64
+rowHashOf (sqlite3_stmt * pStmt, int iFirst, int nCol)
+{
+  u64 h = 0;
+  int i;
+  for (i = iFirst; i < nCol; i++)
+    h = hashMix (h + hashValue (sqlite3_column_value (pStmt, i)));
+  return h;
+}
 
 /*
-** The current state of the rolling hash.
-**
-** z[] holds the values that have been hashed.  z[] is a circular buffer.
-** z[i] is the first entry and z[(i+NHASH-1)%NHASH] is the last entry of
-** the window.
-**
-** Hash.a is the sum of all elements of hash.z[].  Hash.b is a weighted
-** sum.  Hash.b is z[i]*NHASH + z[i+1]*(NHASH-1) + ... + z[i+NHASH-1]*1.
-** (Each index for z[] should be module NHASH, of course.  The %NHASH operator
-** is omitted in the prior expression for brevity.)
+** Return the hash of the name of table zTab and of its nCol columns az
 */
-typedef struct hash hash;
-struct hash
+static u64
+rowHashLayout (const char *zTab, char **az, int nCol)
 {
-  u16 a, b;                     /* Hash values                      */
-  u16 i;                        /* Start of the hash window         */
-  char z[NHASH];                /* The values that have been hashed */
-};
+  u64 h = hashMix (hashBytes (0, (const u8 *) zTab, strlen (zTab)));
+  int i;
+  for (i = 0; i < nCol; i++)
+    h = hashMix (hashBytes (h, (const u8 *) az[i], strlen (az[i]) + 1));
+  return h;
+}
 
 /*
-** Initialize the rolling hash using the first NHASH characters of z[]
+** Return the path of the sidecar of table zTab of p
 */
-static void
-hash_init (hash * pHash, const char *z)
+static char *
+rowHashPath (Replica * p, const char *zTab)
 {
-  u16 a, b, i;
-  a = b = 0;
-  for (i = 0; i < NHASH; i++)
-    {
-      a += z[i];
-      b += (NHASH - i) * z[i];
-      pHash->z[i] = z[i];
-    }
-  pHash->a = a & 0xffff;
-  pHash->b = b & 0xffff;
-  pHash->i = 0;
+  u64 h = hashMix (hashBytes (0, (const u8 *) zTab, strlen (zTab)));
+  char *z = sqlite3_mprintf ("%s.rowhash/%016llx", p->zBackup,
+                             (unsigned long long) h);
+  if (z == 0)
+    runtimeError ("out of memory");
+  return z;
 }
 
 /*
-** Advance the rolling hash by a single character "c"
+** Return true if the primary key of table zTab of zDb is its rowid
 */
-static void
-hash_next (hash * pHash, int c)
+static int
+rowHashKey (const char *zDb, const char *zTab)
 {
-  u16 old = pHash->z[pHash->i];
-  pHash->z[pHash->i] = (char) c;
-  pHash->i = (pHash->i + 1) & (NHASH - 1);
-  pHash->a = pHash->a - old + (char) c;
-  pHash->b = pHash->b - NHASH * old + pHash->a;
+  char **az;
+  int nPk, bRowid = 0;
+  int bKey = 0;
+  sqlite3_stmt *pStmt;
+
+  az = columnNames (zDb, zTab, &nPk, &bRowid);
+  if (az && nPk == 1)
+    {
+      /* Every PRIMARY KEY but an INTEGER PRIMARY KEY has an index */
+      bKey = 1;
+      pStmt = db_prepare ("PRAGMA %s.index_list=%Q", zDb, zTab);
+      while (!bRowid && SQLITE_ROW == sqlite3_step (pStmt))
+        if (sqlite3_stricmp
+            ((const char *) sqlite3_column_text (pStmt, 3), "pk") == 0)
+          bKey = 0;
+      sqlite3_finalize (pStmt);
+    }
+  namelistFree (az);
+  return bKey;
 }
 
 /*
-** Return a 32-bit hash value
+** Return true if the sidecar header pHdr is valid for table zTab of p,
+** with the n columns az in the backup
 */
-static u32
-hash_32bit (hash * pHash)
+static int
+rowHashValid (const RowHashHdr * pHdr, Replica * p, const char *zTab,
+              char **az, int n)
 {
-  return (pHash->a & 0xffff) | (((u32) (pHash->b & 0xffff)) << 16);
+  return memcmp (pHdr->aMagic, ROWHASH_MAGIC, 8) == 0
+    && pHdr->iLayout == rowHashLayout (zTab, az, n)
+    && (p->iApplied == pHdr->iBase + 1
+        || (p->iApplied == pHdr->iBase
+            && (pHdr->flags & ROWHASH_CHANGED) == 0));
 }
 
 /*
-** Write an base-64 integer into the given buffer.
+** Use the sidecar of table zTab of p with the merge join pJoin, opened
+** by mergeOpen() with the n columns az of main and the n2 columns az2 of
+** aux.  If the sidecar is valid, the rows of main are only read by rowid.
 */
 static void
-putInt (unsigned int v, char **pz)
+rowHashOpen (MergeJoin * pJoin, Replica * p, const char *zTab, char **az,
+             char **az2, int n, int n2)
 {
-  static const char zDigits[] =
-    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz~";
-  /*  123456789 123456789 123456789 123456789 123456789 123456789 123 */
-  int i, j;
-  char zBuf[20];
-  if (v == 0)
+  RowHash *pH = sqlite3_malloc (sizeof (*pH));
+  char *zDir;
+  char *zId;
+  Str sql;
+  int i;
+
+  if (pH == 0)
+    runtimeError ("out of memory");
+  memset (pH, 0, sizeof (*pH));
+  pH->zPath = rowHashPath (p, zTab);
+  pH->zTmp = sqlite3_mprintf ("%s.tmp", pH->zPath);
+  zDir = sqlite3_mprintf ("%s.rowhash", p->zBackup);
+  if (pH->zTmp == 0 || zDir == 0)
+    runtimeError ("out of memory");
+  if (mkdir (zDir, 0777) != 0 && errno != EEXIST)
+    runtimeError ("cannot create directory \"%s\": %s", zDir,
+                  strerror (errno));
+  sqlite3_free (zDir);
+
+  pH->out = fopen (pH->zTmp, "wb");
+  if (pH->out == 0)
+    runtimeError ("cannot open \"%s\": %s", pH->zTmp, strerror (errno));
+  memcpy (pH->hdr.aMagic, ROWHASH_MAGIC, 8);
+  pH->hdr.iBase = p->iApplied;
+  pH->hdr.iLayout = rowHashLayout (zTab, az2, n2);
+  fwrite (&pH->hdr, sizeof (pH->hdr), 1, pH->out);
+
+  pH->in = fopen (pH->zPath, "rb");
+  if (pH->in)
     {
-      *(*pz)++ = '0';
-      return;
+      RowHashHdr hdr;
+      if (n != n2 || fread (&hdr, sizeof (hdr), 1, pH->in) != 1
+          || !rowHashValid (&hdr, p, zTab, az, n))
+        {
+          fclose (pH->in);
+          pH->in = 0;
+        }
     }
-  for (i = 0; v > 0; i++, v >>= 6)
-    zBuf[i] = zDigits[v & 0x3f];
+  pJoin->pHash = pH;
+  if (pH->in == 0)
+    return;
 
-  for (j = i - 1; j >= 0; j--)
-    *(*pz)++ = zBuf[j];
+  /* Look the rows of main up by rowid, instead of scanning them */
+  zId = safeId (zTab);
+  strInit (&sql);
+  strPrintf (&sql, "SELECT ");
+  for (i = 0; i < n; i++)
+    strPrintf (&sql, "%sA.%s", i ? ", " : "", az[i]);
+  strPrintf (&sql, " FROM main.%s A WHERE A.%s=?1", zId, az[0]);
+  db_crelease (pJoin->pA);
+  pJoin->pA = db_cprepare ("%s", sql.z);
+  strFree (&sql);
+  sqlite3_free (zId);
 }
 
 /*
-** Return the number digits in the base-64 representation of a positive integer
+** Finish the sidecar of the merge join p, once all its rows were read.
+** Return true if it was written.
 */
 static int
-digit_count (int v)
+rowHashClose (MergeJoin * p, const char *zTab)
 {
-  unsigned int i, x;
-  for (i = 1, x = 64; (unsigned int) v >= x; i++, x <<= 6)
+  RowHash *pH = p->pHash;
+  int bOk;
+
+  if (pH == 0)
+    return 0;
+  if (pH->in)
     {
+      VERBOSE ("* Row hashes of %s: %llu of %llu rows unchanged\n", zTab,
+               (unsigned long long) pH->nSame,
+               (unsigned long long) pH->hdr.nRow);
+      fclose (pH->in);
     }
-  return i;
+  bOk = fseek (pH->out, 0, SEEK_SET) == 0
+    && fwrite (&pH->hdr, sizeof (pH->hdr), 1, pH->out) == 1;
+  bOk = fclose (pH->out) == 0 && bOk;
+  if (bOk)
+    bOk = rename (pH->zTmp, pH->zPath) == 0;
+  if (!bOk)
+    unlink (pH->zTmp);
+  sqlite3_free (pH->zPath);
+  sqlite3_free (pH->zTmp);
+  sqlite3_free (pH);
+  p->pHash = 0;
+  return bOk;
+}
+
+/*
+** Table zTab of p is known not to have changed: keep its sidecar valid
+** for the patch of this diff, if it is valid now.  The columns of the
+** table, unchanged as well, are read from the backup.
+*/
+static void
+rowHashKeep (Replica * p, const char *zTab)
+{
+  char *zPath = rowHashPath (p, zTab);
+  FILE *f = fopen (zPath, "r+b");
+  RowHashHdr hdr;
+  char **az;
+  int nPk, n;
+
+  if (f == 0)
+    {
+      sqlite3_free (zPath);
+      return;
+    }
+  az = columnNames ("main", zTab, &nPk, 0);
+  for (n = 0; az && az[n]; n++);
+  if (az && fread (&hdr, sizeof (hdr), 1, f) == 1
+      && rowHashValid (&hdr, p, zTab, az, n))
+    {
+      hdr.iBase = p->iApplied;
+      hdr.flags &= ~(u64) ROWHASH_CHANGED;
+      if (fseek (f, 0, SEEK_SET) != 0
+          || fwrite (&hdr, sizeof (hdr), 1, f) != 1)
+        unlink (zPath);
+    }
+  if (fclose (f) != 0)
+    unlink (zPath);
+  namelistFree (az);
+  sqlite3_free (zPath);
+}
+
+/*
+** Remove all the sidecars of p, after its backup was replaced
+*/
+static void
+rowHashClear (Replica * p)
+{
+  char *zDir = sqlite3_mprintf ("%s.rowhash", p->zBackup);
+  DIR *pDir;
+  struct dirent *pEntry;
+
+  if (zDir == 0)
+    runtimeError ("out of memory");
+  if ((pDir = opendir (zDir)) != 0)
+    {
+      while ((pEntry = readdir (pDir)) != 0)
+        if (pEntry->d_name[0] != '.')
+          {
+            char *zPath = sqlite3_mprintf ("%s/%s", zDir, pEntry->d_name);
+            if (zPath == 0)
+              runtimeError ("out of memory");
+            unlink (zPath);
+            sqlite3_free (zPath);
+          }
+      closedir (pDir);
+    }
+  sqlite3_free (zDir);
+}
+
+/*
+** Move p to its next row of main, or of the sidecar of main
+*/
+static void
+mergeStepA (MergeJoin * p)
+{
+  if (p->pHash && p->pHash->in)
+    p->bA = fread (&p->pHash->cur, sizeof (RowHashRec), 1, p->pHash->in) == 1;
+  else
+    p->bA = sqlite3_step (p->pA) == SQLITE_ROW;
+  p->bMatched = 0;
+}
+
+/*
+** Move p to its next row of aux
+*/
+static void
+mergeStepB (MergeJoin * p)
+{
+  p->bB = sqlite3_step (p->pB) == SQLITE_ROW;
+  if (p->bB && p->pHash)
+    p->pHash->hB = rowHashOf (p->pB, p->nPk, sqlite3_column_count (p->pB));
+}
+
+/*
+** Read the row of main of the current key of the sidecar of p into pA.
+** Return zero if there is none.
+*/
+static int
+mergeLookup (MergeJoin * p)
+{
+  sqlite3_reset (p->pA);
+  sqlite3_bind_int64 (p->pA, 1, p->pHash->cur.iKey);
+  return sqlite3_step (p->pA) == SQLITE_ROW;
+}
+
+/*
+** Move p to its next pair of rows, and return MERGE_xxx.  With a sidecar
+** of main, bSame is set on a MERGE_UPDATE whose hashes match, and main
+** is not read for it.
+*/
+static int
+mergeStep (MergeJoin * p)
+{
+  RowHash *pH = p->pHash;
+  int c;
+
+  if (p->eLast == MERGE_EOF)
+    return MERGE_EOF;
+  if (p->eLast < 0 || p->eLast == MERGE_DELETE)
+    mergeStepA (p);
+  if (p->eLast != MERGE_DELETE)
+    mergeStepB (p);
+  if (p->eLast == MERGE_UPDATE)
+    p->bMatched = 1;
+  p->bSame = 0;
+
+  for (;;)
+    {
+      if (!p->bA && !p->bB)
+        return p->eLast = MERGE_EOF;
+      if (!p->bB)
+        c = -1;
+      else if (!p->bA)
+        c = 1;
+      else if (pH && pH->in)
+        {
+          sqlite3_int64 iB = sqlite3_column_int64 (p->pB, 0);
+          c = pH->cur.iKey < iB ? -1 : pH->cur.iKey > iB;
+        }
+      else
+        c = mergeCompareKeys (p);
+      if (c < 0 && p->bMatched)
+        {
+          /* The row of main matched the rows of aux before */
+          mergeStepA (p);
+          continue;
+        }
+      if (c > 0 || pH == 0 || pH->in == 0)
+        break;
+      if (c == 0 && pH->hB == pH->cur.h)
+        {
+          p->bSame = 1;
+          break;
+        }
+      if (mergeLookup (p))
+        break;
+      /* The sidecar has a row that main has not */
+      if (c == 0)
+        {
+          c = 1;
+          break;
+        }
+      mergeStepA (p);
+    }
+  if (c >= 0 && pH)
+    {
+      RowHashRec r;
+      r.iKey = sqlite3_column_int64 (p->pB, 0);
+      r.h = pH->hB;
+      fwrite (&r, sizeof (r), 1, pH->out);
+      pH->hdr.nRow++;
+    }
+  return p->eLast = c < 0 ? MERGE_DELETE : c > 0 ? MERGE_INSERT : MERGE_UPDATE;
+}
+
+/*
+** Return true if the query plan of pStmt, a statement from db_cprepare()
+** built to diff table zTab, does a full scan of a table or an index once
+** per row of another loop.  The answer is cached with the statement.
+**
+** The plan is read in the format of SQLite 3.24.0 and later, where each
+** row has its parent: a SCAN is nested if it follows another loop of the
+** same parent, or if its parent is a correlated subquery.  Older versions
+** are checked by diffPlanLegacy().
+*/
+#define PLAN_MAXROW 64          /* Rows of a plan looked at, at most */
+
+/*
+** diffPlanNested() for the plans of SQLite before 3.24.0, whose rows are
+** selectid, order, from and detail.  A SCAN is nested if it is not the
+** outermost loop of its SELECT, or if its SELECT is a correlated
+** subquery, run by a row "EXECUTE CORRELATED ... SUBQUERY N".  The rows
+** of a subquery may come before that row, so they are all read first.
+*/
+static int
+diffPlanLegacy (sqlite3_stmt * pPlan)
+{
+  int aScan[PLAN_MAXROW];       /* selectid of the outermost SCANs       */
+  int aSub[PLAN_MAXROW];        /* Correlated subqueries                 */
+  int nScan = 0, nSub = 0;
+  int bNested = 0;
+  int i, j;
+
+  while (!bNested && SQLITE_ROW == sqlite3_step (pPlan))
+    {
+      int iSelect = sqlite3_column_int (pPlan, 0);
+      int iOrder = sqlite3_column_int (pPlan, 1);
+      const char *z = (const char *) sqlite3_column_text (pPlan, 3);
+      if (z == 0)
+        continue;
+      if (strncmp (z, "SCAN ", 5) == 0)
+        {
+          if (iOrder > 0)
+            bNested = 1;
+          else if (nScan < PLAN_MAXROW)
+            aScan[nScan++] = iSelect;
+        }
+      else if (strncmp (z, "EXECUTE CORRELATED ", 19) == 0
+               && nSub < PLAN_MAXROW)
+        aSub[nSub++] = atoi (strrchr (z, ' ') + 1);
+    }
+  for (i = 0; i < nScan && !bNested; i++)
+    for (j = 0; j < nSub; j++)
+      if (aScan[i] == aSub[j])
+        bNested = 1;
+  return bNested;
+}
+
+static int
+diffPlanNested (sqlite3_stmt * pStmt, const char *zTab)
+{
+  StmtCache *pEntry = db_centry (pStmt);
+  sqlite3_stmt *pPlan;
+  int aId[PLAN_MAXROW];         /* Id of each row of the plan            */
+  int aParent[PLAN_MAXROW];     /* Parent of each row of the plan        */
+  char aKind[PLAN_MAXROW];      /* 'L'oop, 'C'orrelated subquery or 0    */
+  int nRow = 0;
+  int bNested = 0;
+  int i;
+
+  if (pEntry && pEntry->ePlan != PLAN_UNKNOWN)
+    return pEntry->ePlan == PLAN_NESTED;
+
+  pPlan = db_prepare ("EXPLAIN QUERY PLAN %s", sqlite3_sql (pStmt));
+  if (sqlite3_libversion_number () < 3024000)
+    bNested = diffPlanLegacy (pPlan);
+  else
+    while (!bNested && SQLITE_ROW == sqlite3_step (pPlan))
+      {
+        int iId = sqlite3_column_int (pPlan, 0);
+        int iParent = sqlite3_column_int (pPlan, 1);
+        const char *z = (const char *) sqlite3_column_text (pPlan, 3);
+        if (z == 0)
+          continue;
+        if (strncmp (z, "SCAN ", 5) == 0)
+          for (i = 0; i < nRow; i++)
+            if ((aKind[i] == 'L' && aParent[i] == iParent)
+                || (aKind[i] == 'C' && aId[i] == iParent))
+              bNested = 1;
+        if (nRow < PLAN_MAXROW)
+          {
+            aId[nRow] = iId;
+            aParent[nRow] = iParent;
+            aKind[nRow] = strncmp (z, "SCAN ", 5) == 0
+              || strncmp (z, "SEARCH ", 7) == 0 ? 'L'
+              : strncmp (z, "CORRELATED ", 11) == 0 ? 'C' : 0;
+            nRow++;
+          }
+      }
+  sqlite3_finalize (pPlan);
+
+  if (bNested)
+    VERBOSE ("* Nested scan in the diff of %s, merge join\n", zTab);
+  if (pEntry)
+    pEntry->ePlan = bNested ? PLAN_NESTED : PLAN_INDEXED;
+  return bNested;
+}
+
+/*
+** Fill apVal with the next row of the merge join p, in the layout of the
+** rows of the comparison query of diff_one_table() over n columns of
+** main and n2 columns of aux.  Return the type of the row, 1 to 3, or 0
+** after the last one.
+*/
+static int
+mergeDiffRow (MergeJoin * p, int n, int n2, sqlite3_value ** apVal)
+{
+  int nPk = p->nPk;
+  int eRow, i, bChanged;
+
+  do
+    {
+      eRow = mergeStep (p);
+      if (eRow == MERGE_UPDATE && p->bSame)
+        {
+          p->pHash->nSame++;
+          bChanged = 0;
+          continue;
+        }
+      bChanged = eRow != MERGE_UPDATE;
+      for (i = nPk; eRow == MERGE_UPDATE && i < n2; i++)
+        {
+          int bDiff = i < n ? mergeChanged (p, i)
+            : sqlite3_column_type (p->pB, i) != SQLITE_NULL;
+          apVal[nPk + 1 + 2 * (i - nPk)] = mergeConst (p, bDiff);
+          bChanged |= bDiff;
+        }
+    }
+  while (!bChanged);
+  if (eRow == MERGE_EOF)
+    return 0;
+  if (p->pHash)
+    p->pHash->hdr.flags |= ROWHASH_CHANGED;
+
+  for (i = 0; i < nPk; i++)
+    apVal[i] = sqlite3_column_value (eRow == MERGE_DELETE ? p->pA : p->pB, i);
+  apVal[nPk] = mergeConst (p, eRow);
+  for (i = nPk; i < n2; i++)
+    {
+      if (eRow == MERGE_DELETE)
+        {
+          apVal[nPk + 1 + 2 * (i - nPk)] = mergeConst (p, -1);
+          apVal[nPk + 2 + 2 * (i - nPk)] = mergeConst (p, -1);
+          continue;
+        }
+      if (eRow == MERGE_INSERT)
+        apVal[nPk + 1 + 2 * (i - nPk)] = mergeConst (p, 1);
+      apVal[nPk + 2 + 2 * (i - nPk)] = sqlite3_column_value (p->pB, i);
+    }
+  return eRow;
+}
+
+/*
+** Step the comparison query pStmt of diff_one_table() and point the nQ
+** entries of apVal to the values of its next row.  Return zero after
+** the last row.
+*/
+static int
+diffQueryRow (sqlite3_stmt * pStmt, int nQ, sqlite3_value ** apVal)
+{
+  int i;
+  if (sqlite3_step (pStmt) != SQLITE_ROW)
+    return 0;
+  for (i = 0; i < nQ; i++)
+    apVal[i] = sqlite3_column_value (pStmt, i);
+  return 1;
+}
+
+/*
+** Append the comparison query of diff_one_table() to pSql, for the nPk
+** primary key and n other columns az[] of main.zId and the columns az2[]
+** of aux.zId, n2 of them.  zJoin, zRangeA and zRangeB restrict it to a
+** range of keys, see diff_one_table().
+*/
+static void
+diffQuery (Str * pSql, const char *zId, char **az, char **az2, int nPk,
+           int n, int n2, const char *zJoin, const char *zRangeA,
+           const char *zRangeB)
+{
+  const char *zSep;
+  int i;
+
+  if (n2 > nPk)
+    {
+      zSep = "SELECT ";
+      for (i = 0; i < nPk; i++)
+        {
+          strPrintf (pSql, "%sB.%s", zSep, az[i]);
+          zSep = ", ";
+        }
+      strPrintf (pSql, ", 1%s -- changed row\n", nPk == n ? "" : ",");
+      while (az[i])
+        {
+          strPrintf (pSql, "       A.%s IS NOT B.%s, B.%s%s\n",
+                     az[i], az2[i], az2[i], az2[i + 1] == 0 ? "" : ",");
+          i++;
+        }
+      while (az2[i])
+        {
+          strPrintf (pSql, "       B.%s IS NOT NULL, B.%s%s\n",
+                     az2[i], az2[i], az2[i + 1] == 0 ? "" : ",");
+          i++;
+        }
+      strPrintf (pSql, "  FROM %smain.%s A, aux.%s B\n", zJoin, zId, zId);
+      strPrintf (pSql, " WHERE%s", zRangeA);
+      zSep = "";
+      for (i = 0; i < nPk; i++)
+        {
+          strPrintf (pSql, "%s A.%s=B.%s", zSep, az[i], az[i]);
+          zSep = " AND";
+        }
+      zSep = "\n   AND (";
+      while (az[i])
+        {
+          strPrintf (pSql, "%sA.%s IS NOT B.%s%s\n",
+                     zSep, az[i], az2[i], az2[i + 1] == 0 ? ")" : "");
+          zSep = "        OR ";
+          i++;
+        }
+      while (az2[i])
+        {
+          strPrintf (pSql, "%sB.%s IS NOT NULL%s\n",
+                     zSep, az2[i], az2[i + 1] == 0 ? ")" : "");
+          zSep = "        OR ";
+          i++;
+        }
+      strPrintf (pSql, " UNION ALL\n");
+    }
+  zSep = "SELECT ";
+  for (i = 0; i < nPk; i++)
+    {
+      strPrintf (pSql, "%sA.%s", zSep, az[i]);
+      zSep = ", ";
+    }
+  strPrintf (pSql, ", 2%s -- deleted row\n", nPk == n ? "" : ",");
+  while (az2[i])
+    {
+      strPrintf (pSql, "       NULL, NULL%s\n", i == n2 - 1 ? "" : ",");
+      i++;
+    }
+  strPrintf (pSql, "  FROM %smain.%s A\n", zJoin, zId);
+  strPrintf (pSql, " WHERE%s NOT EXISTS(SELECT 1 FROM aux.%s B\n", zRangeA,
+             zId);
+  zSep = "                   WHERE";
+  for (i = 0; i < nPk; i++)
+    {
+      strPrintf (pSql, "%s A.%s=B.%s", zSep, az[i], az[i]);
+      zSep = " AND";
+    }
+  strPrintf (pSql, ")\n");
+  zSep = " UNION ALL\nSELECT ";
+  for (i = 0; i < nPk; i++)
+    {
+      strPrintf (pSql, "%sB.%s", zSep, az[i]);
+      zSep = ", ";
+    }
+  strPrintf (pSql, ", 3%s -- inserted row\n", nPk == n ? "" : ",");
+  while (az2[i])
+    {
+      strPrintf (pSql, "       1, B.%s%s\n", az2[i],
+                 az2[i + 1] == 0 ? "" : ",");
+      i++;
+    }
+  strPrintf (pSql, "  FROM %saux.%s B\n", zJoin, zId);
+  strPrintf (pSql, " WHERE%s NOT EXISTS(SELECT 1 FROM main.%s A\n", zRangeB,
+             zId);
+  zSep = "                   WHERE";
+  for (i = 0; i < nPk; i++)
+    {
+      strPrintf (pSql, "%s A.%s=B.%s", zSep, az[i], az[i]);
+      zSep = " AND";
+    }
+  strPrintf (pSql, ")\n ORDER BY");
+  zSep = " ";
+  for (i = 1; i <= nPk; i++)
+    {
+      strPrintf (pSql, "%s%d", zSep, i);
+      zSep = ", ";
+    }
+  strPrintf (pSql, ";\n");
+
+}
+
+/*
+** Compute all differences for a single table.
+**
+** If bRange is true, only the rows whose primary key falls within one
+** of the rowid ranges stored in the temp.repqlite_cdc table are compared.
+** See cdcPrepareTable() for details.
+**
+** If w.pRange is set, only the rows whose first primary key column falls
+** within it are compared.  The changes to the table itself and to its
+** indexes are output with the first or the last range only.
+*/
+static void
+diff_one_table (const char *zTab, int bRange, FILE * out)
+{
+  char *zId = safeId (zTab);    /* Name of table (translated for us in SQL)   */
+  DiffKernel *k = 0;            /* Columns and output of the table            */
+  char **az = 0;                /* Columns in main                            */
+  char **az2 = 0;               /* Columns in aux                             */
+  int nPk;                      /* Primary key columns in main                */
+  int nPk2;                     /* Primary key columns in aux                 */
+  int n = 0;                    /* Number of columns in main                  */
+  int n2;                       /* Number of columns in aux                   */
+  int nQ;                       /* Number of output columns in the diff query */
+  int i;                        /* Loop counter                               */
+  const char *zSep;             /* Separator string                           */
+  const char *zJoin = "";       /* Join with the range table, if any          */
+  char *zRangeA = 0;            /* Range restriction on table A               */
+  char *zRangeB = 0;            /* Range restriction on table B               */
+  Str sql;                      /* Comparison query, if not cached            */
+  const char *zSql;             /* Comparison query                           */
+  sqlite3_stmt *pStmt;          /* Query statement to do the diff             */
+  MergeJoin mj;                 /* Merge join used instead of pStmt, if any   */
+  sqlite3_value **apVal;        /* Values of the current row of the diff      */
+  const DiffRange *pR = w.pRange;       /* Key range to compare, if any       */
+  int bFirst = pR == 0 || !pR->bLo;     /* The first range of the table       */
+  int bLast = pR == 0 || !pR->bHi;      /* The last range of the table        */
+  int bHash = 0;                /* Diff with the sidecar of the table         */
+  int bHashKept = 0;            /* The sidecar was written again              */
+
+  strInit (&sql);
+  if (g.fDebug == DEBUG_COLUMN_NAMES)
+    { /* Simply run columnNames() on all tables of the origin
+       ** database and show the results.  This is used for testing
+       ** and debugging of the columnNames() function.
+       */
+      az = columnNames ("aux", zTab, &nPk, 0);
+      if (az == 0)
+        printf ("Rowid not accessible for %s\n", zId);
+      else
+        {
+          printf ("%s:", zId);
+          for (i = 0; az[i]; i++)
+            {
+              printf (" %s", az[i]);
+              if (i + 1 == nPk)
+                printf (" *");
+            }
+          printf ("\n");
+        }
+      namelistFree (az);
+      az = 0;
+      goto end_diff_one_table;
+    }
+
+
+  if (sqlite3_table_column_metadata (w.db, "aux", zTab, 0, 0, 0, 0, 0, 0))
+    {
+      if (bFirst && !sqlite3_table_column_metadata
+          (w.db, "main", zTab, 0, 0, 0, 0, 0, 0))
+        { /* Table missing from second database. */
+          patchSql (out, "DROP TABLE %s;\n", zId);
+        }
+      goto end_diff_one_table;
+    }
+
+  if (sqlite3_table_column_metadata (w.db, "main", zTab, 0, 0, 0, 0, 0, 0))
+    { /* Table missing from source */
+      if (bFirst)
+        dump_table (zTab, out);
+      goto end_diff_one_table;
+    }
+
+  k = diffKernel (zTab);
+  kernelMain (k);
+  az = k->azMain;
+  nPk = k->nPkMain;
+  az2 = k->az;
+  nPk2 = k->nPk;
+  if (az && az2)
+    {
+      for (n = 0; az[n] && az2[n]; n++)
+        if (sqlite3_stricmp (az[n], az2[n]) != 0)
+          break;
+    }
+  if (az == 0 || az2 == 0 || nPk != nPk2 || az[n])
+    { /* Schema mismatch */
+      if (bFirst)
+        {
+          patchSql (out, "DROP TABLE %s; -- due to schema mismatch\n", zId);
+          dump_table (zTab, out);
+        }
+      goto end_diff_one_table;
+    }
+
+  if (bRange)
+    {
+      zJoin = "temp.repqlite_cdc R CROSS JOIN ";
+      zRangeA = sqlite3_mprintf (" A.%s BETWEEN R.lo AND R.hi AND", az[0]);
+      zRangeB = sqlite3_mprintf (" B.%s BETWEEN R.lo AND R.hi AND", az[0]);
+    }
+  else if (pR)
+    {
+      zRangeA = diffRangeWhere (pR, "A", az[0]);
+      zRangeB = diffRangeWhere (pR, "B", az[0]);
+    }
+  else
+    {
+      zRangeA = sqlite3_mprintf ("");
+      zRangeB = sqlite3_mprintf ("");
+    }
+
+  /* Build the comparison query */
+  for (n2 = n; az2[n2]; n2++)
+    if (bFirst)
+      patchSql (out, "ALTER TABLE %s ADD COLUMN %s;\n", zId, az2[n2]);
+  nQ = nPk2 + 1 + 2 * (n2 - nPk2);
+  zSql = pR ? 0 : k->azDiff[bRange];
+  if (zSql == 0)
+    {
+      diffQuery (&sql, zId, az, az2, nPk, n, n2, zJoin, zRangeA, zRangeB);
+      zSql = sql.z;
+      if (pR == 0)
+        { /* Only the queries of whole tables are the same next time */
+          k->azDiff[bRange] = sql.z;
+          strInit (&sql);
+        }
+    }
+
+  if (g.fDebug & DEBUG_DIFF_SQL)
+    {
+      printf ("SQL for %s:\n%s\n", zId, zSql);
+      goto end_diff_one_table;
+    }
+
+  /* Drop indexes that are missing in the destination */
+  if (bFirst)
+    {
+      pStmt = db_cprepare ("SELECT name FROM main.sqlite_master"
+                           " WHERE type='index' AND tbl_name=%Q"
+                           "   AND sql IS NOT NULL"
+                           "   AND sql NOT IN (SELECT sql FROM aux.sqlite_master"
+                           "                    WHERE type='index' AND tbl_name=%Q"
+                           "                      AND sql IS NOT NULL)",
+                           zTab, zTab);
+      while (SQLITE_ROW == sqlite3_step (pStmt))
+        {
+          char *z = safeId ((const char *) sqlite3_column_text (pStmt, 0));
+          patchSql (out, "DROP INDEX %s;\n", z);
+          sqlite3_free (z);
+        }
+      db_crelease (pStmt);
+    }
+
+  /* Run the query, or the merge join with --merge-join, --row-hash or
+  ** when the query would nest a full scan, and output differences */
+  bHash = w.pRowHash && !bRange && pR == 0
+    && rowHashKey ("main", zTab) && rowHashKey ("aux", zTab);
+  pStmt = g.bMergeJoin || bHash ? 0 : db_cprepare ("%s", zSql);
+  if ((pStmt == 0 || diffPlanNested (pStmt, zTab))
+      && mergeOpen (&mj, zTab, az, az2, nPk, n, zJoin, zRangeA,
+                    zRangeB) == 0)
+    {
+      db_crelease (pStmt);
+      pStmt = 0;
+      if (bHash)
+        rowHashOpen (&mj, w.pRowHash, zTab, az, az2, n, n2);
+    }
+  else if (pStmt == 0)
+    pStmt = db_cprepare ("%s", zSql);
+  apVal = sqlite3_malloc (nQ * sizeof (apVal[0]));
+  if (apVal == 0)
+    runtimeError ("out of memory");
+  if (g.bBinary)
+    kernelTable (out, k, n2, nPk);
+  while (pStmt ? diffQueryRow (pStmt, nQ, apVal)
+         : mergeDiffRow (&mj, n, n2, apVal))
+    {
+      int iType = sqlite3_value_int (apVal[nPk]);
+      w.anDiffRow[iType == 1 ? ROW_UPDATE : iType == 2 ? ROW_DELETE
+                  : ROW_INSERT]++;
+      if (g.bBinary)
+        {
+          putc (iType == 1 ? 'U' : iType == 2 ? 'D' : 'I', out);
+          for (i = 0; i < nPk; i++)
+            patchValue (out, apVal[i]);
+          for (i = nPk + 1; iType != 2 && i < nQ; i += 2)
+            {
+              if (iType == 1 && sqlite3_value_int (apVal[i]) == 0)
+                putc (PATCH_UNDEFINED, out);
+              else
+                patchValue (out, apVal[i + 1]);
+            }
+        }
+      else if (iType == 1 || iType == 2)
+        {
+          if (iType == 1)
+            { /* Change the content of a row */
+              fputs ("UPDATE ", out);
+              fputs (zId, out);
+              zSep = " SET ";
+              for (i = nPk + 1; i < nQ; i += 2)
+                {
+                  int iCol = (i + nPk - 1) / 2;
+                  if (sqlite3_value_int (apVal[i]) == 0)
+                    continue;
+                  fputs (zSep, out);
+                  fputs (k->azEq[iCol], out);
+                  zSep = ", ";
+                  k->axEmit[iCol] (out, apVal[i + 1]);
+                }
+            }
+          else
+            { /* Delete a row */
+              fputs ("DELETE FROM ", out);
+              fputs (zId, out);
+            }
+
+          zSep = " WHERE ";
+          for (i = 0; i < nPk; i++)
+            {
+              fputs (zSep, out);
+              fputs (k->azEq[i], out);
+              k->axEmit[i] (out, apVal[i]);
+              zSep = " AND ";
+            }
+          fputs (";\n", out);
+        }
+      else
+        { /* Insert a row */
+          fputs (k->zInsert, out);
+          for (i = 0; i < nPk2; i++)
+            {
+              if (i > 0)
+                putc (',', out);
+              k->axEmit[i] (out, apVal[i]);
+            }
+          for (i = nPk2 + 2; i < nQ; i += 2)
+            {
+              putc (',', out);
+              k->axEmit[(i + nPk2 - 2) / 2] (out, apVal[i]);
+            }
+          fputs (");\n", out);
+        }
+    }
+  if (pStmt)
+    db_crelease (pStmt);
+  else
+    {
+      bHashKept = rowHashClose (&mj, zTab);
+      mergeClose (&mj);
+    }
+  sqlite3_free (apVal);
+  /* Create indexes that are missing in the source */
+  if (bLast)
+    {
+      pStmt = db_cprepare ("SELECT sql FROM aux.sqlite_master"
+                           " WHERE type='index' AND tbl_name=%Q"
+                           "   AND sql IS NOT NULL"
+                           "   AND sql NOT IN (SELECT sql FROM main.sqlite_master"
+                           "                    WHERE type='index' AND tbl_name=%Q"
+                           "                      AND sql IS NOT NULL)",
+                           zTab, zTab);
+      while (SQLITE_ROW == sqlite3_step (pStmt))
+        patchSql (out, "%s;\n", sqlite3_column_text (pStmt, 0));
+      db_crelease (pStmt);
+    }
+
+end_diff_one_table:
+  if (w.pRowHash && !bHashKept)
+    {
+      /* The sidecar, if any, is out of date */
+      char *zPath = rowHashPath (w.pRowHash, zTab);
+      unlink (zPath);
+      sqlite3_free (zPath);
+    }
+  strFree (&sql);
+  sqlite3_free (zRangeA);
+  sqlite3_free (zRangeB);
+  sqlite3_free (zId);
+  if (k)
+    kernelRelease (k);
+  return;
+}
+
+/*
+** Check that table zTab exists and has the same schema in both the "main"
+** and "aux" databases currently opened by the worker connection. If they
+** do not, output an error message on stderr and exit(1). Otherwise, if
+** the schemas do match, return control to the caller.
+*/
+static void
+checkSchemasMatch (const char *zTab)
+{
+  sqlite3_stmt *pStmt =
+    db_prepare
+    ("SELECT A.sql=B.sql FROM main.sqlite_master A, aux.sqlite_master B"
+     " WHERE A.name=%Q AND B.name=%Q", zTab, zTab);
+  if (SQLITE_ROW == sqlite3_step (pStmt))
+    {
+      if (sqlite3_column_int (pStmt, 0) == 0)
+        runtimeError ("schema changes for table %s", safeId (zTab));
+    }
+  else
+    runtimeError ("table %s missing from one or both databases",
+                  safeId (zTab));
+
+  sqlite3_finalize (pStmt);
+}
+
+/**************************************************************************
+** The following code is copied from fossil. It is used to generate the
+** fossil delta blobs sometimes used in RBU update records.
+*/
+
+/*
+** The width of a hash window in bytes.  The algorithm only works if this
+** is a power of 2.
+*/
+#define NHASH 16
+
+/*
+** The current state of the rolling hash.
+**
+** z[] holds the values that have been hashed.  z[] is a circular buffer.
+** z[i] is the first entry and z[(i+NHASH-1)%NHASH] is the last entry of
+** the window.
+**
+** Hash.a is the sum of all elements of hash.z[].  Hash.b is a weighted
+** sum.  Hash.b is z[i]*NHASH + z[i+1]*(NHASH-1) + ... + z[i+NHASH-1]*1.
+** (Each index for z[] should be module NHASH, of course.  The %NHASH operator
+** is omitted in the prior expression for brevity.)
+*/
+typedef struct hash hash;
+struct hash
+{
+  u16 a, b;                     /* Hash values                      */
+  u16 i;                        /* Start of the hash window         */
+  char z[NHASH];                /* The values that have been hashed */
+};
+
+/*
+** Initialize the rolling hash using the first NHASH characters of z[]
+*/
+static void
+hash_init (hash * pHash, const char *z)
+{
+  u16 a, b, i;
+  a = b = 0;
+  for (i = 0; i < NHASH; i++)
+    {
+      a += z[i];
+      b += (NHASH - i) * z[i];
+      pHash->z[i] = z[i];
+    }
+  pHash->a = a & 0xffff;
+  pHash->b = b & 0xffff;
+  pHash->i = 0;
+}
+
+/*
+** Advance the rolling hash by a single character "c"
+*/
+static void
+hash_next (hash * pHash, int c)
+{
+  u16 old = pHash->z[pHash->i];
+  pHash->z[pHash->i] = (char) c;
+  pHash->i = (pHash->i + 1) & (NHASH - 1);
+  pHash->a = pHash->a - old + (char) c;
+  pHash->b = pHash->b - NHASH * old + pHash->a;
+}
+
+/*
+** Return a 32-bit hash value
+*/
+static u32
+hash_32bit (hash * pHash)
+{
+  return (pHash->a & 0xffff) | (((u32) (pHash->b & 0xffff)) << 16);
+}
+
+/*
+** Write an base-64 integer into the given buffer.
+*/
+static void
+putInt (unsigned int v, char **pz)
+{
+  static const char zDigits[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz~";
+  /*  123456789 123456789 123456789 123456789 123456789 123456789 123 */
+  int i, j;
+  char zBuf[20];
+  if (v == 0)
+    {
+      *(*pz)++ = '0';
+      return;
+    }
+  for (i = 0; v > 0; i++, v >>= 6)
+    zBuf[i] = zDigits[v & 0x3f];
+
+  for (j = i - 1; j >= 0; j--)
+    *(*pz)++ = zBuf[j];
+}
+
+/*
+** Return the number digits in the base-64 representation of a positive integer
+*/
+static int
+digit_count (int v)
+{
+  unsigned int i, x;
+  for (i = 1, x = 64; (unsigned int) v >= x; i++, x <<= 6)
+    {
+    }
+  return i;
 }
 
 /*
 ** Compute a 32-bit checksum on the N-byte buffer.  Return the result.
 */
-static unsigned int
-checksum (const char *zIn, size_t N)
+static unsigned int
+checksum (const char *zIn, size_t N)
+{
+  const unsigned char *z = (const unsigned char *) zIn;
+  unsigned sum0 = 0;
+  unsigned sum1 = 0;
+  unsigned sum2 = 0;
+  unsigned sum3 = 0;
+  while (N >= 16)
+    {
+      sum0 += ((unsigned) z[0] + z[4] + z[8] + z[12]);
+      sum1 += ((unsigned) z[1] + z[5] + z[9] + z[13]);
+      sum2 += ((unsigned) z[2] + z[6] + z[10] + z[14]);
+      sum3 += ((unsigned) z[3] + z[7] + z[11] + z[15]);
+      z += 16;
+      N -= 16;
+    }
+  while (N >= 4)
+    {
+      sum0 += z[0];
+      sum1 += z[1];
+      sum2 += z[2];
+      sum3 += z[3];
+      z += 4;
+      N -= 4;
+    }
+  sum3 += (sum2 << 8) + (sum1 << 16) + (sum0 << 24);
+  switch (N)
+    {
+    case 3:
+      sum3 += (z[2] << 8);
+      /* fall through */
+    case 2:
+      sum3 += (z[1] << 16);
+      /* fall through */
+    case 1:
+      sum3 += ((unsigned) z[0] << 24);
+    default:;
+    }
+  return sum3;
+}
+
+/*
+** Return the number of leading bytes that a and b, both at least n bytes
+** long, have in common.  Compare a word at a time.
+*/
+static unsigned int
+matchForward (const char *a, const char *b, unsigned int n)
+{
+  unsigned int i = 0;
+  while (i + sizeof (u64) <= n)
+    {
+      u64 x, y;
+      memcpy (&x, &a[i], sizeof (x));
+      memcpy (&y, &b[i], sizeof (y));
+      if (x != y)
+        break;
+      i += sizeof (u64);
+    }
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+/*
+** Return the number of trailing bytes that the n bytes before aEnd and
+** the n bytes before bEnd have in common.  Compare a word at a time.
+*/
+static unsigned int
+matchBackward (const char *aEnd, const char *bEnd, unsigned int n)
+{
+  unsigned int i = 0;
+  while (i + sizeof (u64) <= n)
+    {
+      u64 x, y;
+      memcpy (&x, aEnd - i - sizeof (x), sizeof (x));
+      memcpy (&y, bEnd - i - sizeof (y), sizeof (y));
+      if (x != y)
+        break;
+      i += sizeof (u64);
+    }
+  while (i < n && aEnd[-1 - (int) i] == bEnd[-1 - (int) i])
+    i++;
+  return i;
+}
+
+/*
+** Create a new delta.
+**
+** The delta is written into a preallocated buffer, zDelta, which
+** should be at least 60 bytes longer than the target file, zOut.
+** The delta string will be NUL-terminated, but it might also contain
+** embedded NUL characters if either the zSrc or zOut files are
+** binary.  This function returns the length of the delta string
+** in bytes, excluding the final NUL terminator character.
+**
+** Output Format:
+**
+** The delta begins with a base64 number followed by a newline.  This
+** number is the number of bytes in the TARGET file.  Thus, given a
+** delta file z, a program can compute the size of the output file
+** simply by reading the first line and decoding the base-64 number
+** found there.  The delta_output_size() routine does exactly this.
+**
+** After the initial size number, the delta consists of a series of
+** literal text segments and commands to copy from the SOURCE file.
+** A copy command looks like this:
+**
+**     NNN@MMM,
+**
+** where NNN is the number of bytes to be copied and MMM is the offset
+** into the source file of the first byte (both base-64).   If NNN is 0
+** it means copy the rest of the input file.  Literal text is like this:
+**
+**     NNN:TTTTT
+**
+** where NNN is the number of bytes of text (base-64) and TTTTT is the text.
+**
+** The last term is of the form
+**
+**     NNN;
+**
+** In this case, NNN is a 32-bit bigendian checksum of the output file
+** that can be used to verify that the delta applied correctly.  All
+** numbers are in base-64.
+**
+** Pure text files generate a pure text delta.  Binary files generate a
+** delta that may contain some binary data.
+**
+** Algorithm:
+**
+** The encoder first builds a hash table to help it find matching
+** patterns in the source file.  16-byte chunks of the source file
+** sampled at evenly spaced intervals are used to populate the hash
+** table.
+**
+** Changes from fossil: the source is sampled every g.nDeltaStep bytes
+** instead of every 16 (--delta-step), matches are extended a word at a
+** time, and a prefix and a suffix that the source and target have in
+** common are copied at once without going through the hash table.  The
+** delta format is unchanged.
+**
+** Next we begin scanning the target file using a sliding 16-byte
+** window.  The hash of the 16-byte window in the target is used to
+** search for a matching section in the source file.  When a match
+** is found, a copy command is added to the delta.  An effort is
+** made to extend the matching section to regions that come before
+** and after the 16-byte hash window.  A copy command is only issued
+** if the result would use less space that just quoting the text
+** literally. Literal text is added to the delta for sections that
+** do not match or which can not be encoded efficiently using copy
+** commands.
+*/
+static int
+rbuDeltaCreate (const char *zSrc,       /* The source or pattern file       */
+                unsigned int lenSrc,    /* Length of the source file        */
+                const char *zOut,       /* The target file                  */
+                unsigned int lenOut,    /* Length of the target file        */
+                char *zDelta            /* Write the delta into this buffer */
+  )
+{
+  unsigned int i, base;
+  char *zOrigDelta = zDelta;
+  hash h;
+  int nHash;                    /* Number of hash table entries             */
+  int *landmark;                /* Primary hash table                       */
+  int *collide;                 /* Collision chain                          */
+  int lastRead = -1;            /* Last byte of zSrc read by a COPY command */
+  unsigned int nStep = g.nDeltaStep;    /* Sampling step of the source      */
+  unsigned int nPre, nSuf;      /* Common prefix and suffix                 */
+  unsigned int lenEnd;          /* End of the target less the suffix        */
+
+  /* Add the target file size to the beginning of the delta
+   */
+  putInt (lenOut, &zDelta);
+  *(zDelta++) = '\n';
+
+  /* If the source file is very small, it means that we have no
+   ** chance of ever doing a copy command.  Just output a single
+   ** literal segment for the entire target and exit.
+   */
+  if (lenSrc <= NHASH)
+    {
+      putInt (lenOut, &zDelta);
+      *(zDelta++) = ':';
+      memcpy (zDelta, zOut, lenOut);
+      zDelta += lenOut;
+      putInt (checksum (zOut, lenOut), &zDelta);
+      *(zDelta++) = ';';
+      return zDelta - zOrigDelta;
+    }
+
+  /* Copy the common prefix and suffix at once.  Mostly unchanged blobs
+   ** need nothing else.  Shorter ones are left to the matcher.
+   */
+  nPre = matchForward (zSrc, zOut, lenSrc < lenOut ? lenSrc : lenOut);
+  if (nPre < NHASH)
+    nPre = 0;
+  nSuf = matchBackward (&zSrc[lenSrc], &zOut[lenOut],
+                        (lenSrc < lenOut ? lenSrc : lenOut) - nPre);
+  if (nSuf < NHASH)
+    nSuf = 0;
+  lenEnd = lenOut - nSuf;
+  if (nPre > 0)
+    {
+      putInt (nPre, &zDelta);
+      *(zDelta++) = '@';
+      putInt (0, &zDelta);
+      *(zDelta++) = ',';
+    }
+
+  /* Compute the hash table used to locate matching sections in the
+   ** source file.
+   */
+  nHash = lenSrc / nStep;
+  collide = scratchReserve (&w.pDeltaHash, &w.nDeltaHash,
+                            nHash * 2 * sizeof (int));
+  landmark = &collide[nHash];
+  memset (landmark, -1, nHash * sizeof (int));
+  memset (collide, -1, nHash * sizeof (int));
+  for (i = 0; i < lenSrc - NHASH; i += nStep)
+    {
+      int hv;
+      hash_init (&h, &zSrc[i]);
+      hv = hash_32bit (&h) % nHash;
+      collide[i / nStep] = landmark[hv];
+      landmark[hv] = i / nStep;
+    }
+
+  /* Begin scanning the target file and generating copy commands and
+   ** literal sections of the delta.
+   */
+  base = nPre; /* We have already generated everything before zOut[base] */
+  while (base + NHASH < lenEnd)
+    {
+      int iSrc, iBlock;
+      int bestCnt, bestOfst = 0, bestLitsz = 0;
+      hash_init (&h, &zOut[base]);
+      i = 0; /* Trying to match a landmark against zOut[base+i] */
+      bestCnt = 0;
+      while (1)
+        {
+          int hv;
+          int limit = 250;
+
+          hv = hash_32bit (&h) % nHash;
+          iBlock = landmark[hv];
+          while (iBlock >= 0 && (limit--) > 0)
+            {
+              /*
+               ** The hash window has identified a potential match against
+               ** landmark block iBlock.  But we need to investigate further.
+               **
+               ** Look for a region in zOut that matches zSrc. Anchor the search
+               ** at zSrc[iSrc] and zOut[base+i].  Do not include anything prior to
+               ** zOut[base] or after zOut[outLen] nor anything after zSrc[srcLen].
+               **
+               ** Set cnt equal to the length of the match and set ofst so that
+               ** zSrc[ofst] is the first element of the match.  litsz is the number
+               ** of characters between zOut[base] and the beginning of the match.
+               ** sz will be the overhead (in bytes) needed to encode the copy
+               ** command.  Only generate copy command if the overhead of the
+               ** copy command is less than the amount of literal text to be copied.
+               */
+              int cnt, ofst, litsz;
+              int j, k, x, y;
+              int sz;
+
+              /* Beginning at iSrc, match forwards as far as we can.  j counts
+               ** the number of characters that match */
+              iSrc = iBlock * nStep;
+              x = lenSrc - iSrc;
+              y = lenEnd - (base + i);
+              j = matchForward (&zSrc[iSrc], &zOut[base + i], x < y ? x : y);
+              j--;
+
+              /* Beginning at iSrc-1, match backwards as far as we can.  k counts
+               ** the number of characters that match */
+              x = iSrc - 1;
+              y = i;
+              k = iSrc > 0 ? matchBackward (&zSrc[iSrc], &zOut[base + i],
+                                            x < y ? x : y) : 0;
+
+              /* Compute the offset and size of the matching region */
+              ofst = iSrc - k;
+              cnt = j + k + 1;
+              litsz = i - k;    /* Number of bytes of literal text before the copy */
+              /* sz will hold the number of bytes needed to encode the "insert"
+               ** command and the copy command, not counting the "insert" text */
+              sz =
+                digit_count (i - k) + digit_count (cnt) + digit_count (ofst) +
+                3;
+              if (cnt >= sz && cnt > bestCnt)
+                {
+                  /* Remember this match only if it is the best so far and it
+                   ** does not increase the file size */
+                  bestCnt = cnt;
+                  bestOfst = iSrc - k;
+                  bestLitsz = litsz;
+                }
+
+              /* Check the next matching block */
+              iBlock = collide[iBlock];
+            }
+
+          /* We have a copy command that does not cause the delta to be larger
+           ** than a literal insert.  So add the copy command to the delta.
+           */
+          if (bestCnt > 0)
+            {
+              if (bestLitsz > 0)
+                {
+                  /* Add an insert command before the copy */
+                  putInt (bestLitsz, &zDelta);
+                  *(zDelta++) = ':';
+                  memcpy (zDelta, &zOut[base], bestLitsz);
+                  zDelta += bestLitsz;
+                  base += bestLitsz;
+                }
+              base += bestCnt;
+              putInt (bestCnt, &zDelta);
+              *(zDelta++) = '@';
+              putInt (bestOfst, &zDelta);
+              *(zDelta++) = ',';
+              if (bestOfst + bestCnt - 1 > lastRead)
+                lastRead = bestOfst + bestCnt - 1;
+              bestCnt = 0;
+              break;
+            }
+
+          /* If we reach this point, it means no match is found so far */
+          if (base + i + NHASH >= lenEnd)
+            {
+              /* We have reached the end of the file and have not found any
+               ** matches.  Do an "insert" for everything that does not match */
+              putInt (lenEnd - base, &zDelta);
+              *(zDelta++) = ':';
+              memcpy (zDelta, &zOut[base], lenEnd - base);
+              zDelta += lenEnd - base;
+              base = lenEnd;
+              break;
+            }
+
+          /* Advance the hash by one character.  Keep looking for a match */
+          hash_next (&h, zOut[base + i + NHASH]);
+          i++;
+        }
+    }
+  /* Output a final "insert" record to get all the text at the end of
+   ** the file that does not match anything in the source file.
+   */
+  if (base < lenEnd)
+    {
+      putInt (lenEnd - base, &zDelta);
+      *(zDelta++) = ':';
+      memcpy (zDelta, &zOut[base], lenEnd - base);
+      zDelta += lenEnd - base;
+    }
+  /* Copy the common suffix */
+  if (nSuf > 0)
+    {
+      putInt (nSuf, &zDelta);
+      *(zDelta++) = '@';
+      putInt (lenSrc - nSuf, &zDelta);
+      *(zDelta++) = ',';
+    }
+  /* Output the final checksum record. */
+  putInt (checksum (zOut, lenOut), &zDelta);
+  *(zDelta++) = ';';
+  return zDelta - zOrigDelta;
+}
+
+/*
+** End of code copied from fossil.
+**************************************************************************/
+
+static void
+strPrintfArray (Str * pStr,             /* String object to append to          */
+                const char *zSep,       /* Separator string                    */
+                const char *zFmt,       /* Format for each entry               */
+                char **az, int n        /* Array of strings & its size (or -1) */
+  )
+{
+  int i;
+  for (i = 0; az[i] && (i < n || n < 0); i++)
+    {
+      if (i != 0)
+        strPrintf (pStr, "%s", zSep);
+      strPrintf (pStr, zFmt, az[i], az[i], az[i]);
+    }
+}
+
+static void
+getRbudiffQuery (const char *zTab,
+                 char **azCol, int nPK, int bOtaRowid, Str * pSql)
+{
+  int i;
+
+  /* First the newly inserted rows: * */
+  strPrintf (pSql, "SELECT ");
+  strPrintfArray (pSql, ", ", "%s", azCol, -1);
+  strPrintf (pSql, ", 0, ");  /* Set ota_control to 0 for an insert */
+  strPrintfArray (pSql, ", ", "NULL", azCol, -1);
+  strPrintf (pSql, " FROM aux.%Q AS n WHERE NOT EXISTS (\n", zTab);
+  strPrintf (pSql, "    SELECT 1 FROM ", zTab);
+  strPrintf (pSql, " main.%Q AS o WHERE ", zTab);
+  strPrintfArray (pSql, " AND ", "(n.%Q IS o.%Q)", azCol, nPK);
+  strPrintf (pSql, "\n)");
+
+  /* Deleted rows: */
+  strPrintf (pSql, "\nUNION ALL\nSELECT ");
+  strPrintfArray (pSql, ", ", "%s", azCol, nPK);
+  if (azCol[nPK])
+    {
+      strPrintf (pSql, ", ");
+      strPrintfArray (pSql, ", ", "NULL", &azCol[nPK], -1);
+    }
+  strPrintf (pSql, ", 1, ");  /* Set ota_control to 1 for a delete */
+  strPrintfArray (pSql, ", ", "NULL", azCol, -1);
+  strPrintf (pSql, " FROM main.%Q AS n WHERE NOT EXISTS (\n", zTab);
+  strPrintf (pSql, "    SELECT 1 FROM ", zTab);
+  strPrintf (pSql, " aux.%Q AS o WHERE ", zTab);
+  strPrintfArray (pSql, " AND ", "(n.%Q IS o.%Q)", azCol, nPK);
+  strPrintf (pSql, "\n) ");
+
+  /* Updated rows. If all table columns are part of the primary key, there
+   ** can be no updates. In this case this part of the compound SELECT can
+   ** be omitted altogether. */
+  if (azCol[nPK])
+    {
+      strPrintf (pSql, "\nUNION ALL\nSELECT ");
+      strPrintfArray (pSql, ", ", "n.%s", azCol, nPK);
+      strPrintf (pSql, ",\n");
+      strPrintfArray (pSql, " ,\n",
+                      "    CASE WHEN n.%s IS o.%s THEN NULL ELSE n.%s END",
+                      &azCol[nPK], -1);
+
+      if (bOtaRowid == 0)
+        {
+          strPrintf (pSql, ", '");
+          strPrintfArray (pSql, "", ".", azCol, nPK);
+          strPrintf (pSql, "' ||\n");
+        }
+      else
+        strPrintf (pSql, ",\n");
+
+      strPrintfArray (pSql, " ||\n",
+                      "    CASE WHEN n.%s IS o.%s THEN '.' ELSE 'x' END",
+                      &azCol[nPK], -1);
+      strPrintf (pSql, "\nAS ota_control, ");
+      strPrintfArray (pSql, ", ", "NULL", azCol, nPK);
+      strPrintf (pSql, ",\n");
+      strPrintfArray (pSql, " ,\n",
+                      "    CASE WHEN n.%s IS o.%s THEN NULL ELSE o.%s END",
+                      &azCol[nPK], -1);
+
+      strPrintf (pSql, "\nFROM main.%Q AS o, aux.%Q AS n\nWHERE ", zTab,
+                 zTab);
+      strPrintfArray (pSql, " AND ", "(n.%Q IS o.%Q)", azCol, nPK);
+      strPrintf (pSql, " AND ota_control LIKE '%%x%%'");
+    }
+
+  /* Now add an ORDER BY clause to sort everything by PK. */
+  strPrintf (pSql, "\nORDER BY ");
+  for (i = 1; i <= nPK; i++)
+    strPrintf (pSql, "%s%d", ((i > 1) ? ", " : ""), i);
+}
+
+/*
+** Parallel blob deltas.
+**
+** In an UPDATE row of an RBU diff, every blob column that changed is
+** written as a fossil delta of its old value when that is smaller.
+** Computing the delta of a large blob is expensive, so deltas of blobs
+** of RBU_PARALLEL_MIN bytes or more are computed by a pool of
+** g.nDeltaThread threads while the diff query keeps stepping.  The rows
+** wait in a window, in primary key order, and are written out as soon
+** as the deltas of the first one are ready.  The window is bounded by
+** RBU_WINDOW rows and RBU_WINDOW_BYTES bytes of blobs, or a quarter of
+** the --memory budget.
+**
+** Rows that have no large blob are written at once when the window is
+** empty, and their deltas computed inline, as before.
+*/
+#define RBU_PARALLEL_MIN (64 * 1024)    /* Smallest blob given to the pool  */
+#define RBU_WINDOW 256                  /* Max rows waiting to be written   */
+#define RBU_WINDOW_BYTES (256 * 1024 * 1024)    /* Max blob bytes waiting   */
+
+#define RBU_LAZY    (-2)        /* Delta not computed, do it when written    */
+#define RBU_PENDING (-1)        /* Delta being computed by the pool          */
+
+/*
+** A blob column of an UPDATE row that may be written as a delta
+*/
+typedef struct RbuCell RbuCell;
+struct RbuCell
+{
+  const char *aSrc;             /* Old value, or NULL if not a candidate   */
+  int nSrc;                     /* Size of aSrc                            */
+  const char *aFinal;           /* New value                               */
+  int nFinal;                   /* Size of aFinal                          */
+  char *aDelta;                 /* Delta computed by the pool              */
+  int nDelta;                   /* Size of aDelta, RBU_LAZY or RBU_PENDING */
+  int bPool;                    /* True if given to the pool               */
+  RbuCell *pNext;               /* Next cell in the queue of the pool      */
+};
+
+/*
+** A row of the RBU diff query
+*/
+typedef struct RbuRow RbuRow;
+struct RbuRow
+{
+  sqlite3_value **apVal;        /* The values of the row                   */
+  RbuCell *aCell;               /* One per column for UPDATE rows, or NULL */
+  sqlite3_int64 nByte;          /* Bytes of candidate blobs                */
+};
+
+/*
+** The threads computing deltas for one rbudiff_one_table() call
+*/
+typedef struct RbuPool RbuPool;
+struct RbuPool
+{
+  int nThread;                  /* Number of threads started               */
+  pthread_t *aThread;           /* The threads                             */
+  pthread_mutex_t mutex;        /* Protects the fields below and cells     */
+  pthread_cond_t cond;          /* Signaled when a cell is queued          */
+  pthread_cond_t done;          /* Signaled when a delta is computed       */
+  RbuCell *pFirst;              /* First cell waiting for a thread         */
+  RbuCell *pLast;               /* Last cell waiting for a thread          */
+  int bStop;                    /* Threads exit once the queue is empty    */
+};
+
+/*
+** Compute the delta of pCell into a buffer of its own
+*/
+static void
+rbuCellCompute (RbuCell * pCell, char **paDelta)
+{
+  *paDelta = sqlite3_malloc64 ((sqlite3_uint64) pCell->nFinal + 60);
+  if (*paDelta == 0)
+    runtimeError ("out of memory");
+  pCell->nDelta = rbuDeltaCreate (pCell->aSrc, pCell->nSrc, pCell->aFinal,
+                                  pCell->nFinal, *paDelta);
+}
+
+/*
+** Body of the threads of an RbuPool
+*/
+static void *
+rbuPoolMain (void *pArg)
+{
+  RbuPool *pPool = (RbuPool *) pArg;
+  pthread_mutex_lock (&pPool->mutex);
+  for (;;)
+    {
+      RbuCell *pCell;
+      RbuCell cell;
+      char *aDelta;
+
+      while (pPool->pFirst == 0 && !pPool->bStop)
+        pthread_cond_wait (&pPool->cond, &pPool->mutex);
+      if (pPool->pFirst == 0)
+        break;
+      pCell = pPool->pFirst;
+      pPool->pFirst = pCell->pNext;
+      if (pPool->pFirst == 0)
+        pPool->pLast = 0;
+      cell = *pCell;
+      pthread_mutex_unlock (&pPool->mutex);
+
+      rbuCellCompute (&cell, &aDelta);
+
+      pthread_mutex_lock (&pPool->mutex);
+      pCell->aDelta = aDelta;
+      pCell->nDelta = cell.nDelta;
+      pthread_cond_broadcast (&pPool->done);
+    }
+  pthread_mutex_unlock (&pPool->mutex);
+  sqlite3_free (w.pDeltaHash);
+  return 0;
+}
+
+/*
+** Start a pool of g.nDeltaThread threads
+*/
+static RbuPool *
+rbuPoolStart (void)
+{
+  RbuPool *pPool = sqlite3_malloc (sizeof (*pPool));
+  int i;
+
+  if (pPool == 0)
+    runtimeError ("out of memory");
+  memset (pPool, 0, sizeof (*pPool));
+  pPool->aThread = sqlite3_malloc (g.nDeltaThread * sizeof (pthread_t));
+  if (pPool->aThread == 0)
+    runtimeError ("out of memory");
+  pthread_mutex_init (&pPool->mutex, 0);
+  pthread_cond_init (&pPool->cond, 0);
+  pthread_cond_init (&pPool->done, 0);
+  for (i = 0; i < g.nDeltaThread; i++)
+    {
+      if (pthread_create (&pPool->aThread[i], 0, rbuPoolMain, pPool) != 0)
+        break;
+    }
+  pPool->nThread = i;
+  return pPool;
+}
+
+/*
+** Stop the threads of pPool, once they computed all queued deltas
+*/
+static void
+rbuPoolStop (RbuPool * pPool)
+{
+  int i;
+
+  if (pPool == 0)
+    return;
+  pthread_mutex_lock (&pPool->mutex);
+  pPool->bStop = 1;
+  pthread_cond_broadcast (&pPool->cond);
+  pthread_mutex_unlock (&pPool->mutex);
+  for (i = 0; i < pPool->nThread; i++)
+    pthread_join (pPool->aThread[i], 0);
+  pthread_cond_destroy (&pPool->done);
+  pthread_cond_destroy (&pPool->cond);
+  pthread_mutex_destroy (&pPool->mutex);
+  sqlite3_free (pPool->aThread);
+  sqlite3_free (pPool);
+}
+
+/*
+** Return a copy of the nVal values and the nCol cells of pRow that
+** stays valid after the diff query steps, with the cells of its large
+** blobs queued to the pool *ppPool, started if needed
+*/
+static RbuRow *
+rbuRowCopy (const RbuRow * pRow, int nVal, int nCol, RbuPool ** ppPool)
+{
+  RbuRow *pCopy;
+  int i;
+
+  pCopy = sqlite3_malloc (sizeof (*pCopy) + nVal * sizeof (sqlite3_value *));
+  if (pCopy == 0)
+    runtimeError ("out of memory");
+  pCopy->apVal = (sqlite3_value **) & pCopy[1];
+  pCopy->aCell = 0;
+  pCopy->nByte = pRow->nByte;
+  for (i = 0; i < nVal; i++)
+    if ((pCopy->apVal[i] = sqlite3_value_dup (pRow->apVal[i])) == 0)
+      runtimeError ("out of memory");
+  if (pRow->aCell == 0)
+    return pCopy;
+
+  pCopy->aCell = sqlite3_malloc (nCol * sizeof (RbuCell));
+  if (pCopy->aCell == 0)
+    runtimeError ("out of memory");
+  memcpy (pCopy->aCell, pRow->aCell, nCol * sizeof (RbuCell));
+  for (i = 0; i < nCol; i++)
+    {
+      RbuCell *pCell = &pCopy->aCell[i];
+      if (pCell->aSrc == 0)
+        continue;
+      pCell->aFinal = sqlite3_value_blob (pCopy->apVal[i]);
+      pCell->aSrc = sqlite3_value_blob (pCopy->apVal[nCol + 1 + i]);
+      if (pCell->nFinal >= RBU_PARALLEL_MIN && g.nDeltaThread > 1)
+        {
+          if (*ppPool == 0)
+            *ppPool = rbuPoolStart ();
+          pthread_mutex_lock (&(*ppPool)->mutex);
+          pCell->nDelta = RBU_PENDING;
+          pCell->bPool = 1;
+          pCell->pNext = 0;
+          if ((*ppPool)->pLast)
+            (*ppPool)->pLast->pNext = pCell;
+          else
+            (*ppPool)->pFirst = pCell;
+          (*ppPool)->pLast = pCell;
+          pthread_cond_signal (&(*ppPool)->cond);
+          pthread_mutex_unlock (&(*ppPool)->mutex);
+        }
+    }
+  return pCopy;
+}
+
+/*
+** Free a row returned by rbuRowCopy()
+*/
+static void
+rbuRowFree (RbuRow * pRow, int nVal, int nCol)
+{
+  int i;
+  for (i = 0; i < nVal; i++)
+    sqlite3_value_free (pRow->apVal[i]);
+  if (pRow->aCell)
+    {
+      for (i = 0; i < nCol; i++)
+        sqlite3_free (pRow->aCell[i].aDelta);
+      sqlite3_free (pRow->aCell);
+    }
+  sqlite3_free (pRow);
+}
+
+/*
+** Write the INSERT statement of pRow into the data_xxx table to out,
+** waiting for the deltas that pPool computes for it
+*/
+static void
+rbuRowWrite (FILE * out, const char *zInsert, RbuRow * pRow, int nCol,
+             int nPK, int bOtaRowid, RbuPool * pPool)
+{
+  sqlite3_value **apVal = pRow->apVal;
+  int i;
+
+  /* Output the first part of the INSERT statement */
+  fprintf (out, "%s", zInsert);
+
+  if (pRow->aCell == 0)
+    for (i = 0; i <= nCol; i++)
+      {
+        if (i > 0)
+          fprintf (out, ", ");
+        printQuoted (out, apVal[i]);
+      }
+  else
+    {
+      char *zOtaControl;
+      int nOtaControl = sqlite3_value_bytes (apVal[nCol]);
+
+      zOtaControl = (char *) sqlite3_malloc (nOtaControl + 1);
+      if (zOtaControl == 0)
+        runtimeError ("out of memory");
+      memcpy (zOtaControl, sqlite3_value_text (apVal[nCol]),
+              nOtaControl + 1);
+
+      for (i = 0; i < nCol; i++)
+        {
+          RbuCell *pCell = &pRow->aCell[i];
+          int bDone = 0;
+          if (i >= nPK && pCell->aSrc)
+            {
+              const char *aDelta = pCell->aDelta;
+              if (pCell->bPool)
+                {
+                  pthread_mutex_lock (&pPool->mutex);
+                  while (pCell->nDelta == RBU_PENDING)
+                    pthread_cond_wait (&pPool->done, &pPool->mutex);
+                  pthread_mutex_unlock (&pPool->mutex);
+                  aDelta = pCell->aDelta;
+                }
+              else if (pCell->nDelta == RBU_LAZY)
+                {
+                  char *aBuf = scratchReserve (&w.pDelta, &w.nDelta,
+                                               (size_t) pCell->nFinal + 60);
+                  pCell->nDelta = rbuDeltaCreate (pCell->aSrc, pCell->nSrc,
+                                                  pCell->aFinal,
+                                                  pCell->nFinal, aBuf);
+                  aDelta = aBuf;
+                }
+              if (pCell->nDelta < pCell->nFinal)
+                {
+                  printBlob (out, (const unsigned char *) aDelta,
+                             pCell->nDelta);
+                  zOtaControl[i - bOtaRowid] = 'f';
+                  bDone = 1;
+                }
+            }
+
+          if (bDone == 0)
+            printQuoted (out, apVal[i]);
+
+          fprintf (out, ", ");
+        }
+      fprintf (out, "'%s'", zOtaControl);
+      sqlite3_free (zOtaControl);
+    }
+
+  /* And the closing bracket of the insert statement */
+  fprintf (out, ");\n");
+}
+
+/*
+** Fill apVal with the next row of the merge join p, in the layout of the
+** rows of the query of getRbudiffQuery().  The rbu_control text of an
+** UPDATE row is built in zCtl, and made a value by pCtl, a "SELECT ?1"
+** statement.  Return zero after the last row.
+*/
+static int
+rbuMergeRow (MergeJoin * p, int bOtaRowid, sqlite3_stmt * pCtl, char *zCtl,
+             sqlite3_value ** apVal)
+{
+  int nPK = p->nPk;
+  int nCol = p->nCol;
+  int eRow, i, n;
+
+  for (;;)
+    {
+      eRow = mergeStep (p);
+      if (eRow != MERGE_UPDATE)
+        break;
+      n = 0;
+      if (!bOtaRowid)
+        for (i = 0; i < nPK; i++)
+          zCtl[n++] = '.';
+      for (i = nPK; i < nCol; i++)
+        zCtl[n++] = mergeChanged (p, i) ? 'x' : '.';
+      zCtl[n] = 0;
+      if (memchr (zCtl, 'x', n))
+        break;
+    }
+  if (eRow == MERGE_EOF)
+    return 0;
+
+  for (i = 0; i < nCol; i++)
+    {
+      sqlite3_value *pNull = mergeConst (p, -1);
+      switch (eRow)
+        {
+        case MERGE_INSERT:
+          apVal[i] = sqlite3_column_value (p->pB, i);
+          apVal[nCol + 1 + i] = pNull;
+          break;
+        case MERGE_DELETE:
+          apVal[i] = i < nPK ? sqlite3_column_value (p->pA, i) : pNull;
+          apVal[nCol + 1 + i] = pNull;
+          break;
+        default:
+          if (i < nPK || zCtl[i - (bOtaRowid ? nPK : 0)] == 'x')
+            apVal[i] = sqlite3_column_value (p->pB, i);
+          else
+            apVal[i] = pNull;
+          if (i >= nPK && zCtl[i - (bOtaRowid ? nPK : 0)] == 'x')
+            apVal[nCol + 1 + i] = sqlite3_column_value (p->pA, i);
+          else
+            apVal[nCol + 1 + i] = pNull;
+          break;
+        }
+    }
+  if (eRow == MERGE_UPDATE)
+    {
+      sqlite3_reset (pCtl);
+      if (sqlite3_bind_text (pCtl, 1, zCtl, -1, SQLITE_TRANSIENT) != SQLITE_OK
+          || sqlite3_step (pCtl) != SQLITE_ROW)
+        runtimeError ("%s", sqlite3_errmsg (w.db));
+      apVal[nCol] = sqlite3_column_value (pCtl, 0);
+    }
+  else
+    apVal[nCol] = mergeConst (p, eRow == MERGE_DELETE);
+  return 1;
+}
+
+/*
+** Compute the RBU differences for a single table.  The bRange argument
+** is ignored: RBU diffs always compare the whole table.
+*/
+static void
+rbudiff_one_table (const char *zTab, int bRange, FILE * out)
+{
+  int bOtaRowid;                /* True to use an ota_rowid column        */
+  int nPK;                      /* Number of primary key columns in table */
+  char **azCol;                 /* NULL terminated array of col names     */
+  int i;
+  int nCol;
+  Str ct = { 0, 0, 0 };         /* The "CREATE TABLE data_xxx" statement */
+  Str sql = { 0, 0, 0 };        /* Query to find differences             */
+  Str insert = { 0, 0, 0 };     /* First part of output INSERT statement */
+  sqlite3_stmt *pStmt = 0;
+  int nVal;                     /* Number of columns of the query        */
+  sqlite3_value **apVal;        /* Values of the current row             */
+  RbuCell *aCell;               /* Cells of the current row              */
+  RbuRow *aWin[RBU_WINDOW];     /* Rows waiting for their deltas         */
+  int iWin = 0, nWin = 0;       /* First row and number of rows in aWin  */
+  sqlite3_int64 nWinByte = 0;   /* Bytes of blobs of the rows in aWin    */
+  sqlite3_int64 nWinMax = RBU_WINDOW_BYTES;     /* Max of nWinByte      */
+  RbuPool *pPool = 0;           /* Threads computing deltas, if any      */
+  MergeJoin mj;                 /* Merge join used instead of pStmt      */
+  sqlite3_stmt *pCtl = 0;       /* Makes the rbu_control values of mj    */
+  char *zCtl = 0;               /* Buffer for the rbu_control of mj      */
+
+  (void) bRange;
+  if (g.nMemory > 0 && nWinMax > g.nMemory / 4)
+    nWinMax = g.nMemory / 4;
+
+  /* Check that the schemas of the two tables match. Exit early otherwise. */
+  checkSchemasMatch (zTab);
+
+  /* Grab the column names and PK details for the table(s). If no usable PK
+   ** columns are found, bail out early.  */
+  azCol = columnNames ("main", zTab, &nPK, &bOtaRowid);
+  if (azCol == 0)
+    runtimeError ("table %s has no usable PK columns", zTab);
+
+  for (nCol = 0; azCol[nCol]; nCol++);
+
+  /* Build and output the CREATE TABLE statement for the data_xxx table */
+  strPrintf (&ct, "CREATE TABLE IF NOT EXISTS 'data_%q'(", zTab);
+  if (bOtaRowid)
+    strPrintf (&ct, "rbu_rowid, ");
+  strPrintfArray (&ct, ", ", "%s", &azCol[bOtaRowid], -1);
+  strPrintf (&ct, ", rbu_control);");
+
+  /* Get the SQL for the query to retrieve data from the two databases */
+  getRbudiffQuery (zTab, azCol, nPK, bOtaRowid, &sql);
+
+  /* Build the first part of the INSERT statement output for each row
+   ** in the data_xxx table. */
+  strPrintf (&insert, "INSERT INTO 'data_%q' (", zTab);
+  if (bOtaRowid)
+    strPrintf (&insert, "rbu_rowid, ");
+  strPrintfArray (&insert, ", ", "%s", &azCol[bOtaRowid], -1);
+  strPrintf (&insert, ", rbu_control) VALUES(");
+
+  pStmt = g.bMergeJoin ? 0 : db_cprepare ("%s", sql.z);
+  nVal = 2 * nCol + 1;
+  if ((pStmt == 0 || diffPlanNested (pStmt, zTab))
+      && mergeOpen (&mj, zTab, azCol, azCol, nPK, nCol, "", "", "") == 0)
+    {
+      db_crelease (pStmt);
+      pStmt = 0;
+      pCtl = db_cprepare ("SELECT ?1");
+      zCtl = sqlite3_malloc (nCol + 1);
+      if (zCtl == 0)
+        runtimeError ("out of memory");
+    }
+  else if (pStmt == 0)
+    pStmt = db_cprepare ("%s", sql.z);
+  apVal = sqlite3_malloc (nVal * sizeof (apVal[0]));
+  aCell = sqlite3_malloc (nCol * sizeof (aCell[0]));
+  if (apVal == 0 || aCell == 0)
+    runtimeError ("out of memory");
+
+  while (pStmt ? diffQueryRow (pStmt, nVal, apVal)
+         : rbuMergeRow (&mj, bOtaRowid, pCtl, zCtl, apVal))
+    {
+      RbuRow row;
+      int bLarge = 0;
+
+      /* rbu_control is 0 for an INSERT, 1 for a DELETE, text otherwise */
+      w.anDiffRow[sqlite3_value_type (apVal[nCol]) != SQLITE_INTEGER
+                  ? ROW_UPDATE : sqlite3_value_int (apVal[nCol]) == 1
+                  ? ROW_DELETE : ROW_INSERT]++;
+      /*  If this is the first row output, print out the CREATE TABLE
+       ** statement first. And then set ct.z to NULL so that it is not
+       ** printed again.
+       */
+      if (ct.z)
+        {
+          fprintf (out, "%s\n", ct.z);
+          strFree (&ct);
+        }
+
+      row.apVal = apVal;
+      row.aCell = 0;
+      row.nByte = 0;
+      if (sqlite3_value_type (apVal[nCol]) != SQLITE_INTEGER)
+        {
+          row.aCell = aCell;
+          memset (aCell, 0, nCol * sizeof (aCell[0]));
+          for (i = nPK; i < nCol; i++)
+            if (sqlite3_value_type (apVal[i]) == SQLITE_BLOB
+                && sqlite3_value_type (apVal[nCol + 1 + i]) == SQLITE_BLOB
+                && (g.nMemory == 0 || sqlite3_value_bytes (apVal[i])
+                    <= g.nMemory / MEMORY_DELTA_SHARE))
+              {
+                RbuCell *pCell = &aCell[i];
+                pCell->aSrc = sqlite3_value_blob (apVal[nCol + 1 + i]);
+                pCell->nSrc = sqlite3_value_bytes (apVal[nCol + 1 + i]);
+                pCell->aFinal = sqlite3_value_blob (apVal[i]);
+                pCell->nFinal = sqlite3_value_bytes (apVal[i]);
+                pCell->nDelta = RBU_LAZY;
+                row.nByte += pCell->nSrc + pCell->nFinal;
+                if (pCell->nFinal >= RBU_PARALLEL_MIN)
+                  bLarge = 1;
+              }
+        }
+
+      if (nWin == 0 && (!bLarge || g.nDeltaThread <= 1))
+        {
+          rbuRowWrite (out, insert.z, &row, nCol, nPK, bOtaRowid, 0);
+          continue;
+        }
+
+      /* Queue the row, and write the rows that are due */
+      aWin[(iWin + nWin++) % RBU_WINDOW] =
+        rbuRowCopy (&row, nVal, nCol, &pPool);
+      nWinByte += row.nByte;
+      while (nWin == RBU_WINDOW || (nWin > 1 && nWinByte > nWinMax))
+        {
+          RbuRow *pRow = aWin[iWin];
+          rbuRowWrite (out, insert.z, pRow, nCol, nPK, bOtaRowid, pPool);
+          nWinByte -= pRow->nByte;
+          rbuRowFree (pRow, nVal, nCol);
+          iWin = (iWin + 1) % RBU_WINDOW;
+          nWin--;
+        }
+    }
+
+  /* Write the rows still waiting */
+  for (; nWin > 0; nWin--)
+    {
+      RbuRow *pRow = aWin[iWin];
+      rbuRowWrite (out, insert.z, pRow, nCol, nPK, bOtaRowid, pPool);
+      rbuRowFree (pRow, nVal, nCol);
+      iWin = (iWin + 1) % RBU_WINDOW;
+    }
+  rbuPoolStop (pPool);
+  sqlite3_free (apVal);
+  sqlite3_free (aCell);
+
+  if (pStmt)
+    db_crelease (pStmt);
+  else
+    {
+      mergeClose (&mj);
+      db_crelease (pCtl);
+      sqlite3_free (zCtl);
+    }
+
+  strFree (&ct);
+  strFree (&sql);
+  strFree (&insert);
+}
+
+/*
+** Change capture from the write-ahead log.
+**
+** When the source database is in WAL mode, every page written since the
+** WAL was last restarted can be read back from the "-wal" file.  A row
+** that is inserted or updated always ends up on a table b-tree leaf page
+** that has been written.  A deleted row always lies between the rows of
+** such a page and the nearest rows of the source that were not written.
+** So the rowids found on the leaf pages of the new WAL frames, widened to
+** the next surrounding rows of the source, bound all the rows that may
+** differ from the backup, and only those rows need to be diffed.
+**
+** Schema changes, tables without rowid and --primarykey diffs fall back
+** to the full comparison.
+*/
+
+#define CDC_FULL  0             /* Diff everything                    */
+#define CDC_NONE  1             /* Nothing was committed since        */
+#define CDC_NEW   2             /* Changes are described by CdcChanges */
+
+#define WAL_HDRSIZE        32   /* Size of the WAL header             */
+#define WAL_FRAME_HDRSIZE  24   /* Size of the header of each frame   */
+
+#define CDC_MAXROWID  ((sqlite3_int64) 0x7fffffffffffffffLL)
+#define CDC_MINROWID  (-CDC_MAXROWID - 1)
+
+/*
+** A range of rowids found on a single leaf page
+*/
+typedef struct CdcRange CdcRange;
+struct CdcRange
+{
+  sqlite3_int64 iLo;            /* Smallest rowid of the range            */
+  sqlite3_int64 iHi;            /* Largest rowid of the range             */
+  u32 iPage;                    /* Page of the range, or 0 for any table  */
+  int bEmpty;                   /* True if the page holds no rows at all  */
+};
+
+/*
+** Changes read from the WAL of a database
+*/
+typedef struct CdcChanges CdcChanges;
+struct CdcChanges
+{
+  CdcRange *aRange;             /* Rowid ranges of the written leaf pages */
+  int nRange;                   /* Number of entries in aRange[]          */
+  int nAlloc;                   /* Slots allocated for aRange[]           */
+  int nPage;                    /* Number of frames decoded               */
+  int bIndex;                   /* True if an index b-tree page changed   */
+  u32 *aRoot;                   /* Sorted root pages of all source tables */
+  int nRoot;                    /* Number of entries in aRoot[]           */
+};
+
+/*
+** Read a big-endian 16-bit or 32-bit integer
+*/
+static u32
+get2byte (const u8 * a)
+{
+  return (a[0] << 8) | a[1];
+}
+
+static u32
+get4byte (const u8 * a)
+{
+  return ((u32) a[0] << 24) | ((u32) a[1] << 16) | ((u32) a[2] << 8) | a[3];
+}
+
+/*
+** Read an SQLite varint from a[], which must not extend past aEnd.
+** Return the number of bytes read, or 0 if the varint is truncated.
+*/
+static int
+getVarint (const u8 * a, const u8 * aEnd, sqlite3_uint64 * pv)
+{
+  sqlite3_uint64 v = 0;
+  int i;
+  for (i = 0; i < 8; i++)
+    {
+      if (&a[i] >= aEnd)
+        return 0;
+      v = (v << 7) | (a[i] & 0x7f);
+      if ((a[i] & 0x80) == 0)
+        {
+          *pv = v;
+          return i + 1;
+        }
+    }
+  if (&a[8] >= aEnd)
+    return 0;
+  *pv = (v << 8) | a[8];
+  return 9;
+}
+
+/*
+** Add the checksum of the nByte bytes of a[] to aCksum[], the way the
+** WAL does.  If bBig is true the input is read as big-endian words,
+** otherwise as little-endian words.  nByte must be a multiple of 8.
+*/
+static void
+walChecksum (int bBig, const u8 * a, int nByte, u32 * aCksum)
+{
+  const u8 *aEnd = &a[nByte];
+  u32 s1 = aCksum[0];
+  u32 s2 = aCksum[1];
+  while (a < aEnd)
+    {
+      u32 x0, x1;
+      if (bBig)
+        {
+          x0 = get4byte (a);
+          x1 = get4byte (&a[4]);
+        }
+      else
+        {
+          x0 = a[0] | (a[1] << 8) | (a[2] << 16) | ((u32) a[3] << 24);
+          x1 = a[4] | (a[5] << 8) | (a[6] << 16) | ((u32) a[7] << 24);
+        }
+      s1 += x0 + s2;
+      s2 += x1 + s1;
+      a += 8;
+    }
+  aCksum[0] = s1;
+  aCksum[1] = s2;
+}
+
+/*
+** Record the rowid range [iLo,iHi] of page iPage in pC.
+*/
+static void
+cdcAddRange (CdcChanges * pC, sqlite3_int64 iLo, sqlite3_int64 iHi,
+             u32 iPage, int bEmpty)
+{
+  if (pC->nRange >= pC->nAlloc)
+    {
+      pC->nAlloc = pC->nAlloc * 2 + 100;
+      pC->aRange = sqlite3_realloc (pC->aRange,
+                                    pC->nAlloc * sizeof (pC->aRange[0]));
+      if (pC->aRange == 0)
+        runtimeError ("out of memory");
+    }
+  pC->aRange[pC->nRange].iLo = iLo;
+  pC->aRange[pC->nRange].iHi = iHi;
+  pC->aRange[pC->nRange].iPage = iPage;
+  pC->aRange[pC->nRange].bEmpty = bEmpty;
+  pC->nRange++;
+}
+
+/*
+** Decode the image a[] of page iPage, as found in a WAL frame.  Only
+** table b-tree leaf pages are of interest.  Anything that does not look
+** like a well formed b-tree page (overflow and freelist pages) is
+** ignored: a change to the content of a row always rewrites its leaf.
+*/
+static void
+cdcAddPage (CdcChanges * pC, u32 iPage, const u8 * a, u32 szPage)
+{
+  const u8 *aEnd = &a[szPage];
+  sqlite3_uint64 iLo, iHi, nPayload;
+  u32 nCell, iCell, iOff;
+  int n;
+
+  pC->nPage++;
+
+  /* Page 1 holds the schema, which is checked separately. */
+  if (iPage == 1)
+    return;
+
+  switch (a[0])
+    {
+    case 0x02:                 /* Index b-tree interior page */
+    case 0x0a:                 /* Index b-tree leaf page     */
+      pC->bIndex = 1;
+      return;
+    case 0x0d:                 /* Table b-tree leaf page     */
+      break;
+    default:
+      return;
+    }
+
+  nCell = get2byte (&a[3]);
+  iCell = 8 + nCell * 2;
+  if (iCell > szPage)
+    return;
+  if (nCell == 0)
+    {
+      cdcAddRange (pC, CDC_MINROWID, CDC_MAXROWID, iPage, 1);
+      return;
+    }
+
+  /* The cells are in rowid order, so only the first and last are read */
+  iOff = get2byte (&a[8]);
+  if (iOff < iCell || iOff >= szPage
+      || (n = getVarint (&a[iOff], aEnd, &nPayload)) == 0
+      || getVarint (&a[iOff + n], aEnd, &iLo) == 0)
+    return;
+  iOff = get2byte (&a[8 + (nCell - 1) * 2]);
+  if (iOff < iCell || iOff >= szPage
+      || (n = getVarint (&a[iOff], aEnd, &nPayload)) == 0
+      || getVarint (&a[iOff + n], aEnd, &iHi) == 0)
+    return;
+  if ((sqlite3_int64) iLo > (sqlite3_int64) iHi)
+    return;
+
+  cdcAddRange (pC, (sqlite3_int64) iLo, (sqlite3_int64) iHi, iPage, 0);
+}
+
+/*
+** A cursor over the frames of a WAL file with a given salt
+*/
+typedef struct WalCursor WalCursor;
+struct WalCursor
+{
+  FILE *in;                     /* The WAL file                           */
+  int bBig;                     /* True if checksums use big-endian words */
+  u32 szPage;                   /* Database page size                     */
+  u8 aSalt[8];                  /* Salt that every valid frame carries    */
+  u32 aCksum[2];                /* Checksum of the frames read so far     */
+  u32 iFrame;                   /* Number of frames read so far           */
+  u32 nCommit;                  /* Frames up to the last commit read      */
+  u32 aCommitCksum[2];          /* Value of aCksum[] after frame nCommit  */
+};
+
+/*
+** Read the WAL frames that follow frame pCur->iFrame, for as long as they
+** carry the salt of pCur and continue its checksum chain.  The pages are
+** decoded into pC, unless pC is NULL.  aFrame[] is scratch space for one
+** frame.  Return the number of commits read.
+*/
+static int
+walReadFrames (WalCursor * pCur, u8 * aFrame, CdcChanges * pC)
+{
+  u32 szFrame = WAL_FRAME_HDRSIZE + pCur->szPage;
+  int nTxn = 0;
+
+  if (fseek (pCur->in, WAL_HDRSIZE + (long) pCur->iFrame * szFrame, SEEK_SET))
+    return 0;
+  while (fread (aFrame, 1, szFrame, pCur->in) == szFrame)
+    {
+      u32 aCksum[2];
+      aCksum[0] = pCur->aCksum[0];
+      aCksum[1] = pCur->aCksum[1];
+      if (memcmp (&aFrame[8], pCur->aSalt, 8) != 0)
+        break;
+      walChecksum (pCur->bBig, aFrame, 8, aCksum);
+      walChecksum (pCur->bBig, &aFrame[WAL_FRAME_HDRSIZE], pCur->szPage,
+                   aCksum);
+      if (aCksum[0] != get4byte (&aFrame[16])
+          || aCksum[1] != get4byte (&aFrame[20]))
+        break;
+      pCur->aCksum[0] = aCksum[0];
+      pCur->aCksum[1] = aCksum[1];
+      pCur->iFrame++;
+
+      /* Frames past the last commit belong to a transaction that is
+       ** still being written.  Decoding them too does no harm.  */
+      if (pC)
+        cdcAddPage (pC, get4byte (aFrame), &aFrame[WAL_FRAME_HDRSIZE],
+                    pCur->szPage);
+
+      if (get4byte (&aFrame[4]) != 0)
+        {
+          pCur->nCommit = pCur->iFrame;
+          pCur->aCommitCksum[0] = aCksum[0];
+          pCur->aCommitCksum[1] = aCksum[1];
+          nTxn++;
+        }
+    }
+  return nTxn;
+}
+
+/*
+** Scan the WAL file zWal of the source database replicated by p for
+** transactions committed since the previous scan.  If pC is not NULL,
+** the pages written by those transactions are decoded into it.
+**
+** Return CDC_NEW if pC now describes every change made since the
+** previous scan, CDC_NONE if nothing was committed since then, or
+** CDC_FULL if the changes cannot be recovered from the WAL: there is
+** no WAL, p was never scanned before, or the frames that followed the
+** previous scan have been overwritten.  In every case p is left
+** pointing at the last commit of the WAL.
+**
+** Restarting the WAL changes its salt and rewrites it from the first
+** frame on.  After a single restart, the frames of the previous WAL
+** that were not scanned yet are usually still present past the end of
+** the new frames, so they are read from there.
+*/
+static int
+cdcScanWal (Replica * p, const char *zWal, CdcChanges * pC)
+{
+  u8 aHdr[WAL_HDRSIZE];
+  u8 aHdr2[WAL_HDRSIZE];
+  u8 *aFrame;
+  WalCursor cur;
+  int rc = CDC_FULL;
+  int nTxn = 0;
+
+  memset (&cur, 0, sizeof (cur));
+  cur.in = fopen (zWal, "rb");
+  if (cur.in == 0)
+    {
+      p->bWalValid = 0;
+      return CDC_FULL;
+    }
+
+  if (fread (aHdr, 1, sizeof (aHdr), cur.in) != sizeof (aHdr)
+      || (get4byte (aHdr) & 0xfffffffe) != 0x377f0682)
+    {
+      fclose (cur.in);
+      p->bWalValid = 0;
+      return CDC_FULL;
+    }
+  cur.bBig = get4byte (aHdr) & 1;
+  cur.szPage = get4byte (&aHdr[8]);
+  walChecksum (cur.bBig, aHdr, 24, cur.aCksum);
+  if (cur.aCksum[0] != get4byte (&aHdr[24])
+      || cur.aCksum[1] != get4byte (&aHdr[28])
+      || cur.szPage < 512 || cur.szPage > 65536
+      || (cur.szPage & (cur.szPage - 1)) != 0)
+    {
+      fclose (cur.in);
+      p->bWalValid = 0;
+      return CDC_FULL;
+    }
+  memcpy (cur.aSalt, &aHdr[16], 8);
+  cur.aCommitCksum[0] = cur.aCksum[0];
+  cur.aCommitCksum[1] = cur.aCksum[1];
+
+  aFrame = sqlite3_malloc (WAL_FRAME_HDRSIZE + cur.szPage);
+  if (aFrame == 0)
+    runtimeError ("out of memory");
+
+  if (p->bWalValid && p->aWalSalt[0] == get4byte (&aHdr[16])
+      && p->aWalSalt[1] == get4byte (&aHdr[20]))
+    {
+      /* Same WAL as last time: resume after the last frame scanned */
+      cur.iFrame = cur.nCommit = p->nWalFrame;
+      cur.aCksum[0] = cur.aCommitCksum[0] = p->aWalCksum[0];
+      cur.aCksum[1] = cur.aCommitCksum[1] = p->aWalCksum[1];
+      nTxn = walReadFrames (&cur, aFrame, pC);
+      rc = nTxn ? CDC_NEW : CDC_NONE;
+    }
+  else if (p->bWalValid && get4byte (&aHdr[16]) == p->aWalSalt[0] + 1)
+    {
+      /* Restarted once: read the tail of the previous WAL, then all of
+       ** the new one.  If the new frames reach the tail, it may have been
+       ** overwritten and nothing can be trusted.  */
+      WalCursor old = cur;
+      old.aSalt[0] = p->aWalSalt[0] >> 24;
+      old.aSalt[1] = p->aWalSalt[0] >> 16;
+      old.aSalt[2] = p->aWalSalt[0] >> 8;
+      old.aSalt[3] = p->aWalSalt[0];
+      old.aSalt[4] = p->aWalSalt[1] >> 24;
+      old.aSalt[5] = p->aWalSalt[1] >> 16;
+      old.aSalt[6] = p->aWalSalt[1] >> 8;
+      old.aSalt[7] = p->aWalSalt[1];
+      old.iFrame = old.nCommit = p->nWalFrame;
+      old.aCksum[0] = p->aWalCksum[0];
+      old.aCksum[1] = p->aWalCksum[1];
+      nTxn = walReadFrames (&old, aFrame, pC);
+      nTxn += walReadFrames (&cur, aFrame, pC);
+      if (cur.iFrame + 1 <= p->nWalFrame
+          && fseek (cur.in, 0, SEEK_SET) == 0
+          && fread (aHdr2, 1, sizeof (aHdr2), cur.in) == sizeof (aHdr2)
+          && memcmp (aHdr, aHdr2, sizeof (aHdr)) == 0)
+        rc = nTxn ? CDC_NEW : CDC_NONE;
+    }
+  else
+    walReadFrames (&cur, aFrame, 0);
+
+  if (rc == CDC_FULL && pC)
+    {
+      /* Nothing decoded so far can be used */
+      pC->nRange = 0;
+      pC->nPage = 0;
+      pC->bIndex = 0;
+    }
+
+  sqlite3_free (aFrame);
+  fclose (cur.in);
+
+  p->bWalValid = 1;
+  p->aWalSalt[0] = get4byte (&aHdr[16]);
+  p->aWalSalt[1] = get4byte (&aHdr[20]);
+  p->aWalCksum[0] = cur.aCommitCksum[0];
+  p->aWalCksum[1] = cur.aCommitCksum[1];
+  p->nWalFrame = cur.nCommit;
+  return rc;
+}
+
+/*
+** Begin the change-capture diff of the source database zDb replicated
+** by p.  Return CDC_NEW, CDC_NONE or CDC_FULL as for cdcScanWal().
+**
+** This must be called before the read transaction of the diff starts,
+** so that the snapshot of the diff includes every frame read here.
+** cdcPrepare() completes the job inside the read transaction.
+*/
+static int
+cdcBegin (Replica * p, const char *zDb, CdcChanges * pC)
+{
+  char *zWal;
+  int rc;
+
+  memset (pC, 0, sizeof (*pC));
+  zWal = sqlite3_mprintf ("%s-wal", zDb);
+  if (zWal == 0)
+    runtimeError ("out of memory");
+  rc = cdcScanWal (p, zWal, pC);
+  sqlite3_free (zWal);
+  return rc;
+}
+
+/*
+** Resolve the changes pC read by cdcBegin() against the schema of the
+** source database replicated by p and attached to w.db as "aux".  rc
+** is the value cdcBegin() returned, and the return value is the same
+** or CDC_FULL.  If CDC_NEW is returned, the temp.repqlite_cdc table
+** exists.
+*/
+static int
+cdcPrepare (Replica * p, CdcChanges * pC, int rc)
+{
+  sqlite3_stmt *pStmt;
+  int iSchema = -1;
+  int i, j;
+
+  /* Any schema change forces a full diff */
+  pStmt = db_prepare ("PRAGMA aux.schema_version");
+  if (SQLITE_ROW == sqlite3_step (pStmt))
+    iSchema = sqlite3_column_int (pStmt, 0);
+  sqlite3_finalize (pStmt);
+  if (iSchema != p->iSchema)
+    rc = CDC_FULL;
+  p->iSchema = iSchema;
+  if (rc != CDC_NEW)
+    return rc;
+
+  /* A range read from the root page of a table only applies to that
+   ** table.  Other leaf pages may belong to any table: which one would
+   ** take a walk of the interior pages of every b-tree.  Their ranges
+   ** are applied to all tables instead, see cdcPrepareTable(). */
+  pStmt = db_prepare ("SELECT rootpage FROM aux.sqlite_master"
+                      " WHERE type='table' ORDER BY rootpage");
+  while (SQLITE_ROW == sqlite3_step (pStmt))
+    {
+      pC->aRoot = sqlite3_realloc (pC->aRoot,
+                                   (pC->nRoot + 1) * sizeof (pC->aRoot[0]));
+      if (pC->aRoot == 0)
+        runtimeError ("out of memory");
+      pC->aRoot[pC->nRoot++] = (u32) sqlite3_column_int64 (pStmt, 0);
+    }
+  sqlite3_finalize (pStmt);
+
+  for (i = j = 0; i < pC->nRange; i++)
+    {
+      CdcRange r = pC->aRange[i];
+      int lwr = 0, upr = pC->nRoot - 1, bRoot = 0;
+      while (lwr <= upr && !bRoot)
+        {
+          int mid = (lwr + upr) / 2;
+          if (pC->aRoot[mid] == r.iPage)
+            bRoot = 1;
+          else if (pC->aRoot[mid] < r.iPage)
+            lwr = mid + 1;
+          else
+            upr = mid - 1;
+        }
+      if (!bRoot)
+        {
+          /* Only the root page of an empty table is an empty leaf */
+          if (r.bEmpty)
+            continue;
+          r.iPage = 0;          /* Unattributed: any table */
+        }
+      pC->aRange[j++] = r;
+    }
+  pC->nRange = j;
+
+  if (sqlite3_exec (w.db, "CREATE TEMP TABLE IF NOT EXISTS"
+                    " repqlite_cdc(lo INTEGER, hi INTEGER)", 0, 0, 0))
+    runtimeError ("cannot create temp.repqlite_cdc: %s",
+                  sqlite3_errmsg (w.db));
+  return CDC_NEW;
+}
+
+/*
+** Free the memory held by a CdcChanges object
+*/
+static void
+cdcEnd (CdcChanges * pC)
+{
+  sqlite3_free (pC->aRange);
+  sqlite3_free (pC->aRoot);
+  memset (pC, 0, sizeof (*pC));
+}
+
+/*
+** qsort() comparison function for CdcRange objects
+*/
+static int
+cdcRangeCmp (const void *a, const void *b)
+{
+  const CdcRange *p1 = (const CdcRange *) a;
+  const CdcRange *p2 = (const CdcRange *) b;
+  return p1->iLo < p2->iLo ? -1 : p1->iLo > p2->iLo;
+}
+
+/*
+** Fill temp.repqlite_cdc with the rowid ranges of table zTab that may
+** hold changes.  Return 1 if the diff can be restricted to those ranges,
+** 0 if the whole table must be compared, or -1 if the table did not
+** change at all.
+*/
+static int
+cdcPrepareTable (const char *zTab, CdcChanges * pC)
+{
+  char *zId;                    /* Name of the table, quoted for SQL  */
+  char **az;                    /* Columns of the table in aux        */
+  int nPk;                      /* Number of primary key columns      */
+  int bRowid;                   /* True if the PK is an implicit rowid */
+  int bPkIndex = 0;             /* True if the PK has its own index   */
+  u32 iRoot = 0;                /* Root page of the table             */
+  CdcRange *aR;                 /* Widened ranges of the table        */
+  int nR = 0;                   /* Number of entries in aR[]          */
+  int i, j;
+  sqlite3_stmt *pStmt;
+
+  if (g.bSchemaPK || g.rbuTable)
+    return 0;
+  if (sqlite3_table_column_metadata (w.db, "main", zTab, 0, 0, 0, 0, 0, 0)
+      || sqlite3_table_column_metadata (w.db, "aux", zTab, 0, 0, 0, 0, 0, 0))
+    return 0;
+
+  /* Only tables keyed by their rowid are restricted.  A WITHOUT ROWID
+   ** table lives in an index b-tree and is compared whole, unless no
+   ** index page changed at all.  */
+  az = columnNames ("aux", zTab, &nPk, &bRowid);
+  if (az == 0)
+    return 0;
+  pStmt = db_cprepare ("PRAGMA aux.index_list=%Q", zTab);
+  while (SQLITE_ROW == sqlite3_step (pStmt))
+    if (sqlite3_stricmp
+        ((const char *) sqlite3_column_text (pStmt, 3), "pk") == 0)
+      bPkIndex = 1;
+  db_crelease (pStmt);
+  if (!bRowid && bPkIndex)
+    {
+      namelistFree (az);
+      return pC->bIndex ? 0 : -1;
+    }
+
+  pStmt = db_cprepare ("SELECT rootpage FROM aux.sqlite_master"
+                       " WHERE type='table' AND name=%Q", zTab);
+  if (SQLITE_ROW == sqlite3_step (pStmt))
+    iRoot = (u32) sqlite3_column_int64 (pStmt, 0);
+  db_crelease (pStmt);
+
+  /* Widen every range to the nearest surrounding rows of the source */
+  aR = sqlite3_malloc ((pC->nRange + 1) * sizeof (aR[0]));
+  if (aR == 0)
+    runtimeError ("out of memory");
+  zId = safeId (zTab);
+  pStmt = db_cprepare ("SELECT (SELECT max(%s) FROM aux.%s WHERE %s<?1),"
+                       " (SELECT min(%s) FROM aux.%s WHERE %s>?2)",
+                       az[0], zId, az[0], az[0], zId, az[0]);
+  /* The ranges of leaf pages that are not the root of a table are not
+   ** known to belong to zTab, and are diffed in every table.  This is an
+   ** over-approximation: a write to one table also diffs the rows of the
+   ** other tables whose rowids fall in the ranges it wrote, but no change
+   ** is missed.  */
+  for (i = 0; i < pC->nRange; i++)
+    {
+      const CdcRange *pR = &pC->aRange[i];
+      if (pR->iPage != 0 && pR->iPage != iRoot)
+        continue;
+      aR[nR].iLo = CDC_MINROWID;
+      aR[nR].iHi = CDC_MAXROWID;
+      if (!pR->bEmpty)
+        {
+          sqlite3_bind_int64 (pStmt, 1, pR->iLo);
+          sqlite3_bind_int64 (pStmt, 2, pR->iHi);
+          if (SQLITE_ROW == sqlite3_step (pStmt))
+            {
+              if (sqlite3_column_type (pStmt, 0) != SQLITE_NULL)
+                aR[nR].iLo = sqlite3_column_int64 (pStmt, 0);
+              if (sqlite3_column_type (pStmt, 1) != SQLITE_NULL)
+                aR[nR].iHi = sqlite3_column_int64 (pStmt, 1);
+            }
+          sqlite3_reset (pStmt);
+        }
+      nR++;
+    }
+  db_crelease (pStmt);
+  sqlite3_free (zId);
+  namelistFree (az);
+
+  /* Merge overlapping ranges, so that no row is diffed twice */
+  qsort (aR, nR, sizeof (aR[0]), cdcRangeCmp);
+  for (i = 0, j = 1; j < nR; j++)
+    {
+      if (aR[j].iLo <= aR[i].iHi)
+        {
+          if (aR[j].iHi > aR[i].iHi)
+            aR[i].iHi = aR[j].iHi;
+        }
+      else
+        aR[++i] = aR[j];
+    }
+  if (nR > 0)
+    nR = i + 1;
+
+  sqlite3_exec (w.db, "DELETE FROM temp.repqlite_cdc", 0, 0, 0);
+  pStmt = db_cprepare ("INSERT INTO temp.repqlite_cdc VALUES(?1, ?2)");
+  for (i = 0; i < nR; i++)
+    {
+      sqlite3_bind_int64 (pStmt, 1, aR[i].iLo);
+      sqlite3_bind_int64 (pStmt, 2, aR[i].iHi);
+      sqlite3_step (pStmt);
+      sqlite3_reset (pStmt);
+    }
+  db_crelease (pStmt);
+  sqlite3_free (aR);
+
+  return nR ? 1 : -1;
+}
+
+/*
+** Per-table change detection.
+**
+** SQLite keeps no page LSN or per-table modification counter, so the
+** cheapest way to tell that a table did not change is a hash of its
+** content.  tableHash() computes it with one sequential scan of the
+** source table, and the result is kept in the Replica object.  As long
+** as the backup is only written by repqlite, a table whose hash is the
+** same as after the previous replication needs no diff at all, which
+** saves the scan of the backup and the join of the two.
+**
+** The hash of a table is the sum of the hashes of its rows, so that it
+** does not depend on the order of the scan, mixed with the row count
+** and the hash of the schema of the table and its indexes.
+*/
+static u64
+hashMix (u64 h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static u64
+hashBytes (u64 h, const u8 * a, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    h = (h ^ a[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+/*
+** Hash an sqlite3_value, including its type
+*/
+static u64
+hashValue (sqlite3_value * pVal)
+{
+  u64 h = 0xcbf29ce484222325ULL ^ (u64) sqlite3_value_type (pVal);
+  switch (sqlite3_value_type (pVal))
+    {
+    case SQLITE_INTEGER:
+      {
+        sqlite3_int64 iVal = sqlite3_value_int64 (pVal);
+        h = hashBytes (h, (const u8 *) &iVal, sizeof (iVal));
+        break;
+      }
+    case SQLITE_FLOAT:
+      {
+        double rVal = sqlite3_value_double (pVal);
+        h = hashBytes (h, (const u8 *) &rVal, sizeof (rVal));
+        break;
+      }
+    case SQLITE_TEXT:
+      h = hashBytes (h, sqlite3_value_text (pVal), sqlite3_value_bytes (pVal));
+      break;
+    case SQLITE_BLOB:
+      h = hashBytes (h, sqlite3_value_blob (pVal), sqlite3_value_bytes (pVal));
+      break;
+    }
+  return hashMix (h);
+}
+
+/*
+** Context of the repqlite_hash() aggregate
+*/
+typedef struct HashCtx HashCtx;
+struct HashCtx
+{
+  u64 sum;                      /* Sum of the hashes of all rows  */
+  u64 n;                        /* Number of rows                 */
+};
+
+/*
+** Implementation of the repqlite_hash(X,...) aggregate SQL function
+*/
+static void
+hashStep (sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+  HashCtx *p = sqlite3_aggregate_context (context, sizeof (*p));
+  u64 h = 0;
+  int i;
+  if (p == 0)
+    return;
+  for (i = 0; i < argc; i++)
+    h = hashMix (h + hashValue (argv[i]));
+  p->sum += h;
+  p->n++;
+}
+
+static void
+hashFinal (sqlite3_context * context)
+{
+  HashCtx *p = sqlite3_aggregate_context (context, 0);
+  u64 h = p ? hashMix (p->sum ^ hashMix (p->n)) : 0;
+  sqlite3_result_int64 (context, (sqlite3_int64) h);
+}
+
+/*
+** Return the content hash of table zTab of the source database, or 0
+** if it cannot be computed.
+*/
+static u64
+tableHash (const char *zTab)
+{
+  char *zId;
+  char **az;
+  int nPk, i;
+  u64 h = 0;
+  Str sql;
+  sqlite3_stmt *pStmt;
+
+  if (sqlite3_table_column_metadata (w.db, "aux", zTab, 0, 0, 0, 0, 0, 0))
+    return 0;
+  az = columnNames ("aux", zTab, &nPk, 0);
+  if (az == 0)
+    return 0;
+
+  zId = safeId (zTab);
+  strInit (&sql);
+  strPrintf (&sql, "SELECT repqlite_hash(");
+  for (i = 0; az[i]; i++)
+    strPrintf (&sql, "%s%s", i ? ", " : "", az[i]);
+  strPrintf (&sql, ") FROM aux.%s", zId);
+  pStmt = db_cprepare ("%s", sql.z);
+  if (SQLITE_ROW == sqlite3_step (pStmt))
+    h = (u64) sqlite3_column_int64 (pStmt, 0);
+  db_crelease (pStmt);
+  strFree (&sql);
+  sqlite3_free (zId);
+  namelistFree (az);
+
+  pStmt = db_cprepare ("SELECT repqlite_hash(type, name, sql)"
+                       "  FROM aux.sqlite_master WHERE tbl_name=%Q", zTab);
+  if (SQLITE_ROW == sqlite3_step (pStmt))
+    h = hashMix (h ^ (u64) sqlite3_column_int64 (pStmt, 0));
+  db_crelease (pStmt);
+
+  return h ? h : 1;
+}
+
+/*
+** Return the hash of table zTab stored in p, or 0 if there is none
+*/
+static u64
+replicaGetHash (Replica * p, const char *zTab)
+{
+  int i;
+  for (i = 0; i < p->nHash; i++)
+    if (strcmp (p->aHash[i].zTab, zTab) == 0)
+      return p->aHash[i].h;
+  return 0;
+}
+
+/*
+** Store h as the hash of table zTab in p
+*/
+static void
+replicaSetHash (Replica * p, const char *zTab, u64 h)
+{
+  int i;
+  for (i = 0; i < p->nHash; i++)
+    if (strcmp (p->aHash[i].zTab, zTab) == 0)
+      {
+        p->aHash[i].h = h;
+        return;
+      }
+  if (h == 0)
+    return;
+  p->aHash = sqlite3_realloc (p->aHash, (p->nHash + 1) * sizeof (p->aHash[0]));
+  if (p->aHash == 0)
+    runtimeError ("out of memory");
+  p->aHash[p->nHash].zTab = sqlite3_mprintf ("%s", zTab);
+  if (p->aHash[p->nHash].zTab == 0)
+    runtimeError ("out of memory");
+  p->aHash[p->nHash++].h = h;
+}
+
+/*
+** Forget everything known about the source database of p.  This is
+** done when the backup could not be patched, so that the next event
+** compares both databases again in full.
+*/
+static void
+replicaReset (Replica * p)
+{
+  int i;
+  p->bWalValid = 0;
+  p->bCounterValid = 0;
+  for (i = 0; i < p->nHash; i++)
+    p->aHash[i].h = 0;
+}
+
+/*
+** Read the first n bytes of the source database zDb of p into a[].
+** Return the number of bytes read.
+**
+** While p has connections open, the file is read through the handle of
+** the connection: closing a descriptor of the file opened elsewhere in
+** the process would release the POSIX locks SQLite holds on it.  Another
+** process could then believe it is the last one using the database, and
+** checkpoint and delete a WAL that p->db still reads from, which leaves
+** p->db diffing an old snapshot of the source from then on.
+*/
+static size_t
+sourceRead (Replica * p, const char *zDb, u8 * a, size_t n)
+{
+  sqlite3_file *pFile = 0;
+  FILE *in;
+
+  if (p->db
+      && sqlite3_file_control (p->db, "aux", SQLITE_FCNTL_FILE_POINTER,
+                               &pFile) == SQLITE_OK
+      && pFile && pFile->pMethods)
+    return pFile->pMethods->xRead (pFile, a, (int) n, 0) == SQLITE_OK ? n : 0;
+  in = fopen (zDb, "rb");
+  if (in == 0)
+    return 0;
+  n = fread (a, 1, n, in);
+  fclose (in);
+  return n;
+}
+
+/*
+** Return false if the source database zDb of p certainly did not change
+** since the previous call.  This only reads the database header: in
+** rollback-journal mode, every transaction increments the file change
+** counter at offset 24.  In WAL mode, the counter is not maintained and
+** the WAL is checked for new commits instead, unless --cdc is used, in
+** which case cdcBegin() does it.
+*/
+static int
+sourceChanged (Replica * p, const char *zDb)
+{
+  u8 aHdr[28];
+  u32 iCounter;
+
+  if (sourceRead (p, zDb, aHdr, sizeof (aHdr)) != sizeof (aHdr))
+    {
+      p->bCounterValid = 0;
+      return 1;
+    }
+
+  if (aHdr[18] == 2 || aHdr[19] == 2)
+    {
+      char *zWal;
+      int rc;
+      p->bCounterValid = 0;
+      if (g.bCdc)
+        return 1;
+      zWal = sqlite3_mprintf ("%s-wal", zDb);
+      if (zWal == 0)
+        runtimeError ("out of memory");
+      rc = cdcScanWal (p, zWal, 0);
+      sqlite3_free (zWal);
+      return rc != CDC_NONE;
+    }
+
+  p->bWalValid = 0;
+  iCounter = get4byte (&aHdr[24]);
+  if (p->bCounterValid && p->iCounter == iCounter)
+    return 0;
+  p->bCounterValid = 1;
+  p->iCounter = iCounter;
+  return 1;
+}
+
+/*
+** Reader of the statements of an SQL text patch.
+**
+** The patch is read with read(2) from the file descriptor of a stream
+** with nothing buffered, so that a pipe hands out what it has at once.
+** It is read in chunks of PATCH_CHUNK bytes into a buffer that
+** only grows to hold the largest statement, and every statement is
+** handed out in place, terminated by a zero byte written over the
+** character that follows it.  patcherBind() decodes the literals in
+** place, so the buffer must be writable and private.
+**
+** Statements end at a semicolon outside of string literals, quoted
+** identifiers and comments.  The body of a CREATE TRIGGER statement is
+** left to sqlite3_complete().  The whitespace and comments before a
+** statement are skipped, and an unterminated statement at the end of
+** the patch is dropped.
+*/
+#define PATCH_CHUNK (1024 * 1024)       /* Bytes read at once */
+
+typedef struct PatchReader PatchReader;
+struct PatchReader
+{
+  FILE *in;                     /* The patch journal                      */
+  long nLeft;                   /* Bytes of the patch not read yet        */
+  char *aBuf;                   /* Statements read from the patch         */
+  size_t nAlloc;                /* Allocated size of aBuf[]               */
+  size_t nBuf;                  /* Bytes in aBuf[]                        */
+  size_t iStart;                /* Offset of the next statement           */
+  size_t iScan;                 /* Offset up to which it was lexed        */
+  int eState;                   /* Lexer state at iScan, a LEX_ value     */
+  size_t iSaved;                /* Offset of the byte overwritten by 0    */
+  char cSaved;                  /* Its value                              */
+};
+
+/*
+** Lexer states of PatchReader.eState
+*/
+#define LEX_SQL      0          /* Outside of any literal or comment */
+#define LEX_STRING   1          /* In a '...' literal                */
+#define LEX_DQUOTE   2          /* In a "..." identifier             */
+#define LEX_BQUOTE   3          /* In a `...` identifier             */
+#define LEX_BRACKET  4          /* In a [...] identifier             */
+#define LEX_LINE     5          /* In a -- comment                   */
+#define LEX_BLOCK    6          /* In a C-style comment              */
+
+/*
+** Prepare r to read the nByte bytes of patch at the position of in
+*/
+static void
+patchReaderInit (PatchReader * r, FILE * in, long nByte)
+{
+  memset (r, 0, sizeof (*r));
+  r->in = in;
+  r->nLeft = nByte;
+}
+
+/*
+** Release the buffer of r
+*/
+static void
+patchReaderFree (PatchReader * r)
+{
+  sqlite3_free (r->aBuf);
+  r->aBuf = 0;
+}
+
+/*
+** Read the next chunk of the patch into r, keeping the statement being
+** lexed.  Return false at the end of the patch.
+*/
+static int
+patchReaderFill (PatchReader * r)
+{
+  size_t n;
+  ssize_t nRead;
+
+  if (r->nLeft <= 0)
+    return 0;
+  if (r->iStart > 0)
+    {
+      memmove (r->aBuf, &r->aBuf[r->iStart], r->nBuf - r->iStart);
+      r->nBuf -= r->iStart;
+      r->iScan -= r->iStart;
+      r->iStart = 0;
+    }
+  if (r->nAlloc - r->nBuf < PATCH_CHUNK + 1)
+    {
+      size_t nNew = r->nAlloc * 2 > r->nBuf + PATCH_CHUNK + 1
+        ? r->nAlloc * 2 : r->nBuf + PATCH_CHUNK + 1;
+      char *aNew = sqlite3_realloc64 (r->aBuf, nNew);
+      if (aNew == 0)
+        runtimeError ("out of memory");
+      r->aBuf = aNew;
+      r->nAlloc = nNew;
+    }
+  n = r->nAlloc - r->nBuf - 1;
+  if (n > (size_t) r->nLeft)
+    n = r->nLeft;
+  do
+    nRead = read (fileno (r->in), &r->aBuf[r->nBuf], n);
+  while (nRead < 0 && errno == EINTR);
+  if (nRead <= 0)
+    {
+      r->nLeft = 0;
+      return 0;
+    }
+  n = nRead;
+  r->nBuf += n;
+  r->nLeft -= n;
+  return 1;
+}
+
+/*
+** Return the offset of the first byte of z[0..n-1] that is not
+** whitespace or part of a comment
+*/
+static size_t
+patchReaderSkip (const char *z, size_t n)
+{
+  size_t i = 0;
+  while (i < n)
+    {
+      if (isspace ((unsigned char) z[i]))
+        i++;
+      else if (z[i] == '-' && i + 1 < n && z[i + 1] == '-')
+        {
+          while (i < n && z[i] != '\n')
+            i++;
+        }
+      else if (z[i] == '/' && i + 1 < n && z[i + 1] == '*')
+        {
+          for (i += 2; i + 1 < n && (z[i] != '*' || z[i + 1] != '/'); i++);
+          i += 2;
+        }
+      else
+        break;
+    }
+  return i < n ? i : n;
+}
+
+/*
+** Return the next statement of the patch of r, zero-terminated and
+** ending with its semicolon, or NULL at the end of the patch.  The
+** statement is valid until the next call.
+*/
+static char *
+patchReaderNext (PatchReader * r)
+{
+  if (r->iSaved)
+    {
+      r->aBuf[r->iSaved] = r->cSaved;
+      r->iSaved = 0;
+    }
+
+  for (;;)
+    {
+      size_t i;
+      for (i = r->iScan; i < r->nBuf; i++)
+        {
+          char c = r->aBuf[i];
+          int bMore = i + 1 < r->nBuf || r->nLeft > 0;
+          char cNext = i + 1 < r->nBuf ? r->aBuf[i + 1] : 0;
+
+          switch (r->eState)
+            {
+            case LEX_SQL:
+              if (c == '\'')
+                r->eState = LEX_STRING;
+              else if (c == '"')
+                r->eState = LEX_DQUOTE;
+              else if (c == '`')
+                r->eState = LEX_BQUOTE;
+              else if (c == '[')
+                r->eState = LEX_BRACKET;
+              else if ((c == '-' || c == '/') && i + 1 == r->nBuf && bMore)
+                break;          /* Read the next byte first */
+              else if (c == '-' && cNext == '-')
+                r->eState = LEX_LINE;
+              else if (c == '/' && cNext == '*')
+                {
+                  r->eState = LEX_BLOCK;
+                  i++;
+                }
+              else if (c == ';')
+                {
+                  size_t iFirst = r->iStart;
+                  char *z;
+
+                  iFirst += patchReaderSkip (&r->aBuf[iFirst], i - iFirst);
+                  r->iSaved = i + 1;
+                  r->cSaved = r->aBuf[i + 1];
+                  r->aBuf[i + 1] = 0;
+                  z = &r->aBuf[iFirst];
+                  if (sqlite3_strnicmp (z, "CREATE", 6) == 0
+                      && !sqlite3_complete (z))
+                    {
+                      r->aBuf[i + 1] = r->cSaved;
+                      r->iSaved = 0;
+                      continue;
+                    }
+                  r->iStart = r->iScan = i + 1;
+                  if (iFirst == i)
+                    {           /* Empty statement */
+                      r->aBuf[i + 1] = r->cSaved;
+                      r->iSaved = 0;
+                      continue;
+                    }
+                  return z;
+                }
+              continue;
+            case LEX_STRING:
+              if (c == '\'')
+                r->eState = LEX_SQL;
+              continue;
+            case LEX_DQUOTE:
+              if (c == '"')
+                r->eState = LEX_SQL;
+              continue;
+            case LEX_BQUOTE:
+              if (c == '`')
+                r->eState = LEX_SQL;
+              continue;
+            case LEX_BRACKET:
+              if (c == ']')
+                r->eState = LEX_SQL;
+              continue;
+            case LEX_LINE:
+              if (c == '\n')
+                r->eState = LEX_SQL;
+              continue;
+            case LEX_BLOCK:
+              if (c == '*' && i + 1 == r->nBuf && bMore)
+                break;
+              if (c == '*' && cNext == '/')
+                {
+                  r->eState = LEX_SQL;
+                  i++;
+                }
+              continue;
+            }
+          break;
+        }
+      r->iScan = i;
+      if (!patchReaderFill (r))
+        return 0;
+    }
+}
+
+/*
+** The apply engine.
+**
+** The statements of a patch are executed in a single transaction, or in
+** one transaction every g.nBatch statements with --batch.  Most of them
+** are INSERT, UPDATE and DELETE statements that only differ by their
+** literal values.  Their literals are replaced by SQL parameters, and
+** the resulting "shape" is prepared once and then bound and stepped for
+** every statement of the same shape.  Other statements are run through
+** sqlite3_exec().
+*/
+#define PATCH_NHASH    251      /* Number of hash buckets of the cache */
+#define PATCH_MAXSTMT  1000     /* Max prepared statements in the cache */
+
+/*
+** A literal value of a patch statement
+*/
+typedef struct PatchLit PatchLit;
+struct PatchLit
+{
+  int eType;                    /* SQLITE_INTEGER, _FLOAT, _TEXT or _BLOB */
+  int iStart;                   /* Offset of the literal in the statement */
+  int nByte;                    /* Length of the literal                  */
+};
+
+/*
+** A cached prepared statement.  If pStmt is NULL, statements of this
+** shape cannot be bound and are executed as they are.
+*/
+typedef struct PatchStmt PatchStmt;
+struct PatchStmt
+{
+  char *zShape;                 /* SQL text with literals replaced by "?" */
+  unsigned int h;               /* Hash of zShape                         */
+  sqlite3_stmt *pStmt;          /* The statement prepared from zShape     */
+  PatchStmt *pNext;             /* Next entry in the same hash bucket     */
+};
+
+typedef struct Patcher Patcher;
+struct Patcher
+{
+  sqlite3 *db;                  /* Database being patched                 */
+  PatchStmt *aHash[PATCH_NHASH];        /* Cache of prepared statements    */
+  int nStmt;                    /* Number of entries in the cache         */
+  Str shape;                    /* Shape of the current statement         */
+  PatchLit *aLit;               /* Literals of the current statement      */
+  int nLit;                     /* Number of entries in aLit[]            */
+  int nAlloc;                   /* Allocated size of aLit[]               */
+  int nApplied;                 /* Number of statements applied so far    */
+  int rc;                       /* First error, or SQLITE_OK              */
+};
+
+/*
+** Finalize and forget all cached statements of p
+*/
+static void
+patcherFlush (Patcher * p)
+{
+  int i;
+  for (i = 0; i < PATCH_NHASH; i++)
+    while (p->aHash[i])
+      {
+        PatchStmt *pEntry = p->aHash[i];
+        p->aHash[i] = pEntry->pNext;
+        sqlite3_finalize (pEntry->pStmt);
+        sqlite3_free (pEntry->zShape);
+        sqlite3_free (pEntry);
+      }
+  p->nStmt = 0;
+}
+
+static void
+patcherAddLit (Patcher * p, int eType, int iStart, int nByte)
+{
+  if (p->nLit >= p->nAlloc)
+    {
+      p->nAlloc = p->nAlloc * 2 + 16;
+      p->aLit = sqlite3_realloc (p->aLit, p->nAlloc * sizeof (p->aLit[0]));
+      if (p->aLit == 0)
+        runtimeError ("out of memory");
+    }
+  p->aLit[p->nLit].eType = eType;
+  p->aLit[p->nLit].iStart = iStart;
+  p->aLit[p->nLit].nByte = nByte;
+  p->nLit++;
+}
+
+/*
+** Compute the shape of statement z into p->shape and its literals into
+** p->aLit[].  Return 0 if z is not a statement that can be bound.
+*/
+static int
+patcherShape (Patcher * p, const char *z)
+{
+  int i = 0, j, c;
+  char cPrev = 0;               /* Last significant character copied */
+
+  p->shape.nUsed = 0;
+  p->nLit = 0;
+  while (isspace ((unsigned char) z[i]))
+    i++;
+  if (sqlite3_strnicmp (&z[i], "INSERT", 6) != 0
+      && sqlite3_strnicmp (&z[i], "UPDATE", 6) != 0
+      && sqlite3_strnicmp (&z[i], "DELETE", 6) != 0
+      && sqlite3_strnicmp (&z[i], "REPLACE", 7) != 0)
+    return 0;
+
+  while ((c = z[i]) != 0)
+    {
+      j = i + 1;
+      if (c == '\'')
+        { /* String literal */
+          for (; z[j]; j++)
+            if (z[j] == '\'')
+              {
+                if (z[j + 1] != '\'')
+                  break;
+                j++;
+              }
+          if (z[j] == 0)
+            return 0;
+          patcherAddLit (p, SQLITE_TEXT, i + 1, j - i - 1);
+          strPrintf (&p->shape, "?");
+          i = j + 1;
+          cPrev = '?';
+          continue;
+        }
+      if ((c == 'x' || c == 'X') && z[j] == '\'')
+        { /* Blob literal */
+          for (j++; isxdigit ((unsigned char) z[j]); j++);
+          if (z[j] != '\'' || (j - i) % 2)
+            return 0;
+          patcherAddLit (p, SQLITE_BLOB, i + 2, j - i - 2);
+          strPrintf (&p->shape, "?");
+          i = j + 1;
+          cPrev = '?';
+          continue;
+        }
+      if (isalpha (c) || c == '_')
+        { /* Keyword or identifier */
+          while (isalnum ((unsigned char) z[j]) || z[j] == '_' || z[j] == '$')
+            j++;
+          if ((j - i == 5 && (sqlite3_strnicmp (&z[i], "ORDER", 5) == 0
+                              || sqlite3_strnicmp (&z[i], "LIMIT", 5) == 0
+                              || sqlite3_strnicmp (&z[i], "GROUP", 5) == 0)))
+            return 0;
+          strPrintf (&p->shape, "%.*s", j - i, &z[i]);
+          i = j;
+          cPrev = 'a';
+          continue;
+        }
+      if (c == '"' || c == '`' || c == '[')
+        { /* Quoted identifier */
+          char cEnd = c == '[' ? ']' : c;
+          for (; z[j]; j++)
+            if (z[j] == cEnd)
+              {
+                if (z[j + 1] != cEnd || cEnd == ']')
+                  break;
+                j++;
+              }
+          if (z[j] == 0)
+            return 0;
+          strPrintf (&p->shape, "%.*s", j - i + 1, &z[i]);
+          i = j + 1;
+          cPrev = 'a';
+          continue;
+        }
+      if (isdigit (c) || (c == '.' && isdigit ((unsigned char) z[j]))
+          || (c == '-' && (isdigit ((unsigned char) z[j]) || z[j] == '.')
+              && (cPrev == '(' || cPrev == ',' || cPrev == '=')))
+        { /* Numeric literal, with its sign when it is a unary minus */
+          int eType = SQLITE_INTEGER;
+          for (j = i + (c == '-'); isdigit ((unsigned char) z[j]); j++);
+          if (z[j] == '.')
+            for (eType = SQLITE_FLOAT, j++; isdigit ((unsigned char) z[j]);
+                 j++);
+          if (z[j] == 'e' || z[j] == 'E')
+            {
+              eType = SQLITE_FLOAT;
+              j++;
+              if (z[j] == '+' || z[j] == '-')
+                j++;
+              if (!isdigit ((unsigned char) z[j]))
+                return 0;
+              while (isdigit ((unsigned char) z[j]))
+                j++;
+            }
+          if (isalnum ((unsigned char) z[j]) || z[j] == '_' || z[j] == '.')
+            return 0;
+          if (eType == SQLITE_INTEGER && j - i >= 19)
+            {
+              /* Integers that overflow 64 bits are real numbers */
+              errno = 0;
+              strtoll (&z[i], 0, 10);
+              if (errno == ERANGE)
+                eType = SQLITE_FLOAT;
+            }
+          patcherAddLit (p, eType, i, j - i);
+
+          /* Real numbers are converted by SQLite itself, which does not
+           ** always round the same way as strtod() */
+          strPrintf (&p->shape, eType == SQLITE_FLOAT ? "CAST(? AS REAL)" : "?");
+          i = j;
+          cPrev = '?';
+          continue;
+        }
+      if (c == '-' && z[j] == '-')
+        { /* Comment up to the end of the line */
+          while (z[j] && z[j] != '\n')
+            j++;
+          i = j;
+          continue;
+        }
+      if (c == '/' && z[j] == '*')
+        { /* Block comment */
+          for (j++; z[j] && (z[j] != '*' || z[j + 1] != '/'); j++);
+          i = z[j] ? j + 2 : j;
+          continue;
+        }
+      if (!isspace (c))
+        cPrev = c;
+      strPrintf (&p->shape, "%c", c);
+      i = j;
+    }
+  return p->shape.z != 0;
+}
+
+/*
+** Bind the literals of p->aLit[] found in statement z to pStmt.  The
+** text of z is modified in place.
+*/
+static void
+patcherBind (Patcher * p, sqlite3_stmt * pStmt, char *z)
+{
+  int i, j, k;
+  for (i = 0; i < p->nLit; i++)
+    {
+      PatchLit *pLit = &p->aLit[i];
+      char *zLit = &z[pLit->iStart];
+      switch (pLit->eType)
+        {
+        case SQLITE_INTEGER:
+          sqlite3_bind_int64 (pStmt, i + 1, strtoll (zLit, 0, 10));
+          break;
+        case SQLITE_FLOAT:
+          sqlite3_bind_text (pStmt, i + 1, zLit, pLit->nByte, SQLITE_STATIC);
+          break;
+        case SQLITE_TEXT:
+          /* Unescape '' in place */
+          for (j = k = 0; j < pLit->nByte; j++, k++)
+            {
+              zLit[k] = zLit[j];
+              if (zLit[j] == '\'')
+                j++;
+            }
+          sqlite3_bind_text (pStmt, i + 1, zLit, k, SQLITE_STATIC);
+          break;
+        case SQLITE_BLOB:
+          /* Decode the hex digits in place */
+          for (j = k = 0; j < pLit->nByte; j += 2, k++)
+            {
+              int hi = zLit[j], lo = zLit[j + 1];
+              hi = isdigit (hi) ? hi - '0' : (hi | 0x20) - 'a' + 10;
+              lo = isdigit (lo) ? lo - '0' : (lo | 0x20) - 'a' + 10;
+              zLit[k] = (char) ((hi << 4) | lo);
+            }
+          sqlite3_bind_blob (pStmt, i + 1, zLit, k, SQLITE_STATIC);
+          break;
+        }
+    }
+}
+
+/*
+** Return the cached statement of the shape in p->shape, preparing it if
+** it is not in the cache yet.
+*/
+static PatchStmt *
+patcherFind (Patcher * p)
+{
+  unsigned int h = 0;
+  int i;
+  PatchStmt *pEntry;
+
+  for (i = 0; i < p->shape.nUsed; i++)
+    h = (h ^ (unsigned char) p->shape.z[i]) * 16777619u;
+  for (pEntry = p->aHash[h % PATCH_NHASH]; pEntry; pEntry = pEntry->pNext)
+    if (pEntry->h == h && strcmp (pEntry->zShape, p->shape.z) == 0)
+      return pEntry;
+
+  if (p->nStmt >= PATCH_MAXSTMT)
+    patcherFlush (p);
+  pEntry = sqlite3_malloc (sizeof (*pEntry));
+  if (pEntry == 0)
+    runtimeError ("out of memory");
+  pEntry->zShape = sqlite3_mprintf ("%s", p->shape.z);
+  if (pEntry->zShape == 0)
+    runtimeError ("out of memory");
+  pEntry->h = h;
+  pEntry->pStmt = 0;
+  {
+    const char *zTail = 0;
+    if (sqlite3_prepare_v2 (p->db, pEntry->zShape, -1, &pEntry->pStmt,
+                            &zTail) != SQLITE_OK
+        || pEntry->pStmt == 0
+        || sqlite3_bind_parameter_count (pEntry->pStmt) != p->nLit
+        || zTail[strspn (zTail, " \t\r\n;")] != 0)
+      {
+        sqlite3_finalize (pEntry->pStmt);
+        pEntry->pStmt = 0;
+      }
+  }
+  pEntry->pNext = p->aHash[h % PATCH_NHASH];
+  p->aHash[h % PATCH_NHASH] = pEntry;
+  p->nStmt++;
+  return pEntry;
+}
+
+/*
+** Execute the patch statement z.  Report errors on stderr and return
+** the SQLite result code.
+*/
+static int
+patcherExec (Patcher * p, char *z)
+{
+  PatchStmt *pEntry = 0;
+  char *zErrMsg = 0;
+  int rc;
+
+  if (patcherShape (p, z))
+    pEntry = patcherFind (p);
+  if (pEntry && pEntry->pStmt)
+    {
+      patcherBind (p, pEntry->pStmt, z);
+      sqlite3_step (pEntry->pStmt);
+      rc = sqlite3_reset (pEntry->pStmt);
+      sqlite3_clear_bindings (pEntry->pStmt);
+      if (rc != SQLITE_OK)
+        fprintf (stderr, "sqlite3_step: %s\n", sqlite3_errmsg (p->db));
+      return rc;
+    }
+
+  rc = sqlite3_exec (p->db, z, 0, 0, &zErrMsg);
+  if (rc != SQLITE_OK)
+    {
+      fprintf (stderr, "sqlite3_exec: %s\n", zErrMsg);
+      sqlite3_free (zErrMsg);
+    }
+  return rc;
+}
+
+/*
+** Account for one more statement applied by p, and commit the current
+** transaction if --batch says so.  rc is the result of the statement.
+** Return non-zero if the patch cannot go on.
+*/
+static int
+patcherDone (Patcher * p, int rc)
+{
+  if (rc != SQLITE_OK)
+    {
+      if (p->rc == SQLITE_OK)
+        p->rc = sqlite3_errcode (p->db);
+      if (sqlite3_get_autocommit (p->db))
+        return 1;               /* The transaction was rolled back */
+    }
+  p->nApplied++;
+  if (g.nBatch > 0 && p->nApplied % g.nBatch == 0)
+    {
+      rc = sqlite3_exec (p->db, "COMMIT; BEGIN IMMEDIATE", 0, 0, 0);
+      if (rc != SQLITE_OK)
+        {
+          if (p->rc == SQLITE_OK)
+            p->rc = rc;
+          return 1;
+        }
+    }
+  return 0;
+}
+
+/*
+** Apply the SQL text patch of nByte bytes read from fd
+*/
+static void
+patchText (Patcher * p, FILE * fd, long nByte)
+{
+  PatchReader r;
+  char *z;
+
+  patchReaderInit (&r, fd, nByte);
+  while ((z = patchReaderNext (&r)) != 0)
+    {
+      /* The transaction of --transaction is replaced by ours */
+      if (sqlite3_stricmp (z, "BEGIN TRANSACTION;") != 0
+          && sqlite3_stricmp (z, "COMMIT;") != 0
+          && patcherDone (p, patcherExec (p, z)))
+        break;
+    }
+  patchReaderFree (&r);
+}
+
+/*
+** Return a pointer to the end of the binary patch value at a, or NULL
+** if it does not fit before aEnd.
+*/
+static const u8 *
+patchSkipValue (const u8 * a, const u8 * aEnd)
+{
+  sqlite3_uint64 n;
+  int nVarint;
+  if (a >= aEnd)
+    return 0;
+  switch (a[0])
+    {
+    case PATCH_UNDEFINED:
+    case SQLITE_NULL:
+      return a + 1;
+    case SQLITE_INTEGER:
+    case SQLITE_FLOAT:
+      return aEnd - a > 8 ? a + 9 : 0;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      nVarint = getVarint (a + 1, aEnd, &n);
+      if (nVarint == 0 || n > (sqlite3_uint64) (aEnd - a - 1 - nVarint))
+        return 0;
+      return a + 1 + nVarint + n;
+    }
+  return 0;
+}
+
+/*
+** Bind the binary patch value at a, which is known to be well-formed,
+** to parameter i of pStmt.
+*/
+static void
+patchBindValue (sqlite3_stmt * pStmt, int i, const u8 * a)
+{
+  sqlite3_uint64 v = 0;
+  int j;
+  switch (a[0])
+    {
+    case SQLITE_INTEGER:
+    case SQLITE_FLOAT:
+      for (j = 1; j <= 8; j++)
+        v = (v << 8) | a[j];
+      if (a[0] == SQLITE_INTEGER)
+        sqlite3_bind_int64 (pStmt, i, (sqlite3_int64) v);
+      else
+        {
+          double r;
+          memcpy (&r, &v, sizeof (r));
+          sqlite3_bind_double (pStmt, i, r);
+        }
+      break;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB:
+      j = 1 + getVarint (a + 1, a + 10, &v);
+      if (a[0] == SQLITE_TEXT)
+        sqlite3_bind_text (pStmt, i, (const char *) &a[j], (int) v,
+                           SQLITE_STATIC);
+      else
+        sqlite3_bind_blob (pStmt, i, &a[j], (int) v, SQLITE_STATIC);
+      break;
+    default:
+      sqlite3_bind_null (pStmt, i);
+      break;
+    }
+}
+
+/*
+** Read a varint-prefixed name at *pa into *pz and *pn
+*/
+static int
+patchReadName (const u8 ** pa, const u8 * aEnd, const char **pz, int *pn)
+{
+  sqlite3_uint64 n;
+  int nVarint = getVarint (*pa, aEnd, &n);
+  if (nVarint == 0 || n > (sqlite3_uint64) (aEnd - *pa - nVarint))
+    return 0;
+  *pz = (const char *) (*pa + nVarint);
+  *pn = (int) n;
+  *pa += nVarint + n;
+  return 1;
+}
+
+/*
+** Apply the binary patch of nByte bytes read from fd.
+**
+** The patch is read in chunks of PATCH_CHUNK bytes into a buffer that
+** only grows to hold the largest record, as the text patches are.  A
+** record that does not fit in what was read so far is parsed again once
+** more was read.  The names of the 'T' record in force are copied out
+** of the buffer, which the next records overwrite.
+*/
+static void
+patchBinary (Patcher * p, FILE * fd, long nByte)
+{
+  u8 *aBuf = 0;                 /* Records read, not applied yet        */
+  size_t nBuf = 0;              /* Bytes in aBuf[]                      */
+  size_t nAlloc = 0;            /* Allocated size of aBuf[]             */
+  size_t nLeft = (size_t) nByte;        /* Bytes of the patch not read  */
+  size_t nWant;                 /* Bytes to read next                   */
+  const u8 *a, *aEnd;           /* Read cursor and end of aBuf[]        */
+  const u8 *aRec;               /* Start of the current record          */
+  u8 *aTab = 0;                 /* Copy of the 'T' record in force      */
+  const char *zTab = 0;         /* Current table, quoted for SQL        */
+  int nTab = 0;                 /* Length of zTab                       */
+  const char **azCol = 0;       /* Columns of the current table         */
+  int *anCol = 0;               /* Length of every azCol[] entry        */
+  const u8 **aVal = 0;          /* Values of the current record         */
+  int nCol = 0, nPk = 0;        /* Columns and PK columns of zTab       */
+  int i, n;
+  sqlite3_uint64 v;
+
+  a = aEnd = aBuf;
+  for (;;)
+    {
+      int eOp;
+      int rc = SQLITE_OK;
+      int bSkip = 0;            /* True if this is not a statement */
+      Str *pSql = &p->shape;
+
+      aRec = a;
+      if (a == aEnd)
+        goto more;
+      eOp = *a++;
+      pSql->nUsed = 0;
+      switch (eOp)
+        {
+        case 'S':
+          {
+            const char *z;
+            char *zSql;
+            if (!patchReadName (&a, aEnd, &z, &n))
+              goto more;
+            zSql = sqlite3_mprintf ("%.*s", n, z);
+            if (zSql == 0)
+              runtimeError ("out of memory");
+            rc = sqlite3_exec (p->db, zSql, 0, 0, 0);
+            if (rc != SQLITE_OK)
+              fprintf (stderr, "sqlite3_exec: %s\n", sqlite3_errmsg (p->db));
+            sqlite3_free (zSql);
+            break;
+          }
+        case 'T':
+          if ((n = getVarint (a, aEnd, &v)) == 0)
+            goto more;
+          if (v > 32767)
+            goto corrupt;
+          a += n;
+          nCol = (int) v;
+          if ((n = getVarint (a, aEnd, &v)) == 0)
+            goto more;
+          if (v > (sqlite3_uint64) nCol)
+            goto corrupt;
+          a += n;
+          nPk = (int) v;
+          azCol = sqlite3_realloc (azCol, (nCol + 1) * sizeof (azCol[0]));
+          anCol = sqlite3_realloc (anCol, (nCol + 1) * sizeof (anCol[0]));
+          aVal = sqlite3_realloc (aVal, (nCol + 1) * sizeof (aVal[0]));
+          if (azCol == 0 || anCol == 0 || aVal == 0)
+            runtimeError ("out of memory");
+          zTab = 0;
+          if (!patchReadName (&a, aEnd, &zTab, &nTab))
+            goto more;
+          for (i = 0; i < nCol; i++)
+            if (!patchReadName (&a, aEnd, &azCol[i], &anCol[i]))
+              goto more;
+
+          /* Point the names into a copy of the record */
+          sqlite3_free (aTab);
+          aTab = sqlite3_malloc64 (a - aRec);
+          if (aTab == 0)
+            runtimeError ("out of memory");
+          memcpy (aTab, aRec, a - aRec);
+          zTab = (const char *) aTab + ((const u8 *) zTab - aRec);
+          for (i = 0; i < nCol; i++)
+            azCol[i] = (const char *) aTab + ((const u8 *) azCol[i] - aRec);
+          bSkip = 1;
+          break;
+        case 'I':
+        case 'D':
+        case 'U':
+          {
+            PatchStmt *pEntry;
+            int nVal = eOp == 'D' ? nPk : nCol;
+            int iParam = 0;
+            if (zTab == 0)
+              goto corrupt;
+            for (i = 0; i < nVal; i++)
+              {
+                aVal[i] = a;
+                if ((a = patchSkipValue (a, aEnd)) == 0)
+                  goto more;
+              }
+
+            /* Build the SQL of the statement, then find it in the cache */
+            if (eOp == 'I')
+              {
+                strPrintf (pSql, "INSERT INTO %.*s", nTab, zTab);
+                for (i = 0; i < nCol && anCol[0] > 0; i++)
+                  strPrintf (pSql, "%s%.*s", i ? "," : "(", anCol[i],
+                             azCol[i]);
+                strPrintf (pSql, "%s VALUES(", nCol && anCol[0] ? ")" : "");
+                for (i = 0; i < nCol; i++)
+                  strPrintf (pSql, "%s?", i ? "," : "");
+                strPrintf (pSql, ")");
+                iParam = nCol;
+              }
+            else
+              {
+                if (eOp == 'D')
+                  strPrintf (pSql, "DELETE FROM %.*s", nTab, zTab);
+                else
+                  {
+                    iParam = nPk;
+                    strPrintf (pSql, "UPDATE %.*s", nTab, zTab);
+                    for (i = nPk; i < nCol; i++)
+                      if (aVal[i][0] != PATCH_UNDEFINED)
+                        {
+                          strPrintf (pSql, "%s %.*s=?%d",
+                                     iParam == nPk ? " SET" : ",", anCol[i],
+                                     azCol[i], iParam + 1);
+                          iParam++;
+                        }
+                  }
+                for (i = 0; i < nPk; i++)
+                  strPrintf (pSql, "%s %.*s=?%d", i ? " AND" : " WHERE",
+                             anCol[i], azCol[i], i + 1);
+                if (iParam < nPk)
+                  iParam = nPk;
+              }
+            if (eOp == 'U' && iParam == nPk)
+              {
+                bSkip = 1;      /* Nothing to update */
+                break;
+              }
+            p->nLit = iParam;
+            pEntry = patcherFind (p);
+            if (pEntry->pStmt == 0)
+              {
+                fprintf (stderr, "sqlite3_prepare: %s\n\"%s\"\n",
+                         sqlite3_errmsg (p->db), pSql->z);
+                rc = SQLITE_ERROR;
+                break;
+              }
+
+            /* Bind the values in the order of the ?N parameters */
+            for (i = 0, iParam = 0; i < nVal; i++)
+              if (aVal[i][0] != PATCH_UNDEFINED)
+                patchBindValue (pEntry->pStmt, ++iParam, aVal[i]);
+            sqlite3_step (pEntry->pStmt);
+            rc = sqlite3_reset (pEntry->pStmt);
+            sqlite3_clear_bindings (pEntry->pStmt);
+            if (rc != SQLITE_OK)
+              fprintf (stderr, "sqlite3_step: %s\n", sqlite3_errmsg (p->db));
+            break;
+          }
+        default:
+          goto corrupt;
+        }
+      if (!bSkip && patcherDone (p, rc))
+        break;
+      continue;
+
+    more:
+      /* Keep the partial record at aRec, and read more after it */
+      n = (int) (aEnd - aRec);
+      if (nLeft == 0 && n == 0)
+        break;
+      if (n > 0)
+        memmove (aBuf, aRec, n);
+      nBuf = n;
+      if (nAlloc - nBuf < PATCH_CHUNK)
+        {
+          nAlloc = nAlloc * 2 > nBuf + PATCH_CHUNK
+            ? nAlloc * 2 : nBuf + PATCH_CHUNK;
+          aBuf = sqlite3_realloc64 (aBuf, nAlloc);
+          if (aBuf == 0)
+            runtimeError ("out of memory");
+        }
+      nWant = nAlloc - nBuf < nLeft ? nAlloc - nBuf : nLeft;
+      n = nWant > 0 ? (int) fread (&aBuf[nBuf], 1, nWant, fd) : 0;
+      if (n <= 0)
+        {
+          if (nBuf == 0)
+            break;
+          goto corrupt;         /* A truncated record */
+        }
+      nLeft -= n;
+      nBuf += n;
+      a = aBuf;
+      aEnd = &aBuf[nBuf];
+    }
+  goto end_patch_binary;
+
+corrupt:
+  fprintf (stderr, "%s: corrupt binary patch\n", g.zArgv0);
+  if (p->rc == SQLITE_OK)
+    p->rc = SQLITE_CORRUPT;
+
+end_patch_binary:
+  sqlite3_free (aBuf);
+  sqlite3_free (aTab);
+  sqlite3_free (azCol);
+  sqlite3_free (anCol);
+  sqlite3_free (aVal);
+}
+
+/*
+** Start patching database dbName: set *pp to its Patcher, with a write
+** transaction open unless an error is returned.  The Patcher is kept in
+** pRep, or is *pLocal if pRep is NULL.  patchEnd() must be called in
+** either case.
+*/
+static int
+patchBegin (const char *dbName, Replica * pRep, Patcher * pLocal,
+            Patcher ** pp)
+{
+  int rc = SQLITE_OK;
+  Patcher *p = pLocal;
+
+  if (pRep && pRep->pPatcher)
+    p = pRep->pPatcher;
+  else
+    {
+      if (pRep && (p = sqlite3_malloc (sizeof (*p))) == 0)
+        runtimeError ("out of memory");
+      memset (p, 0, sizeof (*p));
+      strInit (&p->shape);
+      if (pRep)
+        pRep->pPatcher = p;
+    }
+  p->rc = SQLITE_OK;
+  p->nApplied = 0;
+  *pp = p;
+
+  if (p->db == 0)
+    {
+      rc = sqlite3_open (dbName, &p->db);
+      sqlite3_busy_timeout (p->db, g.iBusyTimeout);
+      /* With --direct the diff holds a read lock on the backup until
+       ** the patch is complete, so the pages of a rollback journal mode
+       ** backup cannot be spilled to it.  The setting is only taken
+       ** into account by the transactions started after it. */
+      if (rc == SQLITE_OK && g.bDirect)
+        sqlite3_exec (p->db, "PRAGMA cache_spill=OFF", 0, 0, 0);
+      if (rc == SQLITE_OK)
+        memoryConfigure (p->db, "main");
+    }
+
+  /* A backup in WAL mode is patched while it is read.  Switching to WAL
+   ** fails while it is read, so it is tried again by every patch until
+   ** it succeeds, and is a no-op from then on. */
+  if (rc == SQLITE_OK && g.bBackupWal)
+    sqlite3_exec (p->db, "PRAGMA journal_mode=WAL", 0, 0, 0);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec (p->db, "BEGIN IMMEDIATE", 0, 0, 0);
+  if (rc != SQLITE_OK)
+    p->rc = rc;
+  return rc;
+}
+
+/*
+** Store iSeq in the repqlite_state table of db as the number of the last
+** patch applied.  Return an SQLite error code.
+*/
+static int
+patchMark (sqlite3 * db, sqlite3_uint64 iSeq)
+{
+  char *zSql = sqlite3_mprintf ("CREATE TABLE IF NOT EXISTS"
+                                " repqlite_state(name TEXT PRIMARY KEY,"
+                                " value);"
+                                "INSERT OR REPLACE INTO repqlite_state"
+                                " VALUES('applied', %lld)", iSeq);
+  int rc;
+  if (zSql == 0)
+    runtimeError ("out of memory");
+  rc = sqlite3_exec (db, zSql, 0, 0, 0);
+  sqlite3_free (zSql);
+  return rc;
+}
+
+/*
+** Finish the patch of p begun by patchBegin().  If iSeq is not zero, it
+** is stored in the repqlite_state table of the database as the number
+** of the last patch applied, in the same transaction as the patch.
+** Return the first error of the patch, or SQLITE_OK.
+*/
+static int
+patchEnd (Patcher * p, sqlite3_uint64 iSeq, Replica * pRep,
+          Patcher * pLocal)
+{
+  int rc;
+
+  if (iSeq != 0 && !sqlite3_get_autocommit (p->db)
+      && patchMark (p->db, iSeq) != SQLITE_OK && p->rc == SQLITE_OK)
+    p->rc = sqlite3_errcode (p->db);
+  if (!sqlite3_get_autocommit (p->db))
+    {
+      if (sqlite3_exec (p->db, "COMMIT", 0, 0, 0) != SQLITE_OK)
+        {
+          if (p->rc == SQLITE_OK)
+            p->rc = sqlite3_errcode (p->db);
+          sqlite3_exec (p->db, "ROLLBACK", 0, 0, 0);
+        }
+      else if (iSeq != 0 && pRep)
+        pRep->iApplied = iSeq;
+    }
+  rc = p->rc;
+
+  if (p == pLocal)
+    {
+      patcherFlush (p);
+      sqlite3_close (p->db);
+      sqlite3_free (p->aLit);
+      strFree (&p->shape);
+    }
+  return rc;
+}
+
+/*
+** Patch database dbName with the bytes sqlPos to sqlEnd of file sqlFile,
+** and store iSeq as the number of the last patch applied if it is not
+** zero.  See patchBegin() and patchEnd().
+**
+** If pRep is not NULL, the connection to dbName and the statements
+** prepared for the patch stay open in pRep for the next call.
+*/
+int
+sqlPatch (const char *dbName, const char *sqlFile, long sqlPos, long sqlEnd,
+          sqlite3_uint64 iSeq, Replica * pRep)
+{
+  FILE *fd;
+  Patcher local;
+  Patcher *p;
+
+  fd = fopen (sqlFile, g.bBinary ? "rb" : "r");
+  if (!fd)
+    {
+      perror ("fopen");
+      return SQLITE_CANTOPEN;
+    }
+
+  if (patchBegin (dbName, pRep, &local, &p) == SQLITE_OK)
+    {
+      fseek (fd, sqlPos, SEEK_SET);
+      if (g.bBinary)
+        patchBinary (p, fd, sqlEnd - sqlPos);
+      else
+        patchText (p, fd, sqlEnd - sqlPos);
+    }
+  fclose (fd);
+
+  return patchEnd (p, iSeq, pRep, &local);
+}
+
+/*
+** Persistent connections.
+**
+** Every Replica keeps its diff connection, which has the backup as
+** "main" and the source attached as "aux", and its patch connection to
+** the backup open across events.  Extensions are loaded and the source
+** attached only once, and the statements and column lists cached on the
+** diff connection are only flushed when the schema_version of either
+** database changes.  Both connections are closed if either file is
+** replaced by another one.
+*/
+
+/*
+** Forget the statements, column lists and kernels cached for p
+*/
+static void
+replicaFlushCache (Replica * p)
+{
+  int i;
+  for (i = 0; i < STMT_NHASH; i++)
+    while (p->aStmt[i])
+      {
+        StmtCache *pEntry = p->aStmt[i];
+        p->aStmt[i] = pEntry->pNext;
+        sqlite3_finalize (pEntry->pStmt);
+        sqlite3_free (pEntry->zSql);
+        sqlite3_free (pEntry);
+      }
+  memset (p->aStmtByPtr, 0, sizeof (p->aStmtByPtr));
+  p->nStmt = 0;
+  while (p->pColCache)
+    {
+      ColCache *pEntry = p->pColCache;
+      p->pColCache = pEntry->pNext;
+      namelistFree (pEntry->az);
+      sqlite3_free (pEntry->zDb);
+      sqlite3_free (pEntry->zTab);
+      sqlite3_free (pEntry);
+    }
+  while (p->pKernel)
+    {
+      DiffKernel *k = p->pKernel;
+      p->pKernel = k->pNext;
+      kernelFree (k);
+    }
+}
+
+/*
+** Close the connections of p
+*/
+static void
+replicaClose (Replica * p)
+{
+  int i;
+  replicaFlushCache (p);
+  sqlite3_close (p->db);
+  p->db = 0;
+  for (i = 0; i < p->nReader; i++)
+    sqlite3_close (p->apReader[i]);
+  sqlite3_free (p->apReader);
+  p->apReader = 0;
+  p->nReader = 0;
+  if (p->pPatcher)
+    {
+      patcherFlush (p->pPatcher);
+      sqlite3_close (p->pPatcher->db);
+      sqlite3_free (p->pPatcher->aLit);
+      strFree (&p->pPatcher->shape);
+      sqlite3_free (p->pPatcher);
+      p->pPatcher = 0;
+    }
+}
+
+/*
+** Close the connections of p if its source or backup file was replaced
+** since they were opened
+*/
+static void
+replicaCheckFiles (Replica * p)
+{
+  const char *azPath[2];
+  struct stat st;
+  int i;
+
+  azPath[0] = p->zSrc;
+  azPath[1] = p->zBackup;
+  for (i = 0; i < 2; i++)
+    {
+      if (stat (azPath[i], &st) != 0)
+        memset (&st, 0, sizeof (st));
+      if (st.st_dev != p->aDev[i] || st.st_ino != p->aIno[i])
+        {
+          replicaClose (p);
+          replicaReset (p);
+          if (i == 1)
+            p->bJournal = 0;    /* Read the patch marker of the new backup */
+          p->aDev[i] = st.st_dev;
+          p->aIno[i] = st.st_ino;
+        }
+    }
+}
+
+/*
+** Flush the caches of p if the schema of either database changed.  This
+** must run inside the read transaction of the diff.
+*/
+static void
+replicaCheckSchema (Replica * p)
+{
+  int aSchema[2] = { -1, -1 };
+  sqlite3_stmt *pStmt;
+
+  pStmt = db_prepare ("PRAGMA main.schema_version");
+  if (SQLITE_ROW == sqlite3_step (pStmt))
+    aSchema[0] = sqlite3_column_int (pStmt, 0);
+  sqlite3_finalize (pStmt);
+  pStmt = db_prepare ("PRAGMA aux.schema_version");
+  if (SQLITE_ROW == sqlite3_step (pStmt))
+    aSchema[1] = sqlite3_column_int (pStmt, 0);
+  sqlite3_finalize (pStmt);
+
+  if (aSchema[0] != p->aSchema[0] || aSchema[1] != p->aSchema[1])
+    {
+      replicaFlushCache (p);
+      p->aSchema[0] = aSchema[0];
+      p->aSchema[1] = aSchema[1];
+    }
+}
+
+/*
+** Open w.db on the backup zDb1, with the source zDb2 attached as "aux".
+** Return SQLITE_BUSY if either database stays locked, or SQLITE_OK.
+*/
+static int
+diffOpen (const char *zDb1, const char *zDb2)
+{
+  int i, rc;
+  char *zErrMsg = 0;
+  char *zSql;
+
+  rc = sqlite3_open (zDb1, &w.db);
+  if (rc)
+    cmdlineError ("cannot open database file \"%s\"", zDb1);
+  sqlite3_busy_timeout (w.db, g.iBusyTimeout);
+
+  rc = sqlite3_exec (w.db, "SELECT * FROM sqlite_master", 0, 0, &zErrMsg);
+  if (rc == SQLITE_BUSY)
+    return SQLITE_BUSY;
+  if (rc || zErrMsg)
+    cmdlineError ("\"%s\" does not appear to be a valid SQLite database",
+                  zDb1);
+
+#ifndef SQLITE_OMIT_LOAD_EXTENSION
+  sqlite3_enable_load_extension (w.db, 1);
+  for (i = 0; i < g.nExt; i++)
+    {
+      rc = sqlite3_load_extension (w.db, g.azExt[i], 0, &zErrMsg);
+      if (rc || zErrMsg)
+        cmdlineError ("error loading %s: %s", g.azExt[i], zErrMsg);
+    }
+#endif
+  zSql = sqlite3_mprintf ("ATTACH %Q as aux;", zDb2);
+
+  rc = sqlite3_exec (w.db, zSql, 0, 0, &zErrMsg);
+  sqlite3_free (zSql);
+  if (rc == SQLITE_BUSY)
+    return SQLITE_BUSY;
+  if (rc || zErrMsg)
+    cmdlineError ("cannot attach database \"%s\" (%s)", zDb2,
+                  sqlite3_errstr (rc));
+
+  rc = sqlite3_exec (w.db, "SELECT * FROM aux.sqlite_master", 0, 0, &zErrMsg);
+  if (rc == SQLITE_BUSY)
+    return SQLITE_BUSY;
+  if (rc || zErrMsg)
+    cmdlineError ("\"%s\" does not appear to be a valid SQLite database",
+                  zDb2);
+  memoryConfigure (w.db, "main");
+  memoryConfigure (w.db, "aux");
+
+  if (g.bTableHash)
+    {
+      rc = sqlite3_create_function (w.db, "repqlite_hash", -1,
+                                    SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, 0,
+                                    hashStep, hashFinal);
+      if (rc)
+        runtimeError ("cannot create repqlite_hash(): %s",
+                      sqlite3_errstr (rc));
+    }
+
+  return SQLITE_OK;
+}
+
+/*
+** Metrics.
+**
+** Every database has its ReplicaStats: the events received for it and
+** the ones merged into a replication already dirty or queued, the
+** outcome of every replication, the rows of the diffs by kind, and the
+** histograms of the durations of the diffs and of the patches, of the
+** sizes of the patches and of the replication lag, the time from the
+** first event of a replication to its patch being applied.  Every table
+** has the histogram of its diff durations and its rows by kind.  With
+** --table-jobs or --split-keys, every task of a table is a diff of it.
+**
+** The counters of events are only used by the inotify thread, the rest
+** is updated under g.mutex, once per table diffed and once per patch,
+** so that the metrics can be left on.  With --stats FILE, they are
+** written to FILE in the Prometheus text format every --stats-interval
+** ms, and at exit, through FILE-tmp renamed over FILE, as expected from
+** the textfile collector of node_exporter.
+**
+** The totals of all databases are also kept in g, and printed at exit
+** with --verbose, see statsPrint().  They are what "make bench" reports
+** besides the replication lag it measures itself.  With --direct the
+** patch is applied while it is diffed, and its time is counted from the
+** start of the diff.
+*/
+#define HIST_US_BASE   100      /* First bucket of durations: 100 us     */
+#define HIST_BYTE_BASE 64       /* First bucket of sizes: 64 bytes       */
+
+/*
+** Return a monotonic time in microseconds
+*/
+static sqlite3_int64
+timeNowUs (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+** Add value v to histogram h, whose first bucket is up to iBase
+*/
+static void
+histAdd (Hist * h, sqlite3_int64 iBase, sqlite3_int64 v)
+{
+  int i = 0;
+  while (i < HIST_NBUCKET && v > iBase)
+    {
+      iBase *= 4;
+      i++;
+    }
+  h->aCount[i]++;
+  h->nCount++;
+  h->iSum += v;
+}
+
+/*
+** Return the metrics of table zTab of database p, created if needed.
+** The caller holds g.mutex.
+*/
+static TableStats *
+statsTable (Replica * p, const char *zTab)
+{
+  TableStats **pp = &p->stats.apTable[strHash (zTab) % STATS_NHASH];
+  TableStats *pT;
+
+  for (pT = *pp; pT; pT = pT->pNext)
+    if (strcmp (pT->zTab, zTab) == 0)
+      return pT;
+  pT = sqlite3_malloc (sizeof (*pT));
+  if (pT == 0)
+    runtimeError ("out of memory");
+  memset (pT, 0, sizeof (*pT));
+  pT->zTab = sqlite3_mprintf ("%s", zTab);
+  if (pT->zTab == 0)
+    runtimeError ("out of memory");
+  pT->pNext = *pp;
+  *pp = pT;
+  return pT;
+}
+
+/*
+** Diff table zTab with xDiff, and account for it in the metrics of p,
+** if not NULL
+*/
+static void
+diffTable (Replica * p, void (*xDiff) (const char *, int, FILE *),
+           const char *zTab, int bRange, FILE * out)
+{
+  sqlite3_int64 anRow[ROW_NKIND];
+  sqlite3_int64 iStart;
+  TableStats *pT;
+  int i;
+
+  if (p == 0)
+    {
+      xDiff (zTab, bRange, out);
+      return;
+    }
+  memcpy (anRow, w.anDiffRow, sizeof (anRow));
+  iStart = timeNowUs ();
+  xDiff (zTab, bRange, out);
+  pthread_mutex_lock (&g.mutex);
+  pT = statsTable (p, zTab);
+  histAdd (&pT->diff, HIST_US_BASE, timeNowUs () - iStart);
+  for (i = 0; i < ROW_NKIND; i++)
+    pT->anRow[i] += w.anDiffRow[i] - anRow[i];
+  pthread_mutex_unlock (&g.mutex);
+}
+
+/*
+** Count a replication of p with outcome eResult, STAT_*, that applied
+** no patch
+*/
+static void
+statsCount (Replica * p, int eResult)
+{
+  pthread_mutex_lock (&g.mutex);
+  p->stats.anResult[eResult]++;
+  pthread_mutex_unlock (&g.mutex);
+}
+
+/*
+** Account for a patch of p of nByte bytes, with the rows counted in
+** w.anDiffRow, diffed in usDiff microseconds.  nStmt statements of it
+** were applied in usPatch, and rc is the result of the patch.
+*/
+static void
+statsAdd (Replica * p, long nByte, int nStmt, sqlite3_int64 usDiff,
+          sqlite3_int64 usPatch, int rc)
+{
+  ReplicaStats *s = &p->stats;
+  sqlite3_int64 nRow = 0;
+  int i;
+
+  pthread_mutex_lock (&g.mutex);
+  for (i = 0; i < ROW_NKIND; i++)
+    {
+      s->anRow[i] += w.anDiffRow[i];
+      nRow += w.anDiffRow[i];
+    }
+  s->anResult[rc == SQLITE_OK ? STAT_APPLIED : STAT_FAILED]++;
+  histAdd (&s->diff, HIST_US_BASE, usDiff);
+  histAdd (&s->apply, HIST_US_BASE, usPatch);
+  histAdd (&s->bytes, HIST_BYTE_BASE, nByte);
+  if (rc == SQLITE_OK && p->iJobEvent > 0)
+    histAdd (&s->lag, HIST_US_BASE,
+             (timeNowUs () / 1000 - p->iJobEvent) * 1000);
+  g.nStatPatch++;
+  g.nStatRow += nRow;
+  g.nStatByte += nByte;
+  g.nStatStmt += nStmt;
+  g.usStatDiff += usDiff;
+  g.usStatPatch += usPatch;
+  pthread_mutex_unlock (&g.mutex);
+}
+
+/*
+** Return the peak resident set size of the process, in bytes
+*/
+static long
+statsPeakRss (void)
+{
+  struct rusage ru;
+  if (getrusage (RUSAGE_SELF, &ru) != 0)
+    return 0;
+  return ru.ru_maxrss * 1024L;
+}
+
+/*
+** Print the totals gathered by statsAdd()
+*/
+static void
+statsPrint (void)
+{
+  double sDiff = g.usStatDiff / 1e6;
+  double sPatch = g.usStatPatch / 1e6;
+
+  VERBOSE ("* Diff: %lld patches, %lld rows in %.3f s, %.0f rows/s,"
+           " %.1f bytes per row\n", g.nStatPatch, g.nStatRow, sDiff,
+           sDiff > 0 ? g.nStatRow / sDiff : 0.0,
+           g.nStatRow > 0 ? (double) g.nStatByte / g.nStatRow : 0.0);
+  VERBOSE ("* Patch: %lld statements in %.3f s, %.0f statements/s\n",
+           g.nStatStmt, sPatch, sPatch > 0 ? g.nStatStmt / sPatch : 0.0);
+  VERBOSE ("* Memory: peak RSS %ld KB, peak SQLite heap %lld KB\n",
+           statsPeakRss () / 1024, sqlite3_memory_highwater (0) / 1024);
+}
+
+/*
+** Append label zName="z" to pOut, with z escaped
+*/
+static void
+statsLabel (Str * pOut, const char *zName, const char *z)
+{
+  strPrintf (pOut, "%s=\"", zName);
+  for (; *z; z++)
+    {
+      if (*z == '\\' || *z == '"')
+        strPrintf (pOut, "\\%c", *z);
+      else if (*z == '\n')
+        strPrintf (pOut, "\\n");
+      else
+        strPrintf (pOut, "%c", *z);
+    }
+  strPrintf (pOut, "\"");
+}
+
+/*
+** Append the samples of histogram h of metric zMetric to pOut.  zLabels
+** are its labels, rScale converts its values to the unit of zMetric.
+*/
+static void
+statsHist (Str * pOut, const char *zMetric, const char *zLabels,
+           const Hist * h, sqlite3_int64 iBase, double rScale)
+{
+  sqlite3_int64 n = 0;
+  int i;
+
+  for (i = 0; i < HIST_NBUCKET; i++, iBase *= 4)
+    {
+      n += h->aCount[i];
+      strPrintf (pOut, "%s_bucket{%s,le=\"%.10g\"} %lld\n", zMetric, zLabels,
+                 iBase * rScale, n);
+    }
+  strPrintf (pOut, "%s_bucket{%s,le=\"+Inf\"} %lld\n", zMetric, zLabels,
+             h->nCount);
+  strPrintf (pOut, "%s_sum{%s} %g\n", zMetric, zLabels, h->iSum * rScale);
+  strPrintf (pOut, "%s_count{%s} %lld\n", zMetric, zLabels, h->nCount);
+}
+
+/*
+** Write the metrics to g.zStats
+*/
+static void
+statsWrite (void)
+{
+  static const char *azResult[] = {
+    "applied", "failed", "empty", "unchanged", "busy", "resync"
+  };
+  static const char *azKind[] = { "insert", "update", "delete" };
+  static const struct
+  {
+    const char *zName;          /* Name of the metric                */
+    const char *zHelp;          /* Its description                   */
+    size_t iOff;                /* Offset of its Hist in ReplicaStats */
+    sqlite3_int64 iBase;        /* First bucket of the Hist          */
+    double rScale;              /* Converts the values to the unit   */
+  } aHist[] = {
+    {"repqlite_diff_seconds", "Duration of the diffs",
+     offsetof (ReplicaStats, diff), HIST_US_BASE, 1e-6},
+    {"repqlite_apply_seconds", "Duration of the patches",
+     offsetof (ReplicaStats, apply), HIST_US_BASE, 1e-6},
+    {"repqlite_lag_seconds", "From the first event to the patch applied",
+     offsetof (ReplicaStats, lag), HIST_US_BASE, 1e-6},
+    {"repqlite_patch_bytes", "Size of the patches",
+     offsetof (ReplicaStats, bytes), HIST_BYTE_BASE, 1},
+  };
+  Str out, lbl;
+  Replica *p;
+  FILE *f;
+  char *zTmp;
+  int i, j;
+
+  strInit (&out);
+  strPrintf (&out, "# HELP repqlite_inotify_events_total Events read\n"
+             "# TYPE repqlite_inotify_events_total counter\n"
+             "repqlite_inotify_events_total %lld\n"
+             "# HELP repqlite_inotify_stale_total Events of directories"
+             " no longer watched\n"
+             "# TYPE repqlite_inotify_stale_total counter\n"
+             "repqlite_inotify_stale_total %lld\n"
+             "# HELP repqlite_inotify_overflows_total Queue overflows,"
+             " events dropped\n"
+             "# TYPE repqlite_inotify_overflows_total counter\n"
+             "repqlite_inotify_overflows_total %d\n"
+             "# HELP repqlite_rss_peak_bytes Peak resident set size\n"
+             "# TYPE repqlite_rss_peak_bytes gauge\n"
+             "repqlite_rss_peak_bytes %ld\n"
+             "# HELP repqlite_sqlite_heap_bytes Memory allocated by SQLite\n"
+             "# TYPE repqlite_sqlite_heap_bytes gauge\n"
+             "repqlite_sqlite_heap_bytes %lld\n"
+             "# HELP repqlite_sqlite_heap_peak_bytes Peak of it\n"
+             "# TYPE repqlite_sqlite_heap_peak_bytes gauge\n"
+             "repqlite_sqlite_heap_peak_bytes %lld\n",
+             g.nEvent, g.nEventStale, g.nOverflow, statsPeakRss (),
+             sqlite3_memory_used (), sqlite3_memory_highwater (0));
+
+  strPrintf (&out, "# HELP repqlite_events_total Events of a database\n"
+             "# TYPE repqlite_events_total counter\n");
+  for (p = g.pReplica; p; p = p->pNext)
+    {
+      strInit (&lbl);
+      statsLabel (&lbl, "db", p->zName);
+      strPrintf (&out, "repqlite_events_total{%s} %lld\n", lbl.z,
+                 p->stats.nEvent);
+      strFree (&lbl);
+    }
+  strPrintf (&out, "# HELP repqlite_events_coalesced_total Events merged"
+             " into a pending replication\n"
+             "# TYPE repqlite_events_coalesced_total counter\n");
+  for (p = g.pReplica; p; p = p->pNext)
+    {
+      strInit (&lbl);
+      statsLabel (&lbl, "db", p->zName);
+      strPrintf (&out, "repqlite_events_coalesced_total{%s} %lld\n", lbl.z,
+                 p->stats.nCoalesced);
+      strFree (&lbl);
+    }
+
+  pthread_mutex_lock (&g.mutex);
+  strPrintf (&out, "# HELP repqlite_replications_total Replications,"
+             " by result\n"
+             "# TYPE repqlite_replications_total counter\n");
+  for (p = g.pReplica; p; p = p->pNext)
+    {
+      strInit (&lbl);
+      statsLabel (&lbl, "db", p->zName);
+      for (i = 0; i < STAT_NRESULT; i++)
+        strPrintf (&out, "repqlite_replications_total{%s,result=\"%s\"}"
+                   " %lld\n", lbl.z, azResult[i], p->stats.anResult[i]);
+      strFree (&lbl);
+    }
+  strPrintf (&out, "# HELP repqlite_rows_total Rows output by the diffs\n"
+             "# TYPE repqlite_rows_total counter\n");
+  for (p = g.pReplica; p; p = p->pNext)
+    {
+      strInit (&lbl);
+      statsLabel (&lbl, "db", p->zName);
+      for (i = 0; i < ROW_NKIND; i++)
+        strPrintf (&out, "repqlite_rows_total{%s,type=\"%s\"} %lld\n",
+                   lbl.z, azKind[i], p->stats.anRow[i]);
+      strFree (&lbl);
+    }
+  for (j = 0; j < (int) (sizeof (aHist) / sizeof (aHist[0])); j++)
+    {
+      strPrintf (&out, "# HELP %s %s\n# TYPE %s histogram\n",
+                 aHist[j].zName, aHist[j].zHelp, aHist[j].zName);
+      for (p = g.pReplica; p; p = p->pNext)
+        {
+          strInit (&lbl);
+          statsLabel (&lbl, "db", p->zName);
+          statsHist (&out, aHist[j].zName, lbl.z,
+                     (const Hist *) ((const char *) &p->stats
+                                     + aHist[j].iOff), aHist[j].iBase,
+                     aHist[j].rScale);
+          strFree (&lbl);
+        }
+    }
+
+  strPrintf (&out, "# HELP repqlite_table_diff_seconds Duration of the"
+             " diffs of a table\n"
+             "# TYPE repqlite_table_diff_seconds histogram\n");
+  for (p = g.pReplica; p; p = p->pNext)
+    for (i = 0; i < STATS_NHASH; i++)
+      {
+        TableStats *pT;
+        for (pT = p->stats.apTable[i]; pT; pT = pT->pNext)
+          {
+            strInit (&lbl);
+            statsLabel (&lbl, "db", p->zName);
+            strPrintf (&lbl, ",");
+            statsLabel (&lbl, "table", pT->zTab);
+            statsHist (&out, "repqlite_table_diff_seconds", lbl.z,
+                       &pT->diff, HIST_US_BASE, 1e-6);
+            strFree (&lbl);
+          }
+      }
+  strPrintf (&out, "# HELP repqlite_table_rows_total Rows output by the"
+             " diffs of a table\n"
+             "# TYPE repqlite_table_rows_total counter\n");
+  for (p = g.pReplica; p; p = p->pNext)
+    for (i = 0; i < STATS_NHASH; i++)
+      {
+        TableStats *pT;
+        for (pT = p->stats.apTable[i]; pT; pT = pT->pNext)
+          {
+            strInit (&lbl);
+            statsLabel (&lbl, "db", p->zName);
+            strPrintf (&lbl, ",");
+            statsLabel (&lbl, "table", pT->zTab);
+            for (j = 0; j < ROW_NKIND; j++)
+              strPrintf (&out, "repqlite_table_rows_total{%s,type=\"%s\"}"
+                         " %lld\n", lbl.z, azKind[j], pT->anRow[j]);
+            strFree (&lbl);
+          }
+      }
+  pthread_mutex_unlock (&g.mutex);
+
+  zTmp = sqlite3_mprintf ("%s-tmp", g.zStats);
+  if (zTmp == 0)
+    runtimeError ("out of memory");
+  f = fopen (zTmp, "w");
+  if (f && fwrite (out.z, 1, out.nUsed, f) != (size_t) out.nUsed)
+    {
+      fclose (f);
+      f = 0;
+    }
+  if (f == 0 || fclose (f) != 0 || rename (zTmp, g.zStats) != 0)
+    fprintf (stderr, "%s: cannot write \"%s\": %s\n", g.zArgv0, g.zStats,
+             strerror (errno));
+  sqlite3_free (zTmp);
+  strFree (&out);
+}
+
+/*
+** Write the metrics if they are due.  iWait is the number of ms the
+** inotify thread would wait for, or -1; return it shortened to the
+** next write of the metrics.
+*/
+static int
+statsTick (int iWait)
+{
+  sqlite3_int64 iNow;
+
+  if (g.zStats == 0)
+    return iWait;
+  iNow = timeNowUs () / 1000;
+  if (iNow >= g.iStatsDue)
+    {
+      statsWrite ();
+      g.iStatsDue = iNow + g.iStatsInterval;
+    }
+  if (iWait < 0 || g.iStatsDue - iNow < iWait)
+    iWait = (int) (g.iStatsDue - iNow);
+  return iWait;
+}
+
+/*
+** Parallel table diffs.
+**
+** With --table-jobs N, the tables of a database that need a diff are
+** diffed by up to N threads at once, each on its own connection with
+** the backup as "main" and the source attached as "aux".  The extra
+** connections are kept in the Replica, like the first one.  Every table
+** writes its patch into a buffer of its own, and the buffers are
+** appended to the patch journal in the ORDER BY name order of the
+** serial diff, so the journal does not depend on the scheduling.
+**
+** The extra connections start their read transaction while the first
+** one holds its own.  In rollback journal mode the source cannot change
+** in between, so all tables are diffed from the same state.  In WAL
+** mode, if SQLite is built with SQLITE_ENABLE_SNAPSHOT, they open the
+** snapshot of the source the first connection reads.  Otherwise, or if
+** the snapshot was checkpointed away, a table may be diffed from a later
+** commit than the others; that commit has its own event, and the next
+** diff finds the table equal.
+** A connection that cannot take its read lock at once is not used, so
+** that a writer waiting for its lock is not held up.
+**
+** Tables that --cdc restricts to rowid ranges are diffed by the first
+** connection, which holds the ranges in its temp schema.
+**
+** With --split-keys N, a table is diffed as several tasks, one for each
+** range of N values of its first primary key column.  See diffSplit().
+*/
+#define SPLIT_MAX 1024          /* Max number of ranges of a table        */
+
+typedef struct DiffTask DiffTask;
+struct DiffTask
+{
+  const char *zTab;             /* Name of the table                       */
+  int bRange;                   /* Argument of xDiff()                     */
+  int bSplit;                   /* True to diff only the keys in range     */
+  DiffRange range;              /* The keys to diff, if bSplit             */
+  int bTaken;                   /* True once a thread started it           */
+  char *zOut;                   /* Patch of the table                      */
+  size_t nOut;                  /* Size of zOut                            */
+};
+
+typedef struct DiffJobs DiffJobs;
+struct DiffJobs
+{
+  DiffTask *aTask;              /* Tables to diff, in output order         */
+  int nTask;                    /* Number of entries in aTask[]            */
+  pthread_mutex_t mutex;        /* Protects bTaken                         */
+  void (*xDiff) (const char *, int, FILE *);    /* Diff one table          */
+  Replica *pRowHash;            /* w.pRowHash of the threads               */
+  Replica *pRep;                /* Database whose metrics are updated      */
+};
+
+typedef struct DiffThread DiffThread;
+struct DiffThread
+{
+  DiffJobs *pJobs;              /* The tables to diff                      */
+  sqlite3 *db;                  /* Connection of the thread                */
+  pthread_t tid;                /* The thread                              */
+  sqlite3_int64 anRow[ROW_NKIND];       /* w.anDiffRow, once joined        */
+};
+
+/*
+** Diff the tables of pJobs that are left, on connection w.db.  Only the
+** first connection, bAll true, diffs the tables restricted to ranges.
+*/
+static void
+diffJobsRun (DiffJobs * pJobs, int bAll)
+{
+  for (;;)
+    {
+      DiffTask *pTask = 0;
+      FILE *out;
+      int i;
+
+      pthread_mutex_lock (&pJobs->mutex);
+      for (i = 0; i < pJobs->nTask; i++)
+        if (!pJobs->aTask[i].bTaken && (bAll || !pJobs->aTask[i].bRange))
+          {
+            pTask = &pJobs->aTask[i];
+            pTask->bTaken = 1;
+            break;
+          }
+      pthread_mutex_unlock (&pJobs->mutex);
+      if (pTask == 0)
+        break;
+
+      out = open_memstream (&pTask->zOut, &pTask->nOut);
+      if (out == 0)
+        runtimeError ("out of memory");
+      w.pRange = pTask->bSplit ? &pTask->range : 0;
+      diffTable (pJobs->pRep, pJobs->xDiff, pTask->zTab, pTask->bRange,
+                 out);
+      w.pRange = 0;
+      fclose (out);
+    }
+}
+
+/*
+** Body of the extra diff threads
+*/
+static void *
+diffThreadMain (void *pArg)
+{
+  DiffThread *pThread = (DiffThread *) pArg;
+  w.db = pThread->db;
+  w.pRowHash = pThread->pJobs->pRowHash;
+  diffJobsRun (pThread->pJobs, 0);
+  memcpy (pThread->anRow, w.anDiffRow, sizeof (w.anDiffRow));
+  w.db = 0;
+  w.pRowHash = 0;
+  sqlite3_free (w.pLit);
+  sqlite3_free (w.pDelta);
+  sqlite3_free (w.pDeltaHash);
+  return 0;
+}
+
+/*
+** Return the extra connection iConn of p, with its read transaction
+** started, or NULL if the read lock is not available at once
+*/
+static sqlite3 *
+diffReader (Replica * p, int iConn)
+{
+  sqlite3 *db = w.db;
+  sqlite3 *pReader;
+  int rc;
+
+  if (iConn >= p->nReader)
+    {
+      sqlite3 **apNew = sqlite3_realloc (p->apReader,
+                                         (iConn + 1) * sizeof (sqlite3 *));
+      if (apNew == 0)
+        runtimeError ("out of memory");
+      for (; p->nReader <= iConn; p->nReader++)
+        apNew[p->nReader] = 0;
+      p->apReader = apNew;
+    }
+  if (p->apReader[iConn] == 0)
+    {
+      rc = diffOpen (p->zBackup, p->zSrc);
+      pReader = w.db;
+      w.db = db;
+      if (rc != SQLITE_OK)
+        {
+          sqlite3_close (pReader);
+          return 0;
+        }
+      p->apReader[iConn] = pReader;
+    }
+
+  pReader = p->apReader[iConn];
+  sqlite3_busy_timeout (pReader, 0);
+  rc = sqlite3_exec (pReader, "BEGIN", 0, 0, 0);
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  if (rc == SQLITE_OK && w.pSnapshot)
+    rc = sqlite3_snapshot_open (pReader, "aux", w.pSnapshot);
+#endif
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec (pReader, "SELECT count(*) FROM main.sqlite_master;"
+                       " SELECT count(*) FROM aux.sqlite_master;", 0, 0, 0);
+  sqlite3_busy_timeout (pReader, g.iBusyTimeout);
+  if (rc != SQLITE_OK)
+    {
+      sqlite3_exec (pReader, "ROLLBACK", 0, 0, 0);
+      return 0;
+    }
+  return pReader;
+}
+
+/*
+** Append a task for table zTab to the *pnTask tasks of *paTask.  The
+** task diffs the keys in pR only, if pR is not NULL.
+*/
+static void
+diffTaskAdd (DiffTask ** paTask, int *pnTask, const char *zTab, int bRange,
+             const DiffRange * pR)
+{
+  DiffTask *pTask;
+
+  *paTask = sqlite3_realloc (*paTask, (*pnTask + 1) * sizeof (DiffTask));
+  if (*paTask == 0)
+    runtimeError ("out of memory");
+  pTask = &(*paTask)[(*pnTask)++];
+  memset (pTask, 0, sizeof (*pTask));
+  pTask->zTab = sqlite3_mprintf ("%s", zTab);
+  if (pTask->zTab == 0)
+    runtimeError ("out of memory");
+  pTask->bRange = bRange;
+  if (pR)
+    {
+      pTask->bSplit = 1;
+      pTask->range = *pR;
+    }
+}
+
+/*
+** Append the tasks that diff table zTab in ranges of g.nSplitKey keys to
+** *paTask and return their number, or return 0 if the table is not
+** split.
+**
+** The ranges are taken from the smallest and the largest value of the
+** first primary key column in either database, which the min() and max()
+** optimizations read from the b-tree without a scan.  A table is split
+** only if both are integers; the keys in between are assumed to be about
+** evenly spread, as rowids usually are.  Since NULL sorts first, integers
+** next and all other values last, the ranges cover every row.
+*/
+static int
+diffSplit (const char *zTab, DiffTask ** paTask, int *pnTask)
+{
+  char **az, **az2;             /* Columns in main and aux                 */
+  int nPk, nPk2;                /* Primary key columns in main and aux     */
+  char *zId;                    /* Name of the table, quoted               */
+  sqlite3_stmt *pStmt;          /* Reads the key bounds                    */
+  sqlite3_int64 iMin = 0;       /* Smallest key                            */
+  sqlite3_int64 iMax = 0;       /* Largest key                             */
+  sqlite3_uint64 nSpan;         /* iMax - iMin                             */
+  sqlite3_uint64 nStep;         /* Keys in a range                         */
+  int nPart = 0;                /* Number of ranges                        */
+  DiffRange r;
+  int bKey = 0;
+  int i;
+
+  if (sqlite3_table_column_metadata (w.db, "main", zTab, 0, 0, 0, 0, 0, 0)
+      || sqlite3_table_column_metadata (w.db, "aux", zTab, 0, 0, 0, 0, 0, 0))
+    return 0;
+  az = columnNames ("main", zTab, &nPk, 0);
+  az2 = columnNames ("aux", zTab, &nPk2, 0);
+  if (az && az2 && sqlite3_stricmp (az[0], az2[0]) == 0)
+    {
+      zId = safeId (zTab);
+      pStmt = db_cprepare ("SELECT (SELECT min(%s) FROM main.%s),"
+                           " (SELECT max(%s) FROM main.%s),"
+                           " (SELECT min(%s) FROM aux.%s),"
+                           " (SELECT max(%s) FROM aux.%s)",
+                           az[0], zId, az[0], zId, az[0], zId, az[0], zId);
+      sqlite3_free (zId);
+      nPart = 1;
+      if (SQLITE_ROW == sqlite3_step (pStmt))
+        for (i = 0; i < 4; i++)
+          {
+            sqlite3_int64 iKey = sqlite3_column_int64 (pStmt, i);
+            int eType = sqlite3_column_type (pStmt, i);
+            if (eType == SQLITE_NULL)
+              continue;
+            if (eType != SQLITE_INTEGER)
+              nPart = 0;
+            if (!bKey || iKey < iMin)
+              iMin = iKey;
+            if (!bKey || iKey > iMax)
+              iMax = iKey;
+            bKey = 1;
+          }
+      db_crelease (pStmt);
+    }
+  namelistFree (az);
+  namelistFree (az2);
+  if (!bKey || nPart == 0)
+    return 0;
+
+  /* The span may be up to 2^64-1 keys: count the ranges in 64 bits, and
+  ** keep the bounds within the span so that they cannot wrap around */
+  nSpan = (sqlite3_uint64) iMax - (sqlite3_uint64) iMin;
+  nStep = nSpan / (sqlite3_uint64) g.nSplitKey;
+  nPart = nStep >= SPLIT_MAX ? SPLIT_MAX : (int) nStep + 1;
+  if (nPart < 2)
+    return 0;
+  nStep = nSpan / nPart + 1;
+  for (i = 0; i < nPart; i++)
+    {
+      sqlite3_uint64 iLo = i * nStep < nSpan ? i * nStep : nSpan;
+      sqlite3_uint64 iHi = (i + 1) * nStep < nSpan ? (i + 1) * nStep : nSpan;
+      r.bLo = i > 0;
+      r.bHi = i < nPart - 1;
+      r.iLo = (sqlite3_int64) ((sqlite3_uint64) iMin + iLo);
+      r.iHi = (sqlite3_int64) ((sqlite3_uint64) iMin + iHi);
+      diffTaskAdd (paTask, pnTask, zTab, 0, &r);
+    }
+  return nPart;
+}
+
+/*
+** Diff the nTask tables of aTask with up to g.nTableJob threads, the
+** calling one included, and append their patches to out in order
+*/
+static void
+diffParallel (Replica * p, DiffTask * aTask, int nTask,
+              void (*xDiff) (const char *, int, FILE *), FILE * out)
+{
+  DiffJobs jobs;
+  DiffThread *aThread;
+  int nThread = 0;
+  int i, j;
+
+  memset (&jobs, 0, sizeof (jobs));
+  jobs.aTask = aTask;
+  jobs.nTask = nTask;
+  jobs.xDiff = xDiff;
+  jobs.pRowHash = w.pRowHash;
+  jobs.pRep = p;
+  pthread_mutex_init (&jobs.mutex, 0);
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  /* Fails unless the source is in WAL mode */
+  if (p && sqlite3_snapshot_get (w.db, "aux", &w.pSnapshot) != SQLITE_OK)
+    w.pSnapshot = 0;
+#endif
+
+  aThread = sqlite3_malloc (g.nTableJob * sizeof (aThread[0]));
+  if (aThread == 0)
+    runtimeError ("out of memory");
+  for (i = 0; p && i < g.nTableJob - 1 && i < nTask - 1; i++)
+    {
+      sqlite3 *db = diffReader (p, i);
+      if (db == 0)
+        continue;
+      aThread[nThread].pJobs = &jobs;
+      aThread[nThread].db = db;
+      if (pthread_create (&aThread[nThread].tid, 0, diffThreadMain,
+                          &aThread[nThread]) != 0)
+        {
+          sqlite3_exec (db, "ROLLBACK", 0, 0, 0);
+          continue;
+        }
+      nThread++;
+    }
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  if (w.pSnapshot)
+    sqlite3_snapshot_free (w.pSnapshot);
+  w.pSnapshot = 0;
+#endif
+
+  diffJobsRun (&jobs, 1);
+  for (i = 0; i < nThread; i++)
+    {
+      pthread_join (aThread[i].tid, 0);
+      sqlite3_exec (aThread[i].db, "COMMIT", 0, 0, 0);
+      for (j = 0; j < ROW_NKIND; j++)
+        w.anDiffRow[j] += aThread[i].anRow[j];
+    }
+  pthread_mutex_destroy (&jobs.mutex);
+  sqlite3_free (aThread);
+
+  for (i = 0; i < nTask; i++)
+    {
+      fwrite (aTask[i].zOut, 1, aTask[i].nOut, out);
+      free (aTask[i].zOut);
+    }
+}
+
+/*
+** Values returned by sqlDiff() when the databases stay locked, and when
+** the backup should rather be copied from the source, see
+** replicaResync()
+*/
+#define DIFF_BUSY   (-2)
+#define DIFF_RESYNC (-3)
+
+/*
+** Return true if diff_one_table() would drop table zTab of the backup,
+** if any, and dump the whole table of the source
+*/
+static int
+diffNeedsDump (const char *zTab)
+{
+  char **az, **az2;
+  int nPk, nPk2, n = 0;
+  int bDump;
+
+  if (sqlite3_table_column_metadata (w.db, "main", zTab, 0, 0, 0, 0, 0, 0))
+    return 1;
+  az = columnNames ("main", zTab, &nPk, 0);
+  az2 = columnNames ("aux", zTab, &nPk2, 0);
+  if (az && az2)
+    {
+      for (n = 0; az[n] && az2[n]; n++)
+        if (sqlite3_stricmp (az[n], az2[n]) != 0)
+          break;
+    }
+  bDump = az == 0 || az2 == 0 || nPk != nPk2 || az[n];
+  namelistFree (az);
+  namelistFree (az2);
+  return bDump;
+}
+
+/*
+** Return true if the diff would dump --resync percent of the rows of the
+** source or more.  The rows are only counted if a table needs a dump.
+*/
+static int
+diffResyncWanted (void)
+{
+  sqlite3_stmt *pStmt;
+  sqlite3_int64 nDump = 0, nAll = 0;
+  int bDump = 0;
+
+  pStmt = db_prepare ("SELECT name FROM aux.sqlite_master"
+                      " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'"
+                      " AND name<>'repqlite_state'");
+  while (!bDump && SQLITE_ROW == sqlite3_step (pStmt))
+    bDump = diffNeedsDump ((const char *) sqlite3_column_text (pStmt, 0));
+  sqlite3_reset (pStmt);
+  while (bDump && SQLITE_ROW == sqlite3_step (pStmt))
+    {
+      const char *zTab = (const char *) sqlite3_column_text (pStmt, 0);
+      char *zId = safeId (zTab);
+      sqlite3_stmt *pCount = db_prepare ("SELECT count(*) FROM aux.%s", zId);
+      sqlite3_int64 n = 0;
+      if (SQLITE_ROW == sqlite3_step (pCount))
+        n = sqlite3_column_int64 (pCount, 0);
+      sqlite3_finalize (pCount);
+      sqlite3_free (zId);
+      nAll += n;
+      if (diffNeedsDump (zTab))
+        nDump += n;
+    }
+  sqlite3_finalize (pStmt);
+  return nAll > 0 && nDump * 100 >= nAll * g.nResync;
+}
+
+/*
+** With --checkpoint, run a PASSIVE checkpoint of the source zDb of the
+** diff connection once it is diffed.  The application can then turn its
+** auto-checkpoint off, and the WAL is only checkpointed between two
+** diffs, so --cdc sees it restarted at most once since the previous
+** scan and reads the frames it missed from its tail.  A PASSIVE
+** checkpoint never waits for the readers or the writer of the source,
+** and does nothing if it is not in WAL mode.
+*/
+static void
+diffCheckpoint (const char *zDb)
+{
+  int nLog = 0, nCkpt = 0;
+  int rc = sqlite3_wal_checkpoint_v2 (w.db, "aux", SQLITE_CHECKPOINT_PASSIVE,
+                                      &nLog, &nCkpt);
+  if (rc == SQLITE_OK && nLog > 0)
+    {
+      VERBOSE ("* Checkpoint %s: %d of %d WAL frames\n", zDb, nCkpt, nLog);
+    }
+}
+
+/*
+** End the read transaction of the diff on w.db.  A statement left busy
+** would keep the read transaction open past the COMMIT, and the diffs
+** that follow on the connection would all read the same old snapshot of
+** the source: reset them first.  Return the result of the COMMIT.
+*/
+static int
+diffCommit (void)
+{
+  sqlite3_stmt *pStmt = 0;
+  int rc;
+
+  while ((pStmt = sqlite3_next_stmt (w.db, pStmt)) != 0)
+    if (sqlite3_stmt_busy (pStmt))
+      sqlite3_reset (pStmt);
+  rc = sqlite3_exec (w.db, "COMMIT", 0, 0, 0);
+  if (rc != SQLITE_OK)
+    {
+      fprintf (stderr, "%s: cannot end the diff: %s\n", g.zArgv0,
+               sqlite3_errmsg (w.db));
+      sqlite3_exec (w.db, "ROLLBACK", 0, 0, 0);
+    }
+  return rc;
+}
+
+/*
+** Generate a difference-patch between two SQL databases and write it
+** to out.  If there is no difference then return -1 else return the
+** position of the patch in out, as reported by ftell().
+**
+** Return DIFF_BUSY if the databases stayed locked for longer than
+** --busy-timeout.
+**
+** If pRep is not NULL, the connection is kept in it.  With --cdc, only
+** the changes that zDb2 recorded in its WAL since the previous call are
+** diffed, and with --table-hash, tables whose content hash did not
+** change are skipped.
+*/
+long
+sqlDiff (const char *zDb1, const char *zDb2, FILE * out, Replica * pRep)
+{
+  int rc;
+  long fstart, fend;
+  time_t ltime; /* timestamp for SCN-journal */
+  sqlite3_stmt *pStmt;
+  CdcChanges cdc;
+  int eCdc = CDC_FULL;
+  int nTab = 0, nSame = 0;
+  void (*xDiff) (const char *, int, FILE *) = diff_one_table;
+  DiffTask *aTask = 0;          /* Tables to diff, with --table-jobs */
+  int nTask = 0;
+
+  if (g.rbuTable != 0)
+    xDiff = rbudiff_one_table;
+
+  memset (&cdc, 0, sizeof (cdc));
+  if (pRep && pRep->db)
+    w.db = pRep->db;
+  else
+    {
+      if (diffOpen (zDb1, zDb2) != SQLITE_OK)
+        goto diff_busy;
+      if (pRep)
+        pRep->db = w.db;
+    }
+  w.pRep = pRep;
+  w.pRowHash = g.bRowHash ? pRep : 0;
+  memset (w.anDiffRow, 0, sizeof (w.anDiffRow));
+
+  if (g.bCdc && pRep)
+    eCdc = cdcBegin (pRep, zDb2, &cdc);
+
+  /* Diff both databases as of a single snapshot.  Taking the read locks
+   ** up front waits, up to --busy-timeout, for a writer of the source to
+   ** commit, instead of failing or reading a half-written database in
+   ** the middle of the diff.  */
+  rc = sqlite3_exec (w.db, "BEGIN;"
+                     " SELECT count(*) FROM main.sqlite_master;"
+                     " SELECT count(*) FROM aux.sqlite_master;", 0, 0, 0);
+  if (rc != SQLITE_OK)
+    goto diff_busy;
+  if (pRep)
+    replicaCheckSchema (pRep);
+
+  if (g.bCdc && pRep)
+    {
+      eCdc = cdcPrepare (pRep, &cdc, eCdc);
+      if (eCdc == CDC_NEW)
+        {
+          VERBOSE ("* CDC: %d WAL frames, %d rowid ranges\n", cdc.nPage,
+                   cdc.nRange);
+        }
+      else if (eCdc == CDC_FULL)
+        {
+          VERBOSE ("* CDC: full diff\n");
+        }
+    }
+
+  if (pRep && g.nResync > 0 && eCdc == CDC_FULL && diffResyncWanted ())
+    {
+      VERBOSE ("* %s and its backup differ too much for a diff\n", zDb2);
+      cdcEnd (&cdc);
+      sqlite3_exec (w.db, "ROLLBACK", 0, 0, 0);
+      w.db = 0;
+      w.pRep = 0;
+      w.pRowHash = 0;
+      return DIFF_RESYNC;
+    }
+
+  ltime = time (NULL);
+  fprintf (out, "-- %s\n", asctime (localtime (&ltime)));
+  fstart = ftell (out);
+
+  if (eCdc != CDC_NONE)
+    {
+      if (g.useTransaction && !g.bBinary)
+        fprintf (out, "BEGIN TRANSACTION;\n");
+
+      /* Handle tables one by one */
+      pStmt = db_cprepare ("SELECT name FROM main.sqlite_master\n"
+                           " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
+                           " UNION\n"
+                           "SELECT name FROM aux.sqlite_master\n"
+                           " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
+                           " EXCEPT SELECT 'repqlite_state'\n"
+                           " ORDER BY name");
+      while (SQLITE_ROW == sqlite3_step (pStmt))
+        {
+          const char *zTab = (const char *) sqlite3_column_text (pStmt, 0);
+          int bRange = 0;
+          nTab++;
+          if (eCdc == CDC_NEW && (bRange = cdcPrepareTable (zTab, &cdc)) < 0)
+            {
+              if (w.pRowHash)
+                rowHashKeep (pRep, zTab);
+              continue;
+            }
+          if (g.bTableHash && pRep)
+            {
+              if (eCdc == CDC_NEW)
+                {
+                  /* The stored hash is out of date from now on */
+                  replicaSetHash (pRep, zTab, 0);
+                }
+              else
+                {
+                  u64 h = tableHash (zTab);
+                  int bSame = h != 0 && h == replicaGetHash (pRep, zTab)
+                    && sqlite3_table_column_metadata (w.db, "main", zTab, 0,
+                                                      0, 0, 0, 0, 0) == 0;
+                  replicaSetHash (pRep, zTab, h);
+                  if (bSame)
+                    {
+                      if (w.pRowHash)
+                        rowHashKeep (pRep, zTab);
+                      nSame++;
+                      continue;
+                    }
+                }
+            }
+          if (g.nSplitKey > 0 && !bRange && xDiff == diff_one_table
+              && g.fDebug == 0 && diffSplit (zTab, &aTask, &nTask) > 0)
+            continue;
+          if ((g.nTableJob > 1 && pRep) || nTask > 0)
+            {
+              diffTaskAdd (&aTask, &nTask, zTab, bRange, 0);
+              continue;
+            }
+          diffTable (pRep, xDiff, zTab, bRange, out);
+        }
+
+      db_crelease (pStmt);
+      if (nTask > 0)
+        {
+          diffParallel (pRep, aTask, nTask, xDiff, out);
+          while (nTask > 0)
+            sqlite3_free ((char *) aTask[--nTask].zTab);
+          sqlite3_free (aTask);
+        }
+
+      if (g.useTransaction && !g.bBinary)
+        fprintf (out, "COMMIT;\n");
+      if (g.bTableHash && eCdc != CDC_NEW)
+        {
+          VERBOSE ("* %d of %d tables unchanged\n", nSame, nTab);
+        }
+    }
+  cdcEnd (&cdc);
+  if (diffCommit () != SQLITE_OK && pRep && !sqlite3_get_autocommit (w.db))
+    { /* Do not keep a connection stuck in its transaction */
+      replicaFlushCache (pRep);
+      pRep->db = 0;
+    }
+  if (g.bCheckpoint && pRep && pRep->db)
+    diffCheckpoint (zDb2);
+
+  fend = ftell (out);
+  w.nDiffByte = fend - fstart;
+
+  /* TBD: Handle trigger differences */
+  /* TBD: Handle view differences */
+  if (pRep == 0 || pRep->db != w.db)
+    sqlite3_close (w.db);
+  w.db = 0;
+  w.pRep = 0;
+  w.pRowHash = 0;
+
+  return (fend - fstart == 0) ? -1 : fstart;
+
+diff_busy:
+  /* What cdcBegin() or sourceChanged() consumed was not diffed */
+  VERBOSE ("* %s is locked, will retry\n", zDb2);
+  cdcEnd (&cdc);
+  if (pRep && pRep->db == w.db)
+    sqlite3_exec (w.db, "ROLLBACK", 0, 0, 0);
+  else
+    sqlite3_close (w.db);
+  w.db = 0;
+  w.pRep = 0;
+  w.pRowHash = 0;
+  if (pRep)
+    replicaReset (pRep);
+  return DIFF_BUSY;
+}
+
+/*
+** Create directory zDir and its missing parents
+*/
+static void
+makeDirs (const char *zDir)
+{
+  char *z = sqlite3_mprintf ("%s", zDir);
+  char *zSep;
+  if (z == 0)
+    runtimeError ("out of memory");
+  for (zSep = strchr (z + 1, '/');; zSep = strchr (zSep + 1, '/'))
+    {
+      if (zSep)
+        *zSep = 0;
+      if (mkdir (z, 0777) != 0 && errno != EEXIST)
+        runtimeError ("cannot create directory \"%s\": %s", z,
+                      strerror (errno));
+      if (zSep == 0)
+        break;
+      *zSep = '/';
+    }
+  sqlite3_free (z);
+}
+
+/*
+** Return the Replica object of database zName in the directory of pW, or
+** NULL if there is none yet.  Only the inotify thread calls this.
+*/
+static Replica *
+replicaLookup (const Watch * pW, const char *zName)
+{
+  Replica *p;
+  char *zSrc = sqlite3_mprintf ("%s/%s", pW->zDir, zName);
+
+  if (zSrc == 0)
+    runtimeError ("out of memory");
+  for (p = g.aRepHash[strHash (zSrc) % REPLICA_NHASH]; p; p = p->pHashNext)
+    if (strcmp (p->zSrc, zSrc) == 0)
+      break;
+  sqlite3_free (zSrc);
+  return p;
+}
+
+/*
+** Return the Replica object of database zName in the directory of pW,
+** creating it if needed.  Only the inotify thread calls this, and only
+** it uses g.aRepHash.
+*/
+static Replica *
+replicaFind (const Watch * pW, const char *zName)
+{
+  Replica *p = replicaLookup (pW, zName);
+  const char *zSep = pW->zRel[0] ? "/" : "";
+  char *zSrc;
+  unsigned h;
+
+  if (p)
+    return p;
+  zSrc = sqlite3_mprintf ("%s/%s", pW->zDir, zName);
+  if (zSrc == 0)
+    runtimeError ("out of memory");
+  h = strHash (zSrc) % REPLICA_NHASH;
+
+  p = sqlite3_malloc (sizeof (*p));
+  if (p == 0)
+    runtimeError ("out of memory");
+  memset (p, 0, sizeof (*p));
+  p->zName = sqlite3_mprintf ("%s%s%s", pW->zRel, zSep, zName);
+  p->zSrc = zSrc;
+  p->zBackup = sqlite3_mprintf ("%s/backup/%s", pW->zRoot, p->zName);
+  p->zPatch = sqlite3_mprintf ("%s/patches/%s", pW->zRoot, p->zName);
+  if (p->zName == 0 || p->zBackup == 0 || p->zPatch == 0)
+    runtimeError ("out of memory");
+  if (g.nLink > 0)
+    {
+      p->aAcked = sqlite3_malloc (g.nLink * sizeof (p->aAcked[0]));
+      if (p->aAcked == 0)
+        runtimeError ("out of memory");
+      memset (p->aAcked, 0, g.nLink * sizeof (p->aAcked[0]));
+    }
+  if (pW->zRel[0])
+    {
+      char *zDir = sqlite3_mprintf ("%s/backup/%s", pW->zRoot, pW->zRel);
+      char *zDir2 = sqlite3_mprintf ("%s/patches/%s", pW->zRoot, pW->zRel);
+      if (zDir == 0 || zDir2 == 0)
+        runtimeError ("out of memory");
+      makeDirs (zDir);
+      makeDirs (zDir2);
+      sqlite3_free (zDir);
+      sqlite3_free (zDir2);
+    }
+  pthread_mutex_lock (&g.mutex);      /* The links walk the list */
+  p->pNext = g.pReplica;
+  g.pReplica = p;
+  pthread_mutex_unlock (&g.mutex);
+  p->pHashNext = g.aRepHash[h];
+  g.aRepHash[h] = p;
+  return p;
+}
+
+/*
+** The patch journal.
+**
+** The patches of a database are appended to segments of its journal,
+** PATH/patches/NAME.SEQ, where SEQ is the sequence number of the first
+** patch of the segment.  A new segment is started once the current one
+** reaches --segment-size bytes.  Every patch is numbered, and a record
+** of PATH/patches/NAME.idx tells where it is.  The records are of a
+** fixed size and in sequence number order, with no gap.
+**
+** Applying a patch also stores its number in the repqlite_state table
+** of the backup, in the same transaction, and that table is left out of
+** the diff.  When the journal of a database is first opened, the
+** patches that were journaled but not applied before the program
+** stopped are found from the index and applied.  Only the most recent
+** patch diffed against the state of the backup is applied at each step,
+** since an earlier one that failed was superseded by it.  A backup with
+** no repqlite_state table was not written by a journal and is left as
+** it is.
+**
+** With --keep-segments N, only the N most recent segments are kept, and
+** older ones are removed when they contain applied patches only.
+**
+** A backup overwritten by a copy of its source, see replicaResync(), is
+** recorded as an empty patch whose iBase is JOURNAL_IMAGE: no patch
+** diffed before the copy is applied after it.
+*/
+typedef struct JournalEntry JournalEntry;
+struct JournalEntry
+{
+  sqlite3_uint64 iSeq;          /* Sequence number of the patch            */
+  sqlite3_uint64 iBase;         /* Last patch applied when it was diffed   */
+  sqlite3_uint64 iSegment;      /* Segment holding the patch               */
+  sqlite3_uint64 iStart;        /* Offset of the patch in the segment      */
+  sqlite3_uint64 iEnd;          /* Offset of the end of the patch          */
+};
+
+#define JOURNAL_IMAGE (~(sqlite3_uint64) 0)     /* iBase of a resync      */
+
+/*
+** Return the path of segment iSegment of the journal of p.  The result
+** must be freed with sqlite3_free().
+*/
+static char *
+journalSegment (Replica * p, sqlite3_uint64 iSegment)
+{
+  char *z = sqlite3_mprintf ("%s.%010llu", p->zPatch, iSegment);
+  if (z == 0)
+    runtimeError ("out of memory");
+  return z;
+}
+
+/*
+** Read the index of the journal of p.  Return the number of records
+** read and set *paEntry to them, to be freed with sqlite3_free().
+*/
+static int
+journalRead (Replica * p, JournalEntry ** paEntry)
+{
+  JournalEntry *aEntry = 0;
+  int nEntry = 0;
+  int nAlloc = 0;
+  FILE *in = fopen (p->zIndex, "rb");
+
+  while (in)
+    {
+      if (nEntry == nAlloc)
+        {
+          nAlloc = nAlloc * 2 + 256;
+          aEntry = sqlite3_realloc64 (aEntry, nAlloc * sizeof (*aEntry));
+          if (aEntry == 0)
+            runtimeError ("out of memory");
+        }
+      if (fread (&aEntry[nEntry], sizeof (*aEntry), 1, in) != 1)
+        break;
+      if (nEntry > 0 && aEntry[nEntry].iSeq != aEntry[nEntry - 1].iSeq + 1)
+        {
+          fprintf (stderr, "%s: bad record after patch %llu, ignored\n",
+                   p->zIndex, aEntry[nEntry - 1].iSeq);
+          break;
+        }
+      nEntry++;
+    }
+  if (in)
+    fclose (in);
+  *paEntry = aEntry;
+  return nEntry;
+}
+
+/*
+** Set *piSeq to the number of the last patch applied to backup zDb and
+** return true, or return false if zDb has no repqlite_state table
+*/
+static int
+journalApplied (const char *zDb, sqlite3_uint64 * piSeq)
 {
-  const unsigned char *z = (const unsigned char *) zIn;
-  unsigned sum0 = 0;
-  unsigned sum1 = 0;
-  unsigned sum2 = 0;
-  unsigned sum3 = 0;
-  while (N >= 16)
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int bFound = 0;
+
+  if (sqlite3_open_v2 (zDb, &db, SQLITE_OPEN_READONLY, 0) == SQLITE_OK)
     {
-      sum0 += ((unsigned) z[0] + z[4] + z[8] + z[12]);
-      sum1 += ((unsigned) z[1] + z[5] + z[9] + z[13]);
-      sum2 += ((unsigned) z[2] + z[6] + z[10] + z[14]);
-      sum3 += ((unsigned) z[3] + z[7] + z[11] + z[15]);
-      z += 16;
-      N -= 16;
+      sqlite3_busy_timeout (db, g.iBusyTimeout);
+      if (sqlite3_prepare_v2 (db, "SELECT value FROM repqlite_state"
+                              " WHERE name='applied'", -1, &pStmt,
+                              0) == SQLITE_OK)
+        {
+          if (sqlite3_step (pStmt) == SQLITE_ROW)
+            {
+              *piSeq = (sqlite3_uint64) sqlite3_column_int64 (pStmt, 0);
+              bFound = 1;
+            }
+          sqlite3_finalize (pStmt);
+        }
     }
-  while (N >= 4)
+  sqlite3_close (db);
+  return bFound;
+}
+
+/*
+** Return true if database zName in the directory of pW has a journal
+*/
+static int
+journalExists (const Watch * pW, const char *zName)
+{
+  char *zIndex = sqlite3_mprintf ("%s/patches/%s%s%s.idx", pW->zRoot,
+                                  pW->zRel, pW->zRel[0] ? "/" : "", zName);
+  int bExists;
+  if (zIndex == 0)
+    runtimeError ("out of memory");
+  bExists = access (zIndex, F_OK) == 0;
+  sqlite3_free (zIndex);
+  return bExists;
+}
+
+/*
+** Open the journal of p: find its last patch and segment, cut off what
+** a crash may have left after the last indexed patch, and apply the
+** patches the backup missed.
+*/
+static void
+journalOpen (Replica * p)
+{
+  JournalEntry *aEntry;
+  int nEntry, i;
+  int bMarked;
+
+  if (p->zIndex == 0
+      && (p->zIndex = sqlite3_mprintf ("%s.idx", p->zPatch)) == 0)
+    runtimeError ("out of memory");
+  nEntry = journalRead (p, &aEntry);
+  sqlite3_free (p->zSegment);
+  p->zSegment = 0;
+  p->iSeq = 0;
+  if (nEntry > 0)
+    {
+      JournalEntry *pLast = &aEntry[nEntry - 1];
+      struct stat st;
+      p->iSeq = pLast->iSeq;
+      p->iSegment = pLast->iSegment;
+      p->zSegment = journalSegment (p, p->iSegment);
+      p->nSegment = pLast->iEnd;
+      if (stat (p->zSegment, &st) == 0
+          && (sqlite3_uint64) st.st_size > pLast->iEnd)
+        truncate (p->zSegment, pLast->iEnd);
+    }
+
+  p->iApplied = 0;
+  bMarked = journalApplied (p->zBackup, &p->iApplied);
+  if (p->iApplied > p->iSeq)
+    p->iSeq = p->iApplied;      /* The index was lost */
+  while (bMarked)
+    {
+      JournalEntry *pNext = 0;
+      char *zSegment;
+      int rc;
+
+      for (i = 0; i < nEntry; i++)
+        if (aEntry[i].iBase == p->iApplied && aEntry[i].iSeq > p->iApplied)
+          pNext = &aEntry[i];
+      if (pNext == 0)
+        break;
+      zSegment = journalSegment (p, pNext->iSegment);
+      rc = sqlPatch (p->zBackup, zSegment, pNext->iStart, pNext->iEnd,
+                     pNext->iSeq, p);
+      VERBOSE ("* Catch up %s with patch %llu ... %s\n", p->zBackup,
+               pNext->iSeq, rc ? "fail" : "ok");
+      sqlite3_free (zSegment);
+      if (rc != SQLITE_OK || p->iApplied != pNext->iSeq)
+        break;
+    }
+  sqlite3_free (aEntry);
+  p->bJournal = 1;
+}
+
+/*
+** Remove the segments of the journal of p that --keep-segments does not
+** keep and that hold applied patches only, and their index records
+*/
+static void
+journalCompact (Replica * p)
+{
+  JournalEntry *aEntry;
+  int nEntry, i;
+  int nRemove = 1 - g.nKeepSegment;     /* Segments that may be removed */
+  int iKeep = 0;                /* First record kept                    */
+  sqlite3_uint64 iDone = p->iApplied;   /* Last patch no longer needed  */
+  char *zTmp;
+  FILE *out;
+
+  pthread_mutex_lock (&g.mutex);
+  for (i = 0; i < g.nLink; i++)
+    if (p->aAcked[i] < iDone)
+      iDone = p->aAcked[i];
+  pthread_mutex_unlock (&g.mutex);
+
+  /* The current segment is new, so it is not in the index yet */
+  nEntry = journalRead (p, &aEntry);
+  for (i = 0; i < nEntry; i++)
+    if (i == 0 || aEntry[i].iSegment != aEntry[i - 1].iSegment)
+      nRemove++;
+  for (; nRemove > 0; nRemove--)
+    {
+      i = iKeep;
+      while (i < nEntry && aEntry[i].iSegment == aEntry[iKeep].iSegment)
+        i++;
+      if (aEntry[i - 1].iSeq > iDone)
+        break;
+      iKeep = i;
+    }
+  if (iKeep == 0)
+    {
+      sqlite3_free (aEntry);
+      return;
+    }
+
+  zTmp = sqlite3_mprintf ("%s-tmp", p->zIndex);
+  if (zTmp == 0)
+    runtimeError ("out of memory");
+  out = fopen (zTmp, "wb");
+  if (out == 0)
+    runtimeError ("cannot open \"%s\": %s", zTmp, strerror (errno));
+  fwrite (&aEntry[iKeep], sizeof (*aEntry), nEntry - iKeep, out);
+  if (fclose (out) != 0 || rename (zTmp, p->zIndex) != 0)
+    runtimeError ("cannot write \"%s\": %s", p->zIndex, strerror (errno));
+  sqlite3_free (zTmp);
+
+  for (i = 0; i < iKeep; i++)
+    if (i == 0 || aEntry[i].iSegment != aEntry[i - 1].iSegment)
+      {
+        char *zSegment = journalSegment (p, aEntry[i].iSegment);
+        VERBOSE ("* Remove %s\n", zSegment);
+        unlink (zSegment);
+        sqlite3_free (zSegment);
+      }
+  sqlite3_free (aEntry);
+}
+
+/*
+** Start a new segment of the journal of p if the current one is full
+*/
+static void
+journalRotate (Replica * p)
+{
+  if (p->zSegment && p->nSegment < g.nSegmentSize)
+    return;
+  sqlite3_free (p->zSegment);
+  p->iSegment = p->iSeq + 1;
+  p->zSegment = journalSegment (p, p->iSegment);
+  p->nSegment = 0;
+  truncate (p->zSegment, 0);    /* Left by a crash before it was indexed */
+  if (g.nKeepSegment > 0)
+    journalCompact (p);
+}
+
+/*
+** Add record e to the index of the journal of p
+*/
+static void
+journalIndex (Replica * p, const JournalEntry * e)
+{
+  FILE *out = fopen (p->zIndex, "ab");
+  if (out == 0)
+    runtimeError ("cannot open \"%s\": %s", p->zIndex, strerror (errno));
+  if (fwrite (e, sizeof (*e), 1, out) != 1 || fclose (out) != 0)
+    runtimeError ("cannot write \"%s\": %s", p->zIndex, strerror (errno));
+}
+
+/*
+** Number the patch just appended to the journal of p at offset iStart
+** and add it to the index.  Return its sequence number.
+*/
+static sqlite3_uint64
+journalAppend (Replica * p, long iStart)
+{
+  JournalEntry e;
+  struct stat st;
+
+  if (stat (p->zSegment, &st) != 0)
+    runtimeError ("cannot stat \"%s\": %s", p->zSegment, strerror (errno));
+  e.iSeq = ++p->iSeq;
+  e.iBase = p->iApplied;
+  e.iSegment = p->iSegment;
+  e.iStart = iStart;
+  e.iEnd = st.st_size;
+  p->nSegment = st.st_size;
+  journalIndex (p, &e);
+  return e.iSeq;
+}
+
+/*
+** Number the copy of its source just made over the backup of p, see
+** replicaResync(), and add it to the index.  Return its sequence number.
+*/
+static sqlite3_uint64
+journalImage (Replica * p)
+{
+  JournalEntry e;
+
+  e.iSeq = ++p->iSeq;
+  e.iBase = JOURNAL_IMAGE;
+  e.iSegment = p->iSegment;
+  e.iStart = e.iEnd = p->nSegment;
+  journalIndex (p, &e);
+  return e.iSeq;
+}
+
+/*
+** Open the current segment of the journal of p for appending
+*/
+static FILE *
+journalFile (Replica * p)
+{
+  FILE *out = fopen (p->zSegment, g.bBinary ? "ab" : "a");
+  if (out == 0)
+    runtimeError ("cannot open \"%s\": %s", p->zSegment, strerror (errno));
+  if (w.aOutBuf == 0 && (w.aOutBuf = malloc (OUT_BUFSIZE)) == 0)
+    runtimeError ("out of memory");
+  setvbuf (out, w.aOutBuf, _IOFBF, OUT_BUFSIZE);
+  return out;
+}
+
+/*
+** Page-level resync.
+**
+** When the diff would dump --resync percent of the rows of the source or
+** more, because tables are missing from the backup or their schema
+** changed, the backup is overwritten by a copy of the source made with
+** the backup API instead, which copies pages, not rows.  That is also
+** how a backup that does not exist yet is first made.  The copy is
+** recorded in the journal, then its number stored in repqlite_state.
+** The links then seed their receivers again, see "Remote replicas".
+**
+** The table hashes and the WAL position of --cdc are reset, so the next
+** diff is a full one.
+*/
+
+/*
+** Overwrite the backup of p by a copy of its source.  Return non-zero if
+** it must be tried again later.
+*/
+static int
+replicaResync (Replica * p)
+{
+  sqlite3 *pSrc = 0;
+  sqlite3 *pDst = 0;
+  sqlite3_backup *pBackup;
+  int rc;
+
+  replicaClose (p);
+  replicaReset (p);
+  if (g.bRowHash)
+    rowHashClear (p);
+  rc = sqlite3_open_v2 (p->zSrc, &pSrc, SQLITE_OPEN_READONLY, 0);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_open (p->zBackup, &pDst);
+  if (rc == SQLITE_OK)
+    {
+      sqlite3_busy_timeout (pSrc, g.iBusyTimeout);
+      sqlite3_busy_timeout (pDst, g.iBusyTimeout);
+      pBackup = sqlite3_backup_init (pDst, "main", pSrc, "main");
+      if (pBackup == 0)
+        rc = sqlite3_errcode (pDst);
+      else
+        {
+          rc = sqlite3_backup_step (pBackup, -1);
+          sqlite3_backup_finish (pBackup);
+          if (rc == SQLITE_DONE)
+            rc = SQLITE_OK;
+        }
+    }
+  if (rc == SQLITE_OK && !g.bNoJournal)
+    {
+      sqlite3_uint64 iSeq = journalImage (p);
+      rc = patchMark (pDst, iSeq);
+      if (rc == SQLITE_OK)
+        p->iApplied = iSeq;
+    }
+  sqlite3_close (pSrc);
+  sqlite3_close (pDst);
+  VERBOSE ("* Resync %s ... %s\n", p->zBackup, rc ? "fail" : "ok");
+  if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED)
+    return 1;
+  if (rc != SQLITE_OK)
+    fprintf (stderr, "replicaResync: %s\n", sqlite3_errstr (rc));
+  return 0;
+}
+
+/*
+** Direct replication.
+**
+** With --direct, the diff is not read back from the journal.  The patch
+** is streamed through a pipe of DIRECT_PIPE_SIZE bytes to a thread that
+** applies it to the backup while the diff runs, in one transaction that
+** is committed once the diff is done.  The journal is written by the
+** diff thread on the way, unless --no-journal, and the applier never
+** waits for it.
+**
+** The applier takes its write lock before the diff starts.  The diff
+** only reads the backup, and the patch is not visible to it before the
+** commit.  The write lock is held for the whole diff, and in rollback
+** journal mode the commit must wait for the diff to end its read
+** transaction, so the page cache of the patch is not spilled to the
+** database early, which would need an exclusive lock too.
+*/
+#define DIRECT_PIPE_SIZE (1024 * 1024)  /* Bytes queued for the applier */
+
+typedef struct DirectOut DirectOut;
+struct DirectOut
+{
+  int fd;                       /* Write end of the pipe                  */
+  FILE *pJournal;               /* Journal segment, if any                */
+  off64_t iOff;                 /* Position reported by ftell()           */
+};
+
+typedef struct DirectApply DirectApply;
+struct DirectApply
+{
+  Patcher *p;                   /* Patcher of the backup                  */
+  FILE *in;                     /* Read end of the pipe                   */
+};
+
+/*
+** Write callback of the stream of the diff: copy to the journal, if
+** any, and queue for the applier
+*/
+static ssize_t
+directWrite (void *pCookie, const char *a, size_t n)
+{
+  DirectOut *d = (DirectOut *) pCookie;
+  size_t i = 0;
+
+  if (d->pJournal && fwrite (a, 1, n, d->pJournal) != n)
+    return -1;
+  while (i < n)
+    {
+      ssize_t nWritten = write (d->fd, &a[i], n - i);
+      if (nWritten < 0 && errno == EINTR)
+        continue;
+      if (nWritten < 0)
+        return -1;
+      i += nWritten;
+    }
+  d->iOff += n;
+  return n;
+}
+
+/*
+** Seek callback of the stream of the diff.  Only ftell() is supported:
+** it returns the position in the journal segment.
+*/
+static int
+directSeek (void *pCookie, off64_t * pOff, int whence)
+{
+  DirectOut *d = (DirectOut *) pCookie;
+  if (whence != SEEK_CUR || *pOff != 0)
+    return -1;
+  *pOff = d->iOff;
+  return 0;
+}
+
+/*
+** Close callback of the stream of the diff: the applier reads the end
+** of the patch
+*/
+static int
+directClose (void *pCookie)
+{
+  DirectOut *d = (DirectOut *) pCookie;
+  int rc = close (d->fd);
+  if (d->pJournal && fclose (d->pJournal) != 0)
+    rc = -1;
+  return rc;
+}
+
+/*
+** Body of the applier thread
+*/
+static void *
+directApplyMain (void *pArg)
+{
+  DirectApply *a = (DirectApply *) pArg;
+  char aBuf[4096];
+  int c;
+
+  if (g.bBinary)
+    {
+      /* Skip the text header of the patch, up to its first record */
+      while ((c = getc (a->in)) == '-' || c == '\n')
+        while (c != '\n' && (c = getc (a->in)) != EOF);
+      if (c != EOF)
+        ungetc (c, a->in);
+      patchBinary (a->p, a->in, LONG_MAX);
+    }
+  else
+    patchText (a->p, a->in, LONG_MAX);
+
+  /* Drain what is left after an error, so that the diff can finish */
+  while (fread (aBuf, 1, sizeof (aBuf), a->in) > 0);
+  return 0;
+}
+
+/*
+** Replicate p with --direct.  Return non-zero if it must be tried again
+** later.
+*/
+static int
+replicateDirect (Replica * p)
+{
+  cookie_io_functions_t io = { 0, directWrite, directSeek, directClose };
+  DirectOut d;
+  DirectApply a;
+  Patcher local;
+  Patcher *pP;
+  pthread_t tid;
+  int aFd[2];
+  FILE *out;
+  long nbytes;
+  sqlite3_uint64 iSeq = 0;
+  sqlite3_int64 iStart = timeNowUs ();
+  sqlite3_int64 iDiffEnd;
+  int nStmt;
+  int rc;
+
+  if (patchBegin (p->zBackup, p, &local, &pP) != SQLITE_OK)
+    {
+      VERBOSE ("* %s is locked, will retry\n", p->zBackup);
+      patchEnd (pP, 0, p, &local);
+      statsCount (p, STAT_BUSY);
+      return 1;
+    }
+
+  memset (&d, 0, sizeof (d));
+  if (pipe (aFd) != 0)
+    runtimeError ("pipe: %s", strerror (errno));
+  fcntl (aFd[1], F_SETPIPE_SZ, DIRECT_PIPE_SIZE);
+  d.fd = aFd[1];
+  if (!g.bNoJournal)
+    {
+      struct stat st;
+      d.pJournal = journalFile (p);
+      if (fstat (fileno (d.pJournal), &st) == 0)
+        d.iOff = st.st_size;
+    }
+  out = fopencookie (&d, "w", io);
+  a.p = pP;
+  a.in = fdopen (aFd[0], "r");
+  if (out == 0 || a.in == 0)
+    runtimeError ("out of memory");
+  if (pthread_create (&tid, 0, directApplyMain, &a) != 0)
+    runtimeError ("cannot start the applier thread");
+
+  nbytes = sqlDiff (p->zBackup, p->zSrc, out, p);
+  iDiffEnd = timeNowUs ();
+  if (fclose (out) != 0 && nbytes >= 0)
+    runtimeError ("cannot write \"%s\": %s", p->zSegment, strerror (errno));
+  pthread_join (tid, 0);
+  fclose (a.in);
+
+  if (nbytes < 0)
+    {
+      /* Nothing to apply */
+      sqlite3_exec (pP->db, "ROLLBACK", 0, 0, 0);
+      patchEnd (pP, 0, p, &local);
+      statsCount (p, nbytes == DIFF_RESYNC ? STAT_RESYNC
+                  : nbytes == DIFF_BUSY ? STAT_BUSY : STAT_EMPTY);
+      if (nbytes == DIFF_RESYNC)
+        return replicaResync (p);
+      return nbytes == DIFF_BUSY;
+    }
+  if (!g.bNoJournal)
+    iSeq = journalAppend (p, nbytes);
+  nStmt = pP->nApplied;
+  rc = patchEnd (pP, iSeq, p, &local);
+  statsAdd (p, w.nDiffByte, nStmt, iDiffEnd - iStart,
+            timeNowUs () - iStart, rc);
+  VERBOSE ("* Patch %s ... %s\n", p->zBackup, rc ? "fail" : "ok");
+  if (rc != SQLITE_OK)
+    {
+      fprintf (stderr, "sqlPatch: %s\n", sqlite3_errstr (rc));
+      replicaReset (p);         /* Rescan everything next time */
+    }
+  return 0;
+}
+
+/*
+** Diff the source database of p against its backup and patch the backup.
+** Return non-zero if it must be tried again later.
+*/
+static int
+replicate (Replica * p)
+{
+  long nbytes;
+  FILE *out;
+  sqlite3_int64 iStart;
+
+  replicaCheckFiles (p);
+  if (!sourceChanged (p, p->zSrc))
+    {
+      VERBOSE ("* %s unchanged\n", p->zSrc);
+      statsCount (p, STAT_UNCHANGED);
+      return 0;
+    }
+  if (!g.bNoJournal)
+    {
+      if (!p->bJournal)
+        journalOpen (p);
+      journalRotate (p);
+    }
+  if (g.bDirect)
+    return replicateDirect (p);
+
+  out = journalFile (p);
+  iStart = timeNowUs ();
+  nbytes = sqlDiff (p->zBackup, p->zSrc, out, p);
+  if (fclose (out) != 0 && nbytes >= 0)
+    runtimeError ("cannot write \"%s\": %s", p->zSegment, strerror (errno));
+  if (nbytes == DIFF_BUSY)
+    {
+      statsCount (p, STAT_BUSY);
+      return 1;
+    }
+  if (nbytes == DIFF_RESYNC)
+    {
+      statsCount (p, STAT_RESYNC);
+      return replicaResync (p);
+    }
+  if (nbytes == -1)
+    statsCount (p, STAT_EMPTY);
+  else
+    {
+      sqlite3_uint64 iSeq = journalAppend (p, nbytes);
+      sqlite3_int64 iPatch = timeNowUs ();
+      int rc = sqlPatch (p->zBackup, p->zSegment, nbytes, p->nSegment,
+                         iSeq, p);
+      statsAdd (p, w.nDiffByte, p->pPatcher ? p->pPatcher->nApplied : 0,
+                iPatch - iStart, timeNowUs () - iPatch, rc);
+      VERBOSE ("* Patch %s ... %s\n", p->zBackup, rc ? "fail" : "ok");
+      if (rc != SQLITE_OK)
+        {
+          fprintf (stderr, "sqlPatch: %s\n", sqlite3_errstr (rc));
+          replicaReset (p);     /* Rescan everything next time */
+        }
+    }
+  return 0;
+}
+
+/*
+** The worker pool.
+**
+** The inotify thread only turns events into jobs, which g.nWorker
+** worker threads take from a queue.  A database is never replicated by
+** two workers at once.  A change notified while its database waits in
+** the queue is merged into the queued job.  A change notified while a
+** worker replicates it is remembered, and the database is queued again
+** once the worker is done with it.
+**
+** The job queue and the bQueued, bBusy and bPending flags of Replica
+** objects are protected by g.mutex.  Everything else in a Replica is
+** only used by the worker replicating it.  The worker that leaves the
+** queue empty and no database busy signals g.doneFd, which the event
+** loop waits on at exit.
+*/
+static void
+jobPush (Replica * p)
+{
+  p->bQueued = 1;
+  p->pNextJob = 0;
+  if (g.pLastJob)
+    g.pLastJob->pNextJob = p;
+  else
+    g.pJob = p;
+  g.pLastJob = p;
+  pthread_cond_signal (&g.cond);
+}
+
+/*
+** Schedule the replication of p after a change of its source database
+*/
+static void
+replicaSchedule (Replica * p)
+{
+  pthread_mutex_lock (&g.mutex);
+  if (p->iEventTime == 0)
+    p->iEventTime = p->iFirstEvent;
+  else
+    p->stats.nCoalesced++;
+  if (p->bBusy)
+    p->bPending = 1;
+  else if (!p->bQueued)
+    jobPush (p);
+  pthread_mutex_unlock (&g.mutex);
+}
+
+static void linkNotify (void);
+
+static void *
+workerMain (void *pArg)
+{
+  (void) pArg;
+  pthread_mutex_lock (&g.mutex);
+  for (;;)
+    {
+      Replica *p;
+      int bRetry;
+      while (g.pJob == 0 && !g.bStop)
+        pthread_cond_wait (&g.cond, &g.mutex);
+      if (g.pJob == 0)
+        break;
+
+      p = g.pJob;
+      g.pJob = p->pNextJob;
+      if (g.pJob == 0)
+        g.pLastJob = 0;
+      p->bQueued = 0;
+      p->bBusy = 1;
+      g.nBusy++;
+      p->iJobEvent = p->iEventTime;
+      p->iEventTime = 0;
+      pthread_mutex_unlock (&g.mutex);
+
+      bRetry = replicate (p);
+      scratchTrim ();
+
+      pthread_mutex_lock (&g.mutex);
+      p->bBusy = 0;
+      g.nBusy--;
+      if (bRetry)
+        {
+          p->bPending = 1;
+          if (p->iJobEvent > 0
+              && (p->iEventTime == 0 || p->iJobEvent < p->iEventTime))
+            p->iEventTime = p->iJobEvent;
+        }
+      if (g.nLink > 0 && p->iShipped != p->iApplied)
+        {
+          p->iShipped = p->iApplied;
+          linkNotify ();
+        }
+      if (p->bPending)
+        {
+          p->bPending = 0;
+          jobPush (p);
+        }
+      if (g.pJob == 0 && g.nBusy == 0)
+        {
+          u64 v = 1;
+          if (write (g.doneFd, &v, sizeof (v)) < 0)
+            {
+              /* The event loop is already due to wake up */
+            }
+        }
+    }
+  pthread_mutex_unlock (&g.mutex);
+  sqlite3_free (w.pLit);
+  sqlite3_free (w.pDelta);
+  sqlite3_free (w.pDeltaHash);
+  free (w.aOutBuf);
+  return 0;
+}
+
+/*
+** Start the worker threads
+*/
+static void
+workersStart (void)
+{
+  int i;
+  sigset_t mask, oldMask;
+
+  g.aWorker = sqlite3_malloc (g.nWorker * sizeof (g.aWorker[0]));
+  if (g.aWorker == 0)
+    runtimeError ("out of memory");
+
+  /* Signals are handled by the event loop only */
+  sigfillset (&mask);
+  pthread_sigmask (SIG_BLOCK, &mask, &oldMask);
+  for (i = 0; i < g.nWorker; i++)
+    if (pthread_create (&g.aWorker[i], 0, workerMain, 0))
+      runtimeError ("cannot create worker thread");
+  pthread_sigmask (SIG_SETMASK, &oldMask, 0);
+}
+
+/*
+** Let the workers finish the jobs already queued, then join them
+*/
+static void
+workersStop (void)
+{
+  int i;
+  pthread_mutex_lock (&g.mutex);
+  g.bStop = 1;
+  pthread_cond_broadcast (&g.cond);
+  pthread_mutex_unlock (&g.mutex);
+  for (i = 0; i < g.nWorker; i++)
+    pthread_join (g.aWorker[i], 0);
+  sqlite3_free (g.aWorker);
+  g.aWorker = 0;
+}
+
+/*
+** Event coalescing.
+**
+** Events do not schedule a replication right away.  They mark their
+** database dirty, and a dirty database is scheduled once no event came
+** for g.iInterval ms, but no later than g.iMaxDelay ms after its first
+** event.  A burst of writes therefore costs a single replication, and a
+** database written continuously is replicated every g.iMaxDelay ms.
+*/
+
+/*
+** Return the current time in milliseconds
+*/
+static sqlite3_int64
+timeNow (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+** Note an event for the database of p
+*/
+static void
+replicaTouch (Replica * p)
+{
+  sqlite3_int64 iNow = timeNow ();
+  p->stats.nEvent++;
+  if (!p->bDirty)
     {
-      sum0 += z[0];
-      sum1 += z[1];
-      sum2 += z[2];
-      sum3 += z[3];
-      z += 4;
-      N -= 4;
+      p->bDirty = 1;
+      p->iFirstEvent = iNow;
+      p->pNextDirty = g.pDirty;
+      g.pDirty = p;
     }
-  sum3 += (sum2 << 8) + (sum1 << 16) + (sum0 << 24);
-  switch (N)
+  else
+    p->stats.nCoalesced++;
+  p->iLastEvent = iNow;
+}
+
+/*
+** Schedule all dirty databases that are due, or all of them if bAll.
+** Return the number of ms until the next one is due, or -1 if no
+** database is dirty.  Only the dirty databases are looked at, so that
+** a wakeup does not cost a walk of every known database.
+*/
+static int
+replicaFlush (int bAll)
+{
+  sqlite3_int64 iNow = timeNow ();
+  sqlite3_int64 iWait = -1;
+  Replica **pp = &g.pDirty;
+  Replica *p;
+
+  while ((p = *pp) != 0)
     {
-    case 3:
-      sum3 += (z[2] << 8);
-    case 2:
-      sum3 += (z[1] << 16);
-    case 1:
-      sum3 += (z[0] << 24);
-    default:;
+      sqlite3_int64 iDue = p->iLastEvent + g.iInterval;
+      if (iDue > p->iFirstEvent + g.iMaxDelay)
+        iDue = p->iFirstEvent + g.iMaxDelay;
+      if (bAll || iDue <= iNow)
+        {
+          *pp = p->pNextDirty;
+          p->bDirty = 0;
+          replicaSchedule (p);
+          continue;
+        }
+      if (iWait < 0 || iDue - iNow < iWait)
+        iWait = iDue - iNow;
+      pp = &p->pNextDirty;
     }
-  return sum3;
+  return (int) iWait;
 }
 
 /*
-** Create a new delta.
-**
-** The delta is written into a preallocated buffer, zDelta, which
-** should be at least 60 bytes longer than the target file, zOut.
-** The delta string will be NUL-terminated, but it might also contain
-** embedded NUL characters if either the zSrc or zOut files are
-** binary.  This function returns the length of the delta string
-** in bytes, excluding the final NUL terminator character.
-**
-** Output Format:
-**
-** The delta begins with a base64 number followed by a newline.  This
-** number is the number of bytes in the TARGET file.  Thus, given a
-** delta file z, a program can compute the size of the output file
-** simply by reading the first line and decoding the base-64 number
-** found there.  The delta_output_size() routine does exactly this.
-**
-** After the initial size number, the delta consists of a series of
-** literal text segments and commands to copy from the SOURCE file.
-** A copy command looks like this:
-**
-**     NNN@MMM,
-**
-** where NNN is the number of bytes to be copied and MMM is the offset
-** into the source file of the first byte (both base-64).   If NNN is 0
-** it means copy the rest of the input file.  Literal text is like this:
-**
-**     NNN:TTTTT
+** Remote replicas.
 **
-** where NNN is the number of bytes of text (base-64) and TTTTT is the text.
-**
-** The last term is of the form
-**
-**     NNN;
-**
-** In this case, NNN is a 32-bit bigendian checksum of the output file
-** that can be used to verify that the delta applied correctly.  All
-** numbers are in base-64.
+** With --replica HOST:PORT, the patches applied to the backups are also
+** shipped over TCP to "repqlite --listen PORT PATH" on another host,
+** which applies them to its copies of the backups, PATH/NAME.  The diff
+** runs once whatever the number of replicas: every --replica is a link
+** with its own thread, which reads the patches from the journal.
 **
-** Pure text files generate a pure text delta.  Binary files generate a
-** delta that may contain some binary data.
+** For every database, a link first asks the receiver for the number of
+** the last patch applied to its copy.  It then sends the patches the
+** backup applied since, in order, without waiting for each of them to
+** be acknowledged: up to --send-window patches may be in flight on a
+** link.  The frames are compressed with zlib and queued, and the queue
+** is sent once it reaches LINK_BATCH bytes or nothing more can be sent.
+** The receiver applies a patch only if its copy is at the state the
+** patch was diffed against, and stores its number in repqlite_state in
+** the same transaction, as the backups do.  A link that is broken is
+** connected again, and resumes from the state of the receiver.
 **
-** Algorithm:
+** A receiver with no copy of a database, with a copy that has no
+** repqlite_state table, or with a copy the patches of the journal do not
+** lead from, is seeded: the link snapshots the backup with the backup
+** API and sends the file in chunks of LINK_CHUNK bytes, at most
+** LINK_SEED_STEP bytes at a time so that the other databases of the link
+** are not held up.  The receiver writes it to NAME-seed, then
+** copies it over its copy with the backup API, which readers of the copy
+** can live with.  The snapshot holds the repqlite_state of the backup,
+** so the link goes on from there.
 **
-** The encoder first builds a hash table to help it find matching
-** patterns in the source file.  16-byte chunks of the source file
-** sampled at evenly spaced intervals are used to populate the hash
-** table.
+** With --keep-segments, a segment is not removed before every link had
+** its patches acknowledged.
 **
-** Next we begin scanning the target file using a sliding 16-byte
-** window.  The hash of the 16-byte window in the target is used to
-** search for a matching section in the source file.  When a match
-** is found, a copy command is added to the delta.  An effort is
-** made to extend the matching section to regions that come before
-** and after the 16-byte hash window.  A copy command is only issued
-** if the result would use less space that just quoting the text
-** literally. Literal text is added to the delta for sections that
-** do not match or which can not be encoded efficiently using copy
-** commands.
+** The receiver does not authenticate the senders, so it must only be
+** reachable from a trusted network.
+*/
+#define LINK_HDRSIZE 32         /* Size of the header of a frame            */
+#define LINK_BATCH (256 * 1024) /* Frames queued before they are sent       */
+#define LINK_MAXNAME 4096       /* Longest database name                    */
+#define LINK_MAXDATA (1024 * 1024 * 1024)       /* Largest patch            */
+#define LINK_DEFLATE_MIN 512    /* Smaller patches are not compressed       */
+#define LINK_RETRY 1000         /* ms between attempts to connect           */
+#define LINK_DRAIN 5000         /* Max ms spent shipping patches at exit    */
+#define LINK_CHUNK (256 * 1024) /* Bytes of a seed sent in a frame           */
+#define LINK_SEED_STEP (4 * 1024 * 1024)        /* Seed bytes sent at once  */
+
+/* Frame types */
+#define LINK_QUERY 'Q'          /* Last patch applied to database zName?    */
+#define LINK_STATE 'S'          /* It is iSeq, unless MISSING or UNMARKED    */
+#define LINK_PATCH 'P'          /* Patch iSeq, diffed after patch iArg      */
+#define LINK_ACK   'A'          /* Patch iSeq applied if iArg is SQLITE_OK  */
+#define LINK_IMAGE 'I'          /* Seed chunk at iArg of iArg2, as of iSeq  */
+
+/* Frame flags */
+#define LINK_F_BINARY   0x01    /* The patch is in the binary format        */
+#define LINK_F_DEFLATE  0x02    /* The data is compressed with zlib         */
+#define LINK_F_MISSING  0x04    /* The receiver has no such database        */
+#define LINK_F_UNMARKED 0x08    /* Its copy has no repqlite_state table     */
+
+/*
+** A frame.  On the wire, the header is made of the integer fields below
+** in this order, big-endian, of 1, 1, 2, 4, 8, 8 and 8 bytes.  It is
+** followed by the nName bytes of the name and the nData bytes of data.
+*/
+typedef struct LinkFrame LinkFrame;
+struct LinkFrame
+{
+  int eType;                    /* LINK_QUERY, LINK_STATE...                */
+  int flags;                    /* LINK_F_* flags                           */
+  u32 nName;                    /* Length of zName                          */
+  u32 nData;                    /* Bytes of aData                           */
+  u64 iSeq;                     /* Number of a patch                        */
+  u64 iArg;                     /* Depends on eType                         */
+  u64 iArg2;                    /* Depends on eType                         */
+  const char *zName;            /* Database name, not NUL-terminated        */
+  const u8 *aData;              /* The data                                 */
+};
+
+/*
+** What a link knows of one database
+*/
+#define LINKDB_NEW    0         /* State of the receiver not asked for yet  */
+#define LINKDB_QUERY  1         /* Waiting for the state of the receiver    */
+#define LINKDB_READY  2         /* Shipping the patches                     */
+#define LINKDB_SKIP   3         /* The receiver cannot be patched           */
+#define LINKDB_FAILED 4         /* A patch failed, ask again at iRetry      */
+#define LINKDB_SEED   5         /* Sending a snapshot of the backup         */
+
+struct LinkDb
+{
+  Replica *p;                   /* The database                             */
+  int eState;                   /* LINKDB_* state                           */
+  u64 iSent;                    /* Last patch sent or applied by receiver   */
+  u64 iAcked;                   /* Last patch acknowledged by the receiver  */
+  u64 iSkip;                    /* Patch shipped when last asked or skipped */
+  int nFlight;                  /* Patches sent, not acknowledged yet       */
+  sqlite3_int64 iRetry;         /* Time to ask again, if LINKDB_FAILED      */
+  JournalEntry *aEntry;         /* Index of the journal of p, as last read  */
+  int nEntry;                   /* Number of entries in aEntry[]            */
+  int fdSeed;                   /* Snapshot being sent, or -1               */
+  u64 iSeedSeq;                 /* Last patch applied to the snapshot       */
+  sqlite3_int64 iSeedOff;       /* Bytes of the snapshot sent               */
+  sqlite3_int64 nSeed;          /* Size of the snapshot                     */
+  LinkDb *pNext;                /* Next database of the same link           */
+};
+
+/*
+** Encode or decode the n-byte big-endian integer at a
+*/
+static void
+putNbyte (u8 * a, u64 v, int n)
+{
+  while (n-- > 0)
+    {
+      a[n] = (u8) v;
+      v >>= 8;
+    }
+}
+
+static u64
+getNbyte (const u8 * a, int n)
+{
+  u64 v = 0;
+  int i;
+  for (i = 0; i < n; i++)
+    v = (v << 8) | a[i];
+  return v;
+}
+
+/*
+** Queue frame f in pB
+*/
+static void
+linkAppend (LinkBuf * pB, const LinkFrame * f)
+{
+  u8 *a = scratchReserve (&pB->a, &pB->nAlloc,
+                          pB->n + LINK_HDRSIZE + f->nName + f->nData);
+  a += pB->n;
+  a[0] = (u8) f->eType;
+  a[1] = (u8) f->flags;
+  putNbyte (&a[2], f->nName, 2);
+  putNbyte (&a[4], f->nData, 4);
+  putNbyte (&a[8], f->iSeq, 8);
+  putNbyte (&a[16], f->iArg, 8);
+  putNbyte (&a[24], f->iArg2, 8);
+  memcpy (&a[LINK_HDRSIZE], f->zName, f->nName);
+  if (f->nData > 0)
+    memcpy (&a[LINK_HDRSIZE + f->nName], f->aData, f->nData);
+  pB->n += LINK_HDRSIZE + f->nName + f->nData;
+}
+
+/*
+** Decode the next frame of pB into f.  Return 1 if one was decoded, 0 if
+** pB does not hold a complete frame yet, or -1 if the frame is invalid.
+** f points into pB until the next linkFill().
 */
 static int
-rbuDeltaCreate (const char *zSrc,       /* The source or pattern file       */
-                unsigned int lenSrc,    /* Length of the source file        */
-                const char *zOut,       /* The target file                  */
-                unsigned int lenOut,    /* Length of the target file        */
-                char *zDelta            /* Write the delta into this buffer */
-  )
+linkParse (LinkBuf * pB, LinkFrame * f)
 {
-  unsigned int i, base;
-  char *zOrigDelta = zDelta;
-  hash h;
-  int nHash;                    /* Number of hash table entries             */
-  int *landmark;                /* Primary hash table                       */
-  int *collide;                 /* Collision chain                          */
-  int lastRead = -1;            /* Last byte of zSrc read by a COPY command */
+  const u8 *a = (const u8 *) pB->a + pB->iRead;
+  size_t n = pB->n - pB->iRead;
 
-  /* Add the target file size to the beginning of the delta
-   */
-  putInt (lenOut, &zDelta);
-  *(zDelta++) = '\n';
+  if (n < LINK_HDRSIZE)
+    return 0;
+  f->eType = a[0];
+  f->flags = a[1];
+  f->nName = (u32) getNbyte (&a[2], 2);
+  f->nData = (u32) getNbyte (&a[4], 4);
+  f->iSeq = getNbyte (&a[8], 8);
+  f->iArg = getNbyte (&a[16], 8);
+  f->iArg2 = getNbyte (&a[24], 8);
+  if (f->nName == 0 || f->nName > LINK_MAXNAME || f->nData > LINK_MAXDATA)
+    return -1;
+  if (n < LINK_HDRSIZE + f->nName + f->nData)
+    return 0;
+  f->zName = (const char *) &a[LINK_HDRSIZE];
+  f->aData = &a[LINK_HDRSIZE + f->nName];
+  pB->iRead += LINK_HDRSIZE + f->nName + f->nData;
+  return 1;
+}
 
-  /* If the source file is very small, it means that we have no
-   ** chance of ever doing a copy command.  Just output a single
-   ** literal segment for the entire target and exit.
-   */
-  if (lenSrc <= NHASH)
+/*
+** Send the frames queued in pB to connection fd.  Return 0 on success.
+*/
+static int
+linkFlush (int fd, LinkBuf * pB)
+{
+  size_t i = 0;
+  while (i < pB->n)
     {
-      putInt (lenOut, &zDelta);
-      *(zDelta++) = ':';
-      memcpy (zDelta, zOut, lenOut);
-      zDelta += lenOut;
-      putInt (checksum (zOut, lenOut), &zDelta);
-      *(zDelta++) = ';';
-      return zDelta - zOrigDelta;
+      ssize_t n = send (fd, (u8 *) pB->a + i, pB->n - i, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      i += n;
     }
+  pB->n = 0;
+  return 0;
+}
 
-  /* Compute the hash table used to locate matching sections in the
-   ** source file.
-   */
-  nHash = lenSrc / NHASH;
-  collide = sqlite3_malloc (nHash * 2 * sizeof (int));
-  landmark = &collide[nHash];
-  memset (landmark, -1, nHash * sizeof (int));
-  memset (collide, -1, nHash * sizeof (int));
-  for (i = 0; i < lenSrc - NHASH; i += NHASH)
+/*
+** Read what connection fd has to offer into pB, after the frames not
+** decoded yet.  Return the number of bytes read, 0 at the end of the
+** connection, or -1 on error.
+*/
+static ssize_t
+linkFill (int fd, LinkBuf * pB)
+{
+  ssize_t n;
+  u8 *a;
+
+  pB->n -= pB->iRead;
+  memmove (pB->a, (u8 *) pB->a + pB->iRead, pB->n);
+  pB->iRead = 0;
+  a = scratchReserve (&pB->a, &pB->nAlloc, pB->n + 65536);
+  do
+    n = recv (fd, &a[pB->n], pB->nAlloc - pB->n, 0);
+  while (n < 0 && errno == EINTR);
+  if (n > 0)
+    pB->n += n;
+  return n;
+}
+
+/*
+** Split zArg, [HOST:]PORT, into *pzHost and *pzPort, to be freed with
+** sqlite3_free().  *pzHost is NULL if no HOST is given.  A HOST with a
+** ':' must be between brackets.  Return non-zero if zArg is invalid.
+*/
+static int
+linkSplitAddr (const char *zArg, char **pzHost, char **pzPort)
+{
+  const char *zColon = strrchr (zArg, ':');
+  const char *zHost = zArg;
+  int nHost = zColon ? (int) (zColon - zArg) : 0;
+
+  *pzHost = 0;
+  if (zColon == 0)
+    zColon = zArg - 1;
+  if (zColon[1] == 0)
+    return 1;
+  if (nHost >= 2 && zHost[0] == '[' && zHost[nHost - 1] == ']')
+    {
+      zHost++;
+      nHost -= 2;
+    }
+  if (nHost > 0 && (*pzHost = sqlite3_mprintf ("%.*s", nHost, zHost)) == 0)
+    runtimeError ("out of memory");
+  if ((*pzPort = sqlite3_mprintf ("%s", &zColon[1])) == 0)
+    runtimeError ("out of memory");
+  return 0;
+}
+
+/*
+** Return true if the n bytes of z are a relative path with no "." and
+** ".." component, fit to name the database a receiver patches
+*/
+static int
+linkNameValid (const char *z, int n)
+{
+  int i, iSeg = 0;
+  for (i = 0; i <= n; i++)
+    if (i == n || z[i] == '/')
+      {
+        int nSeg = i - iSeg;
+        if (nSeg == 0 || (nSeg == 1 && z[iSeg] == '.')
+            || (nSeg == 2 && z[iSeg] == '.' && z[iSeg + 1] == '.'))
+          return 0;
+        iSeg = i + 1;
+      }
+    else if (z[i] == 0)
+      return 0;
+  return 1;
+}
+
+/*
+** Wake up the links: patches were applied
+*/
+static void
+linkNotify (void)
+{
+  u64 v = 1;
+  int i;
+  for (i = 0; i < g.nLink; i++)
+    if (write (g.aLink[i].efd, &v, sizeof (v)) < 0)
+      {
+        /* The link is already due to wake up */
+      }
+}
+
+/*
+** Open the connection of pL.  Return 0 on success.
+*/
+static int
+linkConnect (Link * pL)
+{
+  struct addrinfo hints, *aInfo, *pI;
+  int fd = -1;
+  int one = 1;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo (pL->zHost, pL->zPort, &hints, &aInfo) != 0)
+    return -1;
+  for (pI = aInfo; pI && fd < 0; pI = pI->ai_next)
+    {
+      fd = socket (pI->ai_family, pI->ai_socktype, pI->ai_protocol);
+      if (fd >= 0 && connect (fd, pI->ai_addr, pI->ai_addrlen) != 0)
+        {
+          close (fd);
+          fd = -1;
+        }
+    }
+  freeaddrinfo (aInfo);
+  if (fd < 0)
+    return -1;
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  pL->fd = fd;
+  return 0;
+}
+
+/*
+** Forget the snapshot of ld, if any
+*/
+static void
+linkSeedEnd (LinkDb * ld)
+{
+  if (ld->fdSeed >= 0)
+    close (ld->fdSeed);
+  ld->fdSeed = -1;
+}
+
+/*
+** Close the connection of pL, and forget what the receiver told
+*/
+static void
+linkClose (Link * pL)
+{
+  LinkDb *ld;
+  if (pL->fd < 0)
+    return;
+  close (pL->fd);
+  pL->fd = -1;
+  pL->in.n = pL->in.iRead = 0;
+  pL->out.n = 0;
+  pL->nFlight = 0;
+  for (ld = pL->pDb; ld; ld = ld->pNext)
+    {
+      linkSeedEnd (ld);
+      ld->eState = LINKDB_NEW;
+      ld->nFlight = 0;
+    }
+}
+
+/*
+** Return what pL knows of database p, or of the database named by the
+** n bytes of z if p is NULL.  Return NULL if the name is not known.
+*/
+static LinkDb *
+linkDbFind (Link * pL, Replica * p, const char *z, u32 n)
+{
+  LinkDb *ld;
+  for (ld = pL->pDb; ld; ld = ld->pNext)
+    if (p ? ld->p == p : strlen (ld->p->zName) == n
+        && memcmp (ld->p->zName, z, n) == 0)
+      return ld;
+  if (p == 0)
+    return 0;
+  ld = sqlite3_malloc (sizeof (*ld));
+  if (ld == 0)
+    runtimeError ("out of memory");
+  memset (ld, 0, sizeof (*ld));
+  ld->p = p;
+  ld->fdSeed = -1;
+  ld->pNext = pL->pDb;
+  pL->pDb = ld;
+  return ld;
+}
+
+/*
+** Record that the receiver of pL acknowledged the patches of ld up to
+** ld->iAcked, so that journalCompact() may remove them
+*/
+static void
+linkPublish (Link * pL, LinkDb * ld)
+{
+  pthread_mutex_lock (&g.mutex);
+  ld->p->aAcked[pL->iLink] = ld->iAcked;
+  pthread_mutex_unlock (&g.mutex);
+}
+
+/*
+** Return the patch of the journal of ld that follows patch ld->iSent in
+** the backup, with no number past iTarget, or NULL if there is none
+*/
+static const JournalEntry *
+linkNext (const LinkDb * ld, u64 iTarget)
+{
+  const JournalEntry *pNext = 0;
+  int i;
+  for (i = 0; i < ld->nEntry; i++)
+    if (ld->aEntry[i].iBase == ld->iSent && ld->aEntry[i].iSeq > ld->iSent
+        && ld->aEntry[i].iSeq <= iTarget)
+      pNext = &ld->aEntry[i];
+  return pNext;
+}
+
+/*
+** Compress the data of f into pL->pZip, if that makes it smaller
+*/
+static void
+linkDeflate (Link * pL, LinkFrame * f)
+{
+  uLongf nZip = compressBound (f->nData);
+  u8 *aZip;
+
+  if (f->nData < LINK_DEFLATE_MIN)
+    return;
+  aZip = scratchReserve (&pL->pZip, &pL->nZip, nZip);
+  if (compress2 (aZip, &nZip, f->aData, f->nData, Z_BEST_SPEED) == Z_OK
+      && nZip < f->nData)
+    {
+      f->flags |= LINK_F_DEFLATE;
+      f->nData = nZip;
+      f->aData = aZip;
+    }
+}
+
+/*
+** Queue patch e of the journal of p on pL.  Return 0 on success.
+*/
+static int
+linkPatch (Link * pL, Replica * p, const JournalEntry * e)
+{
+  size_t n = e->iEnd - e->iStart;
+  char *zSegment = journalSegment (p, e->iSegment);
+  int fd = open (zSegment, O_RDONLY);
+  LinkFrame f;
+  size_t i = 0;
+  u8 *a;
+
+  if (fd < 0 || n > LINK_MAXDATA)
+    {
+      fprintf (stderr, "cannot read patch %llu of \"%s\"\n", e->iSeq,
+               zSegment);
+      if (fd >= 0)
+        close (fd);
+      sqlite3_free (zSegment);
+      return -1;
+    }
+  a = scratchReserve (&pL->pRaw, &pL->nRaw, n + 1);
+  while (i < n)
+    {
+      ssize_t nRead = pread (fd, &a[i], n - i, e->iStart + i);
+      if (nRead < 0 && errno == EINTR)
+        continue;
+      if (nRead <= 0)
+        break;
+      i += nRead;
+    }
+  close (fd);
+  if (i < n)
     {
-      int hv;
-      hash_init (&h, &zSrc[i]);
-      hv = hash_32bit (&h) % nHash;
-      collide[i / NHASH] = landmark[hv];
-      landmark[hv] = i / NHASH;
+      fprintf (stderr, "cannot read patch %llu of \"%s\"\n", e->iSeq,
+               zSegment);
+      sqlite3_free (zSegment);
+      return -1;
     }
+  sqlite3_free (zSegment);
+
+  memset (&f, 0, sizeof (f));
+  f.eType = LINK_PATCH;
+  f.flags = g.bBinary ? LINK_F_BINARY : 0;
+  f.nName = strlen (p->zName);
+  f.zName = p->zName;
+  f.iSeq = e->iSeq;
+  f.iArg = e->iBase;
+  f.iArg2 = n;
+  f.nData = n;
+  f.aData = a;
+  linkDeflate (pL, &f);
+  linkAppend (&pL->out, &f);
+  return 0;
+}
 
-  /* Begin scanning the target file and generating copy commands and
-   ** literal sections of the delta.
-   */
-  base = 0; /* We have already generated everything before zOut[base] */
-  while (base + NHASH < lenOut)
+/*
+** Snapshot the backup of ld to seed the receiver of pL with it.  Return 0
+** on success.
+*/
+static int
+linkSeedStart (Link * pL, LinkDb * ld)
+{
+  char *zSeed = sqlite3_mprintf ("%s.seed-%d", ld->p->zPatch, pL->iLink);
+  sqlite3 *pSrc = 0;
+  sqlite3 *pDst = 0;
+  sqlite3_backup *pBackup;
+  struct stat st;
+  int rc;
+
+  if (zSeed == 0)
+    runtimeError ("out of memory");
+  unlink (zSeed);
+  rc = sqlite3_open_v2 (ld->p->zBackup, &pSrc, SQLITE_OPEN_READONLY, 0);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_open (zSeed, &pDst);
+  if (rc == SQLITE_OK)
     {
-      int iSrc, iBlock;
-      int bestCnt, bestOfst = 0, bestLitsz = 0;
-      hash_init (&h, &zOut[base]);
-      i = 0; /* Trying to match a landmark against zOut[base+i] */
-      bestCnt = 0;
-      while (1)
+      sqlite3_busy_timeout (pSrc, g.iBusyTimeout);
+      pBackup = sqlite3_backup_init (pDst, "main", pSrc, "main");
+      if (pBackup == 0)
+        rc = sqlite3_errcode (pDst);
+      else
         {
-          int hv;
-          int limit = 250;
+          rc = sqlite3_backup_step (pBackup, -1);
+          sqlite3_backup_finish (pBackup);
+          if (rc == SQLITE_DONE)
+            rc = SQLITE_OK;
+        }
+    }
+  sqlite3_close (pSrc);
+  sqlite3_close (pDst);
 
-          hv = hash_32bit (&h) % nHash;
-          iBlock = landmark[hv];
-          while (iBlock >= 0 && (limit--) > 0)
-            {
-              /*
-               ** The hash window has identified a potential match against
-               ** landmark block iBlock.  But we need to investigate further.
-               **
-               ** Look for a region in zOut that matches zSrc. Anchor the search
-               ** at zSrc[iSrc] and zOut[base+i].  Do not include anything prior to
-               ** zOut[base] or after zOut[outLen] nor anything after zSrc[srcLen].
-               **
-               ** Set cnt equal to the length of the match and set ofst so that
-               ** zSrc[ofst] is the first element of the match.  litsz is the number
-               ** of characters between zOut[base] and the beginning of the match.
-               ** sz will be the overhead (in bytes) needed to encode the copy
-               ** command.  Only generate copy command if the overhead of the
-               ** copy command is less than the amount of literal text to be copied.
-               */
-              int cnt, ofst, litsz;
-              int j, k, x, y;
-              int sz;
+  ld->iSeedSeq = 0;
+  if (rc == SQLITE_OK)
+    {
+      journalApplied (zSeed, &ld->iSeedSeq);
+      ld->fdSeed = open (zSeed, O_RDONLY);
+      if (ld->fdSeed < 0 || fstat (ld->fdSeed, &st) != 0)
+        rc = SQLITE_IOERR;
+    }
+  unlink (zSeed);               /* Gone once sent */
+  sqlite3_free (zSeed);
+  if (rc != SQLITE_OK)
+    {
+      fprintf (stderr, "cannot snapshot %s: %s\n", ld->p->zBackup,
+               sqlite3_errstr (rc));
+      linkSeedEnd (ld);
+      return -1;
+    }
+  VERBOSE ("* Seed %s:%s with %s as of patch %llu\n", pL->zHost,
+           pL->zPort, ld->p->zName, ld->iSeedSeq);
+  ld->nSeed = st.st_size;
+  ld->iSeedOff = 0;
+  ld->eState = LINKDB_SEED;
+  return 0;
+}
 
-              /* Beginning at iSrc, match forwards as far as we can.  j counts
-               ** the number of characters that match */
-              iSrc = iBlock * NHASH;
-              for (j = 0, x = iSrc, y = base + i;
-                   (unsigned int) x < lenSrc && (unsigned int) y < lenOut;
-                   j++, x++, y++)
-                {
-                  if (zSrc[x] != zOut[y])
-                    break;
-                }
-              j--;
+/*
+** Queue up to LINK_SEED_STEP more bytes of the snapshot of ld on pL.
+** Return 0 on success, or -1 if the connection failed.
+*/
+static int
+linkSeedSend (Link * pL, LinkDb * ld)
+{
+  sqlite3_int64 iStop = ld->iSeedOff + LINK_SEED_STEP;
 
-              /* Beginning at iSrc-1, match backwards as far as we can.  k counts
-               ** the number of characters that match */
-              for (k = 1; k < iSrc && (unsigned int) k <= i; k++)
-                if (zSrc[iSrc - k] != zOut[base + i - k])
-                  break;
-              k--;
+  while (ld->fdSeed >= 0 && ld->iSeedOff < iStop)
+    {
+      size_t n = LINK_CHUNK;
+      size_t i = 0;
+      LinkFrame f;
+      u8 *a;
+
+      if ((sqlite3_int64) n > ld->nSeed - ld->iSeedOff)
+        n = ld->nSeed - ld->iSeedOff;
+      a = scratchReserve (&pL->pRaw, &pL->nRaw, n + 1);
+      while (i < n)
+        {
+          ssize_t nRead = pread (ld->fdSeed, &a[i], n - i, ld->iSeedOff + i);
+          if (nRead < 0 && errno == EINTR)
+            continue;
+          if (nRead <= 0)
+            break;
+          i += nRead;
+        }
+      if (i < n)
+        runtimeError ("cannot read the snapshot of %s: %s",
+                      ld->p->zBackup, strerror (errno));
+
+      memset (&f, 0, sizeof (f));
+      f.eType = LINK_IMAGE;
+      f.nName = strlen (ld->p->zName);
+      f.zName = ld->p->zName;
+      f.iSeq = ld->iSeedSeq;
+      f.iArg = ld->iSeedOff;
+      f.iArg2 = ld->nSeed;
+      f.nData = n;
+      f.aData = a;
+      linkDeflate (pL, &f);
+      linkAppend (&pL->out, &f);
+      ld->iSeedOff += n;
+      if (ld->iSeedOff >= ld->nSeed)
+        {
+          /* Acknowledged once the receiver installed it */
+          linkSeedEnd (ld);
+          ld->nFlight++;
+          pL->nFlight++;
+        }
+      if (pL->out.n >= LINK_BATCH && linkFlush (pL->fd, &pL->out) != 0)
+        return -1;
+    }
+  return 0;
+}
 
-              /* Compute the offset and size of the matching region */
-              ofst = iSrc - k;
-              cnt = j + k + 1;
-              litsz = i - k;    /* Number of bytes of literal text before the copy */
-              /* sz will hold the number of bytes needed to encode the "insert"
-               ** command and the copy command, not counting the "insert" text */
-              sz =
-                digit_count (i - k) + digit_count (cnt) + digit_count (ofst) +
-                3;
-              if (cnt >= sz && cnt > bestCnt)
-                {
-                  /* Remember this match only if it is the best so far and it
-                   ** does not increase the file size */
-                  bestCnt = cnt;
-                  bestOfst = iSrc - k;
-                  bestLitsz = litsz;
-                }
+/*
+** Queue and send what pL has to send.  Return the number of databases
+** the link still waits for or has patches to send, or -1 if the
+** connection failed.
+*/
+static int
+linkSend (Link * pL)
+{
+  sqlite3_int64 iNow = timeNow ();
+  int nPending = 0;
+  Replica *p;
+
+  /* Replica objects are only added at the head of the list */
+  pthread_mutex_lock (&g.mutex);
+  p = g.pReplica;
+  pthread_mutex_unlock (&g.mutex);
+  for (; p; p = p->pNext)
+    {
+      LinkDb *ld;
+      u64 iTarget;
+
+      pthread_mutex_lock (&g.mutex);
+      iTarget = p->iShipped;
+      pthread_mutex_unlock (&g.mutex);
+      if (iTarget == 0)
+        continue;               /* Not patched since the program started */
+
+      ld = linkDbFind (pL, p, 0, 0);
+      if (ld->eState == LINKDB_SKIP && ld->iSkip != iTarget)
+        ld->eState = LINKDB_NEW;
+      if (ld->eState == LINKDB_FAILED && ld->nFlight == 0
+          && iNow >= ld->iRetry)
+        ld->eState = LINKDB_NEW;
+      if (ld->eState == LINKDB_NEW)
+        {
+          LinkFrame f;
+          memset (&f, 0, sizeof (f));
+          f.eType = LINK_QUERY;
+          f.nName = strlen (p->zName);
+          f.zName = p->zName;
+          linkAppend (&pL->out, &f);
+          ld->eState = LINKDB_QUERY;
+          ld->iSkip = iTarget;
+        }
 
-              /* Check the next matching block */
-              iBlock = collide[iBlock];
+      while (ld->eState == LINKDB_READY && ld->iSent < iTarget
+             && pL->nFlight < g.nSendWindow)
+        {
+          const JournalEntry *e = linkNext (ld, iTarget);
+          if (e == 0
+              && (ld->nEntry == 0
+                  || ld->aEntry[ld->nEntry - 1].iSeq < iTarget))
+            {
+              sqlite3_free (ld->aEntry);
+              ld->nEntry = journalRead (p, &ld->aEntry);
+              e = linkNext (ld, iTarget);
             }
-
-          /* We have a copy command that does not cause the delta to be larger
-           ** than a literal insert.  So add the copy command to the delta.
-           */
-          if (bestCnt > 0)
+          if (e == 0)
             {
-              if (bestLitsz > 0)
+              VERBOSE ("* No patch of %s follows patch %llu on %s:%s\n",
+                       p->zName, ld->iSent, pL->zHost, pL->zPort);
+              if (linkSeedStart (pL, ld) != 0)
                 {
-                  /* Add an insert command before the copy */
-                  putInt (bestLitsz, &zDelta);
-                  *(zDelta++) = ':';
-                  memcpy (zDelta, &zOut[base], bestLitsz);
-                  zDelta += bestLitsz;
-                  base += bestLitsz;
+                  ld->eState = LINKDB_SKIP;
+                  ld->iSkip = iTarget;
                 }
-              base += bestCnt;
-              putInt (bestCnt, &zDelta);
-              *(zDelta++) = '@';
-              putInt (bestOfst, &zDelta);
-              *(zDelta++) = ',';
-              if (bestOfst + bestCnt - 1 > lastRead)
-                lastRead = bestOfst + bestCnt - 1;
-              bestCnt = 0;
               break;
             }
-
-          /* If we reach this point, it means no match is found so far */
-          if (base + i + NHASH >= lenOut)
+          if (linkPatch (pL, p, e) != 0)
             {
-              /* We have reached the end of the file and have not found any
-               ** matches.  Do an "insert" for everything that does not match */
-              putInt (lenOut - base, &zDelta);
-              *(zDelta++) = ':';
-              memcpy (zDelta, &zOut[base], lenOut - base);
-              zDelta += lenOut - base;
-              base = lenOut;
+              ld->eState = LINKDB_SKIP;
+              ld->iSkip = iTarget;
               break;
             }
-
-          /* Advance the hash by one character.  Keep looking for a match */
-          hash_next (&h, zOut[base + i + NHASH]);
-          i++;
+          ld->iSent = e->iSeq;
+          ld->nFlight++;
+          pL->nFlight++;
+          if (pL->out.n >= LINK_BATCH && linkFlush (pL->fd, &pL->out) != 0)
+            return -1;
         }
+
+      if (ld->eState == LINKDB_SEED && linkSeedSend (pL, ld) != 0)
+        return -1;
+
+      if (ld->eState == LINKDB_QUERY || ld->eState == LINKDB_SEED
+          || ld->nFlight > 0
+          || (ld->eState == LINKDB_READY && ld->iSent < iTarget))
+        nPending++;
     }
-  /* Output a final "insert" record to get all the text at the end of
-   ** the file that does not match anything in the source file.
-   */
-  if (base < lenOut)
-    {
-      putInt (lenOut - base, &zDelta);
-      *(zDelta++) = ':';
-      memcpy (zDelta, &zOut[base], lenOut - base);
-      zDelta += lenOut - base;
-    }
-  /* Output the final checksum record. */
-  putInt (checksum (zOut, lenOut), &zDelta);
-  *(zDelta++) = ';';
-  sqlite3_free (collide);
-  return zDelta - zOrigDelta;
+  if (linkFlush (pL->fd, &pL->out) != 0)
+    return -1;
+  return nPending;
 }
 
 /*
-** End of code copied from fossil.
-**************************************************************************/
-
+** Handle frame f received by pL
+*/
 static void
-strPrintfArray (Str * pStr,             /* String object to append to          */
-                const char *zSep,       /* Separator string                    */
-                const char *zFmt,       /* Format for each entry               */
-                char **az, int n        /* Array of strings & its size (or -1) */
-  )
+linkHandle (Link * pL, const LinkFrame * f)
 {
-  int i;
-  for (i = 0; az[i] && (i < n || n < 0); i++)
+  LinkDb *ld = linkDbFind (pL, 0, f->zName, f->nName);
+
+  if (ld == 0)
+    return;
+  if (f->eType == LINK_STATE && ld->eState == LINKDB_QUERY)
     {
-      if (i != 0)
-        strPrintf (pStr, "%s", zSep);
-      strPrintf (pStr, zFmt, az[i], az[i], az[i]);
+      /* A copy with no repqlite_state may be at any state: the patches
+       ** of the journal cannot be applied to it */
+      if (f->flags & (LINK_F_MISSING | LINK_F_UNMARKED))
+        {
+          VERBOSE ("* %s:%s has %s copy of %s\n", pL->zHost, pL->zPort,
+                   (f->flags & LINK_F_MISSING) ? "no" : "an unmarked",
+                   ld->p->zName);
+          if (linkSeedStart (pL, ld) != 0)
+            ld->eState = LINKDB_SKIP;
+          return;
+        }
+      ld->iSent = ld->iAcked = f->iSeq;
+      ld->eState = LINKDB_READY;
+      linkPublish (pL, ld);
+    }
+  else if (f->eType == LINK_ACK)
+    {
+      if (ld->nFlight > 0)
+        {
+          ld->nFlight--;
+          pL->nFlight--;
+        }
+      if (f->iArg == SQLITE_OK)
+        {
+          if (ld->eState == LINKDB_SEED)
+            {
+              ld->iSent = f->iSeq;
+              ld->eState = LINKDB_READY;
+            }
+          ld->iAcked = f->iSeq;
+          linkPublish (pL, ld);
+          return;
+        }
+      linkSeedEnd (ld);
+      if (ld->eState != LINKDB_FAILED)
+        fprintf (stderr, "%s:%s: patch %llu of %s: %s\n", pL->zHost,
+                 pL->zPort, f->iSeq, ld->p->zName,
+                 sqlite3_errstr ((int) f->iArg));
+      ld->eState = LINKDB_FAILED;
+      ld->iRetry = timeNow () + LINK_RETRY;
     }
 }
 
+/*
+** Read and handle the frames the receiver of pL sent
+*/
 static void
-getRbudiffQuery (const char *zTab,
-                 char **azCol, int nPK, int bOtaRowid, Str * pSql)
+linkReceive (Link * pL)
 {
-  int i;
-
-  /* First the newly inserted rows: * */
-  strPrintf (pSql, "SELECT ");
-  strPrintfArray (pSql, ", ", "%s", azCol, -1);
-  strPrintf (pSql, ", 0, ");  /* Set ota_control to 0 for an insert */
-  strPrintfArray (pSql, ", ", "NULL", azCol, -1);
-  strPrintf (pSql, " FROM aux.%Q AS n WHERE NOT EXISTS (\n", zTab);
-  strPrintf (pSql, "    SELECT 1 FROM ", zTab);
-  strPrintf (pSql, " main.%Q AS o WHERE ", zTab);
-  strPrintfArray (pSql, " AND ", "(n.%Q IS o.%Q)", azCol, nPK);
-  strPrintf (pSql, "\n)");
+  LinkFrame f;
+  int rc;
 
-  /* Deleted rows: */
-  strPrintf (pSql, "\nUNION ALL\nSELECT ");
-  strPrintfArray (pSql, ", ", "%s", azCol, nPK);
-  if (azCol[nPK])
+  if (linkFill (pL->fd, &pL->in) <= 0)
     {
-      strPrintf (pSql, ", ");
-      strPrintfArray (pSql, ", ", "NULL", &azCol[nPK], -1);
+      VERBOSE ("* Lost the connection to %s:%s\n", pL->zHost, pL->zPort);
+      linkClose (pL);
+      return;
     }
-  strPrintf (pSql, ", 1, ");  /* Set ota_control to 1 for a delete */
-  strPrintfArray (pSql, ", ", "NULL", azCol, -1);
-  strPrintf (pSql, " FROM main.%Q AS n WHERE NOT EXISTS (\n", zTab);
-  strPrintf (pSql, "    SELECT 1 FROM ", zTab);
-  strPrintf (pSql, " aux.%Q AS o WHERE ", zTab);
-  strPrintfArray (pSql, " AND ", "(n.%Q IS o.%Q)", azCol, nPK);
-  strPrintf (pSql, "\n) ");
+  while ((rc = linkParse (&pL->in, &f)) > 0)
+    linkHandle (pL, &f);
+  if (rc < 0)
+    {
+      fprintf (stderr, "%s:%s: invalid frame\n", pL->zHost, pL->zPort);
+      linkClose (pL);
+    }
+}
 
-  /* Updated rows. If all table columns are part of the primary key, there
-   ** can be no updates. In this case this part of the compound SELECT can
-   ** be omitted altogether. */
-  if (azCol[nPK])
+static void *
+linkMain (void *pArg)
+{
+  Link *pL = pArg;
+  sqlite3_int64 iDeadline = 0;
+  sqlite3_int64 iConnect = 0;
+
+  for (;;)
     {
-      strPrintf (pSql, "\nUNION ALL\nSELECT ");
-      strPrintfArray (pSql, ", ", "n.%s", azCol, nPK);
-      strPrintf (pSql, ",\n");
-      strPrintfArray (pSql, " ,\n",
-                      "    CASE WHEN n.%s IS o.%s THEN NULL ELSE n.%s END",
-                      &azCol[nPK], -1);
+      struct pollfd aFd[2];
+      int nPending = 0;
+      int bStop;
 
-      if (bOtaRowid == 0)
+      pthread_mutex_lock (&g.mutex);
+      bStop = g.bLinkStop;
+      pthread_mutex_unlock (&g.mutex);
+      if (bStop && iDeadline == 0)
+        iDeadline = timeNow () + LINK_DRAIN;
+
+      if (pL->fd < 0 && !bStop && timeNow () >= iConnect)
         {
-          strPrintf (pSql, ", '");
-          strPrintfArray (pSql, "", ".", azCol, nPK);
-          strPrintf (pSql, "' ||\n");
+          iConnect = timeNow () + LINK_RETRY;
+          if (linkConnect (pL) == 0)
+            VERBOSE ("* Connected to %s:%s\n", pL->zHost, pL->zPort);
         }
-      else
-        strPrintf (pSql, ",\n");
-
-      strPrintfArray (pSql, " ||\n",
-                      "    CASE WHEN n.%s IS o.%s THEN '.' ELSE 'x' END",
-                      &azCol[nPK], -1);
-      strPrintf (pSql, "\nAS ota_control, ");
-      strPrintfArray (pSql, ", ", "NULL", azCol, nPK);
-      strPrintf (pSql, ",\n");
-      strPrintfArray (pSql, " ,\n",
-                      "    CASE WHEN n.%s IS o.%s THEN NULL ELSE o.%s END",
-                      &azCol[nPK], -1);
+      if (pL->fd >= 0 && (nPending = linkSend (pL)) < 0)
+        {
+          VERBOSE ("* Lost the connection to %s:%s\n", pL->zHost,
+                   pL->zPort);
+          linkClose (pL);
+        }
+      if (bStop && (pL->fd < 0 || nPending == 0 || timeNow () >= iDeadline))
+        break;
 
-      strPrintf (pSql, "\nFROM main.%Q AS o, aux.%Q AS n\nWHERE ", zTab,
-                 zTab);
-      strPrintfArray (pSql, " AND ", "(n.%Q IS o.%Q)", azCol, nPK);
-      strPrintf (pSql, " AND ota_control LIKE '%%x%%'");
+      aFd[0].fd = pL->efd;
+      aFd[0].events = POLLIN;
+      aFd[1].fd = pL->fd;       /* Ignored by poll() if negative */
+      aFd[1].events = POLLIN;
+      if (poll (aFd, 2, LINK_RETRY) > 0)
+        {
+          u64 v;
+          if ((aFd[0].revents & POLLIN)
+              && read (pL->efd, &v, sizeof (v)) < 0)
+            {
+              /* Another thread read it */
+            }
+          if (pL->fd >= 0 && aFd[1].revents)
+            linkReceive (pL);
+        }
     }
+  linkClose (pL);
+  return 0;
+}
 
-  /* Now add an ORDER BY clause to sort everything by PK. */
-  strPrintf (pSql, "\nORDER BY ");
-  for (i = 1; i <= nPK; i++)
-    strPrintf (pSql, "%s%d", ((i > 1) ? ", " : ""), i);
+/*
+** Start the thread of every --replica
+*/
+static void
+linksStart (void)
+{
+  sigset_t mask, oldMask;
+  int i;
+
+  sigfillset (&mask);
+  pthread_sigmask (SIG_BLOCK, &mask, &oldMask);
+  for (i = 0; i < g.nLink; i++)
+    {
+      Link *pL = &g.aLink[i];
+      pL->iLink = i;
+      pL->fd = -1;
+      pL->efd = eventfd (0, EFD_NONBLOCK);
+      if (pL->efd < 0)
+        runtimeError ("eventfd: %s", strerror (errno));
+      if (pthread_create (&pL->tid, 0, linkMain, pL))
+        runtimeError ("cannot create link thread");
+    }
+  pthread_sigmask (SIG_SETMASK, &oldMask, 0);
 }
 
+/*
+** Let the links ship what the workers applied, for LINK_DRAIN ms at
+** most, then join them
+*/
 static void
-rbudiff_one_table (const char *zTab, FILE * out)
+linksStop (void)
 {
-  int bOtaRowid;                /* True to use an ota_rowid column        */
-  int nPK;                      /* Number of primary key columns in table */
-  char **azCol;                 /* NULL terminated array of col names     */
   int i;
-  int nCol;
-  Str ct = { 0, 0, 0 };         /* The "CREATE TABLE data_xxx" statement */
-  Str sql = { 0, 0, 0 };        /* Query to find differences             */
-  Str insert = { 0, 0, 0 };     /* First part of output INSERT statement */
-  sqlite3_stmt *pStmt = 0;
-
-  /* --rbu mode must use real primary keys. */
-  g.bSchemaPK = 1;
+  pthread_mutex_lock (&g.mutex);
+  g.bLinkStop = 1;
+  pthread_mutex_unlock (&g.mutex);
+  linkNotify ();
+  for (i = 0; i < g.nLink; i++)
+    {
+      Link *pL = &g.aLink[i];
+      pthread_join (pL->tid, 0);
+      close (pL->efd);
+      while (pL->pDb)
+        {
+          LinkDb *ld = pL->pDb;
+          pL->pDb = ld->pNext;
+          sqlite3_free (ld->aEntry);
+          sqlite3_free (ld);
+        }
+      sqlite3_free (pL->in.a);
+      sqlite3_free (pL->out.a);
+      sqlite3_free (pL->pRaw);
+      sqlite3_free (pL->pZip);
+      sqlite3_free (pL->zHost);
+      sqlite3_free (pL->zPort);
+    }
+  free (g.aLink);
+}
 
-  /* Check that the schemas of the two tables match. Exit early otherwise. */
-  checkSchemasMatch (zTab);
+/*
+** The receiver, --listen.
+**
+** Every connection is served by a thread of its own, which applies the
+** patches in the order they come.  It keeps a Replica object for every
+** database it patches, with only its zName, zBackup, iApplied and
+** pPatcher fields in use, bJournal telling whether iApplied was read.
+** Patches are written to a temporary file to be applied from there.
+*/
+typedef struct RecvConn RecvConn;
+struct RecvConn
+{
+  int fd;                       /* The connection                           */
+  pthread_t tid;                /* Its thread                               */
+  int bDone;                    /* Set when the thread exits (g.mutex)      */
+  Replica *pReplica;            /* The databases patched                    */
+  FILE *pTmp;                   /* Patches are applied from this file       */
+  LinkBuf in;                   /* Frames received                          */
+  LinkBuf out;                  /* Frames to send                           */
+  void *pRaw;                   /* Buffer compressed patches are inflated in*/
+  size_t nRaw;                  /* Bytes allocated for pRaw                 */
+  Replica *pSeed;               /* Database a seed is received for, if any  */
+  char *zSeed;                  /* Where the seed is written                */
+  int fdSeed;                   /* zSeed, open for writing                  */
+  RecvConn *pNext;              /* Next connection                          */
+};
 
-  /* Grab the column names and PK details for the table(s). If no usable PK
-   ** columns are found, bail out early.  */
-  azCol = columnNames ("main", zTab, &nPK, &bOtaRowid);
-  if (azCol == 0)
-    runtimeError ("table %s has no usable PK columns", zTab);
+static volatile sig_atomic_t recvInterrupted = 0;
 
-  for (nCol = 0; azCol[nCol]; nCol++);
+static void
+recvInterrupt (int sig)
+{
+  (void) sig;
+  recvInterrupted = 1;
+}
 
-  /* Build and output the CREATE TABLE statement for the data_xxx table */
-  strPrintf (&ct, "CREATE TABLE IF NOT EXISTS 'data_%q'(", zTab);
-  if (bOtaRowid)
-    strPrintf (&ct, "rbu_rowid, ");
-  strPrintfArray (&ct, ", ", "%s", &azCol[bOtaRowid], -1);
-  strPrintf (&ct, ", rbu_control);");
+/*
+** Return the Replica object of the database named by the n bytes of z,
+** or NULL if the name is not valid
+*/
+static Replica *
+recvFind (RecvConn * c, const char *z, int n)
+{
+  Replica *p;
+  for (p = c->pReplica; p; p = p->pNext)
+    if ((int) strlen (p->zName) == n && memcmp (p->zName, z, n) == 0)
+      return p;
+  if (!linkNameValid (z, n))
+    return 0;
+  p = sqlite3_malloc (sizeof (*p));
+  if (p == 0)
+    runtimeError ("out of memory");
+  memset (p, 0, sizeof (*p));
+  p->zName = sqlite3_mprintf ("%.*s", n, z);
+  p->zBackup = sqlite3_mprintf ("%s/%s", g.azRoot[0], p->zName);
+  if (p->zName == 0 || p->zBackup == 0)
+    runtimeError ("out of memory");
+  p->pNext = c->pReplica;
+  c->pReplica = p;
+  return p;
+}
 
-  /* Get the SQL for the query to retrieve data from the two databases */
-  getRbudiffQuery (zTab, azCol, nPK, bOtaRowid, &sql);
+/*
+** Read the number of the last patch applied to the copy p.  Return the
+** LINK_F_* flags of its state.
+*/
+static int
+recvState (Replica * p)
+{
+  p->bJournal = 1;
+  p->iApplied = 0;
+  if (access (p->zBackup, F_OK) != 0)
+    return LINK_F_MISSING;
+  if (!journalApplied (p->zBackup, &p->iApplied))
+    return LINK_F_UNMARKED;
+  return 0;
+}
 
-  /* Build the first part of the INSERT statement output for each row
-   ** in the data_xxx table. */
-  strPrintf (&insert, "INSERT INTO 'data_%q' (", zTab);
-  if (bOtaRowid)
-    strPrintf (&insert, "rbu_rowid, ");
-  strPrintfArray (&insert, ", ", "%s", &azCol[bOtaRowid], -1);
-  strPrintf (&insert, ", rbu_control) VALUES(");
+/*
+** Apply the n bytes of patch iSeq at a to p.  Return an SQLite error
+** code.
+*/
+static int
+recvApply (RecvConn * c, Replica * p, const u8 * a, size_t n,
+           u64 iSeq, int bBinary)
+{
+  Patcher local;
+  Patcher *pP;
+  int rc;
 
-  pStmt = db_prepare ("%s", sql.z);
+  rewind (c->pTmp);
+  if (fwrite (a, 1, n, c->pTmp) != n || fflush (c->pTmp) != 0)
+    runtimeError ("cannot write temporary file: %s", strerror (errno));
+  rewind (c->pTmp);
+  if (patchBegin (p->zBackup, p, &local, &pP) == SQLITE_OK)
+    {
+      if (bBinary)
+        patchBinary (pP, c->pTmp, n);
+      else
+        patchText (pP, c->pTmp, n);
+    }
+  rc = patchEnd (pP, iSeq, p, &local);
+  VERBOSE ("* Patch %s with %llu ... %s\n", p->zBackup, iSeq,
+           rc ? "fail" : "ok");
+  if (rc != SQLITE_OK)
+    p->bJournal = 0;            /* Read iApplied again */
+  return rc;
+}
 
-  while (sqlite3_step (pStmt) == SQLITE_ROW)
-    { /*  If this is the first row output, print out the CREATE TABLE
-       ** statement first. And then set ct.z to NULL so that it is not
-       ** printed again.
-       */
-      if (ct.z)
-        {
-          fprintf (out, "%s\n", ct.z);
-          strFree (&ct);
-        }
+/*
+** Forget the seed being received on c, if any
+*/
+static void
+recvSeedEnd (RecvConn * c)
+{
+  if (c->fdSeed >= 0)
+    {
+      close (c->fdSeed);
+      unlink (c->zSeed);
+    }
+  c->fdSeed = -1;
+  c->pSeed = 0;
+  sqlite3_free (c->zSeed);
+  c->zSeed = 0;
+}
 
-      /* Output the first part of the INSERT statement */
-      fprintf (out, "%s", insert.z);
+/*
+** Copy the seed received on c over its database.  Return an SQLite error
+** code.
+*/
+static int
+recvSeedInstall (RecvConn * c)
+{
+  Replica *p = c->pSeed;
+  const char *zSep = strrchr (p->zName, '/');
+  sqlite3 *pSrc = 0;
+  sqlite3 *pDst = 0;
+  sqlite3_backup *pBackup;
+  int rc;
 
-      if (sqlite3_column_type (pStmt, nCol) == SQLITE_INTEGER)
-        for (i = 0; i <= nCol; i++)
-          {
-            if (i > 0)
-              fprintf (out, ", ");
-            printQuoted (out, sqlite3_column_value (pStmt, i));
-          }
+  if (zSep)
+    {
+      char *zDir = sqlite3_mprintf ("%s/%.*s", g.azRoot[0],
+                                    (int) (zSep - p->zName), p->zName);
+      if (zDir == 0)
+        runtimeError ("out of memory");
+      makeDirs (zDir);
+      sqlite3_free (zDir);
+    }
+  replicaClose (p);
+  rc = sqlite3_open_v2 (c->zSeed, &pSrc, SQLITE_OPEN_READONLY, 0);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_open (p->zBackup, &pDst);
+  if (rc == SQLITE_OK)
+    {
+      sqlite3_busy_timeout (pDst, g.iBusyTimeout);
+      pBackup = sqlite3_backup_init (pDst, "main", pSrc, "main");
+      if (pBackup == 0)
+        rc = sqlite3_errcode (pDst);
       else
         {
-          char *zOtaControl;
-          int nOtaControl = sqlite3_column_bytes (pStmt, nCol);
-
-          zOtaControl = (char *) sqlite3_malloc (nOtaControl);
-          memcpy (zOtaControl, sqlite3_column_text (pStmt, nCol),
-                  nOtaControl + 1);
-
-          for (i = 0; i < nCol; i++)
-            {
-              int bDone = 0;
-              if (i >= nPK
-                  && sqlite3_column_type (pStmt, i) == SQLITE_BLOB
-                  && sqlite3_column_type (pStmt, nCol + 1 + i) == SQLITE_BLOB)
-                {
-                  const char *aSrc =
-                    sqlite3_column_blob (pStmt, nCol + 1 + i);
-                  int nSrc = sqlite3_column_bytes (pStmt, nCol + 1 + i);
-                  const char *aFinal = sqlite3_column_blob (pStmt, i);
-                  int nFinal = sqlite3_column_bytes (pStmt, i);
-                  char *aDelta;
-                  int nDelta;
-
-                  aDelta = sqlite3_malloc (nFinal + 60);
-                  nDelta =
-                    rbuDeltaCreate (aSrc, nSrc, aFinal, nFinal, aDelta);
-                  if (nDelta < nFinal)
-                    {
-                      int j;
-                      fprintf (out, "x'");
-                      for (j = 0; j < nDelta; j++)
-                        fprintf (out, "%02x", (u8) aDelta[j]);
-                      fprintf (out, "'");
-                      zOtaControl[i - bOtaRowid] = 'f';
-                      bDone = 1;
-                    }
-                  sqlite3_free (aDelta);
-                }
-
-              if (bDone == 0)
-                printQuoted (out, sqlite3_column_value (pStmt, i));
-
-              fprintf (out, ", ");
-            }
-          fprintf (out, "'%s'", zOtaControl);
-          sqlite3_free (zOtaControl);
+          rc = sqlite3_backup_step (pBackup, -1);
+          sqlite3_backup_finish (pBackup);
+          if (rc == SQLITE_DONE)
+            rc = SQLITE_OK;
         }
-
-      /* And the closing bracket of the insert statement */
-      fprintf (out, ");\n");
     }
-
-  sqlite3_finalize (pStmt);
-
-  strFree (&ct);
-  strFree (&sql);
-  strFree (&insert);
+  sqlite3_close (pSrc);
+  sqlite3_close (pDst);
+  recvState (p);
+  VERBOSE ("* Seed %s as of patch %llu ... %s\n", p->zBackup, p->iApplied,
+           rc ? "fail" : "ok");
+  return rc;
 }
 
 /*
-** This routine reads a line of text from FILE in, stores
-** the text in memory obtained from malloc() and returns a pointer
-** to the text.  NULL is returned at end of file, or if malloc()
-** fails.
-**
-** The interface is like "readline" but no command-line editing
-** is done.
+** Write seed chunk f to the seed of p.  Set *pbLast if the seed is done
+** with, because it is complete or failed.  Return an SQLite error code.
 */
-static char *
-local_getline (FILE * in)
+static int
+recvSeed (RecvConn * c, Replica * p, const LinkFrame * f, int *pbLast)
 {
-  char *zLine;
-  int nLine;
-  int n;
-  int inQuote = 0;
-  nLine = 100;
-  zLine = malloc (nLine);
-  if (zLine == 0)
-    return 0;
-  n = 0;
-  while (1)
+  const u8 *a = f->aData;
+  size_t n = LINK_CHUNK;
+  size_t i = 0;
+  int rc = SQLITE_OK;
+
+  *pbLast = 1;
+  if (f->iArg > f->iArg2)
+    return SQLITE_CORRUPT;
+  if (n > f->iArg2 - f->iArg)
+    n = f->iArg2 - f->iArg;
+  if (f->flags & LINK_F_DEFLATE)
+    {
+      uLongf nRaw = n;
+      a = scratchReserve (&c->pRaw, &c->nRaw, n + 1);
+      if (uncompress ((u8 *) a, &nRaw, f->aData, f->nData) != Z_OK
+          || nRaw != n)
+        return SQLITE_CORRUPT;
+    }
+  else if (f->nData != n)
+    return SQLITE_CORRUPT;
+
+  if (f->iArg == 0)
     {
-      if (n + 100 > nLine)
+      recvSeedEnd (c);
+      c->pSeed = p;
+      c->zSeed = sqlite3_mprintf ("%s-seed", p->zBackup);
+      if (c->zSeed == 0)
+        runtimeError ("out of memory");
+      c->fdSeed = open (c->zSeed, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+  if (c->pSeed != p || c->fdSeed < 0)
+    return SQLITE_CANTOPEN;
+  while (i < n)
+    {
+      ssize_t nWrite = pwrite (c->fdSeed, &a[i], n - i, f->iArg + i);
+      if (nWrite < 0 && errno == EINTR)
+        continue;
+      if (nWrite <= 0)
         {
-          nLine = nLine * 2 + 100;
-          zLine = realloc (zLine, nLine);
-          if (zLine == 0)
-            return 0;
+          recvSeedEnd (c);
+          return SQLITE_IOERR;
         }
-      if (fgets (&zLine[n], nLine - n, in) == 0)
+      i += nWrite;
+    }
+  if (f->iArg + n < f->iArg2)
+    {
+      *pbLast = 0;
+      return SQLITE_OK;
+    }
+  if (fsync (c->fdSeed) != 0)
+    rc = SQLITE_IOERR;
+  if (rc == SQLITE_OK)
+    rc = recvSeedInstall (c);
+  recvSeedEnd (c);
+  return rc;
+}
+
+/*
+** Handle frame f received on c, and queue the reply
+*/
+static void
+recvHandle (RecvConn * c, const LinkFrame * f)
+{
+  Replica *p = recvFind (c, f->zName, f->nName);
+  LinkFrame r;
+
+  memset (&r, 0, sizeof (r));
+  r.nName = f->nName;
+  r.zName = f->zName;
+  if (f->eType == LINK_QUERY)
+    {
+      r.eType = LINK_STATE;
+      r.flags = p ? recvState (p) : LINK_F_MISSING;
+      r.iSeq = p ? p->iApplied : 0;
+    }
+  else if (f->eType == LINK_PATCH)
+    {
+      const u8 *a = f->aData;
+      size_t n = f->nData;
+      int rc = SQLITE_OK;
+
+      if (p && !p->bJournal)
+        recvState (p);
+      if (p == 0 || access (p->zBackup, F_OK) != 0)
+        rc = SQLITE_CANTOPEN;
+      else if (f->iArg != p->iApplied)
+        rc = SQLITE_MISMATCH;   /* Not diffed against this state */
+      else if (f->flags & LINK_F_DEFLATE)
         {
-          if (n == 0)
+          uLongf nRaw = (uLongf) f->iArg2;
+          if (f->iArg2 > LINK_MAXDATA)
+            rc = SQLITE_TOOBIG;
+          else
             {
-              free (zLine);
-              return 0;
+              a = scratchReserve (&c->pRaw, &c->nRaw, nRaw + 1);
+              if (uncompress ((u8 *) a, &nRaw, f->aData, f->nData) != Z_OK
+                  || nRaw != f->iArg2)
+                rc = SQLITE_CORRUPT;
+              n = nRaw;
             }
-          zLine[n] = 0;
-          break;
         }
-      while (zLine[n])
-        {
-          if (zLine[n] == '"')
-            inQuote = !inQuote;
-          n++;
-        }
-      if (n > 0 && zLine[n - 1] == '\n' && (!inQuote))
+      if (rc == SQLITE_OK)
+        rc = recvApply (c, p, a, n, f->iSeq, f->flags & LINK_F_BINARY);
+      r.eType = LINK_ACK;
+      r.iSeq = f->iSeq;
+      r.iArg = rc;
+    }
+  else if (f->eType == LINK_IMAGE)
+    {
+      int bLast;
+      int rc = p ? recvSeed (c, p, f, &bLast) : SQLITE_CANTOPEN;
+      if (p && !bLast)
+        return;
+      if (rc != SQLITE_OK && c->pSeed == p)
+        recvSeedEnd (c);
+      r.eType = LINK_ACK;
+      r.iSeq = f->iSeq;
+      r.iArg = rc;
+    }
+  else
+    return;
+  linkAppend (&c->out, &r);
+}
+
+static void *
+recvMain (void *pArg)
+{
+  RecvConn *c = pArg;
+
+  c->fdSeed = -1;
+  c->pTmp = tmpfile ();
+  if (c->pTmp == 0)
+    runtimeError ("cannot create temporary file: %s", strerror (errno));
+  while (linkFill (c->fd, &c->in) > 0)
+    {
+      LinkFrame f;
+      int rc;
+      while ((rc = linkParse (&c->in, &f)) > 0)
+        recvHandle (c, &f);
+      if (rc < 0)
         {
-          n--;
-          if (n > 0 && zLine[n - 1] == '\r')
-            n--;
-          zLine[n] = 0;
+          fprintf (stderr, "invalid frame from a sender\n");
           break;
         }
+      if (linkFlush (c->fd, &c->out) != 0)
+        break;
     }
-  zLine = realloc (zLine, n + 1);
-  return zLine;
+  VERBOSE ("* Connection closed\n");
+
+  recvSeedEnd (c);
+  fclose (c->pTmp);
+  while (c->pReplica)
+    {
+      Replica *p = c->pReplica;
+      c->pReplica = p->pNext;
+      replicaClose (p);
+      sqlite3_free (p->zName);
+      sqlite3_free (p->zBackup);
+      sqlite3_free (p);
+    }
+  sqlite3_free (c->in.a);
+  sqlite3_free (c->out.a);
+  sqlite3_free (c->pRaw);
+  pthread_mutex_lock (&g.mutex);
+  c->bDone = 1;
+  pthread_mutex_unlock (&g.mutex);
+  return 0;
 }
 
 /*
-** Patch database
+** Join the thread of c and free it
 */
-int
-sqlPatch (const char *dbName, const char *sqlFile, long sqlPos)
+static void
+recvJoin (RecvConn * c)
 {
-  int rc, error;
-  FILE *fd;
-  sqlite3 *db;
-  char *line;
-  char *zErrMsg;
+  pthread_join (c->tid, 0);
+  close (c->fd);
+  sqlite3_free (c);
+}
 
-  error = 0;
-  fd = fopen (sqlFile, "r");
-  if (!fd)
-    perror ("fopen");
+/*
+** Serve the senders connecting to g.zListen until SIGINT
+*/
+static void
+recvRun (void)
+{
+  struct addrinfo hints, *aInfo, *pI;
+  struct sigaction sa;
+  RecvConn *pConn = 0;
+  RecvConn *c, **pp;
+  char *zHost, *zPort;
+  int fd = -1;
+  int rc;
 
-  rc = sqlite3_open (dbName, &db);
-  if (rc != SQLITE_OK)
+  linkSplitAddr (g.zListen, &zHost, &zPort);
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((rc = getaddrinfo (zHost, zPort, &hints, &aInfo)) != 0)
+    runtimeError ("%s: %s", g.zListen, gai_strerror (rc));
+  for (pI = aInfo; pI && fd < 0; pI = pI->ai_next)
     {
-      error = 1;
-      goto cleanup;
+      int one = 1;
+      fd = socket (pI->ai_family, pI->ai_socktype, pI->ai_protocol);
+      if (fd < 0)
+        continue;
+      setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+      if (bind (fd, pI->ai_addr, pI->ai_addrlen) != 0
+          || listen (fd, 16) != 0)
+        {
+          close (fd);
+          fd = -1;
+        }
     }
+  freeaddrinfo (aInfo);
+  if (fd < 0)
+    runtimeError ("cannot listen on %s: %s", g.zListen, strerror (errno));
 
-  fseek (fd, sqlPos, SEEK_SET);
-  do
+  sa.sa_handler = recvInterrupt;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction (SIGINT, &sa, NULL);
+
+  VERBOSE ("Listening on %s\n", g.zListen);
+  while (!recvInterrupted)
     {
-      line = local_getline (fd);
-      if (sqlite3_exec (db, line, 0, 0, &zErrMsg) != SQLITE_OK)
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if (poll (&pfd, 1, LINK_RETRY) > 0 && (pfd.revents & POLLIN))
         {
-          fprintf (stderr, "sqlite3_exec: %s\n", zErrMsg);
-          sqlite3_free (zErrMsg);
+          int cfd = accept (fd, 0, 0);
+          int one = 1;
+          sigset_t mask, oldMask;
+          if (cfd < 0)
+            continue;
+          setsockopt (cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+          c = sqlite3_malloc (sizeof (*c));
+          if (c == 0)
+            runtimeError ("out of memory");
+          memset (c, 0, sizeof (*c));
+          c->fd = cfd;
+          c->pNext = pConn;
+          pConn = c;
+          VERBOSE ("* Accepted a connection\n");
+
+          /* SIGINT is handled by this thread only */
+          sigfillset (&mask);
+          pthread_sigmask (SIG_BLOCK, &mask, &oldMask);
+          if (pthread_create (&c->tid, 0, recvMain, c))
+            runtimeError ("cannot create receiver thread");
+          pthread_sigmask (SIG_SETMASK, &oldMask, 0);
         }
-      free (line);
-    }
-  while (line != NULL);
 
-cleanup:
-  fclose (fd);
-  sqlite3_close (db);
+      /* Join the threads of the connections closed */
+      for (pp = &pConn; (c = *pp) != 0;)
+        {
+          int bDone;
+          pthread_mutex_lock (&g.mutex);
+          bDone = c->bDone;
+          pthread_mutex_unlock (&g.mutex);
+          if (bDone)
+            {
+              *pp = c->pNext;
+              recvJoin (c);
+            }
+          else
+            pp = &c->pNext;
+        }
+    }
+  VERBOSE ("Listening stopped\n");
 
-  return error ? rc : SQLITE_OK;
+  close (fd);
+  for (c = pConn; c; c = c->pNext)
+    shutdown (c->fd, SHUT_RDWR);
+  while ((c = pConn) != 0)
+    {
+      pConn = c->pNext;
+      recvJoin (c);
+    }
+  sqlite3_free (zHost);
+  sqlite3_free (zPort);
 }
 
+/*
+** Watch management.
+**
+** Every watched directory has a Watch object in the g.aWatch hash
+** table, so that the directory of an event is found from its watch
+** descriptor.  With --recursive, a watch is added for every directory
+** created under PATH, and removed when inotify reports that the
+** directory is gone (IN_IGNORED).  The "backup" and "patches"
+** directories of PATH are never watched.
+**
+** The mask only asks for the events that can mean a change of a
+** database: g.FSEvent, files renamed into the directory and, with
+** --recursive, created directories.
+*/
 
 /*
-** Generate a difference-patch between two SQL databases.
-** If there is no difference then return -1 else return
-** SqlPos in SCN-journal
+** Return true if zName is a journal, WAL or shm file of SQLite
 */
-long
-sqlDiff (const char *zDb1, const char *zDb2, const char *zLog)
+static int
+isSidecar (const char *zName, size_t nName)
 {
-  int rc;
-  long fstart, fend;
-  time_t ltime; /* timestamp for SCN-journal */
-  char *zErrMsg = 0;
-  char *zSql;
-  sqlite3_stmt *pStmt;
-  void (*xDiff) (const char *, FILE *) = diff_one_table;
-  FILE *out = zLog == NULL ? stdout : fopen (zLog, "a");
-
-  sqlite3_config (SQLITE_CONFIG_SINGLETHREAD);
-
-  if (g.rbuTable != 0)
-    xDiff = rbudiff_one_table;
+  static const char *azSuffix[] = { "-journal", "-wal", "-shm" };
+  size_t i;
+  for (i = 0; i < sizeof (azSuffix) / sizeof (azSuffix[0]); i++)
+    {
+      size_t n = strlen (azSuffix[i]);
+      if (nName > n && memcmp (&zName[nName - n], azSuffix[i], n) == 0)
+        return 1;
+    }
+  return 0;
+}
 
-  rc = sqlite3_open (zDb1, &g.db);
-  if (rc)
-    cmdlineError ("cannot open database file \"%s\"", zDb1);
+/*
+** Return true if file zPath starts with the header of an SQLite database
+*/
+static int
+isDatabase (const char *zPath)
+{
+  char aHdr[16];
+  int fd = open (zPath, O_RDONLY);
+  ssize_t n;
+  if (fd < 0)
+    return 0;
+  n = read (fd, aHdr, sizeof (aHdr));
+  close (fd);
+  return n == sizeof (aHdr) && memcmp (aHdr, "SQLite format 3", 16) == 0;
+}
 
-  rc = sqlite3_exec (g.db, "SELECT * FROM sqlite_master", 0, 0, &zErrMsg);
-  if (rc || zErrMsg)
-    cmdlineError ("\"%s\" does not appear to be a valid SQLite database",
-                  zDb1);
+/*
+** Return the Watch of watch descriptor wd, or NULL
+*/
+static Watch *
+watchFind (int wd)
+{
+  Watch *pW;
+  for (pW = g.aWatch[(unsigned) wd % WATCH_NHASH]; pW; pW = pW->pNext)
+    if (pW->wd == wd)
+      return pW;
+  return 0;
+}
 
-#ifndef SQLITE_OMIT_LOAD_EXTENSION
-  sqlite3_enable_load_extension (g.db, 1);
-  for (i = 0; i < g.nExt; i++)
-    {
-      rc = sqlite3_load_extension (g.db, g.azExt[i], 0, &zErrMsg);
-      if (rc || zErrMsg)
-        cmdlineError ("error loading %s: %s", g.azExt[i], zErrMsg);
-    }
-#endif
-  free (g.azExt);
-  zSql = sqlite3_mprintf ("ATTACH %Q as aux;", zDb2);
+/*
+** Forget the Watch of watch descriptor wd
+*/
+static void
+watchRemove (int wd)
+{
+  Watch **pp;
+  for (pp = &g.aWatch[(unsigned) wd % WATCH_NHASH]; *pp; pp = &(*pp)->pNext)
+    if ((*pp)->wd == wd)
+      {
+        Watch *pW = *pp;
+        *pp = pW->pNext;
+        sqlite3_free (pW->zDir);
+        sqlite3_free (pW->zRel);
+        sqlite3_free (pW);
+        return;
+      }
+}
 
-  rc = sqlite3_exec (g.db, zSql, 0, 0, &zErrMsg);
-  if (rc || zErrMsg)
-    cmdlineError ("cannot attach database \"%s\" (%s)", zDb2,
-                  sqlite3_errstr (rc));
+/*
+** Stop watching subdirectory zName of the directory of pW, and the
+** directories under it.  Their watches are forgotten once inotify
+** confirms their removal with IN_IGNORED.
+*/
+static void
+watchForget (const Watch * pW, const char *zName)
+{
+  char *zDir = sqlite3_mprintf ("%s/%s", pW->zDir, zName);
+  size_t nDir;
+  Watch *p;
+  int i;
 
-  rc = sqlite3_exec (g.db, "SELECT * FROM aux.sqlite_master", 0, 0, &zErrMsg);
-  if (rc || zErrMsg)
-    cmdlineError ("\"%s\" does not appear to be a valid SQLite database",
-                  zDb2);
+  if (zDir == 0)
+    runtimeError ("out of memory");
+  nDir = strlen (zDir);
+  for (i = 0; i < WATCH_NHASH; i++)
+    for (p = g.aWatch[i]; p; p = p->pNext)
+      if (strncmp (p->zDir, zDir, nDir) == 0
+          && (p->zDir[nDir] == 0 || p->zDir[nDir] == '/'))
+        inotify_rm_watch (g.inotifyFd, p->wd);
+  sqlite3_free (zDir);
+}
 
-  ltime = time (NULL);
-  fprintf (out, "-- %s\n", asctime (localtime (&ltime)));
-  fstart = ftell (out);
+static void watchScan (Watch * pW, int bTouch);
 
-  if (g.useTransaction)
-    fprintf (out, "BEGIN TRANSACTION;\n");
+/*
+** Start watching directory zRel of PATH zRoot and, with --recursive, its
+** subdirectories.  If bTouch is true, the databases found in them are
+** replicated, as they may have changed before they were watched.
+*/
+static void
+watchAdd (const char *zRoot, const char *zRel, int bTouch)
+{
+  u32 mask = g.FSEvent | IN_MOVED_TO | IN_ONLYDIR;
+  Watch *pW;
+  char *zDir;
+  int wd;
 
-  /* Handle tables one by one */
-  pStmt = db_prepare ("SELECT name FROM main.sqlite_master\n"
-                      " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
-                      " UNION\n"
-                      "SELECT name FROM aux.sqlite_master\n"
-                      " WHERE type='table' AND sql NOT LIKE 'CREATE VIRTUAL%%'\n"
-                      " ORDER BY name");
-  while (SQLITE_ROW == sqlite3_step (pStmt))
-    xDiff ((const char *) sqlite3_column_text (pStmt, 0), out);
+  if (zRel[0])
+    zDir = sqlite3_mprintf ("%s/%s", zRoot, zRel);
+  else
+    zDir = sqlite3_mprintf ("%s", zRoot);
+  if (zDir == 0)
+    runtimeError ("out of memory");
+  if (g.bRecursive)
+    mask |= IN_CREATE | IN_MOVED_FROM;
+  if (g.bWal)
+    mask |= IN_MODIFY;
 
-  sqlite3_finalize (pStmt);
+  wd = inotify_add_watch (g.inotifyFd, zDir, mask);
+  if (wd == -1)
+    {
+      if (zRel[0] == 0)
+        runtimeError ("cannot watch \"%s\": %s", zDir, strerror (errno));
+      fprintf (stderr, "%s: cannot watch \"%s\": %s\n", g.zArgv0, zDir,
+               strerror (errno));
+      sqlite3_free (zDir);
+      return;
+    }
 
-  if (g.useTransaction)
-    fprintf (out, "COMMIT;\n");
+  pW = watchFind (wd);
+  if (pW)
+    {
+      /* Already watched, maybe under another name */
+      sqlite3_free (zDir);
+    }
+  else
+    {
+      pW = sqlite3_malloc (sizeof (*pW));
+      if (pW == 0)
+        runtimeError ("out of memory");
+      pW->wd = wd;
+      pW->zDir = zDir;
+      pW->zRoot = zRoot;
+      pW->zRel = sqlite3_mprintf ("%s", zRel);
+      if (pW->zRel == 0)
+        runtimeError ("out of memory");
+      pW->pNext = g.aWatch[(unsigned) wd % WATCH_NHASH];
+      g.aWatch[(unsigned) wd % WATCH_NHASH] = pW;
+    }
+  watchScan (pW, bTouch);
+}
 
-  fend = ftell (out);
+/*
+** Add the subdirectories of the directory of pW to the watch list and,
+** if bTouch is true, note a change of every database it contains.  The
+** databases that have a patch journal are noted in any case, so that
+** the patches their backup missed are applied at startup.
+*/
+static void
+watchScan (Watch * pW, int bTouch)
+{
+  DIR *pDir;
+  struct dirent *pEnt;
 
-  /* TBD: Handle trigger differences */
-  /* TBD: Handle view differences */
-  sqlite3_close (g.db);
-  fclose (out);
+  pDir = opendir (pW->zDir);
+  if (pDir == 0)
+    return;
+  while ((pEnt = readdir (pDir)) != 0)
+    {
+      const char *zName = pEnt->d_name;
+      char *zPath;
+      struct stat st;
+      Replica *p;
+
+      if (zName[0] == '.')
+        continue;
+      if (pW->zRel[0] == 0
+          && (strcmp (zName, "backup") == 0 || strcmp (zName, "patches") == 0))
+        continue;
+      zPath = sqlite3_mprintf ("%s/%s", pW->zDir, zName);
+      if (zPath == 0)
+        runtimeError ("out of memory");
+      if (lstat (zPath, &st) == 0)
+        {
+          if (S_ISDIR (st.st_mode) && g.bRecursive)
+            {
+              char *zRel = pW->zRel[0]
+                ? sqlite3_mprintf ("%s/%s", pW->zRel, zName)
+                : sqlite3_mprintf ("%s", zName);
+              if (zRel == 0)
+                runtimeError ("out of memory");
+              watchAdd (pW->zRoot, zRel, bTouch);
+              sqlite3_free (zRel);
+            }
+          else if ((p = replicaLookup (pW, zName)) != 0)
+            {
+              /* A known database is not opened here: that would drop the
+              ** POSIX locks of its connections, see sourceRead() */
+              if (bTouch || journalExists (pW, zName))
+                replicaTouch (p);
+            }
+          else if (S_ISREG (st.st_mode)
+                   && !isSidecar (zName, strlen (zName)) && isDatabase (zPath)
+                   && (bTouch || journalExists (pW, zName)))
+            replicaTouch (replicaFind (pW, zName));
+        }
+      sqlite3_free (zPath);
+    }
+  closedir (pDir);
+}
 
-  return (fend - fstart == 0) ? -1 : fstart;
+/*
+** Recover from an overflow of the inotify queue: the events lost may
+** have been changes of any database, or new directories.  Replicate
+** every database of the watched directories.
+*/
+static void
+watchResync (void)
+{
+  Watch *aW = 0;
+  Watch *pW;
+  int i, n = 0;
+
+  g.nOverflow++;
+  fprintf (stderr, "%s: inotify queue overflow #%d, rescanning"
+           " (consider raising fs.inotify.max_queued_events)\n",
+           g.zArgv0, g.nOverflow);
+
+  /* watchScan() may add watches, so scan a copy of the current list */
+  for (i = 0; i < WATCH_NHASH; i++)
+    for (pW = g.aWatch[i]; pW; pW = pW->pNext)
+      {
+        aW = sqlite3_realloc (aW, (n + 1) * sizeof (aW[0]));
+        if (aW == 0)
+          runtimeError ("out of memory");
+        aW[n++] = *pW;
+      }
+  for (i = 0; i < n; i++)
+    {
+      pW = watchFind (aW[i].wd);
+      if (pW)
+        watchScan (pW, 1);
+    }
+  sqlite3_free (aW);
 }
 
 /*
 ** Read all available inotify events from the file descriptor 'fd'
 */
 static void
-handle_events (int fd, const char *path)
-{ /* Some systems cannot read integer variables if they are not
-  ** properly aligned. On other systems, incorrect alignment may
-  ** decrease performance. Hence, the buffer used for reading from
-  ** the inotify file descriptor should have the same alignment as
-  ** struct inotify_event.
-  */
-  char buf[4096]
-    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
-
+handle_events (int fd)
+{
   const struct inotify_event *event;
   ssize_t len;
   char *ptr;
@@ -1751,8 +10076,10 @@ handle_events (int fd, const char *path)
   /* Loop while events can be read from inotify file descriptor. */
   for (;;)
     {
-      /* Read some events */
-      len = read (fd, buf, sizeof buf);
+      /* Read some events.  g.aEventBuf comes from malloc(), so it is
+      ** aligned for struct inotify_event.
+      */
+      len = read (fd, g.aEventBuf, g.nEventBuf);
       if (len == -1 && errno != EAGAIN)
         {
           perror ("read");
@@ -1765,137 +10092,289 @@ handle_events (int fd, const char *path)
       */
       if (len <= 0)
         break;
+      g.nEventRead++;
+      if (len > g.nEventMax)
+        g.nEventMax = len;
 
       /* Loop over all events in the buffer */
 
-      for (ptr = buf; ptr < buf + len;
+      for (ptr = g.aEventBuf; ptr < g.aEventBuf + len;
            ptr += sizeof (struct inotify_event) + event->len)
         {
+          Watch *pW;
+          char zName[NAME_MAX + 1];     /* event->name, maybe less "-wal" */
+          size_t nName = 0;
+          u32 fEvent = g.FSEvent;
 
           event = (const struct inotify_event *) ptr;
+          g.nEvent++;
 
-          if ((event->mask & g.FSEvent)
-              && strstr (event->name, "-journal") == NULL)
+          if (event->mask & IN_Q_OVERFLOW)
             {
-              int buf_len;
-              buf_len = strlen (path) + strlen (event->name);
-
-              long nbytes;
-              char oldfile[buf_len + 8];        /* 8 == /backup/  */
-              char newfile[buf_len + 2];        /* 2 == //        */
-              char patchfile[buf_len + 9];      /* 9 == /patches/ */
-
-              sprintf (newfile, "%s/%s", path, event->name);
-              sprintf (oldfile, "%s/backup/%s", path, event->name);
-              sprintf (patchfile, "%s/patches/%s", path, event->name);
-
-              VERBOSE ("* Catch %s/%s event.\n", path, event->name);
+              watchResync ();
+              continue;
+            }
+          pW = watchFind (event->wd);
+          if (pW == 0)
+            {
+              g.nEventStale++;
+              continue;
+            }
+          if (event->mask & IN_IGNORED)
+            {
+              VERBOSE ("* Stop watching %s\n", pW->zDir);
+              watchRemove (event->wd);
+              continue;
+            }
 
-              if (g.FSEvent == IN_MODIFY)
-                {
-                  /* Database is locked.
-                   ** Sleep 250ms before start diff&patching.
-                   **
-                   ** TODO fcntl.h
-                   ** Wait until database is unlocked.
-                   */
-                  sqlite3_sleep (250);
-                }
+          /* With --cdc, --wal or --event modify, writes to the WAL are
+           ** changes of its database: the connection the diff keeps open
+           ** stops writers from checkpointing the WAL when they close, so
+           ** the database itself is seldom written.  With --wal, they are
+           ** seen as soon as they are written, whatever --event, as a
+           ** writer in WAL mode seldom closes the WAL. */
+          if (event->len > 0)
+            nName = strnlen (event->name, NAME_MAX);
+          memcpy (zName, event->name, nName);
+          zName[nName] = 0;
+          if ((g.bCdc || g.bWal || (g.FSEvent & IN_MODIFY)) && nName > 4
+              && strcmp (&zName[nName - 4], "-wal") == 0)
+            {
+              nName -= 4;
+              zName[nName] = 0;
+              if (g.bWal)
+                fEvent |= IN_MODIFY;
+            }
 
-              nbytes = sqlDiff (oldfile, newfile, patchfile);
-              if (nbytes != -1)
+          if (event->mask & IN_ISDIR)
+            {
+              /* A directory renamed away: its path is no longer valid */
+              if (event->mask & IN_MOVED_FROM)
+                watchForget (pW, zName);
+
+              /* A new directory, and maybe new databases */
+              if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && g.bRecursive
+                  && !(pW->zRel[0] == 0 && (strcmp (zName, "backup") == 0
+                                            || strcmp (zName, "patches") == 0)))
                 {
-                  VERBOSE ("* Patch %s ... ", oldfile);
-                  int rc = sqlPatch (oldfile, patchfile, nbytes);
-                  if (rc != SQLITE_OK)
-                    {
-                      VERBOSE ("fail\n");
-                      fprintf (stderr, "sqlite3_open: %s\n", sqlite3_errstr (rc));
-                    }
-                  else
-                    {
-                      VERBOSE ("ok\n");
-                    }
+                  char *zRel = pW->zRel[0]
+                    ? sqlite3_mprintf ("%s/%s", pW->zRel, zName)
+                    : sqlite3_mprintf ("%s", zName);
+                  if (zRel == 0)
+                    runtimeError ("out of memory");
+                  watchAdd (pW->zRoot, zRel, 1);
+                  sqlite3_free (zRel);
                 }
-
             }
-          break;
+          else if ((event->mask & (fEvent | IN_MOVED_TO)) && nName > 0
+                   && !isSidecar (zName, nName))
+            {
+              VERBOSE ("* Catch %s/%s event.\n", pW->zDir, event->name);
+              replicaTouch (replicaFind (pW, zName));
+            }
         }
     }  /* for (;;) */
 }
 
 /*
-** inotify - monitoring file system events:
-** This function add directory into watch list
+** The event loop.
+**
+** The main thread waits on a single epoll instance for:
+**
+**   g.inotifyFd   the filesystem events of the watched directories,
+**   g.timerFd     the next deadline: a dirty database due for a
+**                 replication, see replicaFlush(), or the next write of
+**                 the metrics, see statsTick(),
+**   g.signalFd    SIGINT and SIGTERM, which stop the program cleanly,
+**   g.doneFd      the workers going idle, see workerMain().
+**
+** Nothing of the loop blocks on a database or on the patch journals:
+** the diffs, patches and journal I/O run in the workers, the sockets of
+** --replica in the link threads.  A wakeup only costs the events read
+** and the dirty databases, whatever the number of databases watched.
+**
+** On a signal, the loop stops reading filesystem events, schedules the
+** dirty databases at once, and keeps writing the metrics until the
+** workers replicated them.
+*/
+
+/*
+** Add fd to the event loop
 */
 static void
-_inotify_wait (const char *path)
+eventAdd (int fd)
 {
-  int fd, poll_num, wd;
-  struct pollfd fds;
-  static int signaled = 0;
-  static int volatile interrupted = 0;
-  struct sigaction sa;
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl (g.epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    runtimeError ("epoll_ctl: %s", strerror (errno));
+}
 
-  if (signaled)
+/*
+** Arm g.timerFd to expire in iWait ms, or disarm it if iWait < 0
+*/
+static void
+eventArm (int iWait)
+{
+  struct itimerspec its;
+  memset (&its, 0, sizeof (its));
+  if (iWait == 0)
+    its.it_value.tv_nsec = 1;   /* A zero it_value would disarm it */
+  else if (iWait > 0)
     {
-      interrupted = 1;
-      return;
+      its.it_value.tv_sec = iWait / 1000;
+      its.it_value.tv_nsec = (long) (iWait % 1000) * 1000000;
     }
+  if (timerfd_settime (g.timerFd, 0, &its, 0) < 0)
+    runtimeError ("timerfd_settime: %s", strerror (errno));
+}
 
-  sa.sa_handler = (void (*)(int)) _inotify_wait;
-  sigemptyset (&sa.sa_mask);
-  sa.sa_flags = 0;
+/*
+** Drain the counter of eventfd or timerfd fd
+*/
+static void
+eventClear (int fd)
+{
+  u64 v;
+  if (read (fd, &v, sizeof (v)) < 0 && errno != EAGAIN)
+    runtimeError ("read: %s", strerror (errno));
+}
 
-  sigaction (SIGINT, &sa, NULL);
+/*
+** Set up the event loop and the watches of the PATH arguments.  This
+** must run before any thread is started, so that SIGINT and SIGTERM
+** are blocked in all of them and only read from g.signalFd.
+*/
+static void
+eventOpen (void)
+{
+  sigset_t mask;
+  int i;
 
-  signaled = 1;
+  g.aEventBuf = malloc (g.nEventBuf);
+  if (g.aEventBuf == 0)
+    runtimeError ("out of memory");
 
-  /* Create the file descriptor for accessing the inotify API */
-  fd = inotify_init1 (IN_NONBLOCK);
-  if (fd == -1)
-    {
-      perror ("inotify_init1");
-      exit (EXIT_FAILURE);
-    }
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  if (sigprocmask (SIG_BLOCK, &mask, 0) < 0)
+    runtimeError ("sigprocmask: %s", strerror (errno));
+  g.signalFd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (g.signalFd < 0)
+    runtimeError ("signalfd: %s", strerror (errno));
 
-  /* Adding the 'path' directory into watch list */
-  wd = inotify_add_watch (fd, path, IN_ALL_EVENTS);
-  if (wd == -1)
-    {
-      perror ("inotify_add_watch");
-      exit (EXIT_FAILURE);
-    }
+  /* Create the file descriptor for accessing the inotify API */
+  g.inotifyFd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (g.inotifyFd < 0)
+    runtimeError ("inotify_init1: %s", strerror (errno));
+  g.timerFd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (g.timerFd < 0)
+    runtimeError ("timerfd_create: %s", strerror (errno));
+  g.doneFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g.doneFd < 0)
+    runtimeError ("eventfd: %s", strerror (errno));
+  g.epollFd = epoll_create1 (EPOLL_CLOEXEC);
+  if (g.epollFd < 0)
+    runtimeError ("epoll_create1: %s", strerror (errno));
+  eventAdd (g.inotifyFd);
+  eventAdd (g.timerFd);
+  eventAdd (g.signalFd);
+  eventAdd (g.doneFd);
+
+  /* Adding the PATH directories into watch list */
+  for (i = 0; i < g.nRoot; i++)
+    watchAdd (g.azRoot[i], "", 0);
+}
 
-  /* Inotify input */
-  fds.fd = fd;
-  fds.events = POLLIN;
+/*
+** Run the event loop until a signal stopped it and the workers
+** replicated the changes noticed until then
+*/
+static void
+eventLoop (void)
+{
+  int bStop = 0;
 
-  /* Wait for events */
   VERBOSE ("Listening for events\n");
-  while (1)
+  for (;;)
     {
-      if (interrupted)
-        break;
+      struct epoll_event aEv[4];
+      int iWait, nEv, i;
 
-      poll_num = poll (&fds, 1, -1);
-
-      if (poll_num == -1 && errno != EINTR)
+      if (bStop)
         {
-          perror ("poll");
-          exit (EXIT_FAILURE);
+          int bIdle;
+          pthread_mutex_lock (&g.mutex);
+          bIdle = (g.pJob == 0 && g.nBusy == 0);
+          pthread_mutex_unlock (&g.mutex);
+          if (bIdle)
+            break;
+          iWait = statsTick (-1);
         }
+      else
+        iWait = statsTick (replicaFlush (0));
+      eventArm (iWait);
 
-      if (poll_num > 0)
+      nEv = epoll_wait (g.epollFd, aEv, sizeof (aEv) / sizeof (aEv[0]), -1);
+      if (nEv < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          runtimeError ("epoll_wait: %s", strerror (errno));
+        }
+      for (i = 0; i < nEv; i++)
         {
-          if (fds.revents & POLLIN) /* Inotify events are available */
-            handle_events (fd, path);
+          int fd = aEv[i].data.fd;
+          if (fd == g.inotifyFd)
+            handle_events (g.inotifyFd);
+          else if (fd == g.timerFd || fd == g.doneFd)
+            eventClear (fd);
+          else if (fd == g.signalFd)
+            {
+              struct signalfd_siginfo si;
+              if (read (g.signalFd, &si, sizeof (si)) != sizeof (si))
+                continue;
+              if (bStop)
+                continue;
+              bStop = 1;
+              VERBOSE ("Listening for events stopped (%s)\n",
+                       strsignal ((int) si.ssi_signo));
+              VERBOSE ("* %lld events in %lld reads, largest read %ld"
+                       " of %d bytes, %lld stale, %d overflows\n",
+                       g.nEvent, g.nEventRead, (long) g.nEventMax,
+                       g.nEventBuf, g.nEventStale, g.nOverflow);
+
+              /* Replicate the changes noticed so far */
+              if (epoll_ctl (g.epollFd, EPOLL_CTL_DEL, g.inotifyFd, 0) < 0)
+                runtimeError ("epoll_ctl: %s", strerror (errno));
+              replicaFlush (1);
+            }
         }
     }
-  VERBOSE ("Listening for events stopped");
+}
+
+/*
+** Close the event loop and the watches
+*/
+static void
+eventClose (void)
+{
+  int i;
+
+  close (g.epollFd);
+  close (g.doneFd);
+  close (g.timerFd);
+  close (g.signalFd);
 
   /* Close inotify file descriptor */
-  close (fd);
+  close (g.inotifyFd);
+  for (i = 0; i < WATCH_NHASH; i++)
+    while (g.aWatch[i])
+      watchRemove (g.aWatch[i]->wd);
+  free (g.aEventBuf);
 }
 
 /*
@@ -1904,9 +10383,9 @@ _inotify_wait (const char *path)
 static void
 showHelp (void)
 {
-  printf ("Usage: %s [options] PATH\n", g.zArgv0);
+  printf ("Usage: %s [options] PATH...\n", g.zArgv0);
   printf ("Easily keep replicas of SQLite databases.\n"
-          "PATH - The path to the database directory.\n"
+          "PATH - The path to a database directory, several may be given.\n"
           "Options:\n"
           "  sqldiff:\n"
           "   -L|--lib LIBRARY   Load an SQLite extension library\n"
@@ -1914,9 +10393,70 @@ showHelp (void)
           "   --rbu              Output SQL to create/populate RBU table(s)\n"
           "   --transaction      Show SQL output inside a transaction\n"
           "  replicator:\n"
+          "   --backup-wal       Put the backups in WAL mode, so that the\n"
+          "                      patches do not block their readers\n"
+          "   --busy-timeout MS  Max wait for a writer to release its lock\n"
+          "                      Default: 5000\n"
+          "   --batch N          Commit every N statements of a patch\n"
+          "                      Default: 0, the whole patch at once\n"
+          "   --binary           Write and apply binary patches instead of SQL\n"
+          "   --cdc              Diff only the rows written to the WAL since\n"
+          "                      the previous event (source in WAL mode)\n"
+          "   --checkpoint       Checkpoint the sources in WAL mode once\n"
+          "                      diffed (PASSIVE)\n"
+          "   --delta-step N     Index the --rbu delta sources every N bytes,\n"
+          "                      1 to 16. Smaller deltas, more memory and CPU\n"
+          "                      Default: 16\n"
+          "   --delta-threads N  Compute the --rbu deltas of large blobs on\n"
+          "                      N threads. Default: number of CPUs\n"
+          "   --direct           Apply the patches while they are diffed,\n"
+          "                      without reading them back from the journal\n"
           "   --event EVENT      Catch filesystem event: close_write|modify\n"
           "                      Default: close_write\n"
-          "   --verbose          Verbose output\n");
+          "   --event-buffer KB  Size of the buffer inotify events are read in\n"
+          "                      Default: 64\n"
+          "   --interval MS      Replicate once a database is quiet for MS ms\n"
+          "                      Default: 100\n"
+          "   --keep-segments N  Keep only the N most recent patch journal\n"
+          "                      segments. Default: 0, keep all\n"
+          "   --listen ADDR      Receive the patches of --replica on ADDR,\n"
+          "                      [HOST:]PORT, and apply them to PATH/NAME\n"
+          "   --max-delay MS     Replicate a busy database every MS ms at most\n"
+          "                      Default: 1000\n"
+          "   --memory MB        Keep the memory used within about MB\n"
+          "                      megabytes. Default: 0, no limit\n"
+          "   --merge-join       Diff every table by walking its rows and the\n"
+          "                      backup's in primary key order, not by query\n"
+          "   --no-journal       Do not write the patch journal (--direct)\n"
+          "   -r|--recursive     Also watch the subdirectories of PATH, with\n"
+          "                      their backups in PATH/backup/DIR\n"
+          "   --replica ADDR     Also ship the patches to the --listen of\n"
+          "                      ADDR, HOST:PORT. May be given several times\n"
+          "   --resync PCT       Copy the source over its backup page by page\n"
+          "                      when the diff would dump PCT %% of its rows\n"
+          "                      Default: 50, 0 to never do it\n"
+          "   --row-hash         Keep a hash of every row of the backups next\n"
+          "                      to them, and compare only the changed rows\n"
+          "   --segment-size MB  Start a new patch journal segment at MB\n"
+          "                      megabytes. Default: 64\n"
+          "   --send-window N    Patches in flight on a --replica at most\n"
+          "                      Default: 64\n"
+          "   --split-keys N     Diff the tables in ranges of N values of\n"
+          "                      their integer primary key\n"
+          "                      Default: 0, the whole table at once\n"
+          "   --stats FILE       Write the metrics of the replication to\n"
+          "                      FILE, in the Prometheus text format\n"
+          "   --stats-interval MS\n"
+          "                      Write them every MS ms. Default: 10000\n"
+          "   --table-hash       Skip the tables whose content hash did not\n"
+          "                      change since the previous event\n"
+          "   --table-jobs N     Diff up to N tables of a database at once\n"
+          "                      Default: 1\n"
+          "   --verbose          Verbose output\n"
+          "   --wal              Replicate a source in WAL mode on every\n"
+          "                      write to its -wal file, whatever --event\n"
+          "   --workers N        Replicate up to N databases at once\n"
+          "                      Default: 4\n");
 }
 
 /*
@@ -1926,10 +10466,24 @@ int
 main (int argc, char **argv)
 {
   int i;
-  const char *dbPath = 0;
+  Replica *p;
 
   /* Default values */
   g.zArgv0 = argv[0];
+  g.nWorker = 4;
+  g.iInterval = 100;
+  g.iMaxDelay = 1000;
+  g.iBusyTimeout = 5000;
+  g.nEventBuf = 64 * 1024;
+  g.nDeltaStep = NHASH;
+  g.nTableJob = 1;
+  g.nSegmentSize = 64 * 1024 * 1024;
+  g.nSendWindow = 64;
+  g.iStatsInterval = 10000;
+  g.nResync = 50;
+  g.nDeltaThread = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (g.nDeltaThread < 1)
+    g.nDeltaThread = 1;
   g.FSEvent = IN_CLOSE_WRITE;
   g.useTransaction = 0;
 
@@ -1955,6 +10509,36 @@ main (int argc, char **argv)
               else
                 cmdlineError ("illegal argument %s", argv[i - 1]);
             }
+          else if (strcmp (z, "delta-step") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nDeltaStep = strtol (argv[++i], 0, 0);
+              if (g.nDeltaStep < 1 || g.nDeltaStep > NHASH)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "delta-threads") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nDeltaThread = strtol (argv[++i], 0, 0);
+              if (g.nDeltaThread < 1)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "direct") == 0)
+            g.bDirect = 1;
+          else if (strcmp (z, "event-buffer") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nEventBuf = strtol (argv[++i], 0, 0);
+              if (g.nEventBuf < 1 || g.nEventBuf > 1024 * 1024)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+              g.nEventBuf *= 1024;
+            }
           else if (strcmp (z, "debug") == 0)
             {
               if (i == argc - 1)
@@ -1983,27 +10567,249 @@ main (int argc, char **argv)
             }
           else
 #endif
-          if (strcmp (z, "primarykey") == 0)
+          if (strcmp (z, "binary") == 0)
+            g.bBinary = 1;
+          else if (strcmp (z, "batch") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nBatch = strtol (argv[++i], 0, 0);
+              if (g.nBatch < 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "busy-timeout") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.iBusyTimeout = strtol (argv[++i], 0, 0);
+              if (g.iBusyTimeout < 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "backup-wal") == 0)
+            g.bBackupWal = 1;
+          else if (strcmp (z, "cdc") == 0)
+            g.bCdc = 1;
+          else if (strcmp (z, "checkpoint") == 0)
+            g.bCheckpoint = 1;
+          else if (strcmp (z, "interval") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.iInterval = strtol (argv[++i], 0, 0);
+              if (g.iInterval < 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "keep-segments") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nKeepSegment = strtol (argv[++i], 0, 0);
+              if (g.nKeepSegment < 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "listen") == 0)
+            {
+              char *zHost, *zPort;
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.zListen = argv[++i];
+              if (linkSplitAddr (g.zListen, &zHost, &zPort) != 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+              sqlite3_free (zHost);
+              sqlite3_free (zPort);
+            }
+          else if (strcmp (z, "max-delay") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.iMaxDelay = strtol (argv[++i], 0, 0);
+              if (g.iMaxDelay < 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "memory") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nMemory = strtoll (argv[++i], 0, 0) * 1024 * 1024;
+              if (g.nMemory < 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "merge-join") == 0)
+            g.bMergeJoin = 1;
+          else if (strcmp (z, "no-journal") == 0)
+            g.bNoJournal = 1;
+          else if (strcmp (z, "primarykey") == 0)
             g.bSchemaPK = 1;
           else if (strcmp (z, "rbu") == 0)
             g.rbuTable = 1;
+          else if (strcmp (z, "recursive") == 0 || strcmp (z, "r") == 0)
+            g.bRecursive = 1;
+          else if (strcmp (z, "replica") == 0)
+            {
+              Link *pL;
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.aLink = realloc (g.aLink, sizeof (g.aLink[0]) * (g.nLink + 1));
+              if (g.aLink == 0)
+                cmdlineError ("out of memory");
+              pL = &g.aLink[g.nLink++];
+              memset (pL, 0, sizeof (*pL));
+              if (linkSplitAddr (argv[++i], &pL->zHost, &pL->zPort) != 0
+                  || pL->zHost == 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "resync") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nResync = strtol (argv[++i], 0, 0);
+              if (g.nResync < 0 || g.nResync > 100)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "row-hash") == 0)
+            g.bRowHash = 1;
+          else if (strcmp (z, "segment-size") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nSegmentSize = strtoll (argv[++i], 0, 0) * 1024 * 1024;
+              if (g.nSegmentSize < 1)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "send-window") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nSendWindow = strtol (argv[++i], 0, 0);
+              if (g.nSendWindow < 1)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "split-keys") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nSplitKey = strtoll (argv[++i], 0, 0);
+              if (g.nSplitKey < 0)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "stats") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.zStats = argv[++i];
+            }
+          else if (strcmp (z, "stats-interval") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.iStatsInterval = strtol (argv[++i], 0, 0);
+              if (g.iStatsInterval < 1)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
+          else if (strcmp (z, "table-hash") == 0)
+            g.bTableHash = 1;
+          else if (strcmp (z, "wal") == 0)
+            g.bWal = 1;
+          else if (strcmp (z, "table-jobs") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nTableJob = strtol (argv[++i], 0, 0);
+              if (g.nTableJob < 1)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
           else if (strcmp (z, "transaction") == 0)
             g.useTransaction = 1;
           else if (strcmp (z, "verbose") == 0 || strcmp (z, "v") == 0)
             g.verbose = 1;
+          else if (strcmp (z, "workers") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+
+              g.nWorker = strtol (argv[++i], 0, 0);
+              if (g.nWorker < 1)
+                cmdlineError ("illegal argument %s", argv[i - 1]);
+            }
           else
             cmdlineError ("unknown option: %s", argv[i]);
         }
-      else if (dbPath == 0)
-        dbPath = argv[i];
       else
-        cmdlineError ("unknown argument: %s", argv[i]);
+        {
+          g.azRoot = realloc (g.azRoot, sizeof (g.azRoot[0]) * (g.nRoot + 1));
+
+          if (g.azRoot == 0)
+            cmdlineError ("out of memory");
+
+          g.azRoot[g.nRoot++] = argv[i];
+        }
     }
 
-  if (dbPath == 0)
+  if (g.nRoot == 0)
     cmdlineError ("path to databases required");
+  if (g.bBinary && g.rbuTable)
+    cmdlineError ("--binary and --rbu cannot be used together");
+  if (g.bNoJournal && !g.bDirect)
+    cmdlineError ("--no-journal requires --direct");
+  if (g.bDirect && g.nBatch > 0)
+    cmdlineError ("--batch and --direct cannot be used together");
+  if (g.bRowHash && (g.bNoJournal || g.rbuTable))
+    cmdlineError ("--row-hash cannot be used with --no-journal or --rbu");
+  if (g.nLink > 0 && g.bNoJournal)
+    cmdlineError ("--replica and --no-journal cannot be used together");
+  if (g.zListen && g.nLink > 0)
+    cmdlineError ("--listen and --replica cannot be used together");
+  if (g.zListen && g.zStats)
+    cmdlineError ("--listen and --stats cannot be used together");
+  if (g.zListen && g.nRoot > 1)
+    cmdlineError ("--listen takes a single PATH");
 
-  _inotify_wait (dbPath);
+  /* --rbu mode must use real primary keys. */
+  if (g.rbuTable)
+    g.bSchemaPK = 1;
+
+  /* Every worker has its own connections */
+  sqlite3_config (SQLITE_CONFIG_MULTITHREAD);
+  if (g.nMemory > 0)
+    sqlite3_soft_heap_limit64 (g.nMemory / 2);
+  if (g.zListen)
+    {
+      recvRun ();
+      free (g.azRoot);
+      return EXIT_SUCCESS;
+    }
+  eventOpen ();
+  workersStart ();
+  linksStart ();
+  eventLoop ();
+  workersStop ();
+  linksStop ();
+  eventClose ();
+  statsPrint ();
+  if (g.zStats)
+    statsWrite ();
+  for (p = g.pReplica; p; p = p->pNext)
+    {
+      replicaClose (p);
+      sqlite3_free (p->aAcked);
+    }
+  free (g.azExt);
+  free (g.azRoot);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,98 @@
+#!/bin/bash
+#
+# Replicate a source database in WAL mode while it is written again and
+# again, and check that its backup follows it after every round of
+# writes.
+#
+# usage: test/wal.sh [OPTION...]
+#
+# The options are given to repqlite.  Every write is made by a new
+# sqlite3 process, which checkpoints and deletes the WAL when it is the
+# last connection to the source.  The rows written are random, and so is
+# the number of writes of a round, from 1 to 3: the later writes of a
+# round may race with the diff of the earlier ones.  Every round after
+# the first must be replicated by a patch that is not empty: the source
+# may not be found unchanged, nor its backup be resynced.  The
+# environment may set REPQLITE, the program to test (./repqlite), ROUNDS,
+# the number of rounds (20), and DIR, the directory the databases are
+# made in (t/wal).
+
+REPQLITE=${REPQLITE:-./repqlite}
+ROUNDS=${ROUNDS:-20}
+DIR=${DIR:-t/wal}
+SRC=$DIR/wal.db
+BAK=$DIR/backup/wal.db
+
+content () {
+    sqlite3 "$1" "SELECT id, n, hex(b) FROM t ORDER BY id;
+                  SELECT * FROM u ORDER BY id;" 2>/dev/null | md5sum
+}
+
+# Wait up to 5 s for the backup to have the content of the source
+follows () {
+    local i want
+    want=$(content $SRC)
+    for i in $(seq 50); do
+        [ "$(content $BAK)" = "$want" ] && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# Wait up to 5 s for the --stats file to count more than $1 patches
+# applied, and print their number
+applied () {
+    local i n
+    for i in $(seq 50); do
+        n=$(sed -n 's/^repqlite_replications_total{.*"applied"} //p' \
+              $DIR.prom 2>/dev/null)
+        [ "${n:-0}" -gt $1 ] && break
+        sleep 0.1
+    done
+    echo ${n:-0}
+}
+
+rm -rf $DIR && mkdir -p $DIR/backup $DIR/patches || exit 1
+sqlite3 $SRC "PRAGMA journal_mode=WAL;
+              CREATE TABLE t(id INTEGER PRIMARY KEY, n INT, b BLOB);
+              CREATE TABLE u(id INTEGER PRIMARY KEY, s TEXT);" >/dev/null
+
+$REPQLITE --interval 20 --stats $DIR.prom --stats-interval 50 "$@" $DIR \
+    > $DIR.log 2>&1 &
+pid=$!
+sleep 0.5
+
+rc=0
+nApplied=0
+for round in $(seq $ROUNDS); do
+    for write in $(seq $((RANDOM % 3 + 1))); do
+        sqlite3 $SRC "BEGIN;
+            INSERT INTO t(n, b) SELECT $RANDOM, randomblob($RANDOM % 2000)
+              FROM (SELECT 1 UNION ALL SELECT 2 UNION ALL SELECT 3);
+            UPDATE t SET n = n + 1 WHERE id % 5 = $RANDOM % 5;
+            DELETE FROM t WHERE id % 7 = $RANDOM % 7 AND $round % 3 = 0;
+            INSERT INTO u(s) SELECT hex(randomblob(50)) WHERE $write = 2;
+            COMMIT;"
+    done
+    if ! follows; then
+        echo "FAIL $*: the backup does not follow the source at round $round"
+        rc=1
+        break
+    fi
+    # The first round may resync the backup, which does not exist yet
+    if [ $round = 1 ]; then
+        nApplied=-1
+    fi
+    n=$(applied $nApplied)
+    if [ $n -le $nApplied ]; then
+        echo "FAIL $*: no patch was applied at round $round"
+        rc=1
+        break
+    fi
+    nApplied=$n
+done
+
+kill -INT $pid
+wait $pid || rc=1
+[ $rc = 0 ] && echo "ok $*: $ROUNDS rounds replicated"
+exit $rc
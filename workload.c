@@ -0,0 +1,714 @@
+/*
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+**************************************************************************
+**
+** A synthetic workload for repqlite, see "make bench".
+**
+** With --init, the program creates DIR/bench.db with --tables tables of
+** --rows rows each, and its backup in DIR/backup.  Otherwise it writes
+** to DIR/bench.db at --rate transactions per second for --seconds
+** seconds, while repqlite replicates DIR.  Each transaction changes
+** --changes rows, and also stores its sequence number in the bench_clock
+** table.  A thread polls that table in the backup, and the replication
+** lag of a transaction is the time from its commit to the first poll
+** that sees it.  The percentiles of the lag are printed at the end.
+**
+** To compile, simply link against SQLite.
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOB_FIXED   0          /* Every blob is of iBlobA bytes          */
+#define BLOB_UNIFORM 1          /* Between iBlobA and iBlobB bytes        */
+#define BLOB_EXP     2          /* Exponential, of mean iBlobA, at most B */
+
+#define POLL_US      1000       /* Microseconds between polls of backup  */
+
+/*
+** All global variables are gathered into the "g" singleton.
+*/
+struct GlobalVars
+{
+  const char *zArgv0;           /* Name of program                          */
+  const char *zDir;             /* The directory repqlite replicates        */
+  char *zSrc;                   /* Path of the source database              */
+  char *zBackup;                /* Path of its backup                       */
+  int bInit;                    /* Create the databases and exit            */
+  int bWal;                     /* Put the source in WAL mode, with --init  */
+  int nTable;                   /* Number of tables                         */
+  int nRow;                     /* Rows of every table, with --init         */
+  int nWidth;                   /* Characters of the text column            */
+  int eBlob;                    /* Distribution of blob sizes, BLOB_*       */
+  int iBlobA;                   /* Parameters of the distribution           */
+  int iBlobB;
+  int nRate;                    /* Transactions per second                  */
+  int nChange;                  /* Rows changed by every transaction        */
+  int nSecond;                  /* Duration of the run                      */
+  int iTimeout;                 /* Max wait for the backup, in ms           */
+  unsigned long long iRand;     /* State of the random number generator     */
+  sqlite3_int64 *aId;           /* Next new rowid of every table            */
+  pthread_mutex_t mutex;        /* Protects the fields below                */
+  sqlite3_int64 *aCommit;       /* Start of the commit of every transaction */
+  sqlite3_int64 *aLag;          /* Lag of every transaction, or -1          */
+  int iSeen;                    /* Last transaction seen in the backup      */
+  int bStop;                    /* The poller exits                         */
+} g;
+
+/*
+** Print an error resulting from faulting command-line arguments and
+** abort the program.
+*/
+static void
+cmdlineError (const char *zFormat, ...)
+{
+  va_list ap;
+  fprintf (stderr, "%s: ", g.zArgv0);
+  va_start (ap, zFormat);
+  vfprintf (stderr, zFormat, ap);
+  va_end (ap);
+  fprintf (stderr, "\n\"%s --help\" for more help\n", g.zArgv0);
+  exit (1);
+}
+
+/*
+** Print an error message for an error that occurs at runtime, then
+** abort the program.
+*/
+static void
+runtimeError (const char *zFormat, ...)
+{
+  va_list ap;
+  fprintf (stderr, "%s: ", g.zArgv0);
+  va_start (ap, zFormat);
+  vfprintf (stderr, zFormat, ap);
+  va_end (ap);
+  fprintf (stderr, "\n");
+  exit (1);
+}
+
+/*
+** Return a monotonic time in microseconds
+*/
+static sqlite3_int64
+timeNowUs (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+** Sleep until time iUs of timeNowUs()
+*/
+static void
+sleepUntil (sqlite3_int64 iUs)
+{
+  sqlite3_int64 iNow = timeNowUs ();
+  if (iUs > iNow)
+    {
+      struct timespec ts;
+      ts.tv_sec = (iUs - iNow) / 1000000;
+      ts.tv_nsec = (iUs - iNow) % 1000000 * 1000;
+      nanosleep (&ts, 0);
+    }
+}
+
+/*
+** Return a pseudo-random number, xorshift64*.  The workload only
+** depends on --seed.
+*/
+static unsigned long long
+randomNext (void)
+{
+  g.iRand ^= g.iRand >> 12;
+  g.iRand ^= g.iRand << 25;
+  g.iRand ^= g.iRand >> 27;
+  return g.iRand * 2685821657736338717ULL;
+}
+
+/*
+** Return a pseudo-random number from 0 to n - 1
+*/
+static sqlite3_int64
+randomInt (sqlite3_int64 n)
+{
+  return n > 0 ? (sqlite3_int64) (randomNext () % (unsigned long long) n) : 0;
+}
+
+/*
+** Return the size of a new blob, drawn from the --blob distribution
+*/
+static int
+blobSize (void)
+{
+  double u;
+  int n;
+
+  switch (g.eBlob)
+    {
+    case BLOB_UNIFORM:
+      return g.iBlobA + (int) randomInt (g.iBlobB - g.iBlobA + 1);
+    case BLOB_EXP:
+      u = (randomNext () >> 11) * (1.0 / 9007199254740992.0);
+      n = (int) (-log (1.0 - u) * g.iBlobA);
+      return n < g.iBlobB ? n : g.iBlobB;
+    default:
+      return g.iBlobA;
+    }
+}
+
+/*
+** Bind a random text of --width characters and a random blob drawn from
+** the --blob distribution to parameters iCol and iCol + 1 of pStmt
+*/
+static void
+bindRow (sqlite3_stmt * pStmt, int iCol, char *aBuf)
+{
+  int n = blobSize ();
+  int i;
+
+  for (i = 0; i < g.nWidth; i++)
+    aBuf[i] = 'a' + (char) randomInt (26);
+  sqlite3_bind_text (pStmt, iCol, aBuf, g.nWidth, SQLITE_TRANSIENT);
+  for (i = 0; i < n; i++)
+    aBuf[i] = (char) randomNext ();
+  sqlite3_bind_blob (pStmt, iCol + 1, aBuf, n, SQLITE_TRANSIENT);
+}
+
+/*
+** Run statement zSql on db, or abort the program
+*/
+static void
+execOrDie (sqlite3 * db, const char *zSql)
+{
+  char *zErrMsg = 0;
+  if (sqlite3_exec (db, zSql, 0, 0, &zErrMsg) != SQLITE_OK)
+    runtimeError ("%s: %s", zSql, zErrMsg);
+}
+
+/*
+** Prepare zSql on db, or abort the program
+*/
+static sqlite3_stmt *
+prepareOrDie (sqlite3 * db, const char *zSql)
+{
+  sqlite3_stmt *pStmt;
+  if (sqlite3_prepare_v2 (db, zSql, -1, &pStmt, 0) != SQLITE_OK)
+    runtimeError ("%s: %s", zSql, sqlite3_errmsg (db));
+  return pStmt;
+}
+
+/*
+** Step pStmt to completion and reset it, or abort the program
+*/
+static void
+stepOrDie (sqlite3 * db, sqlite3_stmt * pStmt)
+{
+  sqlite3_step (pStmt);
+  if (sqlite3_reset (pStmt) != SQLITE_OK)
+    runtimeError ("%s: %s", sqlite3_sql (pStmt), sqlite3_errmsg (db));
+}
+
+/*
+** Return the size of the buffer bindRow() needs
+*/
+static int
+rowBufSize (void)
+{
+  int n = g.eBlob == BLOB_FIXED ? g.iBlobA : g.iBlobB;
+  return (n > g.nWidth ? n : g.nWidth) + 1;
+}
+
+/*
+** Create the source database, fill it and copy it to its backup
+*/
+static void
+workloadInit (void)
+{
+  sqlite3 *db;
+  sqlite3 *pDst;
+  sqlite3_backup *pBackup;
+  char *aBuf = malloc (rowBufSize ());
+  char *zDir = sqlite3_mprintf ("%s/backup", g.zDir);
+  char *zDir2 = sqlite3_mprintf ("%s/patches", g.zDir);
+  int i, j;
+
+  if (aBuf == 0 || zDir == 0 || zDir2 == 0)
+    runtimeError ("out of memory");
+  mkdir (g.zDir, 0777);
+  mkdir (zDir, 0777);
+  mkdir (zDir2, 0777);
+  if (access (g.zSrc, F_OK) == 0 || access (g.zBackup, F_OK) == 0)
+    runtimeError ("%s or its backup already exists", g.zSrc);
+
+  if (sqlite3_open (g.zSrc, &db) != SQLITE_OK)
+    runtimeError ("cannot open %s: %s", g.zSrc, sqlite3_errmsg (db));
+  if (g.bWal)
+    execOrDie (db, "PRAGMA journal_mode=WAL");
+  execOrDie (db, "BEGIN;"
+             " CREATE TABLE bench_clock (id INTEGER PRIMARY KEY, seq INTEGER);"
+             " INSERT INTO bench_clock VALUES (1, 0)");
+  for (i = 1; i <= g.nTable; i++)
+    {
+      sqlite3_stmt *pStmt;
+      char *zSql = sqlite3_mprintf ("CREATE TABLE t%d (id INTEGER PRIMARY KEY,"
+                                    " v TEXT, b BLOB)", i);
+      execOrDie (db, zSql);
+      sqlite3_free (zSql);
+      zSql = sqlite3_mprintf ("INSERT INTO t%d VALUES (?1, ?2, ?3)", i);
+      pStmt = prepareOrDie (db, zSql);
+      sqlite3_free (zSql);
+      for (j = 1; j <= g.nRow; j++)
+        {
+          sqlite3_bind_int (pStmt, 1, j);
+          bindRow (pStmt, 2, aBuf);
+          stepOrDie (db, pStmt);
+        }
+      sqlite3_finalize (pStmt);
+    }
+  execOrDie (db, "COMMIT");
+
+  if (sqlite3_open (g.zBackup, &pDst) != SQLITE_OK)
+    runtimeError ("cannot open %s: %s", g.zBackup, sqlite3_errmsg (pDst));
+  pBackup = sqlite3_backup_init (pDst, "main", db, "main");
+  if (pBackup == 0 || sqlite3_backup_step (pBackup, -1) != SQLITE_DONE)
+    runtimeError ("cannot copy %s: %s", g.zSrc, sqlite3_errmsg (pDst));
+  sqlite3_backup_finish (pBackup);
+  sqlite3_close (pDst);
+  sqlite3_close (db);
+  printf ("* Created %s: %d tables of %d rows\n", g.zSrc, g.nTable, g.nRow);
+  sqlite3_free (zDir);
+  sqlite3_free (zDir2);
+  free (aBuf);
+}
+
+/*
+** Return the last transaction the backup has, or -1 if it cannot be read
+** right now
+*/
+static int
+backupSeq (sqlite3_stmt * pStmt)
+{
+  int iSeq = -1;
+  if (sqlite3_step (pStmt) == SQLITE_ROW)
+    iSeq = sqlite3_column_int (pStmt, 0);
+  sqlite3_reset (pStmt);
+  return iSeq;
+}
+
+/*
+** Body of the thread that polls the backup.  Every transaction gets the
+** time from its commit to the first poll that sees it as its lag.
+*/
+static void *
+pollerMain (void *pArg)
+{
+  sqlite3 *db = 0;
+  sqlite3_stmt *pStmt;
+  (void) pArg;
+
+  if (sqlite3_open_v2 (g.zBackup, &db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK)
+    runtimeError ("cannot open %s: %s", g.zBackup, sqlite3_errmsg (db));
+  pStmt = prepareOrDie (db, "SELECT seq FROM bench_clock WHERE id=1");
+  pthread_mutex_lock (&g.mutex);
+  while (!g.bStop)
+    {
+      int iSeq;
+      pthread_mutex_unlock (&g.mutex);
+      iSeq = backupSeq (pStmt);
+      pthread_mutex_lock (&g.mutex);
+      if (iSeq > g.iSeen)
+        {
+          sqlite3_int64 iNow = timeNowUs ();
+          for (g.iSeen++; g.iSeen <= iSeq; g.iSeen++)
+            g.aLag[g.iSeen] = iNow - g.aCommit[g.iSeen];
+          g.iSeen = iSeq;
+        }
+      pthread_mutex_unlock (&g.mutex);
+      usleep (POLL_US);
+      pthread_mutex_lock (&g.mutex);
+    }
+  pthread_mutex_unlock (&g.mutex);
+  sqlite3_finalize (pStmt);
+  sqlite3_close (db);
+  return 0;
+}
+
+/*
+** Wait until the backup has transaction iSeq, for --timeout ms at most.
+** Return non-zero if it does.
+*/
+static int
+waitSeen (int iSeq)
+{
+  sqlite3_int64 iEnd = timeNowUs () + (sqlite3_int64) g.iTimeout * 1000;
+  int bSeen;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&g.mutex);
+      bSeen = g.iSeen >= iSeq;
+      pthread_mutex_unlock (&g.mutex);
+      if (bSeen || timeNowUs () >= iEnd)
+        return bSeen;
+      usleep (POLL_US);
+    }
+}
+
+/*
+** Change one random row of a random table, or insert or delete one
+*/
+static void
+changeRow (sqlite3 * db, sqlite3_stmt ** apStmt, char *aBuf)
+{
+  int iTab = (int) randomInt (g.nTable);
+  int iOp = (int) randomInt (100);
+  sqlite3_stmt *pStmt;
+
+  if (iOp < 70)
+    {
+      /* UPDATE, of the text or of both columns */
+      pStmt = apStmt[iTab * 4 + (iOp < 35 ? 0 : 1)];
+      bindRow (pStmt, 2, aBuf);
+      sqlite3_bind_int64 (pStmt, 1, 1 + randomInt (g.aId[iTab] - 1));
+    }
+  else if (iOp < 85)
+    {
+      pStmt = apStmt[iTab * 4 + 2];
+      sqlite3_bind_int64 (pStmt, 1, g.aId[iTab]++);
+      bindRow (pStmt, 2, aBuf);
+    }
+  else
+    {
+      pStmt = apStmt[iTab * 4 + 3];
+      sqlite3_bind_int64 (pStmt, 1, 1 + randomInt (g.aId[iTab] - 1));
+    }
+  stepOrDie (db, pStmt);
+}
+
+/*
+** Write transaction iTx, which changes nChange rows, and note the time
+** of its commit
+*/
+static void
+writeTx (sqlite3 * db, sqlite3_stmt ** apStmt, sqlite3_stmt * pClock,
+         char *aBuf, int iTx, int nChange)
+{
+  int i;
+
+  execOrDie (db, "BEGIN IMMEDIATE");
+  for (i = 0; i < nChange; i++)
+    changeRow (db, apStmt, aBuf);
+  sqlite3_bind_int (pClock, 1, iTx);
+  stepOrDie (db, pClock);
+  pthread_mutex_lock (&g.mutex);
+  g.aCommit[iTx] = timeNowUs ();
+  g.aLag[iTx] = -1;
+  pthread_mutex_unlock (&g.mutex);
+  execOrDie (db, "COMMIT");
+}
+
+/*
+** Compare two lags, for qsort()
+*/
+static int
+lagCmp (const void *a, const void *b)
+{
+  sqlite3_int64 x = *(const sqlite3_int64 *) a;
+  sqlite3_int64 y = *(const sqlite3_int64 *) b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+** Return percentile pct of the n sorted lags of a, in milliseconds
+*/
+static double
+lagPercentile (const sqlite3_int64 * a, int n, int pct)
+{
+  int i = (int) (((sqlite3_int64) n * pct + 99) / 100) - 1;
+  return n > 0 ? a[i < 0 ? 0 : i] / 1000.0 : 0.0;
+}
+
+/*
+** Drive the replicator with the workload and report the lag
+*/
+static void
+workloadRun (void)
+{
+  sqlite3 *db;
+  sqlite3_stmt **apStmt;
+  sqlite3_stmt *pClock;
+  sqlite3_stmt *pMax;
+  pthread_t tid;
+  char *aBuf = malloc (rowBufSize ());
+  int nMax = g.nRate * g.nSecond + 1;
+  sqlite3_int64 iStart, iEnd;
+  sqlite3_int64 *aSorted;
+  int nSorted = 0;
+  int nLost = 0;
+  int i;
+
+  g.aCommit = calloc (nMax + 1, sizeof (g.aCommit[0]));
+  g.aLag = calloc (nMax + 1, sizeof (g.aLag[0]));
+  g.aId = calloc (g.nTable, sizeof (g.aId[0]));
+  apStmt = calloc (g.nTable * 4, sizeof (apStmt[0]));
+  if (aBuf == 0 || g.aCommit == 0 || g.aLag == 0 || g.aId == 0
+      || apStmt == 0)
+    runtimeError ("out of memory");
+
+  if (sqlite3_open_v2 (g.zSrc, &db, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
+    runtimeError ("cannot open %s: %s (see --init)", g.zSrc,
+                  sqlite3_errmsg (db));
+  sqlite3_busy_timeout (db, 5000);
+  pMax = prepareOrDie (db, "SELECT seq FROM bench_clock WHERE id=1");
+  if (sqlite3_step (pMax) != SQLITE_ROW || sqlite3_column_int (pMax, 0) != 0)
+    runtimeError ("%s was already used, create it again with --init",
+                  g.zSrc);
+  sqlite3_finalize (pMax);
+  for (i = 0; i < g.nTable; i++)
+    {
+      static const char *azSql[] = {
+        "UPDATE t%d SET v=?2 WHERE id=?1",
+        "UPDATE t%d SET v=?2, b=?3 WHERE id=?1",
+        "INSERT INTO t%d VALUES (?1, ?2, ?3)",
+        "DELETE FROM t%d WHERE id=?1"
+      };
+      char *zSql;
+      int j;
+      for (j = 0; j < 4; j++)
+        {
+          zSql = sqlite3_mprintf (azSql[j], i + 1);
+          apStmt[i * 4 + j] = prepareOrDie (db, zSql);
+          sqlite3_free (zSql);
+        }
+      zSql = sqlite3_mprintf ("SELECT coalesce(max(id), 0) + 1 FROM t%d",
+                              i + 1);
+      pMax = prepareOrDie (db, zSql);
+      sqlite3_free (zSql);
+      if (sqlite3_step (pMax) == SQLITE_ROW)
+        g.aId[i] = sqlite3_column_int64 (pMax, 0);
+      sqlite3_finalize (pMax);
+    }
+  pClock = prepareOrDie (db, "UPDATE bench_clock SET seq=?1 WHERE id=1");
+
+  pthread_mutex_init (&g.mutex, 0);
+  if (pthread_create (&tid, 0, pollerMain, 0) != 0)
+    runtimeError ("cannot start the poller thread");
+
+  /* Transaction 1 changes no row, it only checks that the replicator
+   ** runs.  The others are started at --rate per second from there.  */
+  writeTx (db, apStmt, pClock, aBuf, 1, 0);
+  if (!waitSeen (1))
+    runtimeError ("%s does not catch up, is repqlite running on %s?",
+                  g.zBackup, g.zDir);
+  iStart = timeNowUs ();
+  for (i = 2; i <= nMax; i++)
+    {
+      sleepUntil (iStart + (sqlite3_int64) (i - 2) * 1000000 / g.nRate);
+      writeTx (db, apStmt, pClock, aBuf, i, g.nChange);
+    }
+  iEnd = timeNowUs ();
+  if (!waitSeen (nMax))
+    fprintf (stderr, "%s: %s did not catch up in %d ms\n", g.zArgv0,
+             g.zBackup, g.iTimeout);
+
+  pthread_mutex_lock (&g.mutex);
+  g.bStop = 1;
+  pthread_mutex_unlock (&g.mutex);
+  pthread_join (tid, 0);
+
+  /* The lags of every transaction but the first one */
+  aSorted = g.aLag + 2;
+  for (i = 2; i <= nMax; i++)
+    if (g.aLag[i] >= 0)
+      aSorted[nSorted++] = g.aLag[i];
+    else
+      nLost++;
+  qsort (aSorted, nSorted, sizeof (aSorted[0]), lagCmp);
+  printf ("* Workload: %d transactions of %d rows in %.3f s, %.1f tx/s\n",
+          nMax - 1, g.nChange, (iEnd - iStart) / 1e6,
+          iEnd > iStart ? (nMax - 1) * 1e6 / (iEnd - iStart) : 0.0);
+  printf ("* Lag: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms,"
+          " %d not replicated\n", lagPercentile (aSorted, nSorted, 50),
+          lagPercentile (aSorted, nSorted, 90),
+          lagPercentile (aSorted, nSorted, 99),
+          lagPercentile (aSorted, nSorted, 100), nLost);
+
+  for (i = 0; i < g.nTable * 4; i++)
+    sqlite3_finalize (apStmt[i]);
+  sqlite3_finalize (pClock);
+  sqlite3_close (db);
+  pthread_mutex_destroy (&g.mutex);
+  free (apStmt);
+  free (g.aId);
+  free (g.aLag);
+  free (g.aCommit);
+  free (aBuf);
+}
+
+/*
+** Print sketchy documentation for this utility program
+*/
+static void
+showHelp (void)
+{
+  printf ("Usage: %s [options] DIR\n", g.zArgv0);
+  printf ("Write a synthetic workload to DIR/bench.db, replicated by repqlite,\n"
+          "and report the replication lag.\n"
+          "Options:\n"
+          "   --blob DIST        Sizes of the blobs: N, MIN-MAX (uniform) or\n"
+          "                      exp:MEAN[-MAX] (exponential)\n"
+          "                      Default: 0-1024\n"
+          "   --changes N        Rows changed by every transaction\n"
+          "                      Default: 10\n"
+          "   --init             Create DIR/bench.db and its backup, and exit\n"
+          "   --rate N           Transactions per second. Default: 50\n"
+          "   --rows N           Rows of every table, with --init\n"
+          "                      Default: 10000\n"
+          "   --seconds N        Duration of the workload. Default: 10\n"
+          "   --seed N           Seed of the random numbers. Default: 1\n"
+          "   --tables N         Number of tables. Default: 4\n"
+          "   --timeout MS       Max wait for the backup to catch up\n"
+          "                      Default: 10000\n"
+          "   --wal              Create DIR/bench.db in WAL mode, with --init\n"
+          "   --width N          Characters of the text column. Default: 32\n");
+}
+
+/*
+** Parse the --blob argument z
+*/
+static void
+parseBlob (const char *z)
+{
+  char *zEnd;
+  long a, b;
+
+  g.eBlob = BLOB_FIXED;
+  if (strncmp (z, "exp:", 4) == 0)
+    {
+      g.eBlob = BLOB_EXP;
+      z += 4;
+    }
+  a = strtol (z, &zEnd, 10);
+  b = a * 16;
+  if (*zEnd == '-')
+    {
+      if (g.eBlob == BLOB_FIXED)
+        g.eBlob = BLOB_UNIFORM;
+      b = strtol (zEnd + 1, &zEnd, 10);
+    }
+  else if (g.eBlob == BLOB_FIXED)
+    b = a;
+  if (zEnd == z || *zEnd || a < 0 || b < a || b > 64 * 1024 * 1024)
+    cmdlineError ("illegal argument to --blob: %s", z);
+  g.iBlobA = (int) a;
+  g.iBlobB = (int) b;
+}
+
+int
+main (int argc, char **argv)
+{
+  int i;
+
+  /* Default values */
+  g.zArgv0 = argv[0];
+  g.nTable = 4;
+  g.nRow = 10000;
+  g.nWidth = 32;
+  g.eBlob = BLOB_UNIFORM;
+  g.iBlobA = 0;
+  g.iBlobB = 1024;
+  g.nRate = 50;
+  g.nChange = 10;
+  g.nSecond = 10;
+  g.iTimeout = 10000;
+  g.iRand = 1;
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *z = argv[i];
+      if (z[0] == '-')
+        {
+          int *pN = 0;
+          z++;
+          if (z[0] == '-')
+            z++;
+          if (strcmp (z, "help") == 0)
+            {
+              showHelp ();
+              return 0;
+            }
+          else if (strcmp (z, "init") == 0)
+            g.bInit = 1;
+          else if (strcmp (z, "wal") == 0)
+            g.bWal = 1;
+          else if (strcmp (z, "changes") == 0)
+            pN = &g.nChange;
+          else if (strcmp (z, "rate") == 0)
+            pN = &g.nRate;
+          else if (strcmp (z, "rows") == 0)
+            pN = &g.nRow;
+          else if (strcmp (z, "seconds") == 0)
+            pN = &g.nSecond;
+          else if (strcmp (z, "tables") == 0)
+            pN = &g.nTable;
+          else if (strcmp (z, "timeout") == 0)
+            pN = &g.iTimeout;
+          else if (strcmp (z, "width") == 0)
+            pN = &g.nWidth;
+          else if (strcmp (z, "blob") == 0 || strcmp (z, "seed") == 0)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+              if (z[0] == 'b')
+                parseBlob (argv[++i]);
+              else
+                g.iRand = strtoull (argv[++i], 0, 10) | 1;
+            }
+          else
+            cmdlineError ("unknown option: %s", argv[i]);
+          if (pN)
+            {
+              if (i == argc - 1)
+                cmdlineError ("missing argument to %s", argv[i]);
+              *pN = atoi (argv[++i]);
+              if (*pN < (pN == &g.nWidth || pN == &g.nRow ? 0 : 1))
+                cmdlineError ("illegal argument to %s", argv[i - 1]);
+            }
+        }
+      else if (g.zDir == 0)
+        g.zDir = argv[i];
+      else
+        cmdlineError ("a single DIR is expected");
+    }
+  if (g.zDir == 0)
+    cmdlineError ("path to the databases directory required");
+
+  g.zSrc = sqlite3_mprintf ("%s/bench.db", g.zDir);
+  g.zBackup = sqlite3_mprintf ("%s/backup/bench.db", g.zDir);
+  if (g.zSrc == 0 || g.zBackup == 0)
+    runtimeError ("out of memory");
+  if (g.bInit)
+    workloadInit ();
+  else
+    workloadRun ();
+  sqlite3_free (g.zSrc);
+  sqlite3_free (g.zBackup);
+  return 0;
+}